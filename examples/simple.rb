@@ -53,6 +53,8 @@ end
 Gfx.set_mode(:autodetect_windowed, 600, 400)
 
 buf = Bitmap.new(Screen.width, Screen.height)
+buf.clear(0x000000)
+buf.track_dirty
 
 seq = [:bk1, :bk2, :fr1, :fr2, :lf1, :lf2, :rt1, :rt2].map do |name|
   bmp = Bitmap.load("sprites/amg1_#{name}.png")
@@ -68,6 +70,8 @@ player.y = 100
 player.width = 64
 player.height = 64
 
+old_x, old_y = player.x, player.y
+
 loop do
   case
   when Key[:esc]   then exit
@@ -77,9 +81,10 @@ loop do
   when Key[:down]  then player.move_down
   end
 
-  buf.rectfill(0, 0, buf.width, buf.height, 0x000000)
+  buf.rectfill(old_x, old_y, old_x + player.width - 1, old_y + player.height - 1, 0x000000)
   player.render(buf)
+  old_x, old_y = player.x, player.y
 
   Gfx.vsync
-  buf.blit(Screen)
+  buf.present(Screen)
 end
@@ -0,0 +1,676 @@
+/*******************************************************************************************
+
+ atlas.c
+
+ class Allegro::Atlas
+
+*******************************************************************************************/
+
+#include "global.h"
+#include <allegro/internal/aintern.h>
+
+typedef struct AtlasRect
+{
+  int x, y, w, h;
+} AtlasRect;
+
+typedef struct AtlasEntry
+{
+  int page;
+  int x, y, w, h;	/* area in the page */
+  int ox, oy;		/* offset of the trimmed area in the original image */
+  int ow, oh;		/* size of the original image */
+} AtlasEntry;
+
+typedef struct Atlas
+{
+  int num_entries;
+  AtlasEntry *entries;
+  VALUE keys;		/* Array: path or index of every entry */
+  VALUE index;		/* Hash: key => entry number */
+  VALUE pages;		/* Array of Bitmap */
+  VALUE subs;		/* Array of Bitmap, one per entry */
+} Atlas;
+
+/* One page being packed with the MaxRects algorithm: the list of
+ * maximal free rectangles is kept up to date and every image goes to
+ * the free rectangle which leaves the shortest leftover side.
+ */
+typedef struct Packer
+{
+  int num_free, max_free;
+  AtlasRect *free;
+  int used_w, used_h;
+} Packer;
+
+#define ATLAS_VERSION 1
+
+/* shortest entry line of a saved atlas: nine digits, their spaces,
+ * the key marker and the newline */
+#define ATLAS_MIN_LINE 20
+
+static void atlas_mark(Atlas *atlas) {
+  rb_gc_mark(atlas->keys);
+  rb_gc_mark(atlas->index);
+  rb_gc_mark(atlas->pages);
+  rb_gc_mark(atlas->subs);
+}
+
+static void atlas_free(Atlas *atlas) {
+  free(atlas->entries);
+  free(atlas);
+}
+
+static inline Atlas* get_atlas(VALUE self) {
+  Atlas *atlas;
+  Data_Get_Struct(self, Atlas, atlas);
+  return atlas;
+}
+
+static void packer_init(Packer *p, int size) {
+  p->max_free = 16;
+  p->free = (AtlasRect *) malloc(p->max_free * sizeof(AtlasRect));
+  p->free[0].x = p->free[0].y = 0;
+  p->free[0].w = p->free[0].h = size;
+  p->num_free = 1;
+  p->used_w = p->used_h = 0;
+}
+
+static void packer_push(Packer *p, int x, int y, int w, int h) {
+  if (p->num_free == p->max_free) {
+    p->max_free *= 2;
+    p->free = (AtlasRect *) realloc(p->free, p->max_free * sizeof(AtlasRect));
+  }
+  p->free[p->num_free].x = x;
+  p->free[p->num_free].y = y;
+  p->free[p->num_free].w = w;
+  p->free[p->num_free].h = h;
+  p->num_free++;
+}
+
+static inline int contains(const AtlasRect *a, const AtlasRect *b) {
+  return b->x >= a->x && b->y >= a->y && b->x + b->w <= a->x + a->w && b->y + b->h <= a->y + a->h;
+}
+
+/**
+ * Finds room for a w x h rectangle. Returns 0 if the page is full.
+ */
+static int packer_insert(Packer *p, int w, int h, int *px, int *py) {
+  AtlasRect used, f;
+  int best = -1, best_short = 0, best_long = 0;
+  int i, j, n, dw, dh, s, l;
+
+  for (i = 0; i < p->num_free; ++i) {
+    dw = p->free[i].w - w;
+    dh = p->free[i].h - h;
+    if (dw < 0 || dh < 0)
+      continue;
+    s = MIN(dw, dh);
+    l = MAX(dw, dh);
+    if (best < 0 || s < best_short || (s == best_short && l < best_long)) {
+      best = i;
+      best_short = s;
+      best_long = l;
+    }
+  }
+
+  if (best < 0)
+    return 0;
+
+  used.x = p->free[best].x;
+  used.y = p->free[best].y;
+  used.w = w;
+  used.h = h;
+
+  /* split every free rectangle the new one overlaps into the up to
+   * four maximal rectangles around it */
+  n = p->num_free;
+  for (i = 0; i < n; ++i) {
+    f = p->free[i];
+    if (used.x >= f.x + f.w || used.x + used.w <= f.x || used.y >= f.y + f.h || used.y + used.h <= f.y)
+      continue;
+
+    if (used.x > f.x)
+      packer_push(p, f.x, f.y, used.x - f.x, f.h);
+    if (used.x + used.w < f.x + f.w)
+      packer_push(p, used.x + used.w, f.y, f.x + f.w - used.x - used.w, f.h);
+    if (used.y > f.y)
+      packer_push(p, f.x, f.y, f.w, used.y - f.y);
+    if (used.y + used.h < f.y + f.h)
+      packer_push(p, f.x, used.y + used.h, f.w, f.y + f.h - used.y - used.h);
+
+    p->free[i] = p->free[--n];
+    p->free[n] = p->free[--p->num_free];
+    --i;
+  }
+
+  /* drop free rectangles contained in others */
+  for (i = 0; i < p->num_free; ++i) {
+    for (j = i + 1; j < p->num_free; ++j) {
+      if (contains(&p->free[j], &p->free[i])) {
+	p->free[i--] = p->free[--p->num_free];
+	break;
+      }
+      if (contains(&p->free[i], &p->free[j])) {
+	p->free[j--] = p->free[--p->num_free];
+      }
+    }
+  }
+
+  p->used_w = MAX(p->used_w, used.x + w);
+  p->used_h = MAX(p->used_h, used.y + h);
+
+  *px = used.x;
+  *py = used.y;
+
+  return 1;
+}
+
+/**
+ * Finds the smallest rectangle holding all pixels which differ from
+ * the mask color and, in 32 bit images with an alpha channel, are not
+ * fully transparent. Opaque files load with alpha 0 throughout, so the
+ * alpha only counts if some pixel has any. Fully transparent images
+ * keep a single pixel.
+ */
+static void trim_bitmap(BITMAP *bmp, AtlasRect *r) {
+  int mask = bitmap_mask_color(bmp);
+  int x1 = bmp->w, y1 = bmp->h, x2 = -1, y2 = -1;
+  int x, y, c, alpha;
+
+  acquire_bitmap(bmp);
+
+  alpha = bitmap_color_depth(bmp) == 32 && _bitmap_has_alpha(bmp);
+
+  for (y = 0; y < bmp->h; ++y) {
+    for (x = 0; x < bmp->w; ++x) {
+      c = getpixel(bmp, x, y);
+      if (c != mask && !(alpha && geta32(c) == 0)) {
+	x1 = MIN(x1, x);
+	x2 = MAX(x2, x);
+	y1 = MIN(y1, y);
+	y2 = MAX(y2, y);
+      }
+    }
+  }
+
+  release_bitmap(bmp);
+
+  if (x2 < 0) {
+    r->x = r->y = 0;
+    r->w = r->h = 1;
+  }
+  else {
+    r->x = x1;
+    r->y = y1;
+    r->w = x2 - x1 + 1;
+    r->h = y2 - y1 + 1;
+  }
+}
+
+static VALUE atlas_alloc(VALUE klass, int num_entries) {
+  Atlas *atlas;
+  VALUE obj = Data_Make_Struct(klass, Atlas, atlas_mark, atlas_free, atlas);
+
+  atlas->keys = rb_ary_new();
+  atlas->index = rb_hash_new();
+  atlas->pages = rb_ary_new();
+  atlas->subs = rb_ary_new();
+  atlas->entries = (AtlasEntry *) calloc(num_entries > 0 ? num_entries : 1, sizeof(AtlasEntry));
+  if (!atlas->entries) {
+    rb_raise(rb_eNoMemError, "out of memory");
+  }
+  atlas->num_entries = num_entries;
+
+  return obj;
+}
+
+/**
+ * Creates the sub-bitmap handles once pages and entries are in place.
+ * Each handle keeps the atlas, and so its page, alive.
+ */
+static void atlas_make_subs(VALUE self) {
+  Atlas *atlas = get_atlas(self);
+  AtlasEntry *e;
+  BITMAP *sub;
+  VALUE obj;
+  int i;
+
+  for (i = 0; i < atlas->num_entries; ++i) {
+    e = &atlas->entries[i];
+    sub = create_sub_bitmap(_get_bmp(RARRAY(atlas->pages)->ptr[e->page]), e->x, e->y, e->w, e->h);
+    if (!sub) {
+      rb_raise(rb_eRuntimeError, "could not create sub bitmap");
+    }
+    obj = Data_Wrap_Struct(c_allegro_bitmap, 0, bitmap_free, sub);
+    rb_iv_set(obj, "@atlas", self);
+    rb_ary_push(atlas->subs, obj);
+    rb_hash_aset(atlas->index, RARRAY(atlas->keys)->ptr[i], INT2FIX(i));
+  }
+}
+
+static int *sort_sizes;
+
+static int by_size(const void *a, const void *b) {
+  return sort_sizes[*(const int *) b] - sort_sizes[*(const int *) a];
+}
+
+typedef struct AtlasPack
+{
+  VALUE self;
+  VALUE images;
+  int trim;
+  int size;
+  int pad;
+  VALUE obj;
+  BITMAP **bmps;
+  AtlasRect *rects;
+  int *order;
+  int *sizes;
+  Packer *packers;
+  int num_pages;
+} AtlasPack;
+
+/* Does the packing; the buffers in args are freed by pack_free, also
+ * when this raises.
+ */
+static VALUE pack_run(VALUE arg) {
+  AtlasPack *args = (AtlasPack *) arg;
+  VALUE img, tmp, page;
+  Atlas *atlas;
+  AtlasRect *rects;
+  BITMAP **bmps, *dst;
+  int *order, *sizes;
+  int n, size = args->size, pad = args->pad, i, j, k, x, y;
+
+  n = RARRAY(args->images)->len;
+
+  args->obj = atlas_alloc(args->self, n);
+  atlas = get_atlas(args->obj);
+
+  /* keeps the bitmaps loaded from files until we are done */
+  tmp = rb_ary_new();
+  bmps = args->bmps = ALLOC_N(BITMAP *, n + 1);
+  rects = args->rects = ALLOC_N(AtlasRect, n + 1);
+  order = args->order = ALLOC_N(int, n + 1);
+  sizes = args->sizes = ALLOC_N(int, n + 1);
+
+  for (i = 0; i < n; ++i) {
+    img = RARRAY(args->images)->ptr[i];
+
+    if (TYPE(img) == T_STRING) {
+      bmps[i] = load_bitmap(STR2CSTR(img), NULL);
+      if (!bmps[i]) {
+	rb_raise(rb_eRuntimeError, "could not load bitmap: %s", STR2CSTR(img));
+      }
+      rb_ary_push(tmp, Data_Wrap_Struct(c_allegro_bitmap, 0, bitmap_free, bmps[i]));
+      rb_ary_push(atlas->keys, rb_str_new4(img));
+    }
+    else {
+      bmps[i] = get_bmp(img);
+      rb_ary_push(atlas->keys, INT2FIX(i));
+    }
+
+    if (args->trim) {
+      trim_bitmap(bmps[i], &rects[i]);
+    }
+    else {
+      rects[i].x = rects[i].y = 0;
+      rects[i].w = bmps[i]->w;
+      rects[i].h = bmps[i]->h;
+    }
+
+    if (rects[i].w + pad > size || rects[i].h + pad > size) {
+      rb_raise(rb_eArgError, "image %d (%dx%d) does not fit into %dx%d", i, rects[i].w, rects[i].h, size, size);
+    }
+
+    order[i] = i;
+    sizes[i] = MAX(rects[i].w, rects[i].h);
+  }
+
+  /* largest first packs tightest */
+  sort_sizes = sizes;
+  qsort(order, n, sizeof(int), by_size);
+
+  for (k = 0; k < n; ++k) {
+    i = order[k];
+
+    for (j = 0; j < args->num_pages; ++j) {
+      if (packer_insert(&args->packers[j], rects[i].w + pad, rects[i].h + pad, &x, &y))
+	break;
+    }
+    if (j == args->num_pages) {
+      REALLOC_N(args->packers, Packer, j + 1);
+      packer_init(&args->packers[j], size);
+      args->num_pages++;
+      packer_insert(&args->packers[j], rects[i].w + pad, rects[i].h + pad, &x, &y);
+    }
+
+    atlas->entries[i].page = j;
+    atlas->entries[i].x = x;
+    atlas->entries[i].y = y;
+    atlas->entries[i].w = rects[i].w;
+    atlas->entries[i].h = rects[i].h;
+    atlas->entries[i].ox = rects[i].x;
+    atlas->entries[i].oy = rects[i].y;
+    atlas->entries[i].ow = bmps[i]->w;
+    atlas->entries[i].oh = bmps[i]->h;
+  }
+
+  for (j = 0; j < args->num_pages; ++j) {
+    dst = create_bitmap(args->packers[j].used_w, args->packers[j].used_h);
+    if (!dst) {
+      rb_raise(rb_eRuntimeError, "could not create atlas page: %s", allegro_error);
+    }
+    page = Data_Wrap_Struct(c_allegro_bitmap, 0, bitmap_free, dst);
+    clear_to_color(dst, bitmap_mask_color(dst));
+    rb_ary_push(atlas->pages, page);
+  }
+
+  for (i = 0; i < n; ++i) {
+    blit(bmps[i], _get_bmp(RARRAY(atlas->pages)->ptr[atlas->entries[i].page]),
+	 rects[i].x, rects[i].y, atlas->entries[i].x, atlas->entries[i].y, rects[i].w, rects[i].h);
+  }
+
+  atlas_make_subs(args->obj);
+
+  return args->obj;
+}
+
+static VALUE pack_free(VALUE arg) {
+  AtlasPack *args = (AtlasPack *) arg;
+  int j;
+
+  for (j = 0; j < args->num_pages; ++j) {
+    free(args->packers[j].free);
+  }
+
+  if (args->packers)
+    xfree(args->packers);
+  if (args->bmps)
+    xfree(args->bmps);
+  if (args->rects)
+    xfree(args->rects);
+  if (args->order)
+    xfree(args->order);
+  if (args->sizes)
+    xfree(args->sizes);
+
+  return Qnil;
+}
+
+/**
+ * call-seq: pack(images, max_size = 2048, trim = true, padding = 1)
+ *
+ * Packs images, an Array of file names or Bitmaps, into as few
+ * max_size x max_size pages as possible, using MaxRects with the best
+ * short side fit heuristic. Every page is cut down to the area it
+ * actually uses. With trim, borders of mask color, or of zero alpha
+ * in 32 bit images with alpha, are removed first; #offset tells where
+ * the trimmed image sits in the original one.
+ * Padding pixels of mask color separate neighbours, so stretched or
+ * rotated sprites do not bleed into each other.
+ *
+ * Images are looked up by their file name, or their index for
+ * Bitmaps, with #[].
+ */
+static VALUE atlas_pack(int argc, VALUE *argv, VALUE self) {
+  VALUE images, max_size, trim, padding;
+  AtlasPack args;
+
+  rb_scan_args(argc, argv, "13", &images, &max_size, &trim, &padding);
+
+  Check_Type(images, T_ARRAY);
+
+  memset(&args, 0, sizeof(args));
+  args.self = self;
+  args.images = images;
+  args.trim = NIL_P(trim) || RTEST(trim);
+  args.size = NIL_P(max_size) ? 2048 : NUM2INT(max_size);
+  args.pad = NIL_P(padding) ? 1 : NUM2INT(padding);
+
+  if (args.size <= 0 || args.pad < 0) {
+    rb_raise(rb_eArgError, "invalid size or padding");
+  }
+
+  return rb_ensure(pack_run, (VALUE) &args, pack_free, (VALUE) &args);
+}
+
+/**
+ * call-seq: [](key)
+ *
+ * Returns the sub-bitmap for a file name or image index, or nil.
+ */
+static VALUE atlas_aref(VALUE self, VALUE key) {
+  Atlas *atlas = get_atlas(self);
+  VALUE i = rb_hash_aref(atlas->index, key);
+
+  return NIL_P(i) ? Qnil : RARRAY(atlas->subs)->ptr[FIX2INT(i)];
+}
+
+static AtlasEntry *get_entry(Atlas *atlas, VALUE key) {
+  VALUE i = rb_hash_aref(atlas->index, key);
+
+  if (NIL_P(i)) {
+    rb_raise(rb_eIndexError, "no such image in atlas");
+  }
+
+  return &atlas->entries[FIX2INT(i)];
+}
+
+/**
+ * call-seq: offset(key)
+ *
+ * Returns [x, y], the position of the trimmed image inside the
+ * original one. Draw the sub-bitmap at this offset to get the
+ * original placement.
+ */
+static VALUE atlas_offset(VALUE self, VALUE key) {
+  AtlasEntry *e = get_entry(get_atlas(self), key);
+  return rb_ary_new3(2, INT2FIX(e->ox), INT2FIX(e->oy));
+}
+
+/**
+ * call-seq: original_size(key)
+ *
+ * Returns [width, height] of the image before trimming.
+ */
+static VALUE atlas_original_size(VALUE self, VALUE key) {
+  AtlasEntry *e = get_entry(get_atlas(self), key);
+  return rb_ary_new3(2, INT2FIX(e->ow), INT2FIX(e->oh));
+}
+
+/**
+ * Returns the page bitmaps.
+ */
+static VALUE atlas_pages(VALUE self) {
+  return rb_ary_dup(get_atlas(self)->pages);
+}
+
+/**
+ * Returns the keys of all images in the order they were given.
+ */
+static VALUE atlas_keys(VALUE self) {
+  return rb_ary_dup(get_atlas(self)->keys);
+}
+
+/**
+ * Returns the number of images.
+ */
+static VALUE atlas_size(VALUE self) {
+  return INT2FIX(get_atlas(self)->num_entries);
+}
+
+static void page_name(char *buf, int len, const char *base, int page) {
+  snprintf(buf, len, "%s-%d.png", base, page);
+  buf[len - 1] = 0;
+}
+
+/**
+ * call-seq: save(base)
+ *
+ * Writes every page to base-N.png and the layout to base.atlas, which
+ * Atlas.load reads back without packing again.
+ */
+static VALUE atlas_save(VALUE self, VALUE base) {
+  Atlas *atlas = get_atlas(self);
+  AtlasEntry *e;
+  VALUE key;
+  char name[1024];
+  FILE *f;
+  int i;
+
+  Check_Type(base, T_STRING);
+
+  for (i = 0; i < RARRAY(atlas->pages)->len; ++i) {
+    page_name(name, sizeof(name), STR2CSTR(base), i);
+    if (save_bitmap(name, _get_bmp(RARRAY(atlas->pages)->ptr[i]), NULL) != 0) {
+      rb_raise(rb_eRuntimeError, "could not save atlas page: %s", name);
+    }
+  }
+
+  snprintf(name, sizeof(name), "%s.atlas", STR2CSTR(base));
+  name[sizeof(name) - 1] = 0;
+
+  if (!(f = fopen(name, "w"))) {
+    rb_raise(rb_eRuntimeError, "could not write %s", name);
+  }
+
+  fprintf(f, "atlas %d %ld %d\n", ATLAS_VERSION, RARRAY(atlas->pages)->len, atlas->num_entries);
+
+  for (i = 0; i < atlas->num_entries; ++i) {
+    e = &atlas->entries[i];
+    key = RARRAY(atlas->keys)->ptr[i];
+    fprintf(f, "%d %d %d %d %d %d %d %d %d ", e->page, e->x, e->y, e->w, e->h, e->ox, e->oy, e->ow, e->oh);
+    if (FIXNUM_P(key))
+      fprintf(f, "#%d\n", (int) FIX2INT(key));
+    else
+      fprintf(f, "=%s\n", STR2CSTR(key));
+  }
+
+  fclose(f);
+
+  return self;
+}
+
+/**
+ * call-seq: load(base)
+ *
+ * Loads an atlas written by #save.
+ */
+static VALUE atlas_load(VALUE self, VALUE base) {
+  VALUE obj;
+  Atlas *atlas;
+  AtlasEntry *e;
+  BITMAP *bmp;
+  char name[1024], line[1200];
+  FILE *f;
+  int version, num_entries, i, len;
+  long num_pages, size;
+
+  Check_Type(base, T_STRING);
+
+  snprintf(name, sizeof(name), "%s.atlas", STR2CSTR(base));
+  name[sizeof(name) - 1] = 0;
+
+  if (!(f = fopen(name, "r"))) {
+    rb_raise(rb_eRuntimeError, "could not read %s", name);
+  }
+
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  rewind(f);
+
+  /* the count is checked against the file size before it is trusted
+   * with an allocation */
+  if (fscanf(f, "atlas %d %ld %d\n", &version, &num_pages, &num_entries) != 3 ||
+      version != ATLAS_VERSION || num_entries < 0 || num_pages < 0 ||
+      num_entries > size / ATLAS_MIN_LINE) {
+    fclose(f);
+    rb_raise(rb_eRuntimeError, "%s is not an atlas", name);
+  }
+
+  obj = atlas_alloc(self, num_entries);
+  atlas = get_atlas(obj);
+
+  for (i = 0; i < num_entries; ++i) {
+    e = &atlas->entries[i];
+    if (!fgets(line, sizeof(line), f) ||
+	sscanf(line, "%d %d %d %d %d %d %d %d %d %n",
+	       &e->page, &e->x, &e->y, &e->w, &e->h, &e->ox, &e->oy, &e->ow, &e->oh, &len) != 9 ||
+	e->page < 0 || e->page >= num_pages) {
+      fclose(f);
+      rb_raise(rb_eRuntimeError, "%s is corrupt", name);
+    }
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[len] == '#')
+      rb_ary_push(atlas->keys, INT2FIX(atoi(line + len + 1)));
+    else
+      rb_ary_push(atlas->keys, rb_str_new2(line + len + 1));
+  }
+
+  fclose(f);
+
+  for (i = 0; i < num_pages; ++i) {
+    page_name(name, sizeof(name), STR2CSTR(base), i);
+    bmp = load_bitmap(name, NULL);
+    if (!bmp) {
+      rb_raise(rb_eRuntimeError, "could not load atlas page: %s", name);
+    }
+    rb_ary_push(atlas->pages, Data_Wrap_Struct(c_allegro_bitmap, 0, bitmap_free, bmp));
+  }
+
+  for (i = 0; i < num_entries; ++i) {
+    e = &atlas->entries[i];
+    bmp = _get_bmp(RARRAY(atlas->pages)->ptr[e->page]);
+    if (e->x < 0 || e->y < 0 || e->w <= 0 || e->h <= 0 || e->x + e->w > bmp->w || e->y + e->h > bmp->h) {
+      rb_raise(rb_eRuntimeError, "atlas entry %d lies outside its page", i);
+    }
+  }
+
+  atlas_make_subs(obj);
+
+  return obj;
+}
+
+/**
+ * Inspect atlas.
+ */
+static VALUE atlas_inspect(VALUE self) {
+  char buf[128];
+  Atlas *atlas = get_atlas(self);
+
+  sprintf(buf, "<Atlas images: %d, pages: %ld>", atlas->num_entries, RARRAY(atlas->pages)->len);
+
+  return rb_str_new2(buf);
+}
+
+void Init_allegro_atlas() {
+
+  /**
+   * An Atlas packs many small images into a few large page bitmaps
+   * and hands out sub-bitmaps of them, which draw like any other
+   * Bitmap but share one allocation per page:
+   *
+   *   atlas = Atlas.pack(Dir["sprites/amg1_*.png"])
+   *   atlas.save("cache/sprites")
+   *   ...
+   *   atlas = Atlas.load("cache/sprites")
+   *   walk = atlas["sprites/amg1_fr1.png"]
+   */
+  c_allegro_atlas = rb_define_class_under(m_allegro, "Atlas", rb_cObject);
+
+  rb_undef_alloc_func(c_allegro_atlas);
+
+  rb_define_singleton_method(c_allegro_atlas, "pack",		atlas_pack,		-1);
+  rb_define_singleton_method(c_allegro_atlas, "load",		atlas_load,		1);
+
+  rb_define_method(c_allegro_atlas, "[]",			atlas_aref,		1);
+  rb_define_method(c_allegro_atlas, "offset",			atlas_offset,		1);
+  rb_define_method(c_allegro_atlas, "original_size",		atlas_original_size,	1);
+  rb_define_method(c_allegro_atlas, "pages",			atlas_pages,		0);
+  rb_define_method(c_allegro_atlas, "keys",			atlas_keys,		0);
+  rb_define_method(c_allegro_atlas, "size",			atlas_size,		0);
+  rb_define_method(c_allegro_atlas, "save",			atlas_save,		1);
+  rb_define_method(c_allegro_atlas, "inspect",			atlas_inspect,		0);
+}
@@ -1,10 +1,11 @@
-#include "global.h"
+#include <math.h>
 
-static inline int bytes_per_pixel(int bpp) {
-  return (bpp + 7) / 8;
-}
+#include "global.h"
+#include "jpgalleg.h"
+#include "loadpng.h"
 
 void bitmap_free(void *ptr) {
+  dirty_track(ptr, 0);
   destroy_bitmap(ptr);
 }
 
@@ -74,20 +75,66 @@ static VALUE bitmap_create_system(VALUE self, VALUE w, VALUE h) {
 }
 
 
+/* Reads the :scale option, 1, 0.5, 0.25 or 0.125 (or the same as a
+ * Rational), and returns the divisor it stands for.
+ */
+int get_scale_option(VALUE opts) {
+  VALUE scale;
+  double value;
+  int i;
+
+  if (NIL_P(opts))
+    return 1;
+
+  Check_Type(opts, T_HASH);
+  scale = rb_hash_aref(opts, ID2SYM(rb_intern("scale")));
+  if (NIL_P(scale))
+    return 1;
+
+  value = NUM2DBL(scale);
+  for (i = 1; i <= 8; i *= 2) {
+    if (value == 1.0 / i)
+      return i;
+  }
+
+  rb_raise(rb_eArgError, "scale must be 1, 1/2, 1/4 or 1/8");
+  return 1;
+}
+
 /**
- * call-seq: load(file)
+ * call-seq: load(file, :scale => s)
  * 
  * Load a bitmap from a file. At present this function supports
  * BMP, LBM, PCX, TGA, JPEG and PNG files, determining the type from the file extension.
+ * JPEG and PNG files are read and decoded with the interpreter lock released, so
+ * other threads keep running meanwhile.
+ *
+ * With :scale of 0.5, 0.25 or 0.125 the bitmap comes out at that
+ * fraction of the image size, rounded up. JPEG files are decoded
+ * straight to the smaller size, which takes a fraction of the time and
+ * memory of a full decode; other formats are loaded whole and shrunk.
+ *
+ *   thumb = Bitmap.load("photo.jpg", :scale => 0.125)
  */
-static VALUE bitmap_load(VALUE self, VALUE file) {											
+static VALUE bitmap_load(int argc, VALUE *argv, VALUE self) {
+  VALUE file, opts;
+  volatile VALUE path;
   BITMAP *bmp;					
+  ImageLoad load;
+
+  rb_scan_args(argc, argv, "11", &file, &opts);
 
   Check_Type(file, T_STRING);
-  bmp = load_bitmap(STR2CSTR(file), NULL);
+  path = rb_str_new4(file);
+
+  image_prepare(&load, STR2CSTR(path));
+  load.scale = get_scale_option(opts);
+  load.threads = cpu_count();
+  call_without_gvl(image_decode, &load);
+  bmp = image_finish(&load);
 
   if (!bmp) {    
-    rb_raise(rb_eRuntimeError, "could not load bitmap: %s", STR2CSTR(file));
+    rb_raise(rb_eRuntimeError, "could not load bitmap: %s (%s)", STR2CSTR(file), image_error(&load));
   }
 
   set_clip_rect(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
@@ -95,6 +142,236 @@ static VALUE bitmap_load(VALUE self, VALUE file) {
   return Data_Wrap_Struct(c_allegro_bitmap,  0, bitmap_free, bmp);
 }
 
+typedef struct LoadMany
+{
+  ImageLoad *loads;
+  int n;
+  int threads;
+  int scale;
+  int wrapped;
+  VALUE paths;
+} LoadMany;
+
+static void load_many_one(void *data, int i) {
+  image_decode(&((ImageLoad *) data)[i]);
+}
+
+static void *load_many_run(void *arg) {
+  LoadMany *batch = (LoadMany *) arg;
+  parallel_run(batch->n, batch->threads, load_many_one, batch->loads);
+  return NULL;
+}
+
+/* Decodes, wraps every bitmap and reports failures; load_many_free
+ * cleans up after it, also when it raises.
+ */
+static VALUE load_many_body(VALUE arg) {
+  LoadMany *batch = (LoadMany *) arg;
+  VALUE result;
+  BITMAP *bmp;
+  int i;
+
+  batch->loads = ALLOC_N(ImageLoad, MAX(batch->n, 1));
+
+  for (i = 0; i < batch->n; ++i) {
+    image_prepare(&batch->loads[i], STR2CSTR(RARRAY(batch->paths)->ptr[i]));
+    batch->loads[i].scale = batch->scale;
+    /* threads left over when there are fewer files go to each file */
+    batch->loads[i].threads = MAX(batch->threads / MAX(batch->n, 1), 1);
+  }
+
+  call_without_gvl(load_many_run, batch);
+
+  /* wrap every bitmap before the block runs, so a raising block
+   * cannot leak the rest */
+  result = rb_ary_new2(batch->n);
+
+  for (; batch->wrapped < batch->n; ++batch->wrapped) {
+    bmp = image_finish(&batch->loads[batch->wrapped]);
+    if (bmp) {
+      set_clip_rect(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+      rb_ary_push(result, Data_Wrap_Struct(c_allegro_bitmap, 0, bitmap_free, bmp));
+    }
+    else {
+      rb_ary_push(result, Qnil);
+    }
+  }
+
+  if (rb_block_given_p()) {
+    for (i = 0; i < batch->n; ++i) {
+      if (!batch->loads[i].bmp)
+	rb_yield_values(2, RARRAY(batch->paths)->ptr[i], rb_str_new2(image_error(&batch->loads[i])));
+    }
+  }
+
+  return result;
+}
+
+static VALUE load_many_free(VALUE arg) {
+  LoadMany *batch = (LoadMany *) arg;
+  int i;
+
+  if (batch->loads) {
+    for (i = batch->wrapped; i < batch->n; ++i) {
+      if (batch->loads[i].bmp)
+	destroy_bitmap(batch->loads[i].bmp);
+    }
+    xfree(batch->loads);
+  }
+
+  return Qnil;
+}
+
+/**
+ * call-seq: load_many(files, :threads => n, :scale => s) { |file, message| ... }
+ *
+ * Loads several files at once, like Bitmap.load. PNG and JPEG files are
+ * read and decoded in parallel on n native threads (by default one per
+ * processor) with the interpreter lock released; other formats are
+ * loaded one after another afterwards.
+ *
+ * Returns the bitmaps in the order of files. A file that cannot be
+ * loaded does not stop the others: its place holds nil, and the block,
+ * if given, is called with the file name and the reason once all
+ * files are done.
+ *
+ *   sprites = Bitmap.load_many(%w(hero.png tiles.jpg)) { |f, e| warn "#{f}: #{e}" }
+ */
+static VALUE bitmap_load_many(int argc, VALUE *argv, VALUE self) {
+  VALUE files, opts, threads;
+  volatile VALUE paths;
+  LoadMany batch;
+  int i;
+
+  rb_scan_args(argc, argv, "11", &files, &opts);
+
+  Check_Type(files, T_ARRAY);
+
+  batch.n = RARRAY(files)->len;
+  batch.threads = cpu_count();
+  batch.loads = NULL;
+  batch.wrapped = 0;
+
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    threads = rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+    if (!NIL_P(threads)) {
+      batch.threads = NUM2INT(threads);
+      if (batch.threads < 1)
+	rb_raise(rb_eArgError, "threads must be positive");
+    }
+  }
+  batch.scale = get_scale_option(opts);
+
+  /* frozen copies keep the names valid while the workers read them */
+  paths = rb_ary_new2(batch.n);
+  for (i = 0; i < batch.n; ++i) {
+    Check_Type(RARRAY(files)->ptr[i], T_STRING);
+    rb_ary_push(paths, rb_str_new4(RARRAY(files)->ptr[i]));
+  }
+  batch.paths = paths;
+
+  return rb_ensure(load_many_body, (VALUE) &batch, load_many_free, (VALUE) &batch);
+}
+
+
+/**
+ * call-seq: probe(file) -> hash
+ *
+ * Reads the size and kind of a PNG or JPEG file from its header,
+ * without loading the image, which makes it cheap enough to run over
+ * thousands of files. Returns a hash with :format (:png or :jpeg),
+ * :width, :height, :depth, the bits per pixel stored in the file, and
+ * :progressive, true for interlaced PNG and progressive JPEG files.
+ *
+ *   Bitmap.probe("photo.jpg")
+ *   # => {:format=>:jpeg, :width=>640, :height=>480, :depth=>24, :progressive=>false}
+ */
+static VALUE bitmap_probe(VALUE self, VALUE file) {
+  VALUE hash;
+  ImageLoad load;
+  ImageInfo info;
+
+  Check_Type(file, T_STRING);
+
+  image_prepare(&load, STR2CSTR(file));
+  if (image_probe(&load, &info)) {
+    rb_raise(rb_eRuntimeError, "could not probe image: %s (%s)", STR2CSTR(file), image_error(&load));
+  }
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("format")),	ID2SYM(rb_intern(info.format)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("width")),	INT2NUM(info.w));
+  rb_hash_aset(hash, ID2SYM(rb_intern("height")),	INT2NUM(info.h));
+  rb_hash_aset(hash, ID2SYM(rb_intern("depth")),	INT2NUM(info.depth));
+  rb_hash_aset(hash, ID2SYM(rb_intern("progressive")),	info.progressive ? Qtrue : Qfalse);
+
+  return hash;
+}
+
+/* Reads a blob format, :auto, :png or :jpeg, and returns its name for
+ * image_prepare_memory, NULL for :auto.
+ */
+const char *get_format_option(VALUE format) {
+  ID id;
+
+  if (NIL_P(format))
+    return NULL;
+
+  Check_Type(format, T_SYMBOL);
+  id = SYM2ID(format);
+  if (id == rb_intern("png"))
+    return "png";
+  if (id == rb_intern("jpeg") || id == rb_intern("jpg"))
+    return "jpeg";
+  if (id != rb_intern("auto"))
+    rb_raise(rb_eArgError, "format must be :auto, :png or :jpeg");
+
+  return NULL;
+}
+
+/**
+ * call-seq: from_blob(string, format = :auto)
+ *
+ * Decodes a PNG or JPEG image held in a String, such as one read out of
+ * an archive, straight from the memory of the String and with the
+ * interpreter lock released. With :auto the format is told from the
+ * first bytes; pass :png or :jpeg to name it.
+ *
+ *   sprite = Bitmap.from_blob(zip.read("sprites/hero.png"))
+ */
+static VALUE bitmap_from_blob(int argc, VALUE *argv, VALUE self) {
+  VALUE str, format;
+  volatile VALUE blob;
+  const char *name;
+  BITMAP *bmp;
+  ImageLoad load;
+
+  rb_scan_args(argc, argv, "11", &str, &format);
+
+  Check_Type(str, T_STRING);
+  name = get_format_option(format);
+
+  /* A frozen copy shares the bytes of the String, and keeps them alive
+   * and unchanged while the lock is released, even if the String is
+   * modified meanwhile. */
+  blob = rb_str_new4(str);
+
+  if (!image_prepare_memory(&load, RSTRING(blob)->ptr, RSTRING(blob)->len, name)) {
+    rb_raise(rb_eArgError, "not a PNG or JPEG image");
+  }
+  load.threads = cpu_count();
+  call_without_gvl(image_decode, &load);
+  bmp = image_finish(&load);
+
+  if (!bmp) {
+    rb_raise(rb_eRuntimeError, "could not load bitmap from blob (%s)", image_error(&load));
+  }
+
+  set_clip_rect(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+
+  return Data_Wrap_Struct(c_allegro_bitmap,  0, bitmap_free, bmp);
+}
 
 /**
  * Converts the byte array into a ruby string.
@@ -144,45 +421,217 @@ static VALUE bitmap_from_str(VALUE self, VALUE str) {
 
   release_bitmap(bmp);	
 
+  dirty_add(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+
   return str;
 }
 
 
-#define PIXEL(bmp, x, y, body)						\
+static VALUE bitmap_buffer_yield(VALUE buf) {
+  return rb_yield(buf);
+}
+
+static VALUE bitmap_buffer_release(VALUE self) {
+  release_bitmap(_get_bmp(self));
+  return Qnil;
+}
+
+/**
+ * call-seq: buffer
+ *           buffer { |buf| ... }
+ *
+ * Returns a Bitmap::Buffer which gives direct access to the pixel
+ * memory of this bitmap, including its pitch, color depth and
+ * sub-bitmap offsets. No pixels are copied.
+ *
+ * If a block is given the bitmap is acquired for the duration of the
+ * block, which is required before touching the memory of video or
+ * system bitmaps, and the result of the block is returned.
+ */
+static VALUE bitmap_buffer(VALUE self) {
+  VALUE buf = buffer_wrap(self);
+
+  if (!rb_block_given_p())
+    return buf;
+
+  acquire_bitmap(_get_bmp(self));
+
+  return rb_ensure(bitmap_buffer_yield, buf, bitmap_buffer_release, self);
+}
+
+
+/**
+ * Reads w pixels of row y starting at column x and converts them to
+ * 32 bit colors.
+ */
+static void read_row32(BITMAP *bmp, int x, int y, int w, uint32_t *out) {
+  int depth = bitmap_color_depth(bmp);
+  unsigned char *p;
+  int i, c;
+
+  bmp_select(bmp);
+  p = (unsigned char *) bmp_read_line(bmp, y) + x * bytes_per_pixel(depth);
+
+  switch (depth) {
+  case 8:
+    for (i = 0; i < w; ++i, ++p) {
+      out[i] = makeacol32(getr8(*p), getg8(*p), getb8(*p), 255);
+    }
+    break;
+  case 15:
+    for (i = 0; i < w; ++i, p += 2) {
+      c = *(uint16_t *) p;
+      out[i] = makeacol32(getr15(c), getg15(c), getb15(c), 255);
+    }
+    break;
+  case 16:
+    for (i = 0; i < w; ++i, p += 2) {
+      c = *(uint16_t *) p;
+      out[i] = makeacol32(getr16(c), getg16(c), getb16(c), 255);
+    }
+    break;
+  case 24:
+    for (i = 0; i < w; ++i, p += 3) {
+      c = READ3BYTES(p);
+      out[i] = makeacol32(getr24(c), getg24(c), getb24(c), 255);
+    }
+    break;
+  default:
+    memcpy(out, p, w * sizeof(uint32_t));
+    break;
+  }
+
+  bmp_unwrite_line(bmp);
+}
+
+/**
+ * Converts w 32 bit colors to the depth of the bitmap and writes them
+ * to row y starting at column x.
+ */
+static void write_row32(BITMAP *bmp, int x, int y, int w, const uint32_t *in) {
+  int depth = bitmap_color_depth(bmp);
+  unsigned char *p;
+  int i, c;
+
+  bmp_select(bmp);
+  p = (unsigned char *) bmp_write_line(bmp, y) + x * bytes_per_pixel(depth);
+
+  switch (depth) {
+  case 8:
+    for (i = 0; i < w; ++i, ++p) {
+      c = in[i];
+      *p = makecol8(getr32(c), getg32(c), getb32(c));
+    }
+    break;
+  case 15:
+    for (i = 0; i < w; ++i, p += 2) {
+      c = in[i];
+      *(uint16_t *) p = makecol15(getr32(c), getg32(c), getb32(c));
+    }
+    break;
+  case 16:
+    for (i = 0; i < w; ++i, p += 2) {
+      c = in[i];
+      *(uint16_t *) p = makecol16(getr32(c), getg32(c), getb32(c));
+    }
+    break;
+  case 24:
+    for (i = 0; i < w; ++i, p += 3) {
+      c = in[i];
+      WRITE3BYTES(p, makecol24(getr32(c), getg32(c), getb32(c)));
+    }
+    break;
+  default:
+    memcpy(p, in, w * sizeof(uint32_t));
+    break;
+  }
+
+  bmp_unwrite_line(bmp);
+}
+
+static void check_region(BITMAP *bmp, int x, int y, int w, int h) {
+  if (x < 0 || y < 0 || w < 0 || h < 0 || x + w > bmp->w || y + h > bmp->h) {
+    rb_raise(rb_eIndexError, "region (%d, %d, %d, %d) outside of %dx%d bitmap",
+	     x, y, w, h, bmp->w, bmp->h);
+  }
+}
 
 /**
- * Converts the pixel array into a ruby array of color objects.
+ * Marks the bounding box of n (x, y) pairs as dirty.
+ */
+static void dirty_points(BITMAP *bmp, const int *pa, int n) {
+  int x1, y1, x2, y2, i;
+
+  if (n <= 0)
+    return;
+
+  x1 = x2 = pa[0];
+  y1 = y2 = pa[1];
+
+  for (i = 1; i < n; ++i) {
+    x1 = MIN(x1, pa[i * 2]);
+    x2 = MAX(x2, pa[i * 2]);
+    y1 = MIN(y1, pa[i * 2 + 1]);
+    y2 = MAX(y2, pa[i * 2 + 1]);
+  }
+
+  dirty_add(bmp, x1, y1, x2, y2);
+}
+
+/**
+ * Marks the area covered by a sprite drawn at (x, y) as dirty. Rotated
+ * sprites turn around the centre of their scaled size, so the circle
+ * through their scaled corners bounds them at any angle.
+ */
+static void dirty_sprite(BITMAP *bmp, BITMAP *sprite, int x, int y, int rotated, double scale) {
+  int cx, cy, r;
+
+  if (!rotated) {
+    dirty_add(bmp, x, y, x + sprite->w - 1, y + sprite->h - 1);
+    return;
+  }
+
+  cx = x + (int) (sprite->w * scale / 2);
+  cy = y + (int) (sprite->h * scale / 2);
+  r = (int) (sqrt((double) sprite->w * sprite->w + (double) sprite->h * sprite->h) / 2 * fabs(scale)) + 1;
+
+  dirty_add(bmp, cx - r, cy - r, cx + r, cy + r);
+}
+
+/**
+ * Converts the pixel array into a ruby array of packed colors.
  */
 static VALUE bitmap_to_ary(VALUE self) {
   BITMAP *bmp = _get_bmp(self);
-  long   len  = bmp->w * bmp->h;
+  VALUE  ary  = rb_ary_new2(bmp->w * bmp->h);
+  uint32_t *row = ALLOCA_N(uint32_t, bmp->w);
   int x, y;
-  int i = 0;
-  struct RArray *ary = RARRAY(rb_ary_new2(len));
-  ary->len = len;
+  long i = 0;
 
   acquire_bitmap(bmp);
 
   for (y = 0; y < bmp->h; ++y) {
+    read_row32(bmp, 0, y, bmp->w, row);
     for (x = 0; x < bmp->w; ++x) {
-      ary->ptr[i] = int_to_color(getpixel(bmp, x, y));
+      rb_ary_store(ary, i++, packed_to_num(row[x]));
     }
   }
 
   release_bitmap(bmp);	
 
-  return (VALUE) ary;
+  return ary;
 }
 
 /**
- * Loads the bitmap from an array of color objects.
+ * Loads the bitmap from an array of packed colors or color objects.
  */
 static VALUE bitmap_from_ary(VALUE self, VALUE _ary) {
   struct RArray * ary;
   BITMAP *bmp = _get_bmp(self);
   long   len  = bmp->w * bmp->h;
+  uint32_t *row = ALLOCA_N(uint32_t, bmp->w);
   int x, y;
-  int i = 0;
+  long i = 0;
 
   Check_Type(_ary, T_ARRAY);  
   ary = RARRAY(_ary);
@@ -195,49 +644,299 @@ static VALUE bitmap_from_ary(VALUE self, VALUE _ary) {
 
   for (y = 0; y < bmp->h; ++y) {
     for (x = 0; x < bmp->w; ++x) {
-      put_pixel(bmp, x, y, color_to_int(ary->ptr[i]));
+      row[x] = color_to_packed(ary->ptr[i++]);
     }
+    write_row32(bmp, 0, y, bmp->w, row);
   }
 
   release_bitmap(bmp);	
 
+  dirty_add(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+
   return _ary;
 }
 
-
 /**
- * call-seq: set_mask(color)
+ * call-seq: get_pixels(x, y, width, height, as = :string)
  *
- * Converting all pixels of specified color to the mask color (#ff00ff).
+ * Reads a rectangle of pixels in one call. The pixels are converted
+ * to packed 32 bit colors (the format of a 32 bit bitmap, with alpha
+ * set to 255 for bitmaps without an alpha channel) and returned row
+ * by row either as a String of width * height * 4 bytes (:string) or
+ * as an Array of Integers (:array). No Color objects are created.
  */
-static VALUE bitmap_set_mask(VALUE self, VALUE color) {
+static VALUE bitmap_get_pixels(int argc, VALUE *argv, VALUE self) {
+  VALUE x, y, w, h, as, result;
   BITMAP *bmp = _get_bmp(self);
-  int mask = bitmap_mask_color(bmp);
-  int col = color_to_int(color);
-  int x, y;
+  uint32_t *row;
+  int _x, _y, _w, _h, i, j;
+  long k = 0;
 
-  acquire_bitmap(bmp);
+  rb_scan_args(argc, argv, "41", &x, &y, &w, &h, &as);
 
-  for (y = 0; y < bmp->h; ++y) {
-    for (x = 0; x < bmp->w; ++x) {
-      if (getpixel(bmp, x, y) == col) {
-	put_pixel(bmp, x, y, mask);
+  _x = NUM2INT(x);
+  _y = NUM2INT(y);
+  _w = NUM2INT(w);
+  _h = NUM2INT(h);
+
+  check_region(bmp, _x, _y, _w, _h);
+
+  if (!NIL_P(as)) {
+    Check_Type(as, T_SYMBOL);
+  }
+
+  if (NIL_P(as) || SYM2ID(as) == rb_intern("string")) {
+    result = rb_str_new(0, (long) _w * _h * sizeof(uint32_t));
+    row = (uint32_t *) RSTRING(result)->ptr;
+
+    acquire_bitmap(bmp);
+    for (j = 0; j < _h; ++j, row += _w) {
+      read_row32(bmp, _x, _y + j, _w, row);
+    }
+    release_bitmap(bmp);
+  }
+  else if (SYM2ID(as) == rb_intern("array")) {
+    result = rb_ary_new2((long) _w * _h);
+    row = ALLOCA_N(uint32_t, _w);
+
+    acquire_bitmap(bmp);
+    for (j = 0; j < _h; ++j) {
+      read_row32(bmp, _x, _y + j, _w, row);
+      for (i = 0; i < _w; ++i) {
+	rb_ary_store(result, k++, packed_to_num(row[i]));
       }
     }
+    release_bitmap(bmp);
+  }
+  else {
+    rb_raise(rb_eArgError, "unknown format: %s", rb_id2name(SYM2ID(as)));
   }
 
-  release_bitmap(bmp);	  
+  return result;
+}
+
+/**
+ * call-seq: put_pixels(x, y, width, height, pixels)
+ *
+ * Writes a rectangle of pixels in one call. Pixels is either a String
+ * of width * height packed 32 bit colors or an Array of width *
+ * height Integers, in the format returned by #get_pixels. The colors
+ * are converted to the depth of the bitmap. Ignores the drawing mode
+ * and clipping rectangle.
+ */
+static VALUE bitmap_put_pixels(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h, VALUE pixels) {
+  BITMAP *bmp = _get_bmp(self);
+  uint32_t *row;
+  int _x = NUM2INT(x);
+  int _y = NUM2INT(y);
+  int _w = NUM2INT(w);
+  int _h = NUM2INT(h);
+  long len = (long) _w * _h;
+  long k = 0;
+  int i, j;
+
+  check_region(bmp, _x, _y, _w, _h);
+
+  if (TYPE(pixels) == T_STRING) {
+    if (RSTRING(pixels)->len != len * (long) sizeof(uint32_t)) {
+      rb_raise(rb_eArgError, "string length is not width * height * 4");
+    }
+    row = (uint32_t *) RSTRING(pixels)->ptr;
+
+    acquire_bitmap(bmp);
+    for (j = 0; j < _h; ++j, row += _w) {
+      write_row32(bmp, _x, _y + j, _w, row);
+    }
+    release_bitmap(bmp);
+  }
+  else if (TYPE(pixels) == T_ARRAY) {
+    if (RARRAY(pixels)->len != len) {
+      rb_raise(rb_eArgError, "array length is not width * height");
+    }
+    row = ALLOCA_N(uint32_t, _w);
+
+    /* convert each row before acquiring the bitmap, a bad color
+     * raises and must not leave a video bitmap locked */
+    for (j = 0; j < _h; ++j) {
+      for (i = 0; i < _w; ++i, ++k) {
+	if (k >= RARRAY(pixels)->len) {
+	  rb_raise(rb_eArgError, "array length is not width * height");
+	}
+	row[i] = color_to_packed(RARRAY(pixels)->ptr[k]);
+      }
+      acquire_bitmap(bmp);
+      write_row32(bmp, _x, _y + j, _w, row);
+      release_bitmap(bmp);
+    }
+  }
+  else {
+    rb_raise_arg_error("String or Array", pixels);
+  }
+
+  dirty_add(bmp, _x, _y, _x + _w - 1, _y + _h - 1);
+
+  return self;
+}
+
+
+/**
+ * call-seq: track_dirty(enable = true)
+ *
+ * Turns dirty rectangle tracking on or off. While it is on, every
+ * drawing method records the area it touched, overlapping areas are
+ * merged, and #present copies only those to the screen. Writes
+ * through a Bitmap::Buffer address bypass the tracking; report them
+ * with #mark_dirty. A freshly tracked bitmap is completely dirty.
+ */
+static VALUE bitmap_track_dirty(int argc, VALUE *argv, VALUE self) {
+  VALUE enable;
+
+  rb_scan_args(argc, argv, "01", &enable);
+
+  dirty_track(_get_bmp(self), argc == 0 || RTEST(enable));
+
+  return self;
+}
+
+/**
+ * Returns true if dirty rectangles are tracked for this bitmap.
+ */
+static VALUE bitmap_is_tracking_dirty(VALUE self) {
+  return dirty_tracking(_get_bmp(self)) ? Qtrue : Qfalse;
+}
+
+/**
+ * call-seq: mark_dirty(x = 0, y = 0, width = self.width, height = self.height)
+ *
+ * Marks a rectangle as changed, by default the whole bitmap.
+ */
+static VALUE bitmap_mark_dirty(int argc, VALUE *argv, VALUE self) {
+  VALUE x, y, w, h;
+  BITMAP *bmp = _get_bmp(self);
+  int _x, _y;
+
+  rb_scan_args(argc, argv, "04", &x, &y, &w, &h);
+
+  _x = NIL_P(x) ? 0 : NUM2INT(x);
+  _y = NIL_P(y) ? 0 : NUM2INT(y);
+
+  dirty_add(bmp, _x, _y,
+	    _x + (NIL_P(w) ? bmp->w : NUM2INT(w)) - 1,
+	    _y + (NIL_P(h) ? bmp->h : NUM2INT(h)) - 1);
 
   return self;
 }
 
+/**
+ * Returns the changed areas as [x, y, width, height] arrays, or nil
+ * if the bitmap is not tracked.
+ */
+static VALUE bitmap_dirty_rects(VALUE self) {
+  const DIRTY_RECT *rects;
+  int n = dirty_rects(_get_bmp(self), &rects);
+  VALUE ary;
+  int i;
+
+  if (n < 0)
+    return Qnil;
+
+  ary = rb_ary_new2(n);
+
+  for (i = 0; i < n; ++i) {
+    rb_ary_push(ary, rb_ary_new3(4,
+				 INT2FIX(rects[i].x1),
+				 INT2FIX(rects[i].y1),
+				 INT2FIX(rects[i].x2 - rects[i].x1 + 1),
+				 INT2FIX(rects[i].y2 - rects[i].y1 + 1)));
+  }
+
+  return ary;
+}
+
+/**
+ * call-seq: present(target, x = 0, y = 0)
+ *
+ * Copies the areas changed since the last present to target, with the
+ * top left corner of this bitmap at (x, y), and starts over with a
+ * clean bitmap. Untracked bitmaps are blitted completely. Meant for
+ * back buffers:
+ *
+ *   buf.track_dirty
+ *   loop do
+ *     buf.rectfill(old_x, old_y, old_x + 63, old_y + 63, 0)
+ *     buf.draw(:normal, sprite, x, y)
+ *     buf.present(Screen)
+ *   end
+ *
+ * Returns the number of rectangles copied.
+ */
+static VALUE bitmap_present(int argc, VALUE *argv, VALUE self) {
+  VALUE target, x, y;
+
+  rb_scan_args(argc, argv, "12", &target, &x, &y);
+
+  return INT2FIX(dirty_present(_get_bmp(self), get_bmp(target),
+			       NIL_P(x) ? 0 : NUM2INT(x),
+			       NIL_P(y) ? 0 : NUM2INT(y)));
+}
+
+/**
+ * call-seq: set_mask(colors, tolerance = 0)
+ *
+ * Converts all pixels matching one of the given colors to the mask
+ * color (#ff00ff). Colors is a single color or an array of
+ * colors. A pixel matches if each of its red, green and blue
+ * components differs by at most tolerance from the key color, which
+ * catches the slightly off backgrounds left by lossy
+ * compression. Works on 8, 15, 16, 24 and 32 bit bitmaps, using
+ * SSE2 or AVX2 for 32 bit ones when the CPU supports it. Up to 256
+ * colors can be given.
+ *
+ * Returns the number of pixels masked.
+ */
+static VALUE bitmap_set_mask(int argc, VALUE *argv, VALUE self) {
+  VALUE colors, tolerance;
+  BITMAP *bmp = _get_bmp(self);
+  uint32_t keys[MAX_MASK_KEYS];
+  int num_keys, i, count;
+
+  rb_scan_args(argc, argv, "11", &colors, &tolerance);
+
+  if (TYPE(colors) == T_ARRAY) {
+    num_keys = RARRAY(colors)->len;
+    if (num_keys > MAX_MASK_KEYS) {
+      rb_raise(rb_eArgError, "at most %d colors can be masked at once", MAX_MASK_KEYS);
+    }
+    for (i = 0; i < num_keys; ++i) {
+      keys[i] = color_to_packed(RARRAY(colors)->ptr[i]);
+    }
+  }
+  else {
+    num_keys = 1;
+    keys[0] = color_to_packed(colors);
+  }
+
+  acquire_bitmap(bmp);
+
+  count = mask_color_keys(bmp, keys, num_keys, NIL_P(tolerance) ? 0 : NUM2INT(tolerance));
+
+  release_bitmap(bmp);	  
+
+  if (count > 0)
+    dirty_add(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+
+  return INT2NUM(count);
+}
+
 
 /**
  * call-seq: save(file, palette)
  * 
  * Write a bitmap into a file. The output format is
  * determined from the filename extension: at present this function
- * supports BMP, PCX and TGA formats.  Two things to watch out for: on
+ * supports BMP, PCX, TGA and PNG formats. Large memory bitmaps are
+ * saved as PNG on one thread per processor, like save_png with the
+ * default options does.  Two things to watch out for: on
  * some video cards it may be faster to copy the screen to a memory
  * bitmap and save the latter, and if you use this to dump the screen
  * into a file you may end up with an image much larger than you were
@@ -246,17 +945,209 @@ static VALUE bitmap_set_mask(VALUE self, VALUE color) {
  * sub-bitmap to specify which part of the screen to save.
  */
 static VALUE bitmap_save(VALUE self, VALUE file) {
-  RGB *pal;
+  PALETTE pal;
   BITMAP *bmp = _get_bmp(self);
 
   Check_Type(file, T_STRING);
 
+  if (ustricmp(get_extension(STR2CSTR(file)), "png") == 0) {
+    get_palette(pal);
+    if (save_png_ex(STR2CSTR(file), bmp, pal, _png_compression_level, LOADPNG_FILTER_DEFAULT, LOADPNG_STRATEGY_DEFAULT, cpu_count()) != 0)
+      rb_raise(rb_eRuntimeError, "could not save PNG: %s", STR2CSTR(file));
+    return self;
+  }
+
   save_bitmap(STR2CSTR(file), bmp, NULL);
 
   return self;
 }
 
 
+/* Returns the value of option name in opts, or nil. */
+VALUE get_option(VALUE opts, const char *name) {
+  if (NIL_P(opts))
+    return Qnil;
+
+  Check_Type(opts, T_HASH);
+  return rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+}
+
+/**
+ * call-seq: to_jpeg(:quality => 75, :sampling => 444)
+ *
+ * Encodes the bitmap as a JPEG file and returns it in a String, without
+ * going through the disk. Quality goes from 1 to 100. Sampling is 444
+ * to keep color at full resolution, 422 to halve it horizontally or 420
+ * to halve it both ways, which gives the smallest files.
+ *
+ *   socket.write(frame.to_jpeg(:quality => 60, :sampling => 420))
+ */
+static VALUE bitmap_to_jpeg(int argc, VALUE *argv, VALUE self) {
+  VALUE opts, value, str;
+  BITMAP *bmp = _get_bmp(self);
+  PALETTE pal;
+  void *data;
+  int quality = 75, flags = JPG_SAMPLING_444;
+  int size, error;
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  value = get_option(opts, "quality");
+  if (!NIL_P(value)) {
+    quality = NUM2INT(value);
+    if (quality < 1 || quality > 100)
+      rb_raise(rb_eArgError, "quality must be between 1 and 100");
+  }
+
+  value = get_option(opts, "sampling");
+  if (!NIL_P(value)) {
+    switch (NUM2INT(value)) {
+    case 444: flags = JPG_SAMPLING_444; break;
+    case 422: flags = JPG_SAMPLING_422; break;
+    case 420: flags = JPG_SAMPLING_411; break;
+    default:
+      rb_raise(rb_eArgError, "sampling must be 444, 422 or 420");
+    }
+  }
+
+  get_palette(pal);
+
+  acquire_bitmap(bmp);
+  data = save_memory_jpg_r(bmp, bitmap_color_depth(bmp) == 8 ? pal : NULL, quality, flags, cpu_count(), &size, &error);
+  release_bitmap(bmp);
+
+  if (!data) {
+    rb_raise(rb_eRuntimeError, "could not encode JPEG (%s)", error == JPG_ERROR_OUT_OF_MEMORY ? "out of memory" : "unsupported bitmap");
+  }
+
+  str = rb_str_new(data, size);
+  free(data);
+
+  return str;
+}
+
+/* Reads the :level, :filter and :strategy options of the PNG savers. */
+static void get_png_options(VALUE opts, int *level, int *filter, int *strategy) {
+  VALUE value;
+  ID id;
+
+  *level = _png_compression_level;
+  *filter = LOADPNG_FILTER_DEFAULT;
+  *strategy = LOADPNG_STRATEGY_DEFAULT;
+
+  value = get_option(opts, "level");
+  if (!NIL_P(value)) {
+    *level = NUM2INT(value);
+    if (*level < 0 || *level > 9)
+      rb_raise(rb_eArgError, "level must be between 0 and 9");
+  }
+
+  value = get_option(opts, "filter");
+  if (!NIL_P(value)) {
+    Check_Type(value, T_SYMBOL);
+    id = SYM2ID(value);
+    if (id == rb_intern("none"))
+      *filter = LOADPNG_FILTER_NONE;
+    else if (id == rb_intern("sub"))
+      *filter = LOADPNG_FILTER_SUB;
+    else if (id == rb_intern("up"))
+      *filter = LOADPNG_FILTER_UP;
+    else if (id == rb_intern("average"))
+      *filter = LOADPNG_FILTER_AVG;
+    else if (id == rb_intern("paeth"))
+      *filter = LOADPNG_FILTER_PAETH;
+    else if (id == rb_intern("adaptive"))
+      *filter = LOADPNG_FILTER_ALL;
+    else
+      rb_raise(rb_eArgError, "filter must be :none, :sub, :up, :average, :paeth or :adaptive");
+  }
+
+  value = get_option(opts, "strategy");
+  if (!NIL_P(value)) {
+    Check_Type(value, T_SYMBOL);
+    id = SYM2ID(value);
+    if (id == rb_intern("default"))
+      *strategy = LOADPNG_STRATEGY_PLAIN;
+    else if (id == rb_intern("filtered"))
+      *strategy = LOADPNG_STRATEGY_FILTERED;
+    else if (id == rb_intern("huffman_only"))
+      *strategy = LOADPNG_STRATEGY_HUFFMAN_ONLY;
+    else if (id == rb_intern("rle"))
+      *strategy = LOADPNG_STRATEGY_RLE;
+    else if (id == rb_intern("fixed"))
+      *strategy = LOADPNG_STRATEGY_FIXED;
+    else
+      rb_raise(rb_eArgError, "strategy must be :default, :filtered, :huffman_only, :rle or :fixed");
+  }
+}
+
+/**
+ * call-seq: to_png(:level => 9, :filter => f, :strategy => s)
+ *
+ * Encodes the bitmap as a PNG file and returns it in a String. The
+ * options are those of save_png.
+ * 8 bit bitmaps are written with the current palette.
+ */
+static VALUE bitmap_to_png(int argc, VALUE *argv, VALUE self) {
+  VALUE opts, str;
+  BITMAP *bmp = _get_bmp(self);
+  PALETTE pal;
+  void *data;
+  int level, filter, strategy;
+  int size;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  get_png_options(opts, &level, &filter, &strategy);
+
+  get_palette(pal);
+
+  data = save_memory_png(bmp, pal, level, filter, strategy, cpu_count(), &size);
+  if (!data) {
+    rb_raise(rb_eRuntimeError, "could not encode PNG");
+  }
+
+  str = rb_str_new(data, size);
+  free(data);
+
+  return str;
+}
+
+/**
+ * call-seq: save_png(file, :level => 9, :filter => f, :strategy => s)
+ *
+ * Writes the bitmap to a PNG file. Level is the zlib compression level,
+ * from 0 (none, fastest) to 9 (smallest). Filter picks the row filter,
+ * one of :none, :sub, :up, :average and :paeth, or :adaptive to try them
+ * all on each row; strategy is the zlib strategy, one of :default,
+ * :filtered, :huffman_only, :rle and :fixed. Both are left to libpng
+ * when not given. Rows of 24 and 32 bit memory bitmaps go to libpng as
+ * they are, without a copy, and large memory bitmaps are deflated in
+ * bands on one thread per processor.
+ * 8 bit bitmaps are written with the current palette.
+ *
+ *   screen_copy.save_png("shot.png", :level => 1, :filter => :sub, :strategy => :rle)
+ *   sprite.save_png("sprite.png", :level => 9, :filter => :adaptive)
+ */
+static VALUE bitmap_save_png(int argc, VALUE *argv, VALUE self) {
+  VALUE file, opts;
+  BITMAP *bmp = _get_bmp(self);
+  PALETTE pal;
+  int level, filter, strategy;
+
+  rb_scan_args(argc, argv, "11", &file, &opts);
+  Check_Type(file, T_STRING);
+  get_png_options(opts, &level, &filter, &strategy);
+
+  get_palette(pal);
+
+  if (save_png_ex(STR2CSTR(file), bmp, pal, level, filter, strategy, cpu_count()) != 0) {
+    rb_raise(rb_eRuntimeError, "could not save PNG: %s", STR2CSTR(file));
+  }
+
+  return self;
+}
+
+
 /**
  * Get width of bitmap.
  */
@@ -415,6 +1306,8 @@ static VALUE bitmap_clear(VALUE self, VALUE color) {
 
   clear_to_color(bmp, color_to_int(color));
 
+  dirty_add(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+
   return self;
 }
 
@@ -445,6 +1338,10 @@ static VALUE bitmap_textout(int argc, VALUE *argv, VALUE self)	  {
 	     NIL_P(col) ? -1 : color_to_int(col), 
 	     NIL_P(bg) ? -1 : color_to_int(bg));
 
+  dirty_add(bmp, NUM2INT(x), NUM2INT(y),
+	    NUM2INT(x) + text_length(get_font(f), STR2CSTR(text)) - 1,
+	    NUM2INT(y) + text_height(get_font(f)) - 1);
+
   return self;
 }
 
@@ -475,6 +1372,12 @@ static VALUE bitmap_blit(int argc, VALUE *argv, VALUE self) {
        NIL_P(w) ? bmp->w : NUM2INT(w), 
        NIL_P(h) ? bmp->h : NUM2INT(h));
 
+  dirty_add(get_bmp(target),
+	    NIL_P(x2) ? 0 : NUM2INT(x2),
+	    NIL_P(y2) ? 0 : NUM2INT(y2),
+	    (NIL_P(x2) ? 0 : NUM2INT(x2)) + (NIL_P(w) ? bmp->w : NUM2INT(w)) - 1,
+	    (NIL_P(y2) ? 0 : NUM2INT(y2)) + (NIL_P(h) ? bmp->h : NUM2INT(h)) - 1);
+
   return self;
 }
 
@@ -503,6 +1406,12 @@ static VALUE bitmap_masked_blit(int argc, VALUE *argv, VALUE self) {
 	      NIL_P(w) ? bmp->w : NUM2INT(w), 
 	      NIL_P(h) ? bmp->h : NUM2INT(h));
 
+  dirty_add(get_bmp(target),
+	    NIL_P(x2) ? 0 : NUM2INT(x2),
+	    NIL_P(y2) ? 0 : NUM2INT(y2),
+	    (NIL_P(x2) ? 0 : NUM2INT(x2)) + (NIL_P(w) ? bmp->w : NUM2INT(w)) - 1,
+	    (NIL_P(y2) ? 0 : NUM2INT(y2)) + (NIL_P(h) ? bmp->h : NUM2INT(h)) - 1);
+
   return self;
 }
 
@@ -532,6 +1441,9 @@ static VALUE bitmap_stretch_blit(VALUE self, VALUE target, VALUE x1, VALUE y1,
   	       NUM2INT(y2),
   	       NUM2INT(w2),
   	       NUM2INT(h2));
+  dirty_add(get_bmp(target), NUM2INT(x2), NUM2INT(y2),
+	    NUM2INT(x2) + NUM2INT(w2) - 1, NUM2INT(y2) + NUM2INT(h2) - 1);
+
   return self;
 }
 
@@ -555,10 +1467,39 @@ static VALUE bitmap_masked_stretch_blit(VALUE self, VALUE target, VALUE x1, VALU
 		      NUM2INT(y2),
 		      NUM2INT(w2),
 		      NUM2INT(h2));
+  dirty_add(get_bmp(target), NUM2INT(x2), NUM2INT(y2),
+	    NUM2INT(x2) + NUM2INT(w2) - 1, NUM2INT(y2) + NUM2INT(h2) - 1);
+
   return self;
 }
 
 
+enum {
+  DRAW_NORMAL,
+  DRAW_LIT,
+  DRAW_TRANS,
+  DRAW_ROTATE,
+  DRAW_ROTATE_SCALED
+};
+
+static ID id_normal, id_lit, id_trans, id_rotate, id_rotate_scaled;
+
+static int draw_mode(VALUE mode) {
+  ID id;
+
+  Check_Type(mode, T_SYMBOL);
+
+  id = SYM2ID(mode);
+
+  if (id == id_normal)        return DRAW_NORMAL;
+  if (id == id_lit)           return DRAW_LIT;
+  if (id == id_trans)         return DRAW_TRANS;
+  if (id == id_rotate)        return DRAW_ROTATE;
+  if (id == id_rotate_scaled) return DRAW_ROTATE_SCALED;
+
+  rb_raise(rb_eArgError, "unknown draw mode: %s", rb_id2name(id));
+}
+
 /**
  * call-seq: draw(mode, bitmap, x, y, angle_or_color = 0, scale = 0)
  * 
@@ -572,32 +1513,195 @@ static VALUE bitmap_masked_stretch_blit(VALUE self, VALUE target, VALUE x1, VALU
  */
 static VALUE bitmap_draw(int argc, VALUE *argv, VALUE self)	 {
   VALUE mode, sprite, x, y, angcol, scale;
-  ID id;
+  BITMAP *bmp = _get_bmp(self);
+  BITMAP *spr;
 
   rb_scan_args(argc, argv, "15", &mode, &sprite, &x, &y, &angcol, &scale);
+
+  switch (draw_mode(mode)) {
+  case DRAW_NORMAL:
+    draw_sprite(bmp, spr = get_bmp(sprite), NUM2INT(x), NUM2INT(y));
+    dirty_sprite(bmp, spr, NUM2INT(x), NUM2INT(y), 0, 1);
+    break;
+  case DRAW_LIT:
+    draw_lit_sprite(bmp, spr = get_bmp(sprite), NUM2INT(x), NUM2INT(y), color_to_int(angcol));
+    dirty_sprite(bmp, spr, NUM2INT(x), NUM2INT(y), 0, 1);
+    break;
+  case DRAW_TRANS:
+    draw_trans_sprite(bmp, spr = get_bmp(sprite), NUM2INT(x), NUM2INT(y));
+    dirty_sprite(bmp, spr, NUM2INT(x), NUM2INT(y), 0, 1);
+    break;
+  case DRAW_ROTATE:
+    rotate_sprite(bmp, spr = get_bmp(sprite), NUM2INT(x), NUM2INT(y),
+		  ftofix(NUM2DBL(angcol) * 128 / PI));
+    dirty_sprite(bmp, spr, NUM2INT(x), NUM2INT(y), 1, 1);
+    break;
+  case DRAW_ROTATE_SCALED:
+    rotate_scaled_sprite(bmp, spr = get_bmp(sprite), NUM2INT(x), NUM2INT(y),
+			 ftofix(NUM2DBL(angcol) * 128 / PI), ftofix(NUM2DBL(scale)));
+    dirty_sprite(bmp, spr, NUM2INT(x), NUM2INT(y), 1, NUM2DBL(scale));
+    break;
+  }
     
-  Check_Type(mode, T_SYMBOL);
+  return self;
+}
 
-  id = SYM2ID(mode);
+#define BATCH_STRIDE 4
+
+typedef struct DrawBatch
+{
+  BITMAP *bmp;
+  int mode;
+  long n;
+  VALUE sprites;
+  VALUE coords;
+  float *coord_buf;
+  BITMAP **list;
+} DrawBatch;
+
+/* Converts the arguments, which may raise, and draws. The buffers it
+ * allocates are freed by draw_batch_free either way.
+ */
+static VALUE draw_batch_run(VALUE arg) {
+  DrawBatch *batch = (DrawBatch *) arg;
+  BITMAP *bmp = batch->bmp;
+  BITMAP *sprite = NULL;
+  BITMAP **list = NULL;
+  const float *c, *first;
+  long n = batch->n, i;
+  int m = batch->mode;
+
+  if (TYPE(batch->coords) == T_STRING) {
+    c = (const float *) RSTRING(batch->coords)->ptr;
+  }
+  else {
+    batch->coord_buf = ALLOC_N(float, n > 0 ? n * BATCH_STRIDE : 1);
+    for (i = 0; i < n * BATCH_STRIDE && i < RARRAY(batch->coords)->len; ++i) {
+      batch->coord_buf[i] = (float) NUM2DBL(RARRAY(batch->coords)->ptr[i]);
+    }
+    c = batch->coord_buf;
+  }
 
-  if (id == rb_intern("normal")) {
-    draw_sprite(_get_bmp(self), get_bmp(sprite), NUM2INT(x), NUM2INT(y));
-  }        
-  else if (id == rb_intern("lit")) {
-    draw_lit_sprite(_get_bmp(self), get_bmp(sprite), NUM2INT(x), NUM2INT(y), color_to_int(angcol));
+  /* NUM2DBL may call a to_f which resizes either array */
+  if (TYPE(batch->coords) == T_ARRAY && RARRAY(batch->coords)->len != n * BATCH_STRIDE) {
+    rb_raise(rb_eRuntimeError, "coords modified during draw_batch");
   }
-  else if (id == rb_intern("trans")) {
-    draw_trans_sprite(_get_bmp(self), get_bmp(sprite), NUM2INT(x), NUM2INT(y));
+  if (TYPE(batch->sprites) == T_ARRAY && RARRAY(batch->sprites)->len != n) {
+    rb_raise(rb_eRuntimeError, "sprites modified during draw_batch");
   }
-  else if (id == rb_intern("rotate")) {
-    rotate_sprite(_get_bmp(self), get_bmp(sprite), NUM2INT(x), NUM2INT(y),
-		  ftofix(NUM2DBL(angcol) * 128 / PI));
+
+  if (TYPE(batch->sprites) == T_ARRAY) {
+    list = batch->list = ALLOC_N(BITMAP *, n > 0 ? n : 1);
+    for (i = 0; i < n; ++i) {
+      list[i] = get_bmp(RARRAY(batch->sprites)->ptr[i]);
+    }
   }
-  else if (id == rb_intern("rotate_scaled")) {        
-    rotate_scaled_sprite(_get_bmp(self), get_bmp(sprite), NUM2INT(x), NUM2INT(y),
-			 ftofix(NUM2DBL(angcol) * 128 / PI), ftofix(NUM2DBL(scale)));
+  else {
+    sprite = get_bmp(batch->sprites);
   }
-    
+
+  first = c;
+
+  acquire_bitmap(bmp);
+
+  switch (m) {
+  case DRAW_NORMAL:
+    for (i = 0; i < n; ++i, c += BATCH_STRIDE) {
+      draw_sprite(bmp, list ? list[i] : sprite, (int) c[0], (int) c[1]);
+    }
+    break;
+  case DRAW_LIT:
+    for (i = 0; i < n; ++i, c += BATCH_STRIDE) {
+      draw_lit_sprite(bmp, list ? list[i] : sprite, (int) c[0], (int) c[1], (int) c[2]);
+    }
+    break;
+  case DRAW_TRANS:
+    for (i = 0; i < n; ++i, c += BATCH_STRIDE) {
+      draw_trans_sprite(bmp, list ? list[i] : sprite, (int) c[0], (int) c[1]);
+    }
+    break;
+  case DRAW_ROTATE:
+    for (i = 0; i < n; ++i, c += BATCH_STRIDE) {
+      rotate_sprite(bmp, list ? list[i] : sprite, (int) c[0], (int) c[1],
+		    ftofix(c[2] * 128 / PI));
+    }
+    break;
+  case DRAW_ROTATE_SCALED:
+    for (i = 0; i < n; ++i, c += BATCH_STRIDE) {
+      rotate_scaled_sprite(bmp, list ? list[i] : sprite, (int) c[0], (int) c[1],
+			   ftofix(c[2] * 128 / PI), ftofix(c[3]));
+    }
+    break;
+  }
+
+  release_bitmap(bmp);
+
+  if (dirty_tracking(bmp)) {
+    for (i = 0, c = first; i < n; ++i, c += BATCH_STRIDE) {
+      dirty_sprite(bmp, list ? list[i] : sprite, (int) c[0], (int) c[1], m >= DRAW_ROTATE,
+		   m == DRAW_ROTATE_SCALED ? c[3] : 1);
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE draw_batch_free(VALUE arg) {
+  DrawBatch *batch = (DrawBatch *) arg;
+
+  if (batch->coord_buf)
+    xfree(batch->coord_buf);
+  if (batch->list)
+    xfree(batch->list);
+
+  return Qnil;
+}
+
+/**
+ * call-seq: draw_batch(mode, sprites, coords)
+ *
+ * Draws many sprites in one call, see #draw for the modes. Sprites is
+ * either a single Bitmap, drawn at every position, or an Array with
+ * one Bitmap per entry. Coords holds four numbers per sprite: x, y,
+ * angle (radians) and scale. For :lit the angle slot holds the light
+ * level instead, and modes which need neither ignore the last two.
+ *
+ * Coords is a flat Array of numbers or, cheaper, a String of native
+ * floats as built by <tt>coords.pack("f*")</tt>; a String can be kept
+ * and updated between frames so nothing is allocated per sprite.
+ */
+static VALUE bitmap_draw_batch(VALUE self, VALUE mode, VALUE sprites, VALUE coords) {
+  DrawBatch batch;
+
+  batch.bmp = _get_bmp(self);
+  batch.mode = draw_mode(mode);
+  batch.sprites = sprites;
+  batch.coords = coords;
+  batch.coord_buf = NULL;
+  batch.list = NULL;
+
+  if (TYPE(coords) == T_STRING) {
+    if (RSTRING(coords)->len % (BATCH_STRIDE * sizeof(float)) != 0) {
+      rb_raise(rb_eArgError, "coords length is not a multiple of %d floats", BATCH_STRIDE);
+    }
+    batch.n = RSTRING(coords)->len / (BATCH_STRIDE * sizeof(float));
+  }
+  else if (TYPE(coords) == T_ARRAY) {
+    if (RARRAY(coords)->len % BATCH_STRIDE != 0) {
+      rb_raise(rb_eArgError, "coords length is not a multiple of %d", BATCH_STRIDE);
+    }
+    batch.n = RARRAY(coords)->len / BATCH_STRIDE;
+  }
+  else {
+    rb_raise_arg_error("String or Array", coords);
+  }
+
+  if (TYPE(sprites) == T_ARRAY && RARRAY(sprites)->len != batch.n) {
+    rb_raise(rb_eArgError, "%ld sprites given for %ld positions", RARRAY(sprites)->len, batch.n);
+  }
+
+  rb_ensure(draw_batch_run, (VALUE) &batch, draw_batch_free, (VALUE) &batch);
+
   return self;
 }
 
@@ -609,13 +1713,16 @@ static VALUE bitmap_draw(int argc, VALUE *argv, VALUE self)	 {
  */
 static VALUE bitmap_putpixel(VALUE self, VALUE x, VALUE y, VALUE color) {
   putpixel(_get_bmp(self), NUM2INT(x), NUM2INT(y), color_to_int(color));
+  dirty_add(_get_bmp(self), NUM2INT(x), NUM2INT(y), NUM2INT(x), NUM2INT(y));
+
   return self;
 }
 
 /**
  * call-seq: getpixel(x, y)
  * 
- * Read a pixel from point (x, y) in the bitmap. 
+ * Read a pixel from point (x, y) in the bitmap. Returns the color as
+ * packed integer, see Color.unpack and Color.[].
  */
 static VALUE bitmap_getpixel(VALUE self, VALUE x, VALUE y) {
   return int_to_color(getpixel(_get_bmp(self), NUM2INT(x), NUM2INT(y)));
@@ -629,6 +1736,8 @@ static VALUE bitmap_getpixel(VALUE self, VALUE x, VALUE y) {
 static VALUE bitmap_line(VALUE self, VALUE x1, VALUE y1, VALUE x2, 
 			 VALUE y2, VALUE color) {
   line(_get_bmp(self), NUM2INT(x1), NUM2INT(y1), NUM2INT(x2), NUM2INT(y2), color_to_int(color));
+  dirty_add(_get_bmp(self), NUM2INT(x1), NUM2INT(y1), NUM2INT(x2), NUM2INT(y2));
+
   return self;
 }
 
@@ -650,6 +1759,12 @@ static VALUE bitmap_triangle(VALUE self, VALUE x1, VALUE y1,
 	   NUM2INT(y3),
 	   color_to_int(color));
 
+  dirty_add(_get_bmp(self),
+	    MIN(NUM2INT(x1), MIN(NUM2INT(x2), NUM2INT(x3))),
+	    MIN(NUM2INT(y1), MIN(NUM2INT(y2), NUM2INT(y3))),
+	    MAX(NUM2INT(x1), MAX(NUM2INT(x2), NUM2INT(x3))),
+	    MAX(NUM2INT(y1), MAX(NUM2INT(y2), NUM2INT(y3))));
+
   return self;
 }
 
@@ -673,6 +1788,8 @@ static VALUE bitmap_polygon(VALUE self, VALUE points, VALUE color) {
 
   polygon(_get_bmp(self), RARRAY(points)->len, pa, color_to_int(color));
 	
+  dirty_points(_get_bmp(self), pa, RARRAY(points)->len / 2);
+
   return self;
 }
 
@@ -691,6 +1808,8 @@ static VALUE bitmap_rect(VALUE self, VALUE x1, VALUE y1, VALUE x2,
        NUM2INT(y2),
        color_to_int(color));
 
+  dirty_add(_get_bmp(self), NUM2INT(x1), NUM2INT(y1), NUM2INT(x2), NUM2INT(y2));
+
   return self;
 }
 
@@ -709,6 +1828,8 @@ static VALUE bitmap_rectfill(VALUE self, VALUE x1, VALUE y1,
 	   NUM2INT(y2),
 	   color_to_int(color));
 
+  dirty_add(_get_bmp(self), NUM2INT(x1), NUM2INT(y1), NUM2INT(x2), NUM2INT(y2));
+
   return self;
 }
 
@@ -725,6 +1846,9 @@ static VALUE bitmap_circle(VALUE self, VALUE x, VALUE y,
 	 NUM2INT(radius),
 	 color_to_int(color));
 
+  dirty_add(_get_bmp(self), NUM2INT(x) - NUM2INT(radius), NUM2INT(y) - NUM2INT(radius),
+	    NUM2INT(x) + NUM2INT(radius), NUM2INT(y) + NUM2INT(radius));
+
   return self;
 }
 
@@ -741,6 +1865,9 @@ static VALUE bitmap_circlefill(VALUE self, VALUE x, VALUE y,
 	     NUM2INT(radius),
 	     color_to_int(color));
 
+  dirty_add(_get_bmp(self), NUM2INT(x) - NUM2INT(radius), NUM2INT(y) - NUM2INT(radius),
+	    NUM2INT(x) + NUM2INT(radius), NUM2INT(y) + NUM2INT(radius));
+
   return self;
 }
 
@@ -758,6 +1885,9 @@ static VALUE bitmap_ellipse(VALUE self, VALUE x, VALUE y,
 	  NUM2INT(ry),
 	  color_to_int(color));
 
+  dirty_add(_get_bmp(self), NUM2INT(x) - NUM2INT(rx), NUM2INT(y) - NUM2INT(ry),
+	    NUM2INT(x) + NUM2INT(rx), NUM2INT(y) + NUM2INT(ry));
+
   return self;
 }
 
@@ -774,6 +1904,9 @@ static VALUE bitmap_ellipsefill(VALUE self, VALUE x, VALUE y, VALUE rx, VALUE ry
 	      NUM2INT(ry),
 	      color_to_int(color));
 
+  dirty_add(_get_bmp(self), NUM2INT(x) - NUM2INT(rx), NUM2INT(y) - NUM2INT(ry),
+	    NUM2INT(x) + NUM2INT(rx), NUM2INT(y) + NUM2INT(ry));
+
   return self;
 }
 
@@ -801,6 +1934,9 @@ static VALUE bitmap_arc(VALUE self, VALUE x, VALUE y, VALUE a1,
       NUM2INT(r),
       color_to_int(c));
 
+  dirty_add(_get_bmp(self), NUM2INT(x) - NUM2INT(r), NUM2INT(y) - NUM2INT(r),
+	    NUM2INT(x) + NUM2INT(r), NUM2INT(y) + NUM2INT(r));
+
   return self;
 }
 
@@ -821,20 +1957,21 @@ static VALUE bitmap_arc(VALUE self, VALUE x, VALUE y, VALUE a1,
  */ 
 static VALUE bitmap_spline(VALUE self, VALUE points, VALUE color) {
   int pa[8];
+  int i;
 
   Check_Type(points, T_ARRAY);
 
-  if (RARRAY(points)->len < 4) {
+  if (RARRAY(points)->len < 8) {
     rb_raise(rb_eArgError, "arg 1 must be array of 4 pairs (x,y)");
   }
 
-  pa[0] = NUM2INT(RARRAY(points)->ptr[0]);
-  pa[1] = NUM2INT(RARRAY(points)->ptr[1]);
-  pa[2] = NUM2INT(RARRAY(points)->ptr[2]);
-  pa[3] = NUM2INT(RARRAY(points)->ptr[3]);
+  for (i = 0; i < 8; ++i)
+    pa[i] = NUM2INT(RARRAY(points)->ptr[i]);
 
   spline(_get_bmp(self), pa, color_to_int(color));
 
+  dirty_points(_get_bmp(self), pa, 4);
+
   return self;
 }
 
@@ -850,6 +1987,8 @@ static VALUE bitmap_floodfill(VALUE self, VALUE x, VALUE y, VALUE color) {
 	    NUM2INT(y),
 	    color_to_int(color));
 
+  dirty_add(_get_bmp(self), 0, 0, _get_bmp(self)->w - 1, _get_bmp(self)->h - 1);
+
   return self;
 }
 
@@ -874,6 +2013,12 @@ void Init_allegro_bitmap() {
     m_allegro = rb_define_module ("Allegro");  
   }
 
+  id_normal        = rb_intern("normal");
+  id_lit           = rb_intern("lit");
+  id_trans         = rb_intern("trans");
+  id_rotate        = rb_intern("rotate");
+  id_rotate_scaled = rb_intern("rotate_scaled");
+
   /**
    * Once you have selected a graphics mode, you can draw things onto
    * the display via the `screen' bitmap. All the Allegro graphics
@@ -925,20 +2070,34 @@ void Init_allegro_bitmap() {
   rb_define_singleton_method(c_allegro_bitmap, "new",			bitmap_new,		2);
   rb_define_singleton_method(c_allegro_bitmap, "create_system",		bitmap_create_system, 2);
   rb_define_singleton_method(c_allegro_bitmap, "create_video",		bitmap_create_video,	2);
-  rb_define_singleton_method(c_allegro_bitmap, "load",			bitmap_load,			1);
+  rb_define_singleton_method(c_allegro_bitmap, "load",			bitmap_load,			-1);
+  rb_define_singleton_method(c_allegro_bitmap, "load_many",		bitmap_load_many,		-1);
+  rb_define_singleton_method(c_allegro_bitmap, "probe",			bitmap_probe,			1);
+  rb_define_singleton_method(c_allegro_bitmap, "from_blob",		bitmap_from_blob,		-1);
 
   rb_define_method(c_allegro_bitmap, "to_str",				bitmap_to_str,		0);
   rb_define_method(c_allegro_bitmap, "to_ary",				bitmap_to_ary,		0);
   rb_define_method(c_allegro_bitmap, "from_str",			bitmap_from_str,		1);
   rb_define_method(c_allegro_bitmap, "from_ary",			bitmap_from_ary,		1);
+  rb_define_method(c_allegro_bitmap, "buffer",				bitmap_buffer,		0);
+  rb_define_method(c_allegro_bitmap, "get_pixels",			bitmap_get_pixels,	-1);
+  rb_define_method(c_allegro_bitmap, "put_pixels",			bitmap_put_pixels,	5);
   rb_define_method(c_allegro_bitmap, "save",				bitmap_save,			1);
+  rb_define_method(c_allegro_bitmap, "to_jpeg",				bitmap_to_jpeg,		-1);
+  rb_define_method(c_allegro_bitmap, "to_png",				bitmap_to_png,		-1);
+  rb_define_method(c_allegro_bitmap, "save_png",			bitmap_save_png,	-1);
   rb_define_method(c_allegro_bitmap, "create_sub",			bitmap_create_sub,	4);
   rb_define_method(c_allegro_bitmap, "width",				bitmap_get_w,			0);
   rb_define_method(c_allegro_bitmap, "height",				bitmap_get_h,			0);
   rb_define_method(c_allegro_bitmap, "clip?",				bitmap_get_clip,		0);
   rb_define_method(c_allegro_bitmap, "clip=",				bitmap_set_clip,		1);
 
-  rb_define_method(c_allegro_bitmap, "set_mask",			bitmap_set_mask,	1);
+  rb_define_method(c_allegro_bitmap, "set_mask",			bitmap_set_mask,	-1);
+  rb_define_method(c_allegro_bitmap, "track_dirty",			bitmap_track_dirty,	-1);
+  rb_define_method(c_allegro_bitmap, "tracking_dirty?",			bitmap_is_tracking_dirty,	0);
+  rb_define_method(c_allegro_bitmap, "mark_dirty",			bitmap_mark_dirty,	-1);
+  rb_define_method(c_allegro_bitmap, "dirty_rects",			bitmap_dirty_rects,	0);
+  rb_define_method(c_allegro_bitmap, "present",				bitmap_present,		-1);
   rb_define_method(c_allegro_bitmap, "same?",				bitmap_is_same,	1);
   rb_define_method(c_allegro_bitmap, "memory?",				bitmap_is_memory,	0);
   rb_define_method(c_allegro_bitmap, "screen?",				bitmap_is_screen,	0);
@@ -956,6 +2115,7 @@ void Init_allegro_bitmap() {
   rb_define_method(c_allegro_bitmap, "stretch_blit",			bitmap_stretch_blit,	9);
   rb_define_method(c_allegro_bitmap, "masked_stretch_blit",		bitmap_masked_stretch_blit,	9);
   rb_define_method(c_allegro_bitmap, "draw",				bitmap_draw,	-1);
+  rb_define_method(c_allegro_bitmap, "draw_batch",			bitmap_draw_batch,	3);
 
   rb_define_method(c_allegro_bitmap, "putpixel",			bitmap_putpixel,			2);
   rb_define_method(c_allegro_bitmap, "getpixel",			bitmap_getpixel,			1);
@@ -0,0 +1,212 @@
+/*******************************************************************************************
+
+ buffer.c
+
+ class Allegro::Bitmap::Buffer
+
+*******************************************************************************************/
+
+#include "global.h"
+
+typedef struct Buffer
+{
+  VALUE bitmap;
+  BITMAP *bmp;
+} Buffer;
+
+static void buffer_mark(Buffer *buf) {
+  rb_gc_mark(buf->bitmap);
+}
+
+static inline Buffer* get_buffer(VALUE self) {
+  Buffer *buf;
+  Data_Get_Struct(self, Buffer, buf);
+  /* raises if the bitmap was destroyed under the buffer */
+  _get_bmp(buf->bitmap);
+  return buf;
+}
+
+static inline void check_pixel(BITMAP *bmp, int x, int y) {
+  if (x < 0 || y < 0 || x >= bmp->w || y >= bmp->h) {
+    rb_raise(rb_eIndexError, "pixel (%d, %d) outside of %dx%d buffer", x, y, bmp->w, bmp->h);
+  }
+}
+
+/**
+ * Wraps the pixel memory of the given bitmap object. The bitmap is
+ * kept alive for as long as the buffer is referenced.
+ */
+VALUE buffer_wrap(VALUE bitmap) {
+  Buffer *buf;
+  VALUE obj;
+  BITMAP *bmp = get_bmp(bitmap);
+
+  if (!is_linear_bitmap(bmp)) {
+    rb_raise(rb_eRuntimeError, "bitmap memory is not linear");
+  }
+
+  obj = Data_Make_Struct(c_allegro_bitmap_buffer, Buffer, buffer_mark, free, buf);
+  buf->bitmap = bitmap;
+  buf->bmp = bmp;
+
+  return obj;
+}
+
+/**
+ * Returns the bitmap this buffer belongs to.
+ */
+static VALUE buffer_bitmap(VALUE self) {
+  return get_buffer(self)->bitmap;
+}
+
+/**
+ * Returns the address of the first pixel as an integer. This can be
+ * handed to other C extensions (or FFI) which want to read or write
+ * the pixels in place. Rows are #pitch bytes apart. For video and
+ * system bitmaps the address is only valid while the bitmap is
+ * acquired, see Bitmap#buffer.
+ */
+static VALUE buffer_address(VALUE self) {
+  /* unsigned long is only 32 bits on Win64, so go through 64 bits */
+  return ULL2NUM((unsigned LONG_LONG) (uintptr_t) get_buffer(self)->bmp->line[0]);
+}
+
+/**
+ * Returns the distance in bytes between two rows. This may be larger
+ * than width * bytes_per_pixel, e.g. for sub-bitmaps, and it may even
+ * be negative for some video bitmaps.
+ */
+static VALUE buffer_pitch(VALUE self) {
+  return INT2FIX(bitmap_pitch(get_buffer(self)->bmp));
+}
+
+/**
+ * Returns the color depth in bits per pixel.
+ */
+static VALUE buffer_depth(VALUE self) {
+  return INT2FIX(bitmap_color_depth(get_buffer(self)->bmp));
+}
+
+/**
+ * Returns the number of bytes used by one pixel.
+ */
+static VALUE buffer_bytes_per_pixel(VALUE self) {
+  return INT2FIX(bytes_per_pixel(bitmap_color_depth(get_buffer(self)->bmp)));
+}
+
+/**
+ * Get width of buffer in pixels.
+ */
+static VALUE buffer_width(VALUE self) {
+  return INT2FIX(get_buffer(self)->bmp->w);
+}
+
+/**
+ * Get height of buffer in pixels.
+ */
+static VALUE buffer_height(VALUE self) {
+  return INT2FIX(get_buffer(self)->bmp->h);
+}
+
+/**
+ * Horizontal offset of a sub-bitmap inside its parent.
+ */
+static VALUE buffer_x_offset(VALUE self) {
+  return INT2FIX(get_buffer(self)->bmp->x_ofs);
+}
+
+/**
+ * Vertical offset of a sub-bitmap inside its parent.
+ */
+static VALUE buffer_y_offset(VALUE self) {
+  return INT2FIX(get_buffer(self)->bmp->y_ofs);
+}
+
+/**
+ * call-seq: [](x, y)
+ *
+ * Read the raw value of pixel (x, y) in the bitmap's own color
+ * format, without clipping or any object allocation.
+ */
+static VALUE buffer_aref(VALUE self, VALUE _x, VALUE _y) {
+  BITMAP *bmp = get_buffer(self)->bmp;
+  int x = NUM2INT(_x);
+  int y = NUM2INT(_y);
+
+  check_pixel(bmp, x, y);
+
+  switch (bitmap_color_depth(bmp)) {
+  case 8:  return INT2FIX(_getpixel(bmp, x, y));
+  case 15: return INT2FIX(_getpixel15(bmp, x, y));
+  case 16: return INT2FIX(_getpixel16(bmp, x, y));
+  case 24: return INT2FIX(_getpixel24(bmp, x, y));
+  default: return UINT2NUM((unsigned int) _getpixel32(bmp, x, y));
+  }
+}
+
+/**
+ * call-seq: []=(x, y, value)
+ *
+ * Write the raw value of pixel (x, y) in the bitmap's own color
+ * format. Ignores the drawing mode and clipping rectangle.
+ */
+static VALUE buffer_aset(VALUE self, VALUE _x, VALUE _y, VALUE value) {
+  BITMAP *bmp = get_buffer(self)->bmp;
+  int x = NUM2INT(_x);
+  int y = NUM2INT(_y);
+  int c = (int) NUM2ULONG(value);
+
+  check_pixel(bmp, x, y);
+
+  switch (bitmap_color_depth(bmp)) {
+  case 8:  _putpixel(bmp, x, y, c);   break;
+  case 15: _putpixel15(bmp, x, y, c); break;
+  case 16: _putpixel16(bmp, x, y, c); break;
+  case 24: _putpixel24(bmp, x, y, c); break;
+  default: _putpixel32(bmp, x, y, c); break;
+  }
+
+  dirty_add(bmp, x, y, x, y);
+
+  return value;
+}
+
+/**
+ * Inspect buffer.
+ */
+static VALUE buffer_inspect(VALUE self) {
+  char buf[256];
+  BITMAP *bmp = get_buffer(self)->bmp;
+
+  sprintf(buf,
+	  "<Buffer %p w: %d, h: %d, depth: %d, pitch: %d, x_ofs: %d, y_ofs: %d>",
+	  bmp->line[0], bmp->w, bmp->h, bitmap_color_depth(bmp), bitmap_pitch(bmp), bmp->x_ofs, bmp->y_ofs);
+
+  return rb_str_new2(buf);
+}
+
+void Init_allegro_buffer() {
+
+  /**
+   * A Buffer is a view on the pixel memory of a Bitmap. Nothing is
+   * copied: reads and writes go straight to the bitmap's scanlines,
+   * so changes are visible to both sides immediately. Use #address,
+   * #pitch and #depth to hand the memory to other C extensions.
+   */
+  c_allegro_bitmap_buffer = rb_define_class_under(c_allegro_bitmap, "Buffer", rb_cObject);
+
+  rb_undef_alloc_func(c_allegro_bitmap_buffer);
+
+  rb_define_method(c_allegro_bitmap_buffer, "bitmap",			buffer_bitmap,		0);
+  rb_define_method(c_allegro_bitmap_buffer, "address",			buffer_address,		0);
+  rb_define_method(c_allegro_bitmap_buffer, "pitch",			buffer_pitch,		0);
+  rb_define_method(c_allegro_bitmap_buffer, "depth",			buffer_depth,		0);
+  rb_define_method(c_allegro_bitmap_buffer, "bytes_per_pixel",		buffer_bytes_per_pixel,	0);
+  rb_define_method(c_allegro_bitmap_buffer, "width",			buffer_width,		0);
+  rb_define_method(c_allegro_bitmap_buffer, "height",			buffer_height,		0);
+  rb_define_method(c_allegro_bitmap_buffer, "x_offset",			buffer_x_offset,	0);
+  rb_define_method(c_allegro_bitmap_buffer, "y_offset",			buffer_y_offset,	0);
+  rb_define_method(c_allegro_bitmap_buffer, "[]",			buffer_aref,		2);
+  rb_define_method(c_allegro_bitmap_buffer, "[]=",			buffer_aset,		3);
+  rb_define_method(c_allegro_bitmap_buffer, "inspect",			buffer_inspect,		0);
+}
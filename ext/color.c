@@ -15,19 +15,116 @@ static VALUE color_set_conversion(VALUE self, VALUE mode)
   return self;
 }
 
+/* Interned colors, keyed by their channels. Bounded so that programs
+ * which intern every color they see cannot grow it without limit.
+ */
+#define COLOR_CACHE_SIZE 4096
+
+static VALUE color_cache = Qnil;
+static int color_cache_size = 0;
+
+static inline unsigned long color_key(int r, int g, int b, int a)
+{
+  return ((unsigned long) (a & 0xFF) << 24) | ((r & 0xFF) << 16) | ((g & 0xFF) << 8) | (b & 0xFF);
+}
+
+static VALUE color_alloc(VALUE klass, int r, int g, int b, int a)
+{
+  Color *color;
+  VALUE obj = Data_Make_Struct(klass, Color, 0, free, color);
+  color->r = r;
+  color->g = g;
+  color->b = b;
+  color->a = a;
+  return obj;
+}
+
+/**
+ * Returns the shared, frozen Color with the given channels, creating
+ * it on first use.
+ */
+static VALUE color_intern(VALUE klass, int r, int g, int b, int a)
+{
+  VALUE key = ULONG2NUM(color_key(r, g, b, a));
+  VALUE color = rb_hash_aref(color_cache, key);
+
+  if (NIL_P(color)) {
+    color = rb_obj_freeze(color_alloc(klass, r, g, b, a));
+    if (color_cache_size < COLOR_CACHE_SIZE) {
+      rb_hash_aset(color_cache, key, color);
+      color_cache_size++;
+    }
+  }
+
+  return color;
+}
+
 /**
- * call-seq: new(red, green, blue, alpha)
+ * call-seq: new(red, green, blue, alpha = 255)
  *
  * Creates a new Color object with given values.
  */
-static VALUE color_new(VALUE self, VALUE r, VALUE g, VALUE b, VALUE a)
+static VALUE color_new(int argc, VALUE *argv, VALUE self)
 {
-  Color *color = (Color *) malloc(sizeof(Color));
-  color->r = NUM2INT(r);
-  color->g = NUM2INT(g);
-  color->b = NUM2INT(b);
-  color->a = NUM2INT(a);
-  return Data_Wrap_Struct(self, 0, free, color);
+  VALUE r, g, b, a;
+
+  rb_scan_args(argc, argv, "31", &r, &g, &b, &a);
+
+  return color_alloc(self, NUM2INT(r), NUM2INT(g), NUM2INT(b), NIL_P(a) ? 255 : NUM2INT(a));
+}
+
+/**
+ * call-seq: [](red, green, blue, alpha = 255)
+ *           [](packed)
+ *
+ * Returns an interned, frozen Color. Asking twice for the same color
+ * returns the same object, so common colors cost one allocation per
+ * program instead of one per use. A packed integer as returned by
+ * Bitmap#getpixel may be given instead of the channels.
+ */
+static VALUE color_aref(int argc, VALUE *argv, VALUE self)
+{
+  VALUE r, g, b, a;
+  uint32_t c;
+
+  rb_scan_args(argc, argv, "13", &r, &g, &b, &a);
+
+  if (argc == 1) {
+    c = color_to_packed(r);
+    return color_intern(self, getr32(c), getg32(c), getb32(c), geta32(c));
+  }
+  if (argc < 3) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1, 3 or 4)", argc);
+  }
+
+  return color_intern(self, NUM2INT(r), NUM2INT(g), NUM2INT(b), NIL_P(a) ? 255 : NUM2INT(a));
+}
+
+/**
+ * call-seq: pack(red, green, blue, alpha = 255)
+ *
+ * Returns the packed integer for the given channels without creating
+ * a Color object. Every method taking a color accepts packed colors.
+ */
+static VALUE color_pack(int argc, VALUE *argv, VALUE self)
+{
+  VALUE r, g, b, a;
+
+  rb_scan_args(argc, argv, "31", &r, &g, &b, &a);
+
+  return packed_to_num(makeacol32(NUM2INT(r), NUM2INT(g), NUM2INT(b), NIL_P(a) ? 255 : NUM2INT(a)));
+}
+
+/**
+ * call-seq: unpack(packed)
+ *
+ * Returns the channels of a packed color as [red, green, blue, alpha].
+ */
+static VALUE color_unpack(VALUE self, VALUE packed)
+{
+  uint32_t c = color_to_packed(packed);
+
+  return rb_ary_new3(4, INT2FIX(getr32(c)), INT2FIX(getg32(c)), INT2FIX(getb32(c)), INT2FIX(geta32(c)));
 }
 
 /**
@@ -66,6 +163,7 @@ static VALUE color_get_a(VALUE self)
  */
 static VALUE color_set_r(VALUE self, VALUE v)
 {
+  rb_check_frozen(self);
   _get_color(self)->r = NUM2INT(v);
   return v;
 }
@@ -75,6 +173,7 @@ static VALUE color_set_r(VALUE self, VALUE v)
  */
 static VALUE color_set_g(VALUE self, VALUE v)
 {
+  rb_check_frozen(self);
   _get_color(self)->g = NUM2INT(v);
   return v;
 }
@@ -84,6 +183,7 @@ static VALUE color_set_g(VALUE self, VALUE v)
  */
 static VALUE color_set_b(VALUE self, VALUE v)
 {
+  rb_check_frozen(self);
   _get_color(self)->b = NUM2INT(v);
   return v;
 }
@@ -93,11 +193,75 @@ static VALUE color_set_b(VALUE self, VALUE v)
  */
 static VALUE color_set_a(VALUE self, VALUE v)
 {
+  rb_check_frozen(self);
   _get_color(self)->a = NUM2INT(v);
   return v;
 }
 
+/**
+ * Returns the color as packed integer.
+ */
+static VALUE color_to_i(VALUE self)
+{
+  return packed_to_num(color_to_packed(self));
+}
+
+/**
+ * Returns [red, green, blue, alpha].
+ */
+static VALUE color_to_a(VALUE self)
+{
+  Color *color = _get_color(self);
+  return rb_ary_new3(4, INT2FIX(color->r), INT2FIX(color->g), INT2FIX(color->b), INT2FIX(color->a));
+}
+
+/**
+ * Two colors are equal if all channels are equal. A color also
+ * equals its packed integer.
+ */
+static VALUE color_equal(VALUE self, VALUE other)
+{
+  Color *color = _get_color(self);
+  Color *o;
+  uint32_t c;
+
+  if (FIXNUM_P(other) || TYPE(other) == T_BIGNUM) {
+    c = color_to_packed(other);
+    return (getr32(c) == color->r && getg32(c) == color->g &&
+	    getb32(c) == color->b && geta32(c) == color->a) ? Qtrue : Qfalse;
+  }
+  if (!rb_obj_is_kind_of(other, c_allegro_color))
+    return Qfalse;
+
+  o = _get_color(other);
+  return (o->r == color->r && o->g == color->g && o->b == color->b && o->a == color->a) ? Qtrue : Qfalse;
+}
+
+static VALUE color_eql(VALUE self, VALUE other)
+{
+  if (!rb_obj_is_kind_of(other, c_allegro_color))
+    return Qfalse;
+  return color_equal(self, other);
+}
 
+static VALUE color_hash(VALUE self)
+{
+  Color *color = _get_color(self);
+  return ULONG2NUM(color_key(color->r, color->g, color->b, color->a));
+}
+
+/**
+ * Inspect color.
+ */
+static VALUE color_inspect(VALUE self)
+{
+  char buf[64];
+  Color *color = _get_color(self);
+
+  sprintf(buf, "<Color r: %d, g: %d, b: %d, a: %d>", color->r, color->g, color->b, color->a);
+
+  return rb_str_new2(buf);
+}
 
 
 void Init_allegro_color()
@@ -107,7 +271,14 @@ void Init_allegro_color()
   }
 
   c_allegro_color = rb_define_class_under(m_allegro, "Color", rb_cObject);
-  rb_define_module_function(c_allegro_color, "new",		color_new,	4);
+
+  color_cache = rb_hash_new();
+  rb_global_variable(&color_cache);
+
+  rb_define_module_function(c_allegro_color, "new",		color_new,	-1);
+  rb_define_singleton_method(c_allegro_color, "[]",		color_aref,	-1);
+  rb_define_singleton_method(c_allegro_color, "pack",		color_pack,	-1);
+  rb_define_singleton_method(c_allegro_color, "unpack",		color_unpack,	1);
   
   rb_define_method(c_allegro_color, "r",			color_get_r,		0);
   rb_define_method(c_allegro_color, "g",			color_get_g,		0);
@@ -117,4 +288,17 @@ void Init_allegro_color()
   rb_define_method(c_allegro_color, "g=",			color_set_g,		1);
   rb_define_method(c_allegro_color, "b=",			color_set_b,		1);
   rb_define_method(c_allegro_color, "a=",			color_set_a,		1);
+  rb_define_method(c_allegro_color, "to_i",			color_to_i,		0);
+  rb_define_method(c_allegro_color, "to_a",			color_to_a,		0);
+  rb_define_method(c_allegro_color, "==",			color_equal,		1);
+  rb_define_method(c_allegro_color, "eql?",			color_eql,		1);
+  rb_define_method(c_allegro_color, "hash",			color_hash,		0);
+  rb_define_method(c_allegro_color, "inspect",			color_inspect,		0);
+
+  rb_define_const(c_allegro_color, "BLACK",	color_intern(c_allegro_color,   0,   0,   0, 255));
+  rb_define_const(c_allegro_color, "WHITE",	color_intern(c_allegro_color, 255, 255, 255, 255));
+  rb_define_const(c_allegro_color, "RED",	color_intern(c_allegro_color, 255,   0,   0, 255));
+  rb_define_const(c_allegro_color, "GREEN",	color_intern(c_allegro_color,   0, 255,   0, 255));
+  rb_define_const(c_allegro_color, "BLUE",	color_intern(c_allegro_color,   0,   0, 255, 255));
+  rb_define_const(c_allegro_color, "MAGENTA",	color_intern(c_allegro_color, 255,   0, 255, 255));
 }
@@ -19,22 +19,9 @@
 
 
 #include <internal.h>
+#include "thread.h"
 
 
-static HUFFMAN_TABLE *ac_luminance_table, *dc_luminance_table;
-static HUFFMAN_TABLE *ac_chrominance_table, *dc_chrominance_table;
-static DATA_BUFFER *data_buffer[3];
-static short quantization_table[256];
-static short *luminance_quantization_table, *chrominance_quantization_table;
-static int jpeg_w, jpeg_h, jpeg_components;
-static int sampling, v_sampling, h_sampling, restart_interval, skip_count;
-static int spectrum_start, spectrum_end, successive_high, successive_low;
-static int scan_components, component[3];
-static int progress_counter, progress_total;
-static void (*idct)(short *block, short *dequant, short *output, short *workspace);
-static void (*ycbcr2rgb)(int address, int y1, int cb1, int cr1, int y2, int cb2, int cr2, int y3, int cb3, int cr3, int y4, int cb4, int cr4);
-static void (*plot)(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr);
-static void (*progress_cb)(int percentage);
 
 
 
@@ -150,32 +137,99 @@ _jpeg_c_idct(short *data, short *output, short *dequant, short *workspace)
 }
 
 
-/* zigzag_reorder:
- *  Reorders a vector of 64 coefficients by the zigzag scan.
+/* _jpeg_c_idct_4x4:
+ *  Inverse DCT for decoding at 1/2 scale: a 4 point IDCT of the lowest 4x4
+ *  frequencies, whose samples go to the top left of the output block. The
+ *  constants are C(u) * cos((2x + 1) * u * pi / 8), divided by the AAN scale
+ *  factor the dequantization tables carry, in 11 bits fixed point.
  */
-static INLINE void
-zigzag_reorder(short *input, short *output)
+static void
+_jpeg_c_idct_4x4(short *data, short *output, short *dequant, short *workspace)
 {
-	int i;
+	int ws[16], *wsptr;
+	int tmp0, tmp1, tmp2, tmp3, i;
+	int e0, e1, o0, o1;
 	
-	for (i = 0; i < 64; i++)
-		output[i] = input[_jpeg_zigzag_scan[i]];
+	(void)workspace;
+	wsptr = ws;
+	for (i = 0; i < 4; i++) {
+		tmp0 = data[i] * dequant[i];
+		tmp1 = data[i + 8] * dequant[i + 8];
+		tmp2 = data[i + 16] * dequant[i + 16];
+		tmp3 = data[i + 24] * dequant[i + 24];
+		e0 = (1448 * tmp0) + (1108 * tmp2);
+		e1 = (1448 * tmp0) - (1108 * tmp2);
+		o0 = (1364 * tmp1) + (667 * tmp3);
+		o1 = (565 * tmp1) - (1609 * tmp3);
+		wsptr[0] = (e0 + o0 + (1 << 10)) >> 11;
+		wsptr[12] = (e0 - o0 + (1 << 10)) >> 11;
+		wsptr[4] = (e1 + o1 + (1 << 10)) >> 11;
+		wsptr[8] = (e1 - o1 + (1 << 10)) >> 11;
+		wsptr++;
+	}
+	
+	wsptr = ws;
+	for (i = 0; i < 4; i++) {
+		e0 = (1448 * wsptr[0]) + (1108 * wsptr[2]) + (1 << 14);
+		e1 = (1448 * wsptr[0]) - (1108 * wsptr[2]) + (1 << 14);
+		o0 = (1364 * wsptr[1]) + (667 * wsptr[3]);
+		o1 = (565 * wsptr[1]) - (1609 * wsptr[3]);
+		output[0] = ((e0 + o0) >> 15) + 128;
+		output[3] = ((e0 - o0) >> 15) + 128;
+		output[1] = ((e1 + o1) >> 15) + 128;
+		output[2] = ((e1 - o1) >> 15) + 128;
+		wsptr += 4;
+		output += 8;
+	}
+}
+
+
+/* _jpeg_c_idct_2x2:
+ *  Inverse DCT for decoding at 1/4 scale, like _jpeg_c_idct_4x4() with 2
+ *  points.
+ */
+static void
+_jpeg_c_idct_2x2(short *data, short *output, short *dequant, short *workspace)
+{
+	int tmp0, tmp1, ws0, ws1, ws2, ws3;
+	
+	(void)workspace;
+	tmp0 = 1448 * data[0] * dequant[0];
+	tmp1 = 1044 * data[8] * dequant[8];
+	ws0 = (tmp0 + tmp1 + (1 << 10)) >> 11;
+	ws2 = (tmp0 - tmp1 + (1 << 10)) >> 11;
+	tmp0 = 1448 * data[1] * dequant[1];
+	tmp1 = 1044 * data[9] * dequant[9];
+	ws1 = (tmp0 + tmp1 + (1 << 10)) >> 11;
+	ws3 = (tmp0 - tmp1 + (1 << 10)) >> 11;
+	output[0] = ((1448 * ws0 + 1044 * ws1 + (1 << 14)) >> 15) + 128;
+	output[1] = ((1448 * ws0 - 1044 * ws1 + (1 << 14)) >> 15) + 128;
+	output[8] = ((1448 * ws2 + 1044 * ws3 + (1 << 14)) >> 15) + 128;
+	output[9] = ((1448 * ws2 - 1044 * ws3 + (1 << 14)) >> 15) + 128;
 }
 
 
-/* free_huffman_table:
- *  Frees memory used by the huffman decoding lookup tables.
+/* _jpeg_c_idct_1x1:
+ *  Inverse DCT for decoding at 1/8 scale: just the DC coefficient.
  */
 static void
-free_huffman_table(HUFFMAN_TABLE *table)
+_jpeg_c_idct_1x1(short *data, short *output, short *dequant, short *workspace)
+{
+	(void)workspace;
+	output[0] = ((data[0] * dequant[0] + 16) >> 5) + 128;
+}
+
+
+/* zigzag_reorder:
+ *  Reorders a vector of 64 coefficients by the zigzag scan.
+ */
+static INLINE void
+zigzag_reorder(short *input, short *output)
 {
 	int i;
 	
-	for (i = 0; i < 16; i++) {
-		if (table->entry_of_length[i])
-			free(table->entry_of_length[i]);
-		table->entry_of_length[i] = NULL;
-	}
+	for (i = 0; i < 64; i++)
+		output[i] = input[_jpeg_zigzag_scan[i]];
 }
 
 
@@ -183,56 +237,68 @@ free_huffman_table(HUFFMAN_TABLE *table)
  *  Reads a DHT (Define Huffman Table) chunk from the input stream.
  */
 static int
-read_dht_chunk(void)
+read_dht_chunk(JPEG_DECODER *jpg)
 {
-	int i, j, table_id, num_codes[16];
-	int code, value;
+	int i, j, table_id, num_codes[16], total;
+	int code, length, index, entry;
 	unsigned char data;
 	HUFFMAN_TABLE *table;
-	HUFFMAN_ENTRY *entry;
 	
-	_jpeg_open_chunk();
+	_jpeg_open_chunk(&jpg->io);
 	do {
-		data = _jpeg_getc();
+		data = _jpeg_getc(&jpg->io);
 		if (data & 0xe0) {
 			TRACE("Invalid DHT information byte");
-			jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+			jpg->io.error = JPG_ERROR_BAD_IMAGE;
 			return -1;
 		}
 		table_id = data & 0xf;
 		if (table_id > 3) {
 			TRACE("Invalid huffman table number");
-			jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+			jpg->io.error = JPG_ERROR_BAD_IMAGE;
 			return -1;
 		}
 		if (data & 0x10)
-			table = &_jpeg_huffman_ac_table[table_id];
+			table = &jpg->huffman_ac_table[table_id];
 		else
-			table = &_jpeg_huffman_dc_table[table_id];
-		for (i = 0; i < 16; i++)
-			num_codes[i] = _jpeg_getc();
-		code = 0;
+			table = &jpg->huffman_dc_table[table_id];
+		total = 0;
 		for (i = 0; i < 16; i++) {
-			if (table->entry_of_length[i])
-				free(table->entry_of_length[i]);
-			table->entry_of_length[i] = (HUFFMAN_ENTRY *)calloc(1 << (i + 1), sizeof(HUFFMAN_ENTRY));
-			if (!table->entry_of_length[i]) {
-				TRACE("Out of memory");
-				jpgalleg_error = JPG_ERROR_OUT_OF_MEMORY;
-				return -1;
-			}
-			for (j = 0; j < num_codes[i]; j++) {
-				value = _jpeg_getc();
-				entry = &table->entry_of_length[i][code];
-				entry->value = value;
-				entry->encoded_value = code;
-				entry->bits_length = i + 1;
+			num_codes[i] = _jpeg_getc(&jpg->io);
+			total += num_codes[i];
+		}
+		if (total > 256) {
+			TRACE("Too many huffman codes");
+			jpg->io.error = JPG_ERROR_BAD_IMAGE;
+			return -1;
+		}
+		for (i = 0; i < total; i++)
+			table->values[i] = _jpeg_getc(&jpg->io);
+		/* Assign canonical codes in order of length */
+		memset(table->lookup, 0, sizeof(table->lookup));
+		code = index = 0;
+		for (length = 1; length <= 16; length++) {
+			table->valoffset[length] = index - code;
+			for (i = 0; i < num_codes[length - 1]; i++) {
+				/* an over-subscribed table would index past the lookup */
+				if (code >= (1 << length)) {
+					TRACE("Invalid huffman code lengths");
+					jpg->io.error = JPG_ERROR_HUFFMAN;
+					return -1;
+				}
+				if (length <= HUFFMAN_LOOKAHEAD) {
+					entry = (length << 8) | table->values[index];
+					for (j = 0; j < (1 << (HUFFMAN_LOOKAHEAD - length)); j++)
+						table->lookup[(code << (HUFFMAN_LOOKAHEAD - length)) | j] = entry;
+				}
 				code++;
+				index++;
 			}
+			table->maxcode[length] = num_codes[length - 1] ? code - 1 : -1;
 			code <<= 1;
 		}
-	} while (!_jpeg_eoc());
-	_jpeg_close_chunk();
+	} while (!_jpeg_eoc(&jpg->io));
+	_jpeg_close_chunk(&jpg->io);
 	
 	return 0;
 }
@@ -242,58 +308,63 @@ read_dht_chunk(void)
  *  Reads a SOF0 (Start Of Frame 0) chunk from the input stream.
  */
 static int
-read_sof0_chunk(void)
+read_sof0_chunk(JPEG_DECODER *jpg)
 {
 	int i, data;
 	
-	_jpeg_open_chunk();
-	if ((data = _jpeg_getc()) != 8) {
+	_jpeg_open_chunk(&jpg->io);
+	if ((data = _jpeg_getc(&jpg->io)) != 8) {
 		TRACE("Unsupported data precision (%d)", data);
-		jpgalleg_error = JPG_ERROR_UNSUPPORTED_DATA_PRECISION;
+		jpg->io.error = JPG_ERROR_UNSUPPORTED_DATA_PRECISION;
 		return -1;
 	}
-	jpeg_h = _jpeg_getw();
-	jpeg_w = _jpeg_getw();
-	jpeg_components = _jpeg_getc();
-	if ((jpeg_components != 1) && (jpeg_components != 3)) {
-		TRACE("Unsupported number of components (%d)", jpeg_components);
-		jpgalleg_error = JPG_ERROR_UNSUPPORTED_COLOR_SPACE;
+	jpg->jpeg_h = _jpeg_getw(&jpg->io);
+	jpg->jpeg_w = _jpeg_getw(&jpg->io);
+	jpg->jpeg_components = _jpeg_getc(&jpg->io);
+	if ((jpg->jpeg_components != 1) && (jpg->jpeg_components != 3)) {
+		TRACE("Unsupported number of components (%d)", jpg->jpeg_components);
+		jpg->io.error = JPG_ERROR_UNSUPPORTED_COLOR_SPACE;
 		return -1;
 	}
-	for (i = 0; i < jpeg_components; i++) {
-		switch (_jpeg_getc()) {
+	for (i = 0; i < jpg->jpeg_components; i++) {
+		switch (_jpeg_getc(&jpg->io)) {
 			case 1:
-				data = _jpeg_getc();
-				h_sampling = data >> 4;
-				v_sampling = data & 0xf;
-				sampling = h_sampling * v_sampling;
-				if ((sampling != 1) && (sampling != 2) && (sampling != 4)) {
-					TRACE("Bad sampling byte (%d)", sampling);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+				data = _jpeg_getc(&jpg->io);
+				jpg->h_sampling = data >> 4;
+				jpg->v_sampling = data & 0xf;
+				jpg->sampling = jpg->h_sampling * jpg->v_sampling;
+				if ((jpg->sampling != 1) && (jpg->sampling != 2) && (jpg->sampling != 4)) {
+					TRACE("Bad sampling byte (%d)", jpg->sampling);
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					return -1;
 				}
-				data = _jpeg_getc();
+				data = _jpeg_getc(&jpg->io);
 				if (data > 3) {
 					TRACE("Bad quantization table number (%d)", data);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					return -1;
 				}
-				luminance_quantization_table = &quantization_table[data * 64];
+				jpg->luminance_quantization_table = &jpg->quantization_table[data * 64];
 				break;
 			case 2:
 			case 3:
-				_jpeg_getc();
-				data = _jpeg_getc();
+				_jpeg_getc(&jpg->io);
+				data = _jpeg_getc(&jpg->io);
 				if (data > 3) {
 					TRACE("Bad quantization table number (%d)", data);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					return -1;
 				}
-				chrominance_quantization_table = &quantization_table[data * 64];
+				jpg->chrominance_quantization_table = &jpg->quantization_table[data * 64];
 				break;
 		}
 	}
-	_jpeg_close_chunk();
+	/* A single component is never interleaved, so its sampling factors
+	 * do not matter: every MCU is a single block.
+	 */
+	if (jpg->jpeg_components == 1)
+		jpg->h_sampling = jpg->v_sampling = jpg->sampling = 1;
+	_jpeg_close_chunk(&jpg->io);
 	
 	return 0;
 }
@@ -303,35 +374,35 @@ read_sof0_chunk(void)
  *  Reads a DQT (Define Quantization Table) chunk from the input stream.
  */
 static int
-read_dqt_chunk(void)
+read_dqt_chunk(JPEG_DECODER *jpg)
 {
 	int i, data;
 	short *table, temp[64];
 	float value;
 	
-	_jpeg_open_chunk();
+	_jpeg_open_chunk(&jpg->io);
 	do {
-  		data = _jpeg_getc();
+  		data = _jpeg_getc(&jpg->io);
 		if ((data & 0xf) > 3) {
 			TRACE("Bad quantization table number (%d)", data);
-			jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+			jpg->io.error = JPG_ERROR_BAD_IMAGE;
 			return -1;
 		}
 		if (data & 0xf0) {
 			TRACE("Unsupported quantization table data precision");
-			jpgalleg_error = JPG_ERROR_UNSUPPORTED_DATA_PRECISION;
+			jpg->io.error = JPG_ERROR_UNSUPPORTED_DATA_PRECISION;
 			return -1;
 		}
-		table = &quantization_table[(data & 0xf) * 64];
+		table = &jpg->quantization_table[(data & 0xf) * 64];
 		for (i = 0; i < 64; i++)
-			temp[i] = _jpeg_getc();
+			temp[i] = _jpeg_getc(&jpg->io);
 		zigzag_reorder(temp, table);
 		for (i = 0; i < 64; i++) {
 			value = (float)table[i] * AAN_FACTOR(i) * 16384.0;
 			table[i] = ((int)value + (1 << 11)) >> 12;
 		}
-	} while (!_jpeg_eoc());
-	_jpeg_close_chunk();
+	} while (!_jpeg_eoc(&jpg->io));
+	_jpeg_close_chunk(&jpg->io);
 	
 	return 0;
 }
@@ -341,54 +412,54 @@ read_dqt_chunk(void)
  *  Reads a SOS (Start Of Scan) chunk from the input stream.
  */
 static int
-read_sos_chunk(void)
+read_sos_chunk(JPEG_DECODER *jpg)
 {
 	int i, data;
 	
-	_jpeg_open_chunk();
-	scan_components = _jpeg_getc();
-	if (scan_components > 3) {
-		TRACE("Unsupported number of scan components (%d)", scan_components);
-		jpgalleg_error = JPG_ERROR_UNSUPPORTED_COLOR_SPACE;
+	_jpeg_open_chunk(&jpg->io);
+	jpg->scan_components = _jpeg_getc(&jpg->io);
+	if (jpg->scan_components > 3) {
+		TRACE("Unsupported number of scan components (%d)", jpg->scan_components);
+		jpg->io.error = JPG_ERROR_UNSUPPORTED_COLOR_SPACE;
 		return -1;
 	}
-	for (i = 0; i < scan_components; i++) {
-		component[i] = _jpeg_getc();
-		switch (component[i]) {
+	for (i = 0; i < jpg->scan_components; i++) {
+		jpg->component[i] = _jpeg_getc(&jpg->io);
+		switch (jpg->component[i]) {
 			case 1:
-				data = _jpeg_getc();
+				data = _jpeg_getc(&jpg->io);
 				if (((data & 0xf) > 3) || ((data >> 4) > 3)) {
-					TRACE("Bad huffman table specified for %s component", _jpeg_component_name[component[i] - 1]);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					TRACE("Bad huffman table specified for %s component", _jpeg_component_name[jpg->component[i] - 1]);
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					return -1;
 				}
-				ac_luminance_table = &_jpeg_huffman_ac_table[data & 0xf];
-				dc_luminance_table = &_jpeg_huffman_dc_table[data >> 4];
+				jpg->ac_luminance_table = &jpg->huffman_ac_table[data & 0xf];
+				jpg->dc_luminance_table = &jpg->huffman_dc_table[data >> 4];
 				break;
 			case 2:
 			case 3:
-				data = _jpeg_getc();
+				data = _jpeg_getc(&jpg->io);
 				if (((data & 0xf) > 3) || ((data >> 4) > 3)) {
-					TRACE("Bad huffman table specified for %s component", _jpeg_component_name[component[i] - 1]);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					TRACE("Bad huffman table specified for %s component", _jpeg_component_name[jpg->component[i] - 1]);
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					return -1;
 				}
-				ac_chrominance_table = &_jpeg_huffman_ac_table[data & 0xf];
-				dc_chrominance_table = &_jpeg_huffman_dc_table[data >> 4];
+				jpg->ac_chrominance_table = &jpg->huffman_ac_table[data & 0xf];
+				jpg->dc_chrominance_table = &jpg->huffman_dc_table[data >> 4];
 				break;
 			default:
-				TRACE("Unsupported component id (%d)", component[i]);
-				jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+				TRACE("Unsupported component id (%d)", jpg->component[i]);
+				jpg->io.error = JPG_ERROR_BAD_IMAGE;
 				break;
 		}
 	}
-	spectrum_start = _jpeg_getc();
-	spectrum_end = _jpeg_getc();
-	data = _jpeg_getc();
-	successive_high = data >> 4;
-	successive_low = data & 0xf;
-	_jpeg_close_chunk();
-	skip_count = 0;
+	jpg->spectrum_start = _jpeg_getc(&jpg->io);
+	jpg->spectrum_end = _jpeg_getc(&jpg->io);
+	data = _jpeg_getc(&jpg->io);
+	jpg->successive_high = data >> 4;
+	jpg->successive_low = data & 0xf;
+	_jpeg_close_chunk(&jpg->io);
+	jpg->skip_count = 0;
 	return 0;
 }
 
@@ -397,7 +468,7 @@ read_sos_chunk(void)
  *  Reads an APP0/APP1 (JFIF/EXIF descriptor) chunk from the input stream.
  */
 static int
-read_appn_chunk(int n)
+read_appn_chunk(JPEG_DECODER *jpg, int n)
 {
 	char *header_id;
 	int i;
@@ -407,24 +478,24 @@ read_appn_chunk(int n)
 	else
 		header_id = "Exif";
 	
-	_jpeg_open_chunk();
+	_jpeg_open_chunk(&jpg->io);
 	for (i = 0; i < 5; i++) {
-		if (_jpeg_getc() != header_id[i]) {
+		if (_jpeg_getc(&jpg->io) != header_id[i]) {
 			TRACE("Bad %s header", (n == CHUNK_APP0) ? "JFIF" : "EXIF" );
-			_jpeg_close_chunk();
-			jpgalleg_error = JPG_ERROR_NOT_JPEG;
+			_jpeg_close_chunk(&jpg->io);
+			jpg->io.error = JPG_ERROR_NOT_JPEG;
 			return -1;
 		}
 	}
 	if (n == CHUNK_APP0) {
 		/* Only JFIF version 1.x is supported */
-		if (_jpeg_getc() != 1) {
+		if (_jpeg_getc(&jpg->io) != 1) {
 			TRACE("Not a JFIF version 1.x file");
-			_jpeg_close_chunk();
+			_jpeg_close_chunk(&jpg->io);
 			return -1;
 		}
 	}
-	_jpeg_close_chunk();
+	_jpeg_close_chunk(&jpg->io);
 	return 0;
 }
 
@@ -433,11 +504,11 @@ read_appn_chunk(int n)
  *  Reads a DRI (Define Restart Interval) chunk from the input stream.
  */
 static int
-read_dri_chunk(void)
+read_dri_chunk(JPEG_DECODER *jpg)
 {
-	_jpeg_open_chunk();
-	restart_interval = _jpeg_getw();
-	_jpeg_close_chunk();
+	_jpeg_open_chunk(&jpg->io);
+	jpg->restart_interval = _jpeg_getw(&jpg->io);
+	_jpeg_close_chunk(&jpg->io);
 	return 0;
 }
 
@@ -446,25 +517,22 @@ read_dri_chunk(void)
  *  Reads a string of bits from the input stream.
  */
 static int
-get_bits(int num_bits)
+get_bits(IO_BUFFER *io, int num_bits)
 {
-	int result = 0;
-	
-	while (_jpeg_io.current_bit < num_bits) {
-		result = (result << _jpeg_io.current_bit) | (*_jpeg_io.buffer & ((1 << _jpeg_io.current_bit) - 1));
-		num_bits -= _jpeg_io.current_bit;
-		_jpeg_io.current_bit = 8;
-		if (*_jpeg_io.buffer == 0xff)
-			_jpeg_io.buffer++;
-		if (_jpeg_io.buffer >= _jpeg_io.buffer_end) {
-			TRACE("Tried to read memory past buffer size");
-			jpgalleg_error = JPG_ERROR_INPUT_BUFFER_TOO_SMALL;
-			return 0x80000000;
-		}
-		_jpeg_io.buffer++;
+	int result;
+	
+	if (!num_bits)
+		return 0;
+	if (io->bits_left < num_bits)
+		_jpeg_fill_bits(io);
+	result = (int)(io->bits >> (64 - num_bits));
+	io->bits <<= num_bits;
+	io->bits_left -= num_bits;
+	if (io->bits_left < io->pad_bits) {
+		TRACE("Tried to read memory past buffer size");
+		io->error = JPG_ERROR_INPUT_BUFFER_TOO_SMALL;
+		return 0x80000000;
 	}
-	result = (result << num_bits) | ((*_jpeg_io.buffer >> (_jpeg_io.current_bit - num_bits)) & ((1 << num_bits) - 1));
-	_jpeg_io.current_bit -= num_bits;
 	
 	return result;
 }
@@ -474,10 +542,14 @@ get_bits(int num_bits)
  *  Reads a string of bits from the input stream and returns a properly signed
  *  number given the category.
  */
-INLINE int
-get_value(int category)
+static INLINE int
+get_value(IO_BUFFER *io, int category)
 {
-	int result = get_bits(category);
+	int result;
+	
+	if (!category)
+		return 0;
+	result = get_bits(io, category);
 	if ((result >= (1 << (category - 1))) || (result < 0))
 		return result;
 	else
@@ -486,47 +558,50 @@ get_value(int category)
 
 
 /* huffman_decode:
- *  Fetches bits from the input stream until a valid huffman code is found,
- *  then returns the value associated with that code.
+ *  Decodes the next huffman code from the input stream and returns the value
+ *  associated with it, or -1 if the code is invalid.
  */
 static int
-huffman_decode(HUFFMAN_TABLE *table)
+huffman_decode(IO_BUFFER *io, HUFFMAN_TABLE *table)
 {
-	HUFFMAN_ENTRY *entry, **entry_lut;
-	int i, value;
-	unsigned char *p = _jpeg_io.buffer;
-	
-	value = (*p & ((1 << _jpeg_io.current_bit) - 1)) << (16 - _jpeg_io.current_bit);
-	if (*p++ == 0xff) p++;
-	value |= *p << (8 - _jpeg_io.current_bit);
-	if (*p++ == 0xff) p++;
-	value |= *p >> _jpeg_io.current_bit;
-	
-	entry_lut = table->entry_of_length;
-	for (i = 15; i >= 0; i--) {
-		entry = &((*entry_lut)[value >> i]);
-		if (entry->bits_length == 16 - i) {
-			_jpeg_io.current_bit -= 16 - i;
-			while (_jpeg_io.current_bit <= 0) {
-				_jpeg_io.current_bit += 8;
-				if (*_jpeg_io.buffer == 0xff)
-					_jpeg_io.buffer++;
-				_jpeg_io.buffer++;
-			}
-			return entry->value;
+	int entry, code, length;
+	
+	if (io->bits_left < 16)
+		_jpeg_fill_bits(io);
+	entry = table->lookup[io->bits >> (64 - HUFFMAN_LOOKAHEAD)];
+	if (entry) {
+		length = entry >> 8;
+		entry &= 0xff;
+	}
+	else {
+		for (length = HUFFMAN_LOOKAHEAD + 1; length <= 16; length++) {
+			code = (int)(io->bits >> (64 - length));
+			if (code <= table->maxcode[length])
+				break;
 		}
-		entry_lut++;
+		if (length > 16)
+			return -1;
+		entry = table->values[code + table->valoffset[length]];
 	}
-	return -1;
+	io->bits <<= length;
+	io->bits_left -= length;
+	if (io->bits_left < io->pad_bits) {
+		TRACE("Tried to read memory past buffer size");
+		io->error = JPG_ERROR_INPUT_BUFFER_TOO_SMALL;
+		return -1;
+	}
+	
+	return entry;
 }
 
 
 /* decode_baseline_block:
  *  Decodes an 8x8 basic block of coefficients of given type (luminance or
- *  chrominance) from the input stream. Used for baseline decoding.
+ *  chrominance) from the given input stream. Used for baseline decoding;
+ *  jpg is only read, so restart segments can be decoded in parallel.
  */
 static int
-decode_baseline_block(short *block, int type, int *old_dc)
+decode_baseline_block(JPEG_DECODER *jpg, IO_BUFFER *io, short *block, int type, int *old_dc)
 {
 	HUFFMAN_TABLE *dc_table, *ac_table;
 	short *quant_table;
@@ -535,36 +610,38 @@ decode_baseline_block(short *block, int type, int *old_dc)
 	short workspace[130];
 	short pre_idct_block[80];
 	short ordered_pre_idct_block[64];
+	void (*idct)(short *, short *, short *, short *) = jpg->idct;
 	
 	if (type == LUMINANCE) {
-		dc_table = dc_luminance_table;
-		ac_table = ac_luminance_table;
-		quant_table = luminance_quantization_table;
+		dc_table = jpg->dc_luminance_table;
+		ac_table = jpg->ac_luminance_table;
+		quant_table = jpg->luminance_quantization_table;
 	}
 	else {
-		dc_table = dc_chrominance_table;
-		ac_table = ac_chrominance_table;
-		quant_table = chrominance_quantization_table;
+		dc_table = jpg->dc_chrominance_table;
+		ac_table = jpg->ac_chrominance_table;
+		quant_table = jpg->chrominance_quantization_table;
+		idct = jpg->chroma_idct;
 	}
 	
-	data = huffman_decode(dc_table);
+	data = huffman_decode(io, dc_table);
 	if (data < 0) {
 		TRACE("Bad dc data");
-		jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+		io->error = JPG_ERROR_BAD_IMAGE;
 		return -1;
 	}
-	if ((data = get_value(data & 0xf)) == (int)0x80000000)
+	if ((data = get_value(io, data & 0xf)) == (int)0x80000000)
 		return -1;
 	*old_dc += data;
 	pre_idct_block[0] = *old_dc;
 	
 	index = 1;
 	do {
-		data = huffman_decode(ac_table);
+		data = huffman_decode(io, ac_table);
 		if (data < 0) {
 			/* Bad block */
 			TRACE("Bad ac data");
-			jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+			io->error = JPG_ERROR_BAD_IMAGE;
 			return -1;
 		}
 		num_zeroes = data >> 4;
@@ -573,7 +650,7 @@ decode_baseline_block(short *block, int type, int *old_dc)
 			/* Normal zero run length coding */
 			for (; num_zeroes; num_zeroes--)
 				pre_idct_block[index++] = 0;
-			if ((data = get_value(category)) == (int)0x80000000)
+			if ((data = get_value(io, category)) == (int)0x80000000)
 				return -1;
 			pre_idct_block[index++] = data;
 		}
@@ -591,7 +668,7 @@ decode_baseline_block(short *block, int type, int *old_dc)
 			}
 			else {
 				TRACE("Bad ac data");
-				jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+				io->error = JPG_ERROR_BAD_IMAGE;
 				return -1;
 			}
 		}
@@ -605,68 +682,155 @@ decode_baseline_block(short *block, int type, int *old_dc)
 }
 
 
+/* expand_block:
+ *  Returns the coefficients of a progressive block, expanded into temp
+ *  unless the block is wide.
+ */
+static short *
+expand_block(JPEG_DECODER *jpg, DATA_BUFFER *buffer, short *temp)
+{
+	int i;
+	
+	if (buffer->wide)
+		return jpg->wide_block[buffer->wide - 1];
+	for (i = 0; i < NARROW_START; i++)
+		temp[i] = buffer->low[i];
+	for (; i < 64; i++)
+		temp[i] = buffer->high[i - NARROW_START];
+	return temp;
+}
+
+
+/* widen_block:
+ *  Moves a progressive block to the wide block pool, for a coefficient
+ *  that does not fit in a byte. Returns its new place.
+ */
+static short *
+widen_block(JPEG_DECODER *jpg, DATA_BUFFER *buffer)
+{
+	short (*pool)[64];
+	int size;
+	
+	if (jpg->wide_count == jpg->wide_size) {
+		size = jpg->wide_size ? jpg->wide_size * 2 : 256;
+		pool = (short (*)[64])realloc(jpg->wide_block, size * sizeof(*pool));
+		if (!pool) {
+			TRACE("Out of memory");
+			jpg->io.error = JPG_ERROR_OUT_OF_MEMORY;
+			return NULL;
+		}
+		jpg->wide_block = pool;
+		jpg->wide_size = size;
+	}
+	expand_block(jpg, buffer, jpg->wide_block[jpg->wide_count]);
+	buffer->wide = ++jpg->wide_count;
+	
+	return jpg->wide_block[buffer->wide - 1];
+}
+
+
+/* get_coefficient:
+ *  Returns a coefficient of a progressive block.
+ */
+static INLINE int
+get_coefficient(JPEG_DECODER *jpg, DATA_BUFFER *buffer, int index)
+{
+	if (buffer->wide)
+		return jpg->wide_block[buffer->wide - 1][index];
+	if (index < NARROW_START)
+		return buffer->low[index];
+	return buffer->high[index - NARROW_START];
+}
+
+
+/* put_coefficient:
+ *  Stores a coefficient into a progressive block.
+ */
+static INLINE int
+put_coefficient(JPEG_DECODER *jpg, DATA_BUFFER *buffer, int index, int value)
+{
+	short *wide;
+	
+	if (buffer->wide)
+		jpg->wide_block[buffer->wide - 1][index] = value;
+	else if (index < NARROW_START)
+		buffer->low[index] = value;
+	else if ((value >= -128) && (value <= 127))
+		buffer->high[index - NARROW_START] = value;
+	else {
+		if (!(wide = widen_block(jpg, buffer)))
+			return -1;
+		wide[index] = value;
+	}
+	return 0;
+}
+
+
 /* decode_progressive_block
  *  Decodes some coefficients for an 8x8 block from the input stream. Used in
  *  progressive mode decoding.
  */
 static int
-decode_progressive_block(int addr, int type, int *old_dc)
+decode_progressive_block(JPEG_DECODER *jpg, DATA_BUFFER *buffer, int type, int *old_dc)
 {
 	HUFFMAN_TABLE *dc_table, *ac_table;
-	short *block = (short *)addr;
+	short *block;
 	int data, index, value;
 	int num_zeroes, category;
 	int p_bit, n_bit;
 	
 	if (type == LUMINANCE) {
-		dc_table = dc_luminance_table;
-		ac_table = ac_luminance_table;
+		dc_table = jpg->dc_luminance_table;
+		ac_table = jpg->ac_luminance_table;
 	}
 	else {
-		dc_table = dc_chrominance_table;
-		ac_table = ac_chrominance_table;
+		dc_table = jpg->dc_chrominance_table;
+		ac_table = jpg->ac_chrominance_table;
+	}
+	
+	if ((jpg->spectrum_start) && (!jpg->successive_high) && (jpg->skip_count)) {
+		/* Block within an end of band run of a first AC scan */
+		jpg->skip_count--;
+		return 0;
 	}
 	
-	if (spectrum_start == 0) {
+	if (jpg->spectrum_start == 0) {
 		/* DC scan */
-		if (successive_high == 0) {
+		block = buffer->wide ? jpg->wide_block[buffer->wide - 1] : buffer->low;
+		if (jpg->successive_high == 0) {
 			/* First DC scan */
-			data = huffman_decode(dc_table);
+			data = huffman_decode(&jpg->io, dc_table);
 			if (data < 0) {
 				TRACE("Bad dc data");
-				jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+				jpg->io.error = JPG_ERROR_BAD_IMAGE;
 				return -1;
 			}
-			if ((data = get_value(data & 0xf)) == (int)0x80000000)
+			if ((data = get_value(&jpg->io, data & 0xf)) == (int)0x80000000)
 				return -1;
 			*old_dc += data;
-			block[0] = *old_dc << successive_low;
+			block[0] = *old_dc << jpg->successive_low;
 		}
 		else {
 			/* DC successive approximation */
-			if ((data = _jpeg_get_bit()) < 0) {
+			if ((data = get_bits(&jpg->io, 1)) < 0) {
 				TRACE("Failed to get bit from input stream");
-				jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+				jpg->io.error = JPG_ERROR_BAD_IMAGE;
 				return -1;
 			}
 			if (data)
-				block[0] |= (1 << successive_low);
+				block[0] |= (1 << jpg->successive_low);
 		}
 	}
 	else {
 		/* AC scan */
-		if (successive_high == 0) {
+		if (jpg->successive_high == 0) {
 			/* First AC scan */
-			if (skip_count) {
-				skip_count--;
-				return 0;
-			}
-			index = spectrum_start;
+			index = jpg->spectrum_start;
 			do {
-				data = huffman_decode(ac_table);
+				data = huffman_decode(&jpg->io, ac_table);
 				if (data < 0) {
 					TRACE("Bad ac data (first scan)");
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					return -1;
 				}
 				num_zeroes = data >> 4;
@@ -676,61 +840,63 @@ decode_progressive_block(int addr, int type, int *old_dc)
 						index += 16;
 					else {
 						index++;
-						skip_count = 0;
+						jpg->skip_count = 0;
 						if (num_zeroes) {
-							value = get_bits(num_zeroes);
+							value = get_bits(&jpg->io, num_zeroes);
 							if (value < 0) {
 								TRACE("Failed to get bit from input stream");
-								jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+								jpg->io.error = JPG_ERROR_BAD_IMAGE;
 								return -1;
 							}
-							skip_count = (1 << num_zeroes) + value - 1;
+							jpg->skip_count = (1 << num_zeroes) + value - 1;
 						}
 						break;
 					}
 				}
 				else {
 					index += num_zeroes;
-					if ((data = get_value(category)) == (int)0x80000000)
+					if ((data = get_value(&jpg->io, category)) == (int)0x80000000)
+						return -1;
+					if ((index < 64) && (put_coefficient(jpg, buffer, index, data << jpg->successive_low)))
 						return -1;
-					block[index++] = data << successive_low;
+					index++;
 				}
-			} while (index <= spectrum_end);
+			} while (index <= jpg->spectrum_end);
 		}
 		else {
 			/* AC successive approximation */
-			index = spectrum_start;
-			p_bit = 1 << successive_low;
-			n_bit = (-1) << successive_low;
-			if (skip_count == 0) {
+			index = jpg->spectrum_start;
+			p_bit = 1 << jpg->successive_low;
+			n_bit = (-1) << jpg->successive_low;
+			if (jpg->skip_count == 0) {
 				do {
-					data = huffman_decode(ac_table);
+					data = huffman_decode(&jpg->io, ac_table);
 					if (data < 0) {
 						TRACE("Bad ac data");
-						jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+						jpg->io.error = JPG_ERROR_BAD_IMAGE;
 						return -1;
 					}
 					num_zeroes = data >> 4;
 					category = data & 0xf;
 					if (category == 0) {
 						if (num_zeroes < 15) {
-							skip_count = 1 << num_zeroes;
+							jpg->skip_count = 1 << num_zeroes;
 							if (num_zeroes) {
-								value = get_bits(num_zeroes);
+								value = get_bits(&jpg->io, num_zeroes);
 								if (value < 0) {
 									TRACE("Failed to get bit from input stream");
-									jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+									jpg->io.error = JPG_ERROR_BAD_IMAGE;
 									return -1;
 								}
-								skip_count += value;
+								jpg->skip_count += value;
 							}
 							break;
 						}
 					}
 					else if (category == 1) {
-						if ((data = _jpeg_get_bit()) < 0) {
+						if ((data = get_bits(&jpg->io, 1)) < 0) {
 							TRACE("Failed to get bit from input stream");
-							jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+							jpg->io.error = JPG_ERROR_BAD_IMAGE;
 							return -1;
 						}
 						if (data)
@@ -740,21 +906,19 @@ decode_progressive_block(int addr, int type, int *old_dc)
 					}
 					else {
 						TRACE("Unexpected ac value category");
-						jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+						jpg->io.error = JPG_ERROR_BAD_IMAGE;
 						return -1;
 					}
 					do {
-						if (block[index]) {
-							if ((data = _jpeg_get_bit()) < 0) {
+						if ((value = get_coefficient(jpg, buffer, index))) {
+							if ((data = get_bits(&jpg->io, 1)) < 0) {
 								TRACE("Failed to get bit from input stream");
-								jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+								jpg->io.error = JPG_ERROR_BAD_IMAGE;
 								return -1;
 							}
-							if ((data) && (!(block[index] & p_bit))) {
-								if (block[index] >= 0)
-									block[index] += p_bit;
-								else
-									block[index] += n_bit;
+							if ((data) && (!(value & p_bit))) {
+								if (put_coefficient(jpg, buffer, index, value + ((value >= 0) ? p_bit : n_bit)))
+									return -1;
 							}
 						}
 						else {
@@ -763,30 +927,28 @@ decode_progressive_block(int addr, int type, int *old_dc)
 								break;
 						}
 						index++;
-					} while (index <= spectrum_end);
-					if ((category) && (index < 64))
-						block[index] = category;
+					} while (index <= jpg->spectrum_end);
+					if ((category) && (index < 64) && (put_coefficient(jpg, buffer, index, category)))
+						return -1;
 					index++;
-				} while (index <= spectrum_end);
+				} while (index <= jpg->spectrum_end);
 			}
-			if (skip_count > 0) {
-				while (index <= spectrum_end) {
-					if (block[index]) {
-						if ((data = _jpeg_get_bit()) < 0) {
+			if (jpg->skip_count > 0) {
+				while (index <= jpg->spectrum_end) {
+					if ((value = get_coefficient(jpg, buffer, index))) {
+						if ((data = get_bits(&jpg->io, 1)) < 0) {
 							TRACE("Failed to get bit from input stream");
-							jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+							jpg->io.error = JPG_ERROR_BAD_IMAGE;
 							return -1;
 						}
-						if ((data) && (!(block[index] & p_bit))) {
-							if (block[index] >= 0)
-								block[index] += p_bit;
-							else
-								block[index] += n_bit;
+						if ((data) && (!(value & p_bit))) {
+							if (put_coefficient(jpg, buffer, index, value + ((value >= 0) ? p_bit : n_bit)))
+								return -1;
 						}
 					}
 					index++;
 				}
-				skip_count--;
+				jpg->skip_count--;
 			}
 		}
 	}
@@ -794,13 +956,40 @@ decode_progressive_block(int addr, int type, int *old_dc)
 	return 0;
 }
 
+/* is_last_scan:
+ *  Looks ahead past the entropy coded data of the scan about to be decoded
+ *  and tells whether the image ends after it. Rows of the last scan are
+ *  final as soon as it is done with them.
+ */
+static int
+is_last_scan(IO_BUFFER *io)
+{
+	unsigned char *p = io->buffer;
+	int marker;
+	
+	while (p + 1 < io->buffer_end) {
+		if (*p++ != 0xff)
+			continue;
+		marker = *p;
+		if ((marker == 0) || (marker == 0xff) || ((marker >= (CHUNK_RST0 & 0xff)) && (marker <= (CHUNK_RST7 & 0xff))))
+			continue;
+		if (marker == (CHUNK_EOI & 0xff))
+			return TRUE;
+		if ((marker == CHUNK_SOS) || (p + 2 >= io->buffer_end))
+			return FALSE;
+		/* Tables and other chunks between scans */
+		p += 1 + ((p[1] << 8) | p[2]);
+	}
+	return FALSE;
+}
+
 
 /* _jpeg_c_ycbcr2rgb:
  *  C version of the YCbCr -> RGB color conversion routine. Converts 2 pixels
  *  at a time.
  */
 static void
-_jpeg_c_ycbcr2rgb(int addr, int y1, int cb1, int cr1, int y2, int cb2, int cr2, int y3, int cb3, int cr3, int y4, int cb4, int cr4)
+_jpeg_c_ycbcr2rgb(unsigned char *addr, int y1, int cb1, int cr1, int y2, int cb2, int cr2, int y3, int cb3, int cr3, int y4, int cb4, int cr4)
 {
 	int r, g, b;
 	unsigned int *ptr = (unsigned int *)addr, temp, p0, p1, p2;
@@ -854,39 +1043,51 @@ _jpeg_c_ycbcr2rgb(int addr, int y1, int cb1, int cr1, int y2, int cb2, int cr2,
 }
 
 
+/* _jpeg_c_ycbcr2rgb_row:
+ *  Converts a row of 8 pixels through jpg->ycbcr2rgb. With dup set, cb and
+ *  cr hold 4 samples, each covering 2 pixels.
+ */
+static void
+_jpeg_c_ycbcr2rgb_row(JPEG_DECODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int dup)
+{
+	if (dup) {
+		jpg->ycbcr2rgb(addr, y[0], cb[0], cr[0], y[1], cb[0], cr[0], y[2], cb[1], cr[1], y[3], cb[1], cr[1]);
+		jpg->ycbcr2rgb(addr + 12, y[4], cb[2], cr[2], y[5], cb[2], cr[2], y[6], cb[3], cr[3], y[7], cb[3], cr[3]);
+	}
+	else {
+		jpg->ycbcr2rgb(addr, y[0], cb[0], cr[0], y[1], cb[1], cr[1], y[2], cb[2], cr[2], y[3], cb[3], cr[3]);
+		jpg->ycbcr2rgb(addr + 12, y[4], cb[4], cr[4], y[5], cb[5], cr[5], y[6], cb[6], cr[6], y[7], cb[7], cr[7]);
+	}
+}
+
+
 /* plot_444:
  *  Plots an 8x8 MCU block for 444 mode. Also used to plot greyscale MCUs.
  */
 static void
-plot_444(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
+plot_444(JPEG_DECODER *jpg, unsigned char *addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
 {
 	int x, y;
-	short *y1_ptr = y1, *cb_ptr = cb, *cr_ptr = cr, v;
+	short *y1_ptr = y1, v;
 	
 	(void)y2;
 	(void)y3;
 	(void)y4;
 	
-	if (jpeg_components == 1) {
+	if (jpg->jpeg_components == 1) {
 		for (y = 0; y < 8; y++) {
 			for (x = 0; x < 8; x++) {
 				v = *y1_ptr++;
-				*(unsigned char *)addr = MID(0, v, 255);
+				*addr = MID(0, v, 255);
 				addr++;
 			}
 			addr += (pitch - 8);
 		}
 	}
 	else {
-		for (y = 0; y < 8; y++) {
-			for (x = 0; x < 8; x += 4) {
-				ycbcr2rgb(addr, *y1_ptr, *cb_ptr, *cr_ptr, *(y1_ptr + 1), *(cb_ptr + 1), *(cr_ptr + 1), *(y1_ptr + 2), *(cb_ptr + 2), *(cr_ptr + 2), *(y1_ptr + 3), *(cb_ptr + 3), *(cr_ptr + 3));
-				y1_ptr += 4;
-				cb_ptr += 4;
-				cr_ptr += 4;
-				addr += 12;
-			}
-			addr += (pitch - 24);
+		for (y = 0; y < 64; y += 8) {
+			jpg->ycbcr2rgb_row(jpg, addr, y1 + y, cb + y, cr + y, FALSE);
+			addr += pitch;
 		}
 	}
 }
@@ -896,27 +1097,17 @@ plot_444(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, short
  *  Plots a 16x8 MCU block for 422 mode.
  */
 static void
-plot_422_h(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
+plot_422_h(JPEG_DECODER *jpg, unsigned char *addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
 {
-	int x, y;
-	short *y1_ptr = y1, *y2_ptr = y2, *cb_ptr = cb, *cr_ptr = cr;
+	int y;
 	
 	(void)y3;
 	(void)y4;
 	
-	for (y = 0; y < 8; y++) {
-		for (x = 0; x < 8; x += 4) {
-			ycbcr2rgb(addr, *y1_ptr, *cb_ptr, *cr_ptr, *(y1_ptr + 1), *cb_ptr, *cr_ptr, *(y1_ptr + 2), *(cb_ptr + 1), *(cr_ptr + 1), *(y1_ptr + 3), *(cb_ptr + 1), *(cr_ptr + 1));
-			ycbcr2rgb(addr + 24, *y2_ptr, *(cb_ptr + 4), *(cr_ptr + 4), *(y2_ptr + 1), *(cb_ptr + 4), *(cr_ptr + 4), *(y2_ptr + 2), *(cb_ptr + 5), *(cr_ptr + 5), *(y2_ptr + 3), *(cb_ptr + 5), *(cr_ptr + 5));
-			y1_ptr += 4;
-			y2_ptr += 4;
-			cb_ptr += 2;
-			cr_ptr += 2;
-			addr += 12;
-		}
-		cb_ptr += 4;
-		cr_ptr += 4;
-		addr += (pitch - 24);
+	for (y = 0; y < 64; y += 8) {
+		jpg->ycbcr2rgb_row(jpg, addr, y1 + y, cb + y, cr + y, TRUE);
+		jpg->ycbcr2rgb_row(jpg, addr + 24, y2 + y, cb + y + 4, cr + y + 4, TRUE);
+		addr += pitch;
 	}
 }
 
@@ -925,28 +1116,18 @@ plot_422_h(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, shor
  *  Plots a 8x16 MCU block for 422 mode.
  */
 static void
-plot_422_v(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
+plot_422_v(JPEG_DECODER *jpg, unsigned char *addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
 {
-	int x, y, d;
-	short *y1_ptr = y1, *y2_ptr = y2, *cb_ptr = cb, *cr_ptr = cr;
+	int y, c;
 	
 	(void)y3;
 	(void)y4;
 	
-	for (y = 0; y < 8; y++) {
-		for (x = 0; x < 8; x += 4) {
-			ycbcr2rgb(addr, *y1_ptr, *cb_ptr, *cr_ptr, *(y1_ptr + 1), *(cb_ptr + 1), *(cr_ptr + 1), *(y1_ptr + 2), *(cb_ptr + 2), *(cr_ptr + 2), *(y1_ptr + 3), *(cb_ptr + 3), *(cr_ptr + 3));
-			ycbcr2rgb(addr + (pitch * 8), *y2_ptr, *(cb_ptr + 32), *(cr_ptr + 32), *(y2_ptr + 1), *(cb_ptr + 33), *(cr_ptr + 33), *(y2_ptr + 2), *(cb_ptr + 34), *(cr_ptr + 34), *(y2_ptr + 3), *(cb_ptr + 35), *(cr_ptr + 35));
-			y1_ptr += 4;
-			y2_ptr += 4;
-			cb_ptr += 4;
-			cr_ptr += 4;
-			addr += 12;
-		}
-		d = (!(y & 1)) * 8;
-		cb_ptr -= d;
-		cr_ptr -= d;
-		addr += (pitch - 24);
+	for (y = 0; y < 64; y += 8) {
+		c = (y >> 4) * 8;
+		jpg->ycbcr2rgb_row(jpg, addr, y1 + y, cb + c, cr + c, FALSE);
+		jpg->ycbcr2rgb_row(jpg, addr + (pitch * 8), y2 + y, cb + c + 32, cr + c + 32, FALSE);
+		addr += pitch;
 	}
 }
 
@@ -955,42 +1136,195 @@ plot_422_v(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, shor
  *  Plots a 16x16 MCU block for 411 mode.
  */
 static void
-plot_411(int addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
+plot_411(JPEG_DECODER *jpg, unsigned char *addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
+{
+	int y, c;
+	
+	for (y = 0; y < 64; y += 8) {
+		c = (y >> 4) * 8;
+		jpg->ycbcr2rgb_row(jpg, addr, y1 + y, cb + c, cr + c, TRUE);
+		jpg->ycbcr2rgb_row(jpg, addr + 24, y2 + y, cb + c + 4, cr + c + 4, TRUE);
+		jpg->ycbcr2rgb_row(jpg, addr + (pitch * 8), y3 + y, cb + c + 32, cr + c + 32, TRUE);
+		jpg->ycbcr2rgb_row(jpg, addr + (pitch * 8) + 24, y4 + y, cb + c + 36, cr + c + 36, TRUE);
+		addr += pitch;
+	}
+}
+
+
+/* plot_scaled:
+ *  Plots an MCU decoded at reduced scale, for any sampling. Each luminance
+ *  block holds n x n samples at its top left, n being 8 >> jpg->scale, and
+ *  they come in row order. Chrominance covers the whole MCU; when it is
+ *  subsampled it was decoded one scale step larger (2n x 2n samples), so
+ *  it keeps its resolution and is averaged along an axis that is not
+ *  subsampled.
+ */
+static void
+plot_scaled(JPEG_DECODER *jpg, unsigned char *addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr)
 {
-	int x, y, d;
-	short *y1_ptr = y1, *y2_ptr = y2, *y3_ptr = y3, *y4_ptr = y4, *cb_ptr = cb, *cr_ptr = cr;
-	
-	for (y = 0; y < 8; y++) {
-		for (x = 0; x < 8; x += 4) {
-			ycbcr2rgb(addr, *y1_ptr, *cb_ptr, *cr_ptr, *(y1_ptr + 1), *cb_ptr, *cr_ptr, *(y1_ptr + 2), *(cb_ptr + 1), *(cr_ptr + 1), *(y1_ptr + 3), *(cb_ptr + 1), *(cr_ptr + 1));
-			ycbcr2rgb(addr + 24, *y2_ptr, *(cb_ptr + 4), *(cr_ptr + 4), *(y2_ptr + 1), *(cb_ptr + 4), *(cr_ptr + 4), *(y2_ptr + 2), *(cb_ptr + 5), *(cr_ptr + 5), *(y2_ptr + 3), *(cb_ptr + 5), *(cr_ptr + 5));
-			ycbcr2rgb(addr + (pitch * 8), *y3_ptr, *(cb_ptr + 32), *(cr_ptr + 32), *(y3_ptr + 1), *(cb_ptr + 32), *(cr_ptr + 32), *(y3_ptr + 2), *(cb_ptr + 33), *(cr_ptr + 33), *(y3_ptr + 3), *(cb_ptr + 33), *(cr_ptr + 33));
-			ycbcr2rgb(addr + (pitch * 8) + 24, *y4_ptr, *(cb_ptr + 36), *(cr_ptr + 36), *(y4_ptr + 1), *(cb_ptr + 36), *(cr_ptr + 36), *(y4_ptr + 2), *(cb_ptr + 37), *(cr_ptr + 37), *(y4_ptr + 3), *(cb_ptr + 37), *(cr_ptr + 37));
-			y1_ptr += 4;
-			y2_ptr += 4;
-			y3_ptr += 4;
-			y4_ptr += 4;
-			cb_ptr += 2;
-			cr_ptr += 2;
-			addr += 12;
+	short *luma[4], *lptr, cb_out[64], cr_out[64];
+	int n = 8 >> jpg->scale, shift = 3 - jpg->scale;
+	int w = n * jpg->h_sampling, h = n * jpg->v_sampling;
+	int x, y, i, c, v, a, b, cn, fx, fy, cb_sum, cr_sum, r_pos, g_pos, b_pos;
+	unsigned char *ptr;
+	
+	luma[0] = y1;
+	luma[1] = y2;
+	luma[2] = y3;
+	luma[3] = y4;
+#ifdef ALLEGRO_LITTLE_ENDIAN
+	r_pos = _rgb_r_shift_24 >> 3;
+	g_pos = _rgb_g_shift_24 >> 3;
+	b_pos = _rgb_b_shift_24 >> 3;
+#else
+	r_pos = 2 - (_rgb_r_shift_24 >> 3);
+	g_pos = 2 - (_rgb_g_shift_24 >> 3);
+	b_pos = 2 - (_rgb_b_shift_24 >> 3);
+#endif
+	
+	if (jpg->jpeg_components > 1) {
+		/* Chrominance samples per output pixel along each axis; 4:1:1
+		 * has less than one horizontally and repeats them */
+		cn = (jpg->sampling > 1) ? 2 * n : n;
+		fx = MAX(1, cn / w);
+		fy = MAX(1, cn / h);
+		for (y = 0; y < h; y++) {
+			for (x = 0; x < w; x++) {
+				cb_sum = cr_sum = 0;
+				for (b = 0; b < fy; b++) {
+					for (a = 0; a < fx; a++) {
+						c = ((((y * cn) / h) + b) * 8) + ((x * cn) / w) + a;
+						cb_sum += cb[c];
+						cr_sum += cr[c];
+					}
+				}
+				c = fx * fy;
+				cb_out[(y * w) + x] = (cb_sum + (c >> 1)) / c;
+				cr_out[(y * w) + x] = (cr_sum + (c >> 1)) / c;
+			}
+		}
+	}
+	
+	for (y = 0; y < h; y++) {
+		ptr = addr;
+		for (i = 0; i < jpg->h_sampling; i++) {
+			lptr = luma[((y >> shift) * jpg->h_sampling) + i] + ((y & (n - 1)) * 8);
+			if (jpg->jpeg_components == 1) {
+				for (x = 0; x < n; x++)
+					*ptr++ = MID(0, lptr[x], 255);
+				continue;
+			}
+			for (x = 0; x < n; x++) {
+				v = lptr[x] << 8;
+				c = (y * w) + (i * n) + x;
+				ptr[r_pos] = MID(0, (v                             + (359 * (cr_out[c] - 128))) >> 8, 255);
+				ptr[g_pos] = MID(0, (v -  (88 * (cb_out[c] - 128)) - (183 * (cr_out[c] - 128))) >> 8, 255);
+				ptr[b_pos] = MID(0, (v + (453 * (cb_out[c] - 128))                            ) >> 8, 255);
+				ptr += 3;
+			}
+		}
+		addr += pitch;
+	}
+}
+
+
+/* plot_rows:
+ *  Applies the IDCT to the coefficients of MCU rows first to last - 1 of a
+ *  progressive image and plots them.
+ */
+static void
+plot_rows(JPEG_DECODER *jpg, BITMAP *bmp, int first, int last)
+{
+	const int x_ofs[4] = { 0, 1, 0, 1 }, y_ofs[4] = { 0, 0, 1, 1 };
+	short coefs_buffer[384], coefs[64], temp[64], *coefs_ptr, *temp_ptr;
+	short *y1, *y2, *y3, *y4, *cb, *cr;
+	short workspace[130];
+	unsigned char *addr;
+	int pitch, width, i, c;
+	int block_x, block_y, blocks_per_row[3];
+	int blocks_in_mcu, block_component[6];
+	int block_x_ofs[6], block_y_ofs[6];
+	int mcu_w, mcu_h, component_w[3], component_h[3];
+	
+	pitch = (int)(bmp->line[1] - bmp->line[0]);
+	width = (jpg->jpeg_w + 15) & ~0xf;
+	y1 = coefs_buffer;
+	y2 = coefs_buffer + 64;
+	y3 = coefs_buffer + 128;
+	y4 = coefs_buffer + 192;
+	cb = coefs_buffer + 256;
+	cr = coefs_buffer + 320;
+	
+	blocks_per_row[0] = width / 8;
+	component_w[0] = jpg->h_sampling;
+	component_h[0] = jpg->v_sampling;
+	mcu_w = jpg->h_sampling * 8;
+	mcu_h = jpg->v_sampling * 8;
+	blocks_in_mcu = jpg->sampling;
+	for (i = 0; i < jpg->sampling; i++) {
+		block_component[i] = 0;
+		block_x_ofs[i] = x_ofs[i];
+		block_y_ofs[i] = y_ofs[i];
+	}
+	if ((jpg->h_sampling == 1) && (jpg->v_sampling == 2)) {
+		block_x_ofs[1] = x_ofs[2];
+		block_y_ofs[1] = y_ofs[2];
+	}
+	for (i = 1; i < jpg->jpeg_components; i++) {
+		blocks_per_row[i] = width / mcu_w;
+		component_w[i] = component_h[i] = 1;
+		block_component[blocks_in_mcu] = i;
+		block_x_ofs[blocks_in_mcu] = 0;
+		block_y_ofs[blocks_in_mcu] = 0;
+		blocks_in_mcu++;
+	}
+	jpg->plot = plot_411;
+	if (jpg->sampling < 4) {
+		jpg->plot = plot_422_v;
+		if (jpg->h_sampling == 2)
+			jpg->plot = plot_422_h;
+		cb -= 128;
+		cr -= 128;
+		if (jpg->sampling < 2) {
+			jpg->plot = plot_444;
+			cb -= 64;
+			cr -= 64;
+		}
+	}
+	if (jpg->scale)
+		jpg->plot = plot_scaled;
+	if (jpg->sampling == 1)
+		jpg->chroma_idct = jpg->idct;
+	
+	for (block_y = first; block_y < last; block_y++) {
+		for (block_x = 0; block_x < width / mcu_w; block_x++) {
+			coefs_ptr = coefs_buffer;
+			for (i = 0; i < blocks_in_mcu; i++) {
+				c = block_component[i];
+				temp_ptr = expand_block(jpg, &jpg->data_buffer[c][(block_y * blocks_per_row[c] * component_h[c]) + (blocks_per_row[c] * block_y_ofs[i]) + (block_x * component_w[c]) + block_x_ofs[i]], temp);
+				zigzag_reorder(temp_ptr, coefs);
+				if (c == 0)
+					jpg->idct(coefs, coefs_ptr, jpg->luminance_quantization_table, workspace);
+				else
+					jpg->chroma_idct(coefs, coefs_ptr, jpg->chrominance_quantization_table, workspace);
+				coefs_ptr += 64;
+			}
+			addr = bmp->line[(block_y * mcu_h) >> jpg->scale] + (((block_x * mcu_w) >> jpg->scale) * (jpg->jpeg_components == 1 ? 1 : 3));
+			jpg->plot(jpg, addr, pitch, y1, y2, y3, y4, cb, cr);
 		}
-		d = ((y & 1) * 8) - 4;
-		cb_ptr += d;
-		cr_ptr += d;
-		addr += (pitch - 24);
 	}
 }
 
 
 #ifdef DEBUG
 static void
-dump_chunk(char *msg, int length)
+dump_chunk(JPEG_DECODER *jpg, char *msg, int length)
 {
 	char buffer[65536];
 	int i;
 	
-	for (i = 0; (i < length) && (!_jpeg_eoc()); i++)
-		buffer[i] = _jpeg_getc();
+	for (i = 0; (i < length) && (!_jpeg_eoc(&jpg->io)); i++)
+		buffer[i] = _jpeg_getc(&jpg->io);
 	buffer[i] = '\0';
 	
 	TRACE("%s%s", msg, buffer);
@@ -998,17 +1332,227 @@ dump_chunk(char *msg, int length)
 #endif
 
 
+/* Baseline images at least this big, in pixels, have their restart
+ * segments decoded on several threads.
+ */
+#define PARALLEL_MIN_PIXELS	(512 * 512)
+
+
+typedef struct RESTART_SEGMENT
+{
+	unsigned char *start, *end;
+	int error;
+} RESTART_SEGMENT;
+
+
+typedef struct PARALLEL_DECODE
+{
+	JPEG_DECODER *jpg;
+	BITMAP *bmp;
+	RESTART_SEGMENT *segment;
+	int pitch, mcus, mcus_per_row, mcu_w, mcu_h;
+	int blocks_in_mcu, *block_component;
+} PARALLEL_DECODE;
+
+
+/* find_restart_segments:
+ *  Splits the entropy coded data at the current input position at its RSTn
+ *  markers, without consuming it. Returns the number of segments found, at
+ *  most max; the last one ends at the first other marker.
+ */
+static int
+find_restart_segments(IO_BUFFER *io, RESTART_SEGMENT *segment, int max)
+{
+	unsigned char *p;
+	int n = 0;
+	
+	segment[0].start = io->buffer;
+	for (p = io->buffer; p + 1 < io->buffer_end; p++) {
+		/* Skip data bytes, fill bytes and stuffed 0xff00 */
+		if ((p[0] != 0xff) || (p[1] == 0xff))
+			continue;
+		if (p[1] == 0) {
+			p++;
+			continue;
+		}
+		segment[n++].end = p;
+		if ((n == max) || ((0xff00 | p[1]) < CHUNK_RST0) || ((0xff00 | p[1]) > CHUNK_RST7))
+			return n;
+		segment[n].start = p + 2;
+		segment[n].error = JPG_ERROR_NONE;
+		p++;
+	}
+	segment[n].end = io->buffer_end;
+	
+	return n + 1;
+}
+
+
+/* decode_segment:
+ *  Decodes and plots the MCUs of a restart segment. Runs on worker threads,
+ *  with an input stream of its own for the segment.
+ */
+static void
+decode_segment(void *data, int index)
+{
+	PARALLEL_DECODE *pd = (PARALLEL_DECODE *)data;
+	JPEG_DECODER *jpg = pd->jpg;
+	RESTART_SEGMENT *segment = &pd->segment[index];
+	IO_BUFFER io;
+	short coefs_buffer[384], *cb, *cr;
+	int old_dc[3] = { 0, 0, 0 };
+	int mcu, last, block_x, block_y, i, c;
+	unsigned char *addr;
+	
+	memset(&io, 0, sizeof(io));
+	io.buffer = io.buffer_start = segment->start;
+	io.buffer_end = segment->end;
+	cb = coefs_buffer + (jpg->sampling * 64);
+	cr = cb + 64;
+	
+	last = MIN((index + 1) * jpg->restart_interval, pd->mcus);
+	for (mcu = index * jpg->restart_interval; mcu < last; mcu++) {
+		for (i = 0; i < pd->blocks_in_mcu; i++) {
+			c = pd->block_component[i];
+			if (decode_baseline_block(jpg, &io, coefs_buffer + (i * 64), (c == 0) ? LUMINANCE : CHROMINANCE, &old_dc[c])) {
+				segment->error = io.error;
+				return;
+			}
+		}
+		block_x = (mcu % pd->mcus_per_row) * pd->mcu_w;
+		block_y = (mcu / pd->mcus_per_row) * pd->mcu_h;
+		addr = pd->bmp->line[block_y >> jpg->scale] + ((block_x >> jpg->scale) * (jpg->jpeg_components == 1 ? 1 : 3));
+		jpg->plot(jpg, addr, pd->pitch, coefs_buffer, coefs_buffer + 64, coefs_buffer + 128, coefs_buffer + 192, cb, cr);
+	}
+}
+
+
+/* decode_parallel:
+ *  Decodes a baseline image with restart markers by spreading its restart
+ *  segments over jpg->threads threads. Returns 0 on success, -1 on error,
+ *  or 1 if the markers do not match the image and it must be decoded
+ *  serially instead.
+ */
+static int
+decode_parallel(JPEG_DECODER *jpg, BITMAP *bmp, int pitch, int mcu_w, int mcu_h, int blocks_in_mcu, int *block_component)
+{
+	PARALLEL_DECODE pd;
+	int i, count;
+	
+	pd.jpg = jpg;
+	pd.bmp = bmp;
+	pd.pitch = pitch;
+	pd.mcu_w = mcu_w;
+	pd.mcu_h = mcu_h;
+	pd.mcus_per_row = (jpg->jpeg_w + mcu_w - 1) / mcu_w;
+	pd.mcus = pd.mcus_per_row * ((jpg->jpeg_h + mcu_h - 1) / mcu_h);
+	pd.blocks_in_mcu = blocks_in_mcu;
+	pd.block_component = block_component;
+	
+	count = (pd.mcus + jpg->restart_interval - 1) / jpg->restart_interval;
+	pd.segment = (RESTART_SEGMENT *)malloc(count * sizeof(RESTART_SEGMENT));
+	if (!pd.segment)
+		return 1;
+	pd.segment[0].error = JPG_ERROR_NONE;
+	if (find_restart_segments(&jpg->io, pd.segment, count) != count) {
+		TRACE("Restart markers do not match the image, decoding serially");
+		free(pd.segment);
+		return 1;
+	}
+	
+	TRACE("Decoding %d restart segments on %d threads", count, jpg->threads);
+	parallel_run(count, jpg->threads, decode_segment, &pd);
+	
+	for (i = 0; i < count; i++) {
+		if (pd.segment[i].error) {
+			jpg->io.error = pd.segment[i].error;
+			break;
+		}
+	}
+	free(pd.segment);
+	
+	return (i < count) ? -1 : 0;
+}
+
+
+/* _jpeg_probe:
+ *  Reads the header of the image in jpg->io just far enough to find its
+ *  SOFx chunk, leaving the size and number of components of the image in
+ *  jpg and whether it is progressive in *progressive. Nothing else is
+ *  parsed. Returns 0 on success, or -1 with the error code in jpg->io.error.
+ */
+int
+_jpeg_probe(JPEG_DECODER *jpg, int *progressive)
+{
+	int data;
+	
+	jpg->io.error = JPG_ERROR_NONE;
+	
+	if (_jpeg_getw(&jpg->io) != CHUNK_SOI) {
+		TRACE("SOI chunk not found");
+		jpg->io.error = JPG_ERROR_NOT_JPEG;
+		return -1;
+	}
+	
+	while ((data = _jpeg_getc(&jpg->io)) >= 0) {
+		if (data != 0xff)
+			continue;
+		while ((data = _jpeg_getc(&jpg->io)) == 0xff)
+			;
+		switch (data) {
+			case -1:
+				return -1;
+			case 0:
+				break;
+			case CHUNK_SOF0:
+			case CHUNK_SOF1:
+			case CHUNK_SOF2:
+				*progressive = (data == CHUNK_SOF2);
+				return read_sof0_chunk(jpg);
+			case CHUNK_SOF3:
+			case CHUNK_SOF5:
+			case CHUNK_SOF6:
+			case CHUNK_SOF7:
+			case CHUNK_SOF9:
+			case CHUNK_SOF10:
+			case CHUNK_SOF11:
+			case CHUNK_SOF13:
+			case CHUNK_SOF14:
+			case CHUNK_SOF15:
+				TRACE("Unsupported encoding chunk (0xFF%X)", data);
+				jpg->io.error = JPG_ERROR_UNSUPPORTED_ENCODING;
+				return -1;
+			case CHUNK_SOS:
+			case CHUNK_EOI & 0xff:
+				TRACE("No SOFx chunk before image data");
+				jpg->io.error = JPG_ERROR_BAD_IMAGE;
+				return -1;
+			default:
+				/* Everything else in the header is a chunk to skip */
+				_jpeg_open_chunk(&jpg->io);
+				_jpeg_close_chunk(&jpg->io);
+				break;
+		}
+	}
+	
+	return -1;
+}
+
+
 /* _jpeg_decode:
- *  Main decoding function.
+ *  Main decoding function. Decodes the image in jpg->io into a new 8 bpp
+ *  (greyscale) or 24 bpp bitmap; on failure returns NULL and leaves the
+ *  error code in jpg->io.error. With jpg->scale set to 1, 2 or 3 the image
+ *  comes out at 1/2, 1/4 or 1/8 of its size, through reduced inverse DCTs.
  */
 BITMAP *
-_jpeg_decode(RGB *pal, void (*callback)(int))
+_jpeg_decode(JPEG_DECODER *jpg, RGB *pal, void (*callback)(int))
 {
 	const int x_ofs[4] = { 0, 1, 0, 1 }, y_ofs[4] = { 0, 0, 1, 1 };
-	short coefs_buffer[384], coefs[64], *coefs_ptr, *temp_ptr;
+	short coefs_buffer[384], *coefs_ptr;
 	short *y1, *y2, *y3, *y4, *cb, *cr;
-	short workspace[130];
-	int addr, pitch, i, j;
+	unsigned char *addr;
+	int pitch, width, height, i, j;
 	int block_x, block_y, block_max_x, block_max_y;
 	int blocks_per_row[3];
 	int blocks_in_mcu, block_component[6];
@@ -1019,33 +1563,45 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 	BITMAP *bmp;
 	int data, flags = 0;
 	int restart_count;
-	int depth;
+	DATA_BUFFER *buffer;
+	int last_scan, rows, rows_done, scan;
 	
-	jpgalleg_error = JPG_ERROR_NONE;
+	jpg->io.error = JPG_ERROR_NONE;
 	
 	TRACE("############### Decode start ###############");
 	
 #ifdef JPGALLEG_MMX
 	if (cpu_capabilities & CPU_MMX) {
-		idct = _jpeg_mmx_idct;
+		jpg->idct = _jpeg_mmx_idct;
 		if (_rgb_r_shift_24 == 0)
-			ycbcr2rgb = _jpeg_mmx_ycbcr2rgb;
+			jpg->ycbcr2rgb = _jpeg_mmx_ycbcr2rgb;
 		else if (_rgb_r_shift_24 == 16)
-			ycbcr2rgb = _jpeg_mmx_ycbcr2bgr;
+			jpg->ycbcr2rgb = _jpeg_mmx_ycbcr2bgr;
 		else
-			ycbcr2rgb = _jpeg_c_ycbcr2rgb;
+			jpg->ycbcr2rgb = _jpeg_c_ycbcr2rgb;
 		TRACE("Using MMX...");
 	}
 	else {
 #endif
-		idct = _jpeg_c_idct;
-		ycbcr2rgb = _jpeg_c_ycbcr2rgb;
+		jpg->idct = _jpeg_c_idct;
+		jpg->ycbcr2rgb = _jpeg_c_ycbcr2rgb;
 #ifdef JPGALLEG_MMX
 	}
 #endif
+	jpg->ycbcr2rgb_row = _jpeg_c_ycbcr2rgb_row;
+	_jpeg_simd_decoder(jpg);
+	/* Subsampled chrominance covers twice the area of a luminance block, so
+	 * it is decoded one scale step larger to keep its resolution. Without
+	 * subsampling both use the same scale, set once the sampling is known */
+	jpg->chroma_idct = jpg->idct;
+	switch (jpg->scale) {
+		case 1: jpg->idct = _jpeg_c_idct_4x4; break;
+		case 2: jpg->idct = _jpeg_c_idct_2x2; jpg->chroma_idct = _jpeg_c_idct_4x4; break;
+		case 3: jpg->idct = _jpeg_c_idct_1x1; jpg->chroma_idct = _jpeg_c_idct_2x2; break;
+	}
 
-	memset(_jpeg_huffman_dc_table, 0, 4 * sizeof(HUFFMAN_TABLE));
-	memset(_jpeg_huffman_ac_table, 0, 4 * sizeof(HUFFMAN_TABLE));
+	memset(jpg->huffman_dc_table, 0, 4 * sizeof(HUFFMAN_TABLE));
+	memset(jpg->huffman_ac_table, 0, 4 * sizeof(HUFFMAN_TABLE));
 	y1 = coefs_buffer;
 	y2 = coefs_buffer + 64;
 	y3 = coefs_buffer + 128;
@@ -1053,21 +1609,19 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 	cb = coefs_buffer + 256;
 	cr = coefs_buffer + 320;
 	
-	_jpeg_io.current_bit = 8;
-	
-	if (_jpeg_getw() != CHUNK_SOI) {
+	if (_jpeg_getw(&jpg->io) != CHUNK_SOI) {
 		TRACE("SOI chunk not found");
-		jpgalleg_error = JPG_ERROR_NOT_JPEG;
+		jpg->io.error = JPG_ERROR_NOT_JPEG;
 		return NULL;
 	}
 	
 	/* Examine header */
 	do {
-		data = _jpeg_getc();
+		data = _jpeg_getc(&jpg->io);
 		if (data < 0)
 			return NULL;
 		else if (data == 0xff) {
-			while ((data = _jpeg_getc()) == 0xff)
+			while ((data = _jpeg_getc(&jpg->io)) == 0xff)
 				;
 			switch (data) {
 				case -1:
@@ -1080,7 +1634,7 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 				case CHUNK_SOF0:
 				case CHUNK_SOF1:
 					TRACE("SOFx chunk found");
-					if (read_sof0_chunk())
+					if (read_sof0_chunk(jpg))
 						return NULL;
 					flags |= SOF0_DEFINED;
 					break;
@@ -1095,42 +1649,42 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 				case CHUNK_SOF14:
 				case CHUNK_SOF15:
 					TRACE("Unsupported encoding chunk (0xFF%X)", data);
-					jpgalleg_error = JPG_ERROR_UNSUPPORTED_ENCODING;
+					jpg->io.error = JPG_ERROR_UNSUPPORTED_ENCODING;
 					return NULL;
 				case CHUNK_DHT:
 					TRACE("DHT chunk found");
-					if (read_dht_chunk())
+					if (read_dht_chunk(jpg))
 						return NULL;
 					flags |= DHT_DEFINED;
 					break;
 				case CHUNK_SOS:
 					TRACE("SOS chunk found");
-					if (read_sos_chunk())
+					if (read_sos_chunk(jpg))
 						return NULL;
 					flags |= SOS_DEFINED;
 					break;
 				case CHUNK_DQT:
 					TRACE("DQT chunk found");
-					if (read_dqt_chunk())
+					if (read_dqt_chunk(jpg))
 						return NULL;
 					flags |= DQT_DEFINED;
 					break;
 				case CHUNK_APP0:
 					TRACE("APP0 chunk found");
-					if (read_appn_chunk(data))
+					if (read_appn_chunk(jpg, data))
 						return NULL;
 					flags |= APP0_DEFINED;
 					break;
 				case CHUNK_APP1:
 					TRACE("APP1 chunk found");
 					if (!(flags & APP1_DEFINED)) {
-						if (read_appn_chunk(data))
+						if (read_appn_chunk(jpg, data))
 							return NULL;
 						flags |= APP1_DEFINED;
 					}
 					else {
-						_jpeg_open_chunk();
-						_jpeg_close_chunk();
+						_jpeg_open_chunk(&jpg->io);
+						_jpeg_close_chunk(&jpg->io);
 					}
 					break;
 				case CHUNK_APP2:
@@ -1148,17 +1702,17 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 				case CHUNK_APP14:
 				case CHUNK_APP15:
 					TRACE("APP%d chunk found, skipping", data - CHUNK_APP0);
-					_jpeg_open_chunk();
+					_jpeg_open_chunk(&jpg->io);
 #ifdef DEBUG
-					dump_chunk("First 30 bytes of chunk: ", 30);
+					dump_chunk(jpg, "First 30 bytes of chunk: ", 30);
 #endif
-					_jpeg_close_chunk();
+					_jpeg_close_chunk(&jpg->io);
 					flags |= APP0_DEFINED;
 					break;
 					
 				case CHUNK_DRI:
 					TRACE("DRI chunk found");
-					if (read_dri_chunk())
+					if (read_dri_chunk(jpg))
 						return NULL;
 					flags |= DRI_DEFINED;
 					break;
@@ -1173,161 +1727,193 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 				case CHUNK_RST6:
 				case CHUNK_RST7:
 					TRACE("Unexpected chunk found in header (0xFF%X)", data);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					return NULL;
 				case CHUNK_COM:
-					_jpeg_open_chunk();
+					_jpeg_open_chunk(&jpg->io);
 #ifdef DEBUG
-					dump_chunk("COM chunk found; comment: ", 65536);
+					dump_chunk(jpg, "COM chunk found; comment: ", 65536);
 #endif
-					_jpeg_close_chunk();
+					_jpeg_close_chunk(&jpg->io);
 					break;
 				default:
 					TRACE("Unknown chunk found in header (0xFF%X), skipping", data);
-					_jpeg_open_chunk();
+					_jpeg_open_chunk(&jpg->io);
 #ifdef DEBUG
-					dump_chunk("First 30 bytes of chunk: ", 30);
+					dump_chunk(jpg, "First 30 bytes of chunk: ", 30);
 #endif
-					_jpeg_close_chunk();
+					_jpeg_close_chunk(&jpg->io);
 					break;
 			}
 		}
 	} while (((flags & JFIF_OK) != JFIF_OK) && ((flags & EXIF_OK) != EXIF_OK));
 	
 	/* Deal with bogus restart interval */
-	if (restart_interval <= 0)
+	if (jpg->restart_interval <= 0)
 		flags &= ~DRI_DEFINED;
 	
-	bmp = create_bitmap_ex((jpeg_components == 1) ? 8 : 24, (jpeg_w + 15) & ~0xf, (jpeg_h + 15) & ~0xf);
+	/* Blocks are laid out over the full size image, rounded up to whole
+	 * MCUs; the bitmap gets that size reduced by the scale.
+	 */
+	width = (jpg->jpeg_w + 15) & ~0xf;
+	height = (jpg->jpeg_h + 15) & ~0xf;
+	bmp = create_bitmap_ex((jpg->jpeg_components == 1) ? 8 : 24, width >> jpg->scale, height >> jpg->scale);
 	if (!bmp) {
 		TRACE("Out of memory");
 		return NULL;
 	}
 	pitch = (int)(bmp->line[1] - bmp->line[0]);
+	/* Hack to set size; image may be really slightly bigger than reported.
+	 * We assume final user always to access data via line pointers and NEVER
+	 * assume data is linearly stored in memory starting at bmp->dat...
+	 */
+	bmp->w = bmp->cr = (jpg->jpeg_w + (1 << jpg->scale) - 1) >> jpg->scale;
+	bmp->h = bmp->cb = (jpg->jpeg_h + (1 << jpg->scale) - 1) >> jpg->scale;
+	/* Greyscale images come as 8 bpp with a grey ramp palette; conversion
+	 * to the load color depth is left to fixup_jpg(), which unlike this
+	 * function needs Allegro's global state.
+	 */
+	if (jpg->jpeg_components == 1) {
+		for (i = 0; i < 256; i++)
+			pal[i].r = pal[i].g = pal[i].b = (i >> 2);
+	}
 	
 	block_x = block_y = 0;
 	restart_count = 0;
-	memset(data_buffer, 0, 3 * sizeof(DATA_BUFFER *));
+	memset(jpg->data_buffer, 0, 3 * sizeof(DATA_BUFFER *));
 	
-	progress_cb = callback;
-	progress_counter = 0;
+	jpg->progress_cb = callback;
+	jpg->progress_counter = 0;
 	
 	if (!(flags & IS_PROGRESSIVE)) {
 		/* Baseline decoding */
 		TRACE("Starting baseline decoding");
 		blocks_in_mcu = 0;
 		coefs_ptr = coefs_buffer;
-		for (i = 0; i < sampling; i++) {
+		for (i = 0; i < jpg->sampling; i++) {
 			block_component[blocks_in_mcu] = 0;
 			block_ptr[blocks_in_mcu] = coefs_ptr;
 			coefs_ptr += 64;
 			blocks_in_mcu++;
 		}
-		for (i = 1; i < jpeg_components; i++) {
+		for (i = 1; i < jpg->jpeg_components; i++) {
 			block_component[blocks_in_mcu] = i;
 			block_ptr[blocks_in_mcu] = coefs_ptr;
 			coefs_ptr += 64;
 			blocks_in_mcu++;
 		}
-		mcu_w = h_sampling * 8;
-		mcu_h = v_sampling * 8;
-		plot = plot_411;
-		if (sampling < 4) {
-			plot = plot_422_v;
-			if (h_sampling == 2)
-				plot = plot_422_h;
+		mcu_w = jpg->h_sampling * 8;
+		mcu_h = jpg->v_sampling * 8;
+		jpg->plot = plot_411;
+		if (jpg->sampling < 4) {
+			jpg->plot = plot_422_v;
+			if (jpg->h_sampling == 2)
+				jpg->plot = plot_422_h;
 			cb -= 128;
 			cr -= 128;
-			if (sampling < 2) {
-				plot = plot_444;
+			if (jpg->sampling < 2) {
+				jpg->plot = plot_444;
 				cb -= 64;
 				cr -= 64;
 			}
 		}
 		
-		progress_total = (bmp->w / mcu_w) * (bmp->h / mcu_h);
+		jpg->progress_total = (width / mcu_w) * (height / mcu_h);
 		
-		TRACE("%dx%d %s image, %s mode", jpeg_w, jpeg_h, jpeg_components == 1 ? "greyscale" : "color", plot == plot_444 ? "444" : (((plot == plot_422_h) || (plot == plot_422_v)) ? "422" : "411"));
+		TRACE("%dx%d %s image, %s mode", jpg->jpeg_w, jpg->jpeg_h, jpg->jpeg_components == 1 ? "greyscale" : "color", jpg->plot == plot_444 ? "444" : (((jpg->plot == plot_422_h) || (jpg->plot == plot_422_v)) ? "422" : "411"));
+		if (jpg->scale)
+			jpg->plot = plot_scaled;
+		if (jpg->sampling == 1)
+			jpg->chroma_idct = jpg->idct;
+		if ((flags & DRI_DEFINED) && (jpg->threads > 1) && (!callback) && (width * height >= PARALLEL_MIN_PIXELS)) {
+			data = decode_parallel(jpg, bmp, pitch, mcu_w, mcu_h, blocks_in_mcu, block_component);
+			if (data < 0)
+				goto exit_error;
+			if (data == 0)
+				goto exit_ok;
+		}
 		/* Start decoding! */
 		do {
 			for (i = 0; i < blocks_in_mcu; i++) {
-				if (decode_baseline_block(block_ptr[i], (block_component[i] == 0) ? LUMINANCE : CHROMINANCE, &old_dc[block_component[i]]))
+				if (decode_baseline_block(jpg, &jpg->io, block_ptr[i], (block_component[i] == 0) ? LUMINANCE : CHROMINANCE, &old_dc[block_component[i]]))
 					goto exit_error;
 			}
-			addr = (int)bmp->line[block_y] + (block_x * (jpeg_components == 1 ? 1 : 3));
-			plot(addr, pitch, y1, y2, y3, y4, cb, cr);
+			addr = bmp->line[block_y >> jpg->scale] + ((block_x >> jpg->scale) * (jpg->jpeg_components == 1 ? 1 : 3));
+			jpg->plot(jpg, addr, pitch, y1, y2, y3, y4, cb, cr);
 			block_x += mcu_w;
-			if (block_x >= jpeg_w) {
+			if (block_x >= jpg->jpeg_w) {
 				block_x = 0;
 				block_y += mcu_h;
 			}
 			restart_count++;
-			if ((flags & DRI_DEFINED) && (restart_count >= restart_interval)) {
-				data = _jpeg_getw();
+			if ((flags & DRI_DEFINED) && (restart_count >= jpg->restart_interval)) {
+				data = _jpeg_getw(&jpg->io);
 				if (data == CHUNK_EOI)
 					break;
 				if ((data < CHUNK_RST0) || (data > CHUNK_RST7)) {
 					TRACE("Expected RSTx chunk not found, found 0x%X instead", data);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					goto exit_error;
 				}
 				memset(old_dc, 0, 3 * sizeof(int));
 				restart_count = 0;
 			}
-			if (progress_cb)
-				progress_cb((progress_counter * 100) / progress_total);
-			progress_counter++;
-		} while (block_y < jpeg_h);
+			if (jpg->progress_cb)
+				jpg->progress_cb((jpg->progress_counter * 100) / jpg->progress_total);
+			jpg->progress_counter++;
+		} while (block_y < jpg->jpeg_h);
 	}
 	else {
 		/* Progressive decoding */
 		TRACE("Starting progressive decoding");
-		blocks_per_row[0] = bmp->w / 8;
-		data_buffer[0] = (DATA_BUFFER *)calloc(1, sizeof(DATA_BUFFER) * (bmp->w / 8) * (bmp->h / 8));
-		if (!data_buffer[0]) {
+		blocks_per_row[0] = width / 8;
+		jpg->data_buffer[0] = (DATA_BUFFER *)calloc(1, sizeof(DATA_BUFFER) * (width / 8) * (height / 8));
+		if (!jpg->data_buffer[0]) {
 			TRACE("Out of memory");
-			jpgalleg_error = JPG_ERROR_OUT_OF_MEMORY;
+			jpg->io.error = JPG_ERROR_OUT_OF_MEMORY;
 			goto exit_error;
 		}
-		for (i = 1; i < jpeg_components; i++) {
-			blocks_per_row[i] = bmp->w / (h_sampling * 8);
+		for (i = 1; i < jpg->jpeg_components; i++) {
+			blocks_per_row[i] = width / (jpg->h_sampling * 8);
 			component_w[i] = component_h[i] = 1;
-			data_buffer[i] = (DATA_BUFFER *)calloc(1, sizeof(DATA_BUFFER) * (bmp->w / 8) * (bmp->h / 8) / sampling);
-			if (!data_buffer[i]) {
+			jpg->data_buffer[i] = (DATA_BUFFER *)calloc(1, sizeof(DATA_BUFFER) * (width / 8) * (height / 8) / jpg->sampling);
+			if (!jpg->data_buffer[i]) {
 				TRACE("Out of memory");
-				jpgalleg_error = JPG_ERROR_OUT_OF_MEMORY;
+				jpg->io.error = JPG_ERROR_OUT_OF_MEMORY;
 				goto exit_error;
 			}
 		}
 		
-		progress_total = (2 + (3 * jpeg_components)) * blocks_per_row[0] * (bmp->h / (v_sampling * 8));
+		jpg->progress_total = (2 + (3 * jpg->jpeg_components)) * blocks_per_row[0] * (height / (jpg->v_sampling * 8));
+		rows_done = scan = 0;
 		
-		TRACE("%dx%d image, %s mode", jpeg_w, jpeg_h, sampling == 1 ? "444" : (sampling == 2 ? "422" : "411"));
+		TRACE("%dx%d image, %s mode", jpg->jpeg_w, jpg->jpeg_h, jpg->sampling == 1 ? "444" : (jpg->sampling == 2 ? "422" : "411"));
 		while (1) {
 			/* Decode new scan */
-			if (((spectrum_start > spectrum_end) || (spectrum_end > 63)) ||
-					((spectrum_start == 0) && (spectrum_end != 0)) ||
-					((successive_high != 0) && (successive_high != successive_low + 1))) {
+			if (((jpg->spectrum_start > jpg->spectrum_end) || (jpg->spectrum_end > 63)) ||
+					((jpg->spectrum_start == 0) && (jpg->spectrum_end != 0)) ||
+					((jpg->successive_high != 0) && (jpg->successive_high != jpg->successive_low + 1))) {
 				TRACE("Bad progressive scan parameters");
-				jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+				jpg->io.error = JPG_ERROR_BAD_IMAGE;
 				goto exit_error;
 			}
 			restart_count = 0;
 			block_x = block_y = 0;
 			memset(old_dc, 0, 3 * sizeof(int));
+			last_scan = is_last_scan(&jpg->io);
 			/* Setup MCU layout for this scan */
 			blocks_in_mcu = 0;
 			mcu_w = mcu_h = 8;
-			for (i = 0; i < scan_components; i++) {
-				switch (component[i]) {
+			for (i = 0; i < jpg->scan_components; i++) {
+				switch (jpg->component[i]) {
 					case 1:
-						for (j = 0; j < sampling; j++) {
+						for (j = 0; j < jpg->sampling; j++) {
 							block_component[blocks_in_mcu] = 0;
 							block_x_ofs[blocks_in_mcu] = x_ofs[j];
 							block_y_ofs[blocks_in_mcu] = y_ofs[j];
 							blocks_in_mcu++;
 						}
-						if ((h_sampling == 1) && (v_sampling == 2)) {
+						if ((jpg->h_sampling == 1) && (jpg->v_sampling == 2)) {
 							block_x_ofs[1] = x_ofs[2];
 							block_y_ofs[1] = y_ofs[2];
 						}
@@ -1335,79 +1921,94 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 						
 					case 2:
 					case 3:
-						block_component[blocks_in_mcu] = component[i] - 1;
+						block_component[blocks_in_mcu] = jpg->component[i] - 1;
 						block_x_ofs[blocks_in_mcu] = 0;
 						block_y_ofs[blocks_in_mcu] = 0;
 						blocks_in_mcu++;
-						mcu_w = MAX(mcu_w, h_sampling * 8);
-						mcu_h = MAX(mcu_h, v_sampling * 8);
+						mcu_w = MAX(mcu_w, jpg->h_sampling * 8);
+						mcu_h = MAX(mcu_h, jpg->v_sampling * 8);
 						break;
 				}
 			}
-			block_max_x = (((jpeg_w + mcu_w - 1) & ~(mcu_w - 1)) / mcu_w);
-			block_max_y = (((jpeg_h + mcu_h - 1) & ~(mcu_h - 1)) / mcu_h);
+			block_max_x = (((jpg->jpeg_w + mcu_w - 1) & ~(mcu_w - 1)) / mcu_w);
+			block_max_y = (((jpg->jpeg_h + mcu_h - 1) & ~(mcu_h - 1)) / mcu_h);
 			/* Remove sampling dependency from luminance only scans */
-			if ((scan_components == 1) && (block_component[0] == 0)) {
+			if ((jpg->scan_components == 1) && (block_component[0] == 0)) {
 				blocks_in_mcu = 1;
 				component_w[0] = component_h[0] = 1;
 			}
 			else {
-				component_w[0] = h_sampling;
-				component_h[0] = v_sampling;
+				component_w[0] = jpg->h_sampling;
+				component_h[0] = jpg->v_sampling;
 			}
-			TRACE("Starting new scan (%s%s%s, %dx%d MCU)", _jpeg_component_name[component[0] - 1],
-				(scan_components > 1 ? _jpeg_component_name[component[1] - 1] : ""),
-				(scan_components > 2 ? _jpeg_component_name[component[2] - 1] : ""), mcu_w, mcu_h);
+			TRACE("Starting new scan (%s%s%s, %dx%d MCU)", _jpeg_component_name[jpg->component[0] - 1],
+				(jpg->scan_components > 1 ? _jpeg_component_name[jpg->component[1] - 1] : ""),
+				(jpg->scan_components > 2 ? _jpeg_component_name[jpg->component[2] - 1] : ""), mcu_w, mcu_h);
 			/* Start decoding! */
 			do {
-				restart_count++;
-				if ((flags & DRI_DEFINED) && (restart_count >= restart_interval)) {
-					data = _jpeg_getw();
+				if ((flags & DRI_DEFINED) && (restart_count >= jpg->restart_interval)) {
+					data = _jpeg_getw(&jpg->io);
 					if ((data < CHUNK_RST0) || (data > CHUNK_RST7)) {
 						TRACE("Expected RSTx chunk not found, found 0x%X instead", data);
-						jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+						jpg->io.error = JPG_ERROR_BAD_IMAGE;
 						goto exit_error;
 					}
 					memset(old_dc, 0, 3 * sizeof(int));
-					restart_count = skip_count = 0;
+					restart_count = jpg->skip_count = 0;
 				}
+				restart_count++;
 				for (i = 0; i < blocks_in_mcu; i++) {
 					c = block_component[i];
-					addr = (int)(data_buffer[c][((block_y * component_h[c]) * blocks_per_row[c]) + (block_y_ofs[i] * blocks_per_row[c]) + (block_x * component_w[c]) + block_x_ofs[i]].data);
-					if (decode_progressive_block(addr, (c == 0) ? LUMINANCE : CHROMINANCE, &old_dc[c]))
+					buffer = &jpg->data_buffer[c][((block_y * component_h[c]) * blocks_per_row[c]) + (block_y_ofs[i] * blocks_per_row[c]) + (block_x * component_w[c]) + block_x_ofs[i]];
+					if (decode_progressive_block(jpg, buffer, (c == 0) ? LUMINANCE : CHROMINANCE, &old_dc[c]))
 						goto exit_error;
 				}
 				block_x++;
 				if (block_x >= block_max_x) {
 					block_x = 0;
 					block_y++;
+					/* Rows left behind by the last scan are final */
+					if (last_scan) {
+						rows = block_y;
+						if ((jpg->scan_components == 1) && (block_component[0] == 0))
+							rows /= jpg->v_sampling;
+						if (rows > rows_done) {
+							plot_rows(jpg, bmp, rows_done, rows);
+							rows_done = rows;
+						}
+					}
 				}
-				if (progress_cb)
-					progress_cb((progress_counter * 100) / progress_total);
-				progress_counter++;
-				if (progress_counter > progress_total)
-					progress_total += (bmp->w / mcu_w) * (bmp->h / mcu_h);
+				if (jpg->progress_cb)
+					jpg->progress_cb((jpg->progress_counter * 100) / jpg->progress_total);
+				jpg->progress_counter++;
+				if (jpg->progress_counter > jpg->progress_total)
+					jpg->progress_total += (width / mcu_w) * (height / mcu_h);
 			} while (block_y < block_max_y);
+			scan++;
+			if ((jpg->scan_cb) && (!last_scan)) {
+				plot_rows(jpg, bmp, 0, height / (jpg->v_sampling * 8));
+				jpg->scan_cb(bmp, scan, jpg->scan_data);
+			}
 			/* Process inter-scan chunks */
 			while (1) {
-				while ((data = _jpeg_getc()) == 0xff)
+				while ((data = _jpeg_getc(&jpg->io)) == 0xff)
 					;
 				if (data == CHUNK_SOS) {
-					if (read_sos_chunk()) {
-						jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					if (read_sos_chunk(jpg)) {
+						jpg->io.error = JPG_ERROR_BAD_IMAGE;
 						goto exit_error;
 					}
 					break;
 				}
 				else if (data == CHUNK_DHT) {
-					if (read_dht_chunk()) {
-						jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					if (read_dht_chunk(jpg)) {
+						jpg->io.error = JPG_ERROR_BAD_IMAGE;
 						goto exit_error;
 					}
 				}
 				else if (data == CHUNK_DRI) {
-					if (read_dri_chunk()) {
-						jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					if (read_dri_chunk(jpg)) {
+						jpg->io.error = JPG_ERROR_BAD_IMAGE;
 						goto exit_error;
 					}
 				}
@@ -1415,90 +2016,23 @@ _jpeg_decode(RGB *pal, void (*callback)(int))
 					goto eoi_found;
 				else {
 					TRACE("Unexpected inter-scan chunk found (0xFF%X)", data);
-					jpgalleg_error = JPG_ERROR_BAD_IMAGE;
+					jpg->io.error = JPG_ERROR_BAD_IMAGE;
 					goto exit_error;
 				}
 			}
 		}
 eoi_found:
-		/* Apply idct and plot image */
-		component_w[0] = h_sampling;
-		component_h[0] = v_sampling;
-		mcu_w = h_sampling * 8;
-		mcu_h = v_sampling * 8;
-		blocks_in_mcu = sampling;
-		for (i = 0; i < sampling; i++) {
-			block_component[i] = 0;
-			block_x_ofs[i] = x_ofs[i];
-			block_y_ofs[i] = y_ofs[i];
-		}
-		if ((h_sampling == 1) && (v_sampling == 2)) {
-			block_x_ofs[1] = x_ofs[2];
-			block_y_ofs[1] = y_ofs[2];
-		}
-		for (i = 1; i < jpeg_components; i++) {
-			block_component[blocks_in_mcu] = i;
-			block_x_ofs[blocks_in_mcu] = 0;
-			block_y_ofs[blocks_in_mcu] = 0;
-			blocks_in_mcu++;
-		}
-		plot = plot_411;
-		if (sampling < 4) {
-			plot = plot_422_v;
-			if (h_sampling == 2)
-				plot = plot_422_h;
-			cb -= 128;
-			cr -= 128;
-			if (sampling < 2) {
-				plot = plot_444;
-				cb -= 64;
-				cr -= 64;
-			}
-		}
-		for (block_y = 0; block_y < bmp->h / mcu_h; block_y++) {
-			for (block_x = 0; block_x < bmp->w / mcu_w; block_x++) {
-				coefs_ptr = coefs_buffer;
-				for (i = 0; i < blocks_in_mcu; i++) {
-					c = block_component[i];
-					temp_ptr = data_buffer[c][(block_y * blocks_per_row[c] * component_h[c]) + (blocks_per_row[c] * block_y_ofs[i]) + (block_x * component_w[c]) + block_x_ofs[i]].data;
-					zigzag_reorder(temp_ptr, coefs);
-					idct(coefs, coefs_ptr, (c == 0) ? luminance_quantization_table : chrominance_quantization_table, workspace);
-					coefs_ptr += 64;
-				}
-				addr = (int)bmp->line[block_y * mcu_h] + (block_x * mcu_w * (jpeg_components == 1 ? 1 : 3));
-				plot(addr, pitch, y1, y2, y3, y4, cb, cr);
-			}
-		}
+		/* Plot what the last scan did not */
+		plot_rows(jpg, bmp, rows_done, height / (jpg->v_sampling * 8));
 	}
 
-	/* Fixup image depth and size */
-	if (jpeg_components == 1) {
-		for (i = 0; i < 256; i++)
-			pal[i].r = pal[i].g = pal[i].b = (i >> 2);
-		depth = _color_load_depth(8, FALSE);
-	}
-	else
-		depth = _color_load_depth(24, FALSE);
-	if (((jpeg_components == 1) && (depth != 8)) || ((jpeg_components != 1) && (depth != 24)))
-		bmp = _fixup_loaded_bitmap(bmp, pal, depth);
-	if (depth != 8)
-		generate_332_palette(pal);
-	/* Hack to set size; image may be really slightly bigger than reported.
-	 * We assume final user always to access data via line pointers and NEVER
-	 * assume data is linearly stored in memory starting at bmp->dat...
-	 */
-	bmp->w = bmp->cr = jpeg_w;
-	bmp->h = bmp->cb = jpeg_h;
-	
 exit_ok:
-	for (i = 0; i < jpeg_components; i++) {
-		if (data_buffer[i])
-			free(data_buffer[i]);
-	}
-	for (i = 0; i < 4; i++) {
-		free_huffman_table(&_jpeg_huffman_dc_table[i]);
-		free_huffman_table(&_jpeg_huffman_ac_table[i]);
+	for (i = 0; i < jpg->jpeg_components; i++) {
+		if (jpg->data_buffer[i])
+			free(jpg->data_buffer[i]);
 	}
+	if (jpg->wide_block)
+		free(jpg->wide_block);
 	
 	TRACE("################ Decode end ################");
 	
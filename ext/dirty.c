@@ -0,0 +1,206 @@
+/*******************************************************************************************
+
+ dirty.c
+
+ Dirty rectangle tracking: remembers which parts of a bitmap were drawn
+ to, so that only those need to be copied to the screen.
+
+*******************************************************************************************/
+
+#include "global.h"
+
+/* Beyond this many rectangles the new one is merged into the rectangle
+ * it grows least, which keeps the bookkeeping and the number of blits
+ * per present bounded.
+ */
+#define DIRTY_MAX_RECTS 32
+
+typedef struct Dirty
+{
+  BITMAP *bmp;
+  int num;
+  DIRTY_RECT rects[DIRTY_MAX_RECTS];
+  struct Dirty *next;
+} Dirty;
+
+/* Only a handful of bitmaps (back buffers) are ever tracked, so a list
+ * is enough. Drawing on untracked bitmaps stops at the NULL check.
+ */
+static Dirty *tracked = NULL;
+
+static Dirty *dirty_find(BITMAP *bmp) {
+  Dirty *d;
+
+  for (d = tracked; d; d = d->next) {
+    if (d->bmp == bmp)
+      return d;
+  }
+
+  return NULL;
+}
+
+static inline int touches(const DIRTY_RECT *a, const DIRTY_RECT *b) {
+  return a->x1 <= b->x2 + 1 && b->x1 <= a->x2 + 1 && a->y1 <= b->y2 + 1 && b->y1 <= a->y2 + 1;
+}
+
+static inline void merge(DIRTY_RECT *a, const DIRTY_RECT *b) {
+  a->x1 = MIN(a->x1, b->x1);
+  a->y1 = MIN(a->y1, b->y1);
+  a->x2 = MAX(a->x2, b->x2);
+  a->y2 = MAX(a->y2, b->y2);
+}
+
+static inline long area(const DIRTY_RECT *r) {
+  return (long) (r->x2 - r->x1 + 1) * (r->y2 - r->y1 + 1);
+}
+
+static void dirty_insert(Dirty *d, DIRTY_RECT r) {
+  DIRTY_RECT u;
+  long cost, best_cost;
+  int i, best;
+
+ again:
+  for (i = 0; i < d->num; ++i) {
+    if (touches(&r, &d->rects[i])) {
+      merge(&r, &d->rects[i]);
+      d->rects[i] = d->rects[--d->num];
+      goto again;
+    }
+  }
+
+  if (d->num == DIRTY_MAX_RECTS) {
+    best = 0;
+    best_cost = -1;
+    for (i = 0; i < d->num; ++i) {
+      u = r;
+      merge(&u, &d->rects[i]);
+      cost = area(&u) - area(&d->rects[i]);
+      if (best_cost < 0 || cost < best_cost) {
+	best = i;
+	best_cost = cost;
+      }
+    }
+    merge(&r, &d->rects[best]);
+    d->rects[best] = d->rects[--d->num];
+    goto again;
+  }
+
+  d->rects[d->num++] = r;
+}
+
+/**
+ * Starts or stops tracking the given bitmap. A bitmap starts out
+ * completely dirty.
+ */
+void dirty_track(BITMAP *bmp, int enable) {
+  Dirty *d = dirty_find(bmp);
+  Dirty **p;
+
+  if (enable && !d) {
+    d = (Dirty *) malloc(sizeof(Dirty));
+    d->bmp = bmp;
+    d->num = 0;
+    d->next = tracked;
+    tracked = d;
+    dirty_add(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+  }
+  else if (!enable && d) {
+    for (p = &tracked; *p != d; p = &(*p)->next)
+      ;
+    *p = d->next;
+    free(d);
+  }
+}
+
+int dirty_tracking(BITMAP *bmp) {
+  return dirty_find(bmp) != NULL;
+}
+
+/**
+ * Marks the rectangle from (x1, y1) to (x2, y2) inclusive as changed.
+ * The corners may come in any order; the rectangle is clipped to the
+ * bitmap and its clipping rectangle.
+ */
+void dirty_add(BITMAP *bmp, int x1, int y1, int x2, int y2) {
+  DIRTY_RECT r;
+  Dirty *d;
+
+  if (!tracked || !(d = dirty_find(bmp)))
+    return;
+
+  r.x1 = MIN(x1, x2);
+  r.y1 = MIN(y1, y2);
+  r.x2 = MAX(x1, x2);
+  r.y2 = MAX(y1, y2);
+
+  if (bmp->clip) {
+    r.x1 = MAX(r.x1, bmp->cl);
+    r.y1 = MAX(r.y1, bmp->ct);
+    r.x2 = MIN(r.x2, bmp->cr - 1);
+    r.y2 = MIN(r.y2, bmp->cb - 1);
+  }
+  else {
+    r.x1 = MAX(r.x1, 0);
+    r.y1 = MAX(r.y1, 0);
+    r.x2 = MIN(r.x2, bmp->w - 1);
+    r.y2 = MIN(r.y2, bmp->h - 1);
+  }
+
+  if (r.x1 > r.x2 || r.y1 > r.y2)
+    return;
+
+  dirty_insert(d, r);
+}
+
+/**
+ * Returns the changed rectangles of the bitmap and their number, or
+ * -1 if the bitmap is not tracked.
+ */
+int dirty_rects(BITMAP *bmp, const DIRTY_RECT **rects) {
+  Dirty *d = dirty_find(bmp);
+
+  if (!d)
+    return -1;
+
+  *rects = d->rects;
+  return d->num;
+}
+
+void dirty_clear(BITMAP *bmp) {
+  Dirty *d = dirty_find(bmp);
+
+  if (d)
+    d->num = 0;
+}
+
+/**
+ * Blits the changed rectangles of bmp to dst, with the top left corner
+ * of bmp at (x, y), and clears them. Untracked bitmaps are blitted
+ * completely. Returns the number of rectangles copied.
+ */
+int dirty_present(BITMAP *bmp, BITMAP *dst, int x, int y) {
+  Dirty *d = dirty_find(bmp);
+  DIRTY_RECT *r;
+  int i;
+
+  if (!d) {
+    blit(bmp, dst, 0, 0, x, y, bmp->w, bmp->h);
+    dirty_add(dst, x, y, x + bmp->w - 1, y + bmp->h - 1);
+    return 1;
+  }
+
+  if (d->num > 0) {
+    acquire_bitmap(dst);
+    for (i = 0; i < d->num; ++i) {
+      r = &d->rects[i];
+      blit(bmp, dst, r->x1, r->y1, x + r->x1, y + r->y1, r->x2 - r->x1 + 1, r->y2 - r->y1 + 1);
+      dirty_add(dst, x + r->x1, y + r->y1, x + r->x2, y + r->y2);
+    }
+    release_bitmap(dst);
+  }
+
+  i = d->num;
+  d->num = 0;
+
+  return i;
+}
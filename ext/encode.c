@@ -19,6 +19,7 @@
 
 
 #include <internal.h>
+#include "thread.h"
 
 
 /* Standard quantization tables for luminance and chrominance. Scaled version
@@ -113,17 +114,29 @@ static const unsigned char default_val_ac_chrominance[] = {
 };
 
 
-static unsigned char *num_codes_dc_luminance, *val_dc_luminance;
-static unsigned char *num_codes_dc_chrominance, *val_dc_chrominance;
-static unsigned char *num_codes_ac_luminance, *val_ac_luminance;
-static unsigned char *num_codes_ac_chrominance, *val_ac_chrominance;
-static int luminance_quant_table[64];
-static int chrominance_quant_table[64];
-static int current_pass, progress_counter, progress_total;
-static int sampling, greyscale, mcu_w, mcu_h, pitch;
-static BITMAP *fixed_bmp;
-static void (*rgb2ycbcr)(int address, short *y1, short *cb1, short *cr1, short *y2, short *cb2, short *cr2);
-static void (*progress_cb)(int percentage);
+
+
+
+/* Images at least this large, encoded with more than one thread, are cut
+ * into restart intervals of one MCU row each, which the threads encode at
+ * once. The output is the same for any number of threads above one.
+ */
+#define PARALLEL_MIN_PIXELS	(512 * 512)
+
+
+/* A band of consecutive MCU rows, encoded into an output buffer of its own
+ * and with huffman code frequencies of its own. As every row is a restart
+ * interval, the output of the bands is simply put one after the other.
+ */
+typedef struct ENCODE_BAND
+{
+	JPEG_ENCODER *jpg;
+	IO_BUFFER *io;
+	IO_BUFFER own_io;
+	int first_row, last_row;
+	int count[2][2][257];	/* [luminance, chrominance][dc, ac][value] */
+	int error;
+} ENCODE_BAND;
 
 
 
@@ -257,7 +270,7 @@ zigzag_reorder(short *input, short *output)
  *  output stream.
  */
 static void
-write_quantization_table(int *quant_table, const unsigned char *data, int quality)
+write_quantization_table(JPEG_ENCODER *jpg, int *quant_table, const unsigned char *data, int quality)
 {
 	short temp[64], temp_table[64];
 	double value, factor = QUALITY_FACTOR(quality);
@@ -272,7 +285,7 @@ write_quantization_table(int *quant_table, const unsigned char *data, int qualit
 	}
 	zigzag_reorder(temp, temp_table);
 	for (i = 0; i < 64; i++) {
-		_jpeg_chunk_putc(temp_table[i]);
+		_jpeg_chunk_putc(&jpg->io, temp_table[i]);
 		quant_table[i] = (1 << 16) / (int)temp_table[i];
 	}
 }
@@ -501,13 +514,13 @@ build_huffman_table(HUFFMAN_TABLE *table, unsigned char *num_codes, unsigned cha
  *  for faster huffman encoding.
  */
 static void
-write_huffman_table(HUFFMAN_TABLE *table, unsigned const char *num_codes, unsigned const char *value)
+write_huffman_table(JPEG_ENCODER *jpg, HUFFMAN_TABLE *table, unsigned const char *num_codes, unsigned const char *value)
 {
 	HUFFMAN_ENTRY *entry;
 	int i, j, code, index;
 	
 	for (i = 1; i <= 16; i++)
-		_jpeg_chunk_putc(num_codes[i]);
+		_jpeg_chunk_putc(&jpg->io, num_codes[i]);
 	memset(table, 0, sizeof(HUFFMAN_TABLE));
 	index = code = 0;
 	entry = table->entry;
@@ -516,7 +529,7 @@ write_huffman_table(HUFFMAN_TABLE *table, unsigned const char *num_codes, unsign
 			entry->value = value[index];
 			entry->encoded_value = code;
 			entry->bits_length = i;
-			_jpeg_chunk_putc(value[index]);
+			_jpeg_chunk_putc(&jpg->io, value[index]);
 			table->code[entry->value] = entry;
 			entry++;
 			code++;
@@ -533,74 +546,81 @@ write_huffman_table(HUFFMAN_TABLE *table, unsigned const char *num_codes, unsign
  *  DHT, SOS.
  */
 static int
-write_header(int sampling, int greyscale, int quality, int width, int height)
+write_header(JPEG_ENCODER *jpg, int quality, int width, int height)
 {
 	char *comment = "Generated using " JPGALLEG_VERSION_STRING;
 	/* JFIF 1.1, no units, 1:1 aspect ratio, no thumbnail */
 	unsigned char app0[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
 	/* 8 bits data precision, Y uses quantization table 0, Cb and Cr table 1 */
-	unsigned char sof0[] = { 8, (height >> 8) & 0xff, height & 0xff, (width >> 8) & 0xff, width & 0xff, greyscale ? 1 : 3, 1, 0, 0, 2, 0x11, 1, 3, 0x11, 1 };
+	unsigned char sof0[] = { 8, (height >> 8) & 0xff, height & 0xff, (width >> 8) & 0xff, width & 0xff, jpg->greyscale ? 1 : 3, 1, 0, 0, 2, 0x11, 1, 3, 0x11, 1 };
 	/* Y uses DC table 0 and AC table 0, Cb and Cr use DC table 1 and AC table 1 */
 	unsigned char sos_greyscale[] = { 1, 1, 0x00, 0, 63, 0 };
 	unsigned char sos_color[] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
 	
-	_jpeg_putw(CHUNK_SOI);
+	_jpeg_putw(&jpg->io, CHUNK_SOI);
 	
 	/* APP0 chunk */
-	_jpeg_new_chunk(CHUNK_APP0);
-	_jpeg_chunk_puts(app0, 14);
-	_jpeg_write_chunk();
+	_jpeg_new_chunk(&jpg->io, CHUNK_APP0);
+	_jpeg_chunk_puts(&jpg->io, app0, 14);
+	_jpeg_write_chunk(&jpg->io);
 	
 	/* COM chunk ;) */
-	_jpeg_new_chunk(CHUNK_COM);
-	_jpeg_chunk_puts(comment, strlen(comment));
-	_jpeg_write_chunk();
+	_jpeg_new_chunk(&jpg->io, CHUNK_COM);
+	_jpeg_chunk_puts(&jpg->io, comment, strlen(comment));
+	_jpeg_write_chunk(&jpg->io);
 	
 	/* DQT chunk */
-	_jpeg_new_chunk(CHUNK_DQT);
-	_jpeg_chunk_putc(0);
-	write_quantization_table(luminance_quant_table, default_luminance_quant_table, quality);
-	if (!greyscale) {
-		_jpeg_chunk_putc(1);
-		write_quantization_table(chrominance_quant_table, default_chrominance_quant_table, quality);
+	_jpeg_new_chunk(&jpg->io, CHUNK_DQT);
+	_jpeg_chunk_putc(&jpg->io, 0);
+	write_quantization_table(jpg, jpg->luminance_quant_table, default_luminance_quant_table, quality);
+	if (!jpg->greyscale) {
+		_jpeg_chunk_putc(&jpg->io, 1);
+		write_quantization_table(jpg, jpg->chrominance_quant_table, default_chrominance_quant_table, quality);
 	}
-	_jpeg_write_chunk();
+	_jpeg_write_chunk(&jpg->io);
 	
 	/* SOF0 chunk */
-	if (greyscale)
+	if (jpg->greyscale)
 		sof0[7] = 0x11;
 	else {
-		switch (sampling) {
+		switch (jpg->sampling) {
 			case JPG_SAMPLING_411: sof0[7] = 0x22; break;
 			case JPG_SAMPLING_422: sof0[7] = 0x21; break;
 			case JPG_SAMPLING_444: sof0[7] = 0x11; break;
 		}
 	}
-	_jpeg_new_chunk(CHUNK_SOF0);
-	_jpeg_chunk_puts(sof0, greyscale ? 9 : 15);
-	_jpeg_write_chunk();
+	_jpeg_new_chunk(&jpg->io, CHUNK_SOF0);
+	_jpeg_chunk_puts(&jpg->io, sof0, jpg->greyscale ? 9 : 15);
+	_jpeg_write_chunk(&jpg->io);
 	
 	/* DHT chunk */
-	_jpeg_new_chunk(CHUNK_DHT);
-	_jpeg_chunk_putc(0x00);		/* DC huffman table 0 (used for luminance) */
-	write_huffman_table(&_jpeg_huffman_dc_table[0], num_codes_dc_luminance, val_dc_luminance);
-	_jpeg_chunk_putc(0x10);		/* AC huffman table 0 (used for luminance) */
-	write_huffman_table(&_jpeg_huffman_ac_table[0], num_codes_ac_luminance, val_ac_luminance);
-	if (!greyscale) {
-		_jpeg_chunk_putc(0x01);		/* DC huffman table 1 (used for chrominance) */
-		write_huffman_table(&_jpeg_huffman_dc_table[1], num_codes_dc_chrominance, val_dc_chrominance);
-		_jpeg_chunk_putc(0x11);		/* AC huffman table 1 (used for chrominance) */
-		write_huffman_table(&_jpeg_huffman_ac_table[1], num_codes_ac_chrominance, val_ac_chrominance);
-	}
-	_jpeg_write_chunk();
+	_jpeg_new_chunk(&jpg->io, CHUNK_DHT);
+	_jpeg_chunk_putc(&jpg->io, 0x00);		/* DC huffman table 0 (used for luminance) */
+	write_huffman_table(jpg, &jpg->huffman_dc_table[0], jpg->num_codes_dc_luminance, jpg->val_dc_luminance);
+	_jpeg_chunk_putc(&jpg->io, 0x10);		/* AC huffman table 0 (used for luminance) */
+	write_huffman_table(jpg, &jpg->huffman_ac_table[0], jpg->num_codes_ac_luminance, jpg->val_ac_luminance);
+	if (!jpg->greyscale) {
+		_jpeg_chunk_putc(&jpg->io, 0x01);		/* DC huffman table 1 (used for chrominance) */
+		write_huffman_table(jpg, &jpg->huffman_dc_table[1], jpg->num_codes_dc_chrominance, jpg->val_dc_chrominance);
+		_jpeg_chunk_putc(&jpg->io, 0x11);		/* AC huffman table 1 (used for chrominance) */
+		write_huffman_table(jpg, &jpg->huffman_ac_table[1], jpg->num_codes_ac_chrominance, jpg->val_ac_chrominance);
+	}
+	_jpeg_write_chunk(&jpg->io);
+	
+	/* DRI chunk */
+	if (jpg->restart_interval) {
+		_jpeg_new_chunk(&jpg->io, CHUNK_DRI);
+		_jpeg_chunk_putw(&jpg->io, jpg->restart_interval);
+		_jpeg_write_chunk(&jpg->io);
+	}
 	
 	/* SOS chunk */
-	_jpeg_new_chunk(CHUNK_SOS);
-	if (greyscale)
-		_jpeg_chunk_puts(sos_greyscale, 6);
+	_jpeg_new_chunk(&jpg->io, CHUNK_SOS);
+	if (jpg->greyscale)
+		_jpeg_chunk_puts(&jpg->io, sos_greyscale, 6);
 	else
-		_jpeg_chunk_puts(sos_color, 10);
-	_jpeg_write_chunk();
+		_jpeg_chunk_puts(&jpg->io, sos_color, 10);
+	_jpeg_write_chunk(&jpg->io);
 	
 	return 0;
 }
@@ -631,12 +651,12 @@ format_number(int num, int *category, int *bits)
  *   Writes some bits to the output stream.
  */
 static INLINE int
-put_bits(int value, int num_bits)
+put_bits(IO_BUFFER *io, int value, int num_bits)
 {
 	int i;
 
 	for (i = num_bits - 1; i >= 0; i--) {
-		if (_jpeg_put_bit((value >> i) & 0x1))
+		if (_jpeg_put_bit(io, (value >> i) & 0x1))
 			return -1;
 	}
 	return 0;
@@ -644,53 +664,57 @@ put_bits(int value, int num_bits)
 
 
 /* huffman_encode:
- *  Writes the huffman code of a given value.
+ *  Writes the huffman code of a given value, or just counts it during the
+ *  first pass of optimized encoding.
  */
 static INLINE int
-huffman_encode(HUFFMAN_TABLE *table, int value)
+huffman_encode(ENCODE_BAND *band, HUFFMAN_TABLE *table, int *count, int value)
 {
 	HUFFMAN_ENTRY *entry;
 	
-	if (current_pass == PASS_COMPUTE_HUFFMAN) {
-		table->entry[value].value = value;
-		table->entry[value].frequency++;
+	if (band->jpg->current_pass == PASS_COMPUTE_HUFFMAN) {
+		count[value]++;
 		return 0;
 	}
 	entry = table->code[value];
 	if (entry)
-		return put_bits(entry->encoded_value, entry->bits_length);
+		return put_bits(band->io, entry->encoded_value, entry->bits_length);
 	TRACE("Huffman code (%d) not found", value);
-	jpgalleg_error = JPG_ERROR_HUFFMAN;
+	band->io->error = JPG_ERROR_HUFFMAN;
 	return -1;
 }
 
 
 /* encode_block:
  *  Encodes an 8x8 basic block of coefficients of given type (luminance or
- *  chrominance) and writes it to the output stream.
+ *  chrominance) and writes it to the output stream of the band.
  */
 static int
-encode_block(short *block, int type, int *old_dc)
+encode_block(ENCODE_BAND *band, short *block, int type, int *old_dc)
 {
+	JPEG_ENCODER *jpg = band->jpg;
 	HUFFMAN_TABLE *dc_table, *ac_table;
-	int *quant_table;
+	int *quant_table, *dc_count, *ac_count;
+	int write = (jpg->current_pass == PASS_WRITE);
 	short data[64];
 	int i, index;
 	int value, num_zeroes;
 	int category, bits;
 	
 	if (type == LUMINANCE) {
-		dc_table = &_jpeg_huffman_dc_table[0];
-		ac_table = &_jpeg_huffman_ac_table[0];
-		quant_table = luminance_quant_table;
+		dc_table = &jpg->huffman_dc_table[0];
+		ac_table = &jpg->huffman_ac_table[0];
+		quant_table = jpg->luminance_quant_table;
 	}
 	else {
-		dc_table = &_jpeg_huffman_dc_table[1];
-		ac_table = &_jpeg_huffman_ac_table[1];
-		quant_table = chrominance_quant_table;
+		dc_table = &jpg->huffman_dc_table[1];
+		ac_table = &jpg->huffman_ac_table[1];
+		quant_table = jpg->chrominance_quant_table;
 	}
+	dc_count = band->count[type][0];
+	ac_count = band->count[type][1];
 	
-	apply_fdct(block);
+	jpg->fdct(block);
 	
 	zigzag_reorder(block, data);
 
@@ -708,9 +732,9 @@ encode_block(short *block, int type, int *old_dc)
 	value = data[0] - *old_dc;
 	*old_dc = data[0];
 	format_number(value, &category, &bits);
-	if (huffman_encode(dc_table, category))
+	if (huffman_encode(band, dc_table, dc_count, category))
 		return -1;
-	if (put_bits(bits, category))
+	if (write && put_bits(band->io, bits, category))
 		return -1;
 
 	num_zeroes = 0;
@@ -719,21 +743,21 @@ encode_block(short *block, int type, int *old_dc)
 			num_zeroes++;
 		else {
 			while (num_zeroes > 15) {
-				if (huffman_encode(ac_table, 0xf0))
+				if (huffman_encode(band, ac_table, ac_count, 0xf0))
 					return -1;
 				num_zeroes -= 16;
 			}
 			format_number(value, &category, &bits);
 			value = (num_zeroes << 4) | category;
-			if (huffman_encode(ac_table, value))
+			if (huffman_encode(band, ac_table, ac_count, value))
 				return -1;
-			if (put_bits(bits, category))
+			if (write && put_bits(band->io, bits, category))
 				return -1;
 			num_zeroes = 0;
 		}
 	}
 	if (num_zeroes > 0) {
-		if (huffman_encode(ac_table, 0x00))
+		if (huffman_encode(band, ac_table, ac_count, 0x00))
 			return -1;
 	}
 	
@@ -746,7 +770,7 @@ encode_block(short *block, int type, int *old_dc)
  *  at a time.
  */
 static void
-_jpeg_c_rgb2ycbcr(int addr, short *y1, short *cb1, short *cr1, short *y2, short *cb2, short *cr2)
+_jpeg_c_rgb2ycbcr(unsigned char *addr, short *y1, short *cb1, short *cr1, short *y2, short *cb2, short *cr2)
 {
 	int r, g, b;
 	unsigned int *ptr = (unsigned int *)addr;
@@ -766,46 +790,61 @@ _jpeg_c_rgb2ycbcr(int addr, short *y1, short *cb1, short *cr1, short *y2, short
 }
 
 
-/* encode_pass:
- *  Main encoding function. Can be used one time for unoptimized encoding,
- *  or two times for optimized encoding (first pass to gather sample
- *  frequencies to generate optimized huffman tables, second pass to
- *  actually write encoded image).
+/* _jpeg_c_rgb2ycbcr_row:
+ *  Converts a row of width pixels, a multiple of 8, through jpg->rgb2ycbcr.
+ */
+static void
+_jpeg_c_rgb2ycbcr_row(JPEG_ENCODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int width)
+{
+	int x;
+	
+	for (x = 0; x < width; x += 2) {
+		jpg->rgb2ycbcr(addr, y, cb, cr, y + 1, cb + 1, cr + 1);
+		y += 2;
+		cb += 2;
+		cr += 2;
+		addr += 8;
+	}
+}
+
+
+/* encode_rows:
+ *  Encodes the MCU rows of a band. With restart markers each row starts
+ *  from fresh DC predictions and ends on a byte boundary, so it makes no
+ *  difference which band, or thread, encodes it.
  */
 static int
-encode_pass(BITMAP *bmp, int quality)
+encode_rows(ENCODE_BAND *band)
 {
+	JPEG_ENCODER *jpg = band->jpg;
 	short y_buf[256], cb_buf[256], cr_buf[256];
 	short y4[256], cb[64], cr[64], y_blocks_per_mcu;
 	short *y_ptr, *cb_ptr, *cr_ptr;
 	int dc_y, dc_cb, dc_cr;
-	int block_x, block_y, x, y, i, addr;
-	
-	_jpeg_io.buffer = _jpeg_io.buffer_start;
-	
-	if (write_header(sampling, greyscale, quality, bmp->w, bmp->h))
-		return -1;
+	int write = (jpg->current_pass == PASS_WRITE);
+	int row, block_x, block_y, x, y, i;
 	
 	dc_y = dc_cb = dc_cr = 0;
 	
-	for (block_y = 0; block_y < bmp->h; block_y += mcu_h) {
-		for (block_x = 0; block_x < bmp->w; block_x += mcu_w) {
-			addr = (int)fixed_bmp->line[block_y] + (block_x * 4);
+	for (row = band->first_row; row < band->last_row; row++) {
+		if ((jpg->restart_interval) && (row > 0)) {
+			dc_y = dc_cb = dc_cr = 0;
+			if (write)
+				_jpeg_putw(band->io, CHUNK_RST0 + ((row - 1) & 7));
+		}
+		block_y = row * jpg->mcu_h;
+		for (block_x = 0; block_x < jpg->fixed_bmp->w; block_x += jpg->mcu_w) {
 			y_ptr = y_buf;
 			cb_ptr = cb_buf;
 			cr_ptr = cr_buf;
-			for (y = 0; y < mcu_h; y++) {
-				for (x = 0; x < mcu_w; x += 2) {
-					rgb2ycbcr(addr, y_ptr, cb_ptr, cr_ptr, y_ptr + 1, cb_ptr + 1, cr_ptr + 1);
-					y_ptr += 2;
-					cb_ptr += 2;
-					cr_ptr += 2;
-					addr += 8;
-				}
-				addr += pitch;
+			for (y = 0; y < jpg->mcu_h; y++) {
+				jpg->rgb2ycbcr_row(jpg, jpg->fixed_bmp->line[block_y + y] + (block_x * 4), y_ptr, cb_ptr, cr_ptr, jpg->mcu_w);
+				y_ptr += jpg->mcu_w;
+				cb_ptr += jpg->mcu_w;
+				cr_ptr += jpg->mcu_w;
 			}
-			if (mcu_w > 8) {
-				if (mcu_h > 8) {
+			if (jpg->mcu_w > 8) {
+				if (jpg->mcu_h > 8) {
 					/* 411 subsampling */
 					for (y = 0; y < 8; y++) for (x = 0; x < 8; x++) {
 						cb[(y << 3) | x] = (cb_buf[(y << 5) | (x << 1)] + cb_buf[(y << 5) | (x << 1) | 1] +
@@ -841,23 +880,140 @@ encode_pass(BITMAP *bmp, int quality)
 				y_blocks_per_mcu = 1;
 			}
 			for (i = 0; i < y_blocks_per_mcu; i++) {
-				if (encode_block(y_ptr, LUMINANCE, &dc_y))
+				if (encode_block(band, y_ptr, LUMINANCE, &dc_y))
 					return -1;
 				y_ptr += 64;
 			}
-			if (!greyscale) {
-				if (encode_block(cb_ptr, CHROMINANCE, &dc_cb) ||
-				    encode_block(cr_ptr, CHROMINANCE, &dc_cr))
+			if (!jpg->greyscale) {
+				if (encode_block(band, cb_ptr, CHROMINANCE, &dc_cb) ||
+				    encode_block(band, cr_ptr, CHROMINANCE, &dc_cr))
 					return -1;
 			}
-			if (progress_cb)
-				progress_cb((progress_counter * 100) / progress_total);
-			progress_counter++;
+			if (jpg->progress_cb) {
+				jpg->progress_cb((jpg->progress_counter * 100) / jpg->progress_total);
+				jpg->progress_counter++;
+			}
+		}
+		if ((jpg->restart_interval) && (write))
+			_jpeg_flush_bits(band->io);
+	}
+	
+	return 0;
+}
+
+
+/* encode_band:
+ *  parallel_run() worker encoding one band.
+ */
+static void
+encode_band(void *data, int index)
+{
+	ENCODE_BAND *band = &((ENCODE_BAND *)data)[index];
+	
+	if (encode_rows(band))
+		band->error = band->io->error ? band->io->error : JPG_ERROR_HUFFMAN;
+}
+
+
+/* add_counts:
+ *  Adds the code frequencies gathered by a band to a huffman table.
+ */
+static void
+add_counts(HUFFMAN_TABLE *table, int *count)
+{
+	int i;
+	
+	for (i = 0; i < 257; i++) {
+		if (count[i]) {
+			table->entry[i].value = i;
+			table->entry[i].frequency += count[i];
+		}
+	}
+}
+
+
+/* encode_pass:
+ *  Main encoding function. Can be used one time for unoptimized encoding,
+ *  or two times for optimized encoding (first pass to gather sample
+ *  frequencies to generate optimized huffman tables, second pass to
+ *  actually write encoded image).
+ *  Images with restart markers are split in bands of rows encoded on
+ *  jpg->threads threads.
+ */
+static int
+encode_pass(JPEG_ENCODER *jpg, BITMAP *bmp, int quality)
+{
+	ENCODE_BAND *bands;
+	unsigned char *p;
+	int rows, count, size, i, result = 0;
+	
+	jpg->io.buffer = jpg->io.buffer_start;
+	
+	if (write_header(jpg, quality, bmp->w, bmp->h))
+		return -1;
+	
+	rows = jpg->fixed_bmp->h / jpg->mcu_h;
+	count = jpg->restart_interval ? MIN(rows, jpg->threads * 4) : 1;
+	
+	bands = (ENCODE_BAND *)calloc(count, sizeof(ENCODE_BAND));
+	if (!bands) {
+		TRACE("Out of memory");
+		jpg->io.error = JPG_ERROR_OUT_OF_MEMORY;
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		bands[i].jpg = jpg;
+		bands[i].first_row = (rows * i) / count;
+		bands[i].last_row = (rows * (i + 1)) / count;
+		bands[i].io = &jpg->io;
+		if ((count > 1) && (jpg->current_pass == PASS_WRITE)) {
+			/* About two bits per pixel, as for the whole image */
+			size = ((jpg->fixed_bmp->w * jpg->mcu_h * (bands[i].last_row - bands[i].first_row)) / 4) + 1024;
+			bands[i].own_io.buffer = bands[i].own_io.buffer_start = (unsigned char *)malloc(size);
+			bands[i].own_io.buffer_end = bands[i].own_io.buffer_start + size;
+			bands[i].own_io.current_bit = 7;
+			bands[i].own_io.growable = TRUE;
+			bands[i].io = &bands[i].own_io;
+			if (!bands[i].own_io.buffer_start)
+				bands[i].error = JPG_ERROR_OUT_OF_MEMORY;
+		}
+	}
+	
+	if (count > 1) {
+		TRACE("Encoding %d bands on %d threads", count, jpg->threads);
+		for (i = 0; (i < count) && (!bands[i].error); i++)
+			;
+		if (i == count)
+			parallel_run(count, jpg->threads, encode_band, bands);
+	}
+	else
+		encode_band(bands, 0);
+	
+	for (i = 0; i < count; i++) {
+		if ((bands[i].error) && (!result)) {
+			jpg->io.error = bands[i].error;
+			result = -1;
+		}
+		if (jpg->current_pass == PASS_COMPUTE_HUFFMAN) {
+			add_counts(&jpg->huffman_dc_table[0], bands[i].count[LUMINANCE][0]);
+			add_counts(&jpg->huffman_ac_table[0], bands[i].count[LUMINANCE][1]);
+			add_counts(&jpg->huffman_dc_table[1], bands[i].count[CHROMINANCE][0]);
+			add_counts(&jpg->huffman_ac_table[1], bands[i].count[CHROMINANCE][1]);
+		}
+		if (bands[i].io != &jpg->io) {
+			for (p = bands[i].own_io.buffer_start; (!result) && (p < bands[i].own_io.buffer); p++) {
+				if (_jpeg_putc(&jpg->io, *p))
+					result = -1;
+			}
+			free(bands[i].own_io.buffer_start);
 		}
 	}
+	free(bands);
+	if (result)
+		return -1;
 	
-	_jpeg_flush_bits();
-	_jpeg_putw(CHUNK_EOI);
+	_jpeg_flush_bits(&jpg->io);
+	_jpeg_putw(&jpg->io, CHUNK_EOI);
 	
 	return 0;
 }
@@ -867,90 +1023,94 @@ encode_pass(BITMAP *bmp, int quality)
  *  Encodes specified image in JPG format.
  */
 int
-_jpeg_encode(BITMAP *bmp, AL_CONST RGB *pal, int quality, int flags, void (*callback)(int))
+_jpeg_encode(JPEG_ENCODER *jpg, BITMAP *bmp, AL_CONST RGB *pal, int quality, int flags, void (*callback)(int))
 {
 	unsigned char *tables = NULL;
 	int i, result = -1;
 	
-	jpgalleg_error = JPG_ERROR_NONE;
+	jpg->io.error = JPG_ERROR_NONE;
 	
 	TRACE("############### Encode start ###############");
 	
 #ifdef JPGALLEG_MMX
 	if (cpu_capabilities & CPU_MMX) {
 		if (_rgb_r_shift_32 == 0)
-			rgb2ycbcr = _jpeg_mmx_rgb2ycbcr;
+			jpg->rgb2ycbcr = _jpeg_mmx_rgb2ycbcr;
 		else if (_rgb_r_shift_32 == 16)
-			rgb2ycbcr = _jpeg_mmx_bgr2ycbcr;
+			jpg->rgb2ycbcr = _jpeg_mmx_bgr2ycbcr;
 		else
-			rgb2ycbcr = _jpeg_c_rgb2ycbcr;
+			jpg->rgb2ycbcr = _jpeg_c_rgb2ycbcr;
 	}
 	else
 #endif
-	rgb2ycbcr = _jpeg_c_rgb2ycbcr;
+	jpg->rgb2ycbcr = _jpeg_c_rgb2ycbcr;
+	jpg->rgb2ycbcr_row = _jpeg_c_rgb2ycbcr_row;
+	jpg->fdct = apply_fdct;
+	_jpeg_simd_encoder(jpg);
 	
 	quality = MID(1, quality, 100);
-	sampling = flags & 0xf;
-	if ((sampling != JPG_SAMPLING_411) && (sampling != JPG_SAMPLING_422) && (sampling != JPG_SAMPLING_444)) {
+	jpg->sampling = flags & 0xf;
+	if ((jpg->sampling != JPG_SAMPLING_411) && (jpg->sampling != JPG_SAMPLING_422) && (jpg->sampling != JPG_SAMPLING_444)) {
 		TRACE("Unknown sampling specified in flags parameter");
 		return -1;
 	}
-	greyscale = flags & JPG_GREYSCALE;
-	if (greyscale)
-		sampling = JPG_SAMPLING_444;
+	jpg->greyscale = flags & JPG_GREYSCALE;
+	if (jpg->greyscale)
+		jpg->sampling = JPG_SAMPLING_444;
 	
-	mcu_w = 8 * (sampling == JPG_SAMPLING_444 ? 1 : 2);
-	mcu_h = 8 * (sampling != JPG_SAMPLING_411 ? 1 : 2);
+	jpg->mcu_w = 8 * (jpg->sampling == JPG_SAMPLING_444 ? 1 : 2);
+	jpg->mcu_h = 8 * (jpg->sampling != JPG_SAMPLING_411 ? 1 : 2);
 	
-	fixed_bmp = create_bitmap_ex(32, (bmp->w + mcu_w - 1) & ~(mcu_w - 1), (bmp->h + mcu_h - 1) & ~(mcu_h - 1));
-	if (!fixed_bmp) {
+	jpg->fixed_bmp = create_bitmap_ex(32, (bmp->w + jpg->mcu_w - 1) & ~(jpg->mcu_w - 1), (bmp->h + jpg->mcu_h - 1) & ~(jpg->mcu_h - 1));
+	if (!jpg->fixed_bmp) {
 		TRACE("Out of memory");
 		return -1;
 	}
 	if (pal)
 		select_palette(pal);
-	blit(bmp, fixed_bmp, 0, 0, 0, 0, bmp->w, bmp->h);
+	blit(bmp, jpg->fixed_bmp, 0, 0, 0, 0, bmp->w, bmp->h);
 	if (pal)
 		unselect_palette();
-	for (i = bmp->w; i < fixed_bmp->w; i++)
-		blit(fixed_bmp, fixed_bmp, bmp->w - 1, 0, i, 0, 1, bmp->h);
-	for (i = bmp->h; i < fixed_bmp->h; i++)
-		blit(fixed_bmp, fixed_bmp, 0, bmp->h - 1, 0, i, fixed_bmp->w, 1);
-	pitch = (int)(fixed_bmp->line[1] - fixed_bmp->line[0]) - (mcu_w * 4);
+	for (i = bmp->w; i < jpg->fixed_bmp->w; i++)
+		blit(jpg->fixed_bmp, jpg->fixed_bmp, bmp->w - 1, 0, i, 0, 1, bmp->h);
+	for (i = bmp->h; i < jpg->fixed_bmp->h; i++)
+		blit(jpg->fixed_bmp, jpg->fixed_bmp, 0, bmp->h - 1, 0, i, jpg->fixed_bmp->w, 1);
 	
-	progress_cb = callback;
-	progress_counter = 0;
-	progress_total = (fixed_bmp->w / mcu_w) * (fixed_bmp->h / mcu_h) * (flags & JPG_OPTIMIZE ? 2 : 1);
+	jpg->progress_cb = callback;
+	if ((jpg->threads > 1) && (!callback) && (jpg->fixed_bmp->w * jpg->fixed_bmp->h >= PARALLEL_MIN_PIXELS))
+		jpg->restart_interval = jpg->fixed_bmp->w / jpg->mcu_w;
+	jpg->progress_counter = 0;
+	jpg->progress_total = (jpg->fixed_bmp->w / jpg->mcu_w) * (jpg->fixed_bmp->h / jpg->mcu_h) * (flags & JPG_OPTIMIZE ? 2 : 1);
 	
-	TRACE("Saving %dx%d %s image in %s mode, quality %d%s", bmp->w, bmp->h, greyscale ? "greyscale" : "color",
-		sampling == JPG_SAMPLING_444 ? "444" : (sampling == JPG_SAMPLING_422 ? "422" : "411"), quality,
-		current_pass == PASS_COMPUTE_HUFFMAN ? " (first pass)" : "");
+	TRACE("Saving %dx%d %s image in %s mode, quality %d%s", bmp->w, bmp->h, jpg->greyscale ? "greyscale" : "color",
+		jpg->sampling == JPG_SAMPLING_444 ? "444" : (jpg->sampling == JPG_SAMPLING_422 ? "422" : "411"), quality,
+		jpg->current_pass == PASS_COMPUTE_HUFFMAN ? " (first pass)" : "");
 	
 	if (flags & JPG_OPTIMIZE) {
 		tables = calloc(1, 1092);
 		if (!tables) {
-			jpgalleg_error = JPG_ERROR_OUT_OF_MEMORY;
+			jpg->io.error = JPG_ERROR_OUT_OF_MEMORY;
 			goto exit_error;
 		}
-		num_codes_dc_luminance = tables;
-		num_codes_dc_chrominance = tables + 17;
-		num_codes_ac_luminance = tables + 34;
-		num_codes_ac_chrominance = tables + 51;
-		val_dc_luminance = tables + 68;
-		val_dc_chrominance = tables + 324;
-		val_ac_luminance = tables + 580;
-		val_ac_chrominance = tables + 836;
-		current_pass = PASS_COMPUTE_HUFFMAN;
-		result = encode_pass(bmp, quality);
+		jpg->num_codes_dc_luminance = tables;
+		jpg->num_codes_dc_chrominance = tables + 17;
+		jpg->num_codes_ac_luminance = tables + 34;
+		jpg->num_codes_ac_chrominance = tables + 51;
+		jpg->val_dc_luminance = tables + 68;
+		jpg->val_dc_chrominance = tables + 324;
+		jpg->val_ac_luminance = tables + 580;
+		jpg->val_ac_chrominance = tables + 836;
+		jpg->current_pass = PASS_COMPUTE_HUFFMAN;
+		result = encode_pass(jpg, bmp, quality);
 		if (result) {
 			TRACE("First pass failed");
 			goto exit_error;
 		}
-		result |= build_huffman_table(&_jpeg_huffman_dc_table[0], num_codes_dc_luminance, val_dc_luminance);
-		result |= build_huffman_table(&_jpeg_huffman_ac_table[0], num_codes_ac_luminance, val_ac_luminance);
+		result |= build_huffman_table(&jpg->huffman_dc_table[0], jpg->num_codes_dc_luminance, jpg->val_dc_luminance);
+		result |= build_huffman_table(&jpg->huffman_ac_table[0], jpg->num_codes_ac_luminance, jpg->val_ac_luminance);
 		if (!(flags & JPG_GREYSCALE)) {
-			result |= build_huffman_table(&_jpeg_huffman_dc_table[1], num_codes_dc_chrominance, val_dc_chrominance);
-			result |= build_huffman_table(&_jpeg_huffman_ac_table[1], num_codes_ac_chrominance, val_ac_chrominance);
+			result |= build_huffman_table(&jpg->huffman_dc_table[1], jpg->num_codes_dc_chrominance, jpg->val_dc_chrominance);
+			result |= build_huffman_table(&jpg->huffman_ac_table[1], jpg->num_codes_ac_chrominance, jpg->val_ac_chrominance);
 		}
 		if (result) {
 			TRACE("Failed building optimized huffman tables");
@@ -958,20 +1118,20 @@ _jpeg_encode(BITMAP *bmp, AL_CONST RGB *pal, int quality, int flags, void (*call
 		}
 	}
 	else {
-		num_codes_dc_luminance = (unsigned char *)default_num_codes_dc_luminance;
-		num_codes_dc_chrominance = (unsigned char *)default_num_codes_dc_chrominance;
-		num_codes_ac_luminance = (unsigned char *)default_num_codes_ac_luminance;
-		num_codes_ac_chrominance = (unsigned char *)default_num_codes_ac_chrominance;
-		val_dc_luminance = (unsigned char *)default_val_dc_luminance;
-		val_dc_chrominance = (unsigned char *)default_val_dc_chrominance;
-		val_ac_luminance = (unsigned char *)default_val_ac_luminance;
-		val_ac_chrominance = (unsigned char *)default_val_ac_chrominance;
-	}
-	current_pass = PASS_WRITE;
-	result = encode_pass(bmp, quality);
+		jpg->num_codes_dc_luminance = (unsigned char *)default_num_codes_dc_luminance;
+		jpg->num_codes_dc_chrominance = (unsigned char *)default_num_codes_dc_chrominance;
+		jpg->num_codes_ac_luminance = (unsigned char *)default_num_codes_ac_luminance;
+		jpg->num_codes_ac_chrominance = (unsigned char *)default_num_codes_ac_chrominance;
+		jpg->val_dc_luminance = (unsigned char *)default_val_dc_luminance;
+		jpg->val_dc_chrominance = (unsigned char *)default_val_dc_chrominance;
+		jpg->val_ac_luminance = (unsigned char *)default_val_ac_luminance;
+		jpg->val_ac_chrominance = (unsigned char *)default_val_ac_chrominance;
+	}
+	jpg->current_pass = PASS_WRITE;
+	result = encode_pass(jpg, bmp, quality);
 
 exit_error:
-	destroy_bitmap(fixed_bmp);
+	destroy_bitmap(jpg->fixed_bmp);
 	if (tables)
 		free(tables);
 	
@@ -17,4 +17,12 @@ unless have_library('alleg', 'install_allegro')
   exit
 end
 
+# Bitmap.load_many decodes on a pool of native threads
+have_library('pthread', 'pthread_create') unless RUBY_PLATFORM =~ /mswin|mingw/
+
+# Decoders release the interpreter lock where the ruby has one
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_thread_blocking_region')
+
 create_makefile "Allegro"
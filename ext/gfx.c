@@ -185,8 +185,8 @@ static VALUE gfx_get_display_switch_mode(VALUE self) {
  * adjusted with the "disable_vsync" config key in the [graphics]
  * section of allegro.cfg.
  */
-static VALUE gfx_show_video_bitmap(VALUE self) {
-  return show_video_bitmap(get_bmp(self)) == 0 ? Qtrue : Qfalse;
+static VALUE gfx_show_video_bitmap(VALUE self, VALUE bitmap) {
+  return show_video_bitmap(get_bmp(bitmap)) == 0 ? Qtrue : Qfalse;
 }
 
 /**
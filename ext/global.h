@@ -14,6 +14,7 @@
 #endif
 
 #include "ruby.h"
+#include "thread.h"
 
 extern VALUE m_allegro;
 extern VALUE m_allegro_gfx;
@@ -27,6 +28,12 @@ extern VALUE m_allegro_fx;
 
 extern VALUE c_allegro_color;
 extern VALUE c_allegro_bitmap;
+extern VALUE c_allegro_bitmap_buffer;
+extern VALUE c_allegro_swapchain;
+extern VALUE c_allegro_timer;
+extern VALUE c_allegro_atlas;
+extern VALUE c_allegro_loader;
+extern VALUE c_allegro_future;
 extern VALUE c_allegro_sample;
 extern VALUE c_allegro_joystick_info;
 extern VALUE c_allegro_joystick_stickinfo;
@@ -48,7 +55,76 @@ typedef struct Color
 
 #define MALLOC(type) (type *) malloc(sizeof(type))
 
-BITMAP *load_jpg(FILE *f, unsigned char *memory, int size);
+void bitmap_free(void *ptr);
+VALUE get_option(VALUE opts, const char *name);
+int get_scale_option(VALUE opts);
+const char *get_format_option(VALUE format);
+VALUE buffer_wrap(VALUE bitmap);
+/* Every key costs a pass over each pixel, so long lists are a mistake. */
+#define MAX_MASK_KEYS 256
+int mask_color_keys(BITMAP *bmp, const uint32_t *keys, int num_keys, int tolerance);
+
+typedef struct DIRTY_RECT
+{
+  int x1, y1, x2, y2;
+} DIRTY_RECT;
+
+void dirty_track(BITMAP *bmp, int enable);
+int dirty_tracking(BITMAP *bmp);
+void dirty_add(BITMAP *bmp, int x1, int y1, int x2, int y2);
+int dirty_rects(BITMAP *bmp, const DIRTY_RECT **rects);
+void dirty_clear(BITMAP *bmp);
+int dirty_present(BITMAP *bmp, BITMAP *dst, int x, int y);
+
+double timer_now(void);
+void timer_sleep_until(double deadline);
+
+void *call_without_gvl(void *(*func)(void *), void *data);
+
+/* A file, or a buffer in memory, read and decoded by image_decode, which
+ * is safe on any thread, and finished by image_finish on the main thread.
+ */
+typedef struct ImageLoad
+{
+  const char *file;
+  const void *data;
+  int size;
+  int type;
+  int scale;
+  int threads;
+  BITMAP *bmp;
+  PALETTE pal;
+  int error;
+} ImageLoad;
+
+/* The size and kind of an image, as image_probe reads them from the
+ * header of the file.
+ */
+typedef struct ImageInfo
+{
+  const char *format;
+  int w;
+  int h;
+  int depth;
+  int progressive;
+} ImageInfo;
+
+void image_prepare(ImageLoad *load, const char *file);
+int image_prepare_memory(ImageLoad *load, const void *data, int size, const char *format);
+void *image_decode(void *load);
+BITMAP *image_finish(ImageLoad *load);
+int image_probe(ImageLoad *load, ImageInfo *info);
+const char *image_error(ImageLoad *load);
+
+static inline int bytes_per_pixel(int bpp) {
+  return (bpp + 7) / 8;
+}
+
+static inline int bitmap_pitch(BITMAP *bmp) {
+  if (bmp->h > 1)
+    return (int)(bmp->line[1] - bmp->line[0]);
+  return bmp->w * bytes_per_pixel(bitmap_color_depth(bmp));
+}
 
 static inline void rb_raise_arg_error(char *expected, VALUE x)
 {
@@ -71,6 +147,10 @@ static inline BITMAP* get_bmp(VALUE var)
     Data_Get_Struct(var, BITMAP, bmp);
   else
     rb_raise_arg_error("Bitmap", var);
+
+  /* pages of a disposed SwapChain */
+  if (!bmp)
+    rb_raise(rb_eRuntimeError, "bitmap was destroyed");
 	
   return bmp;
 }
@@ -79,6 +159,8 @@ static inline BITMAP* _get_bmp(VALUE var)
 {
   BITMAP *bmp;
   Data_Get_Struct(var, BITMAP, bmp);
+  if (!bmp)
+    rb_raise(rb_eRuntimeError, "bitmap was destroyed");
   return bmp;
 }
 
@@ -106,41 +188,62 @@ static inline FONT* get_font(VALUE var)
   return font;
 }
 
-static inline VALUE int_to_color(unsigned long c)
+/* Colors cross the ruby boundary as packed integers in the format of
+ * a 32 bit bitmap (see makeacol32), normally 0xAARRGGBB. On 64 bit
+ * builds they are Fixnums, so passing them around allocates nothing;
+ * 32 bit Fixnums only hold 30 bits plus sign, so there any color with
+ * alpha of 0x40 or more becomes a Bignum.
+ */
+static inline VALUE packed_to_num(uint32_t c)
 {
-  Color *color = (Color *) malloc(sizeof(Color));
-  color->r = getr(c);
-  color->g = getg(c);
-  color->b = getb(c);
-  color->a = geta(c);
-  return Data_Wrap_Struct(c_allegro_color, 0, free, color);
+  return UINT2NUM(c);
 }
 
-static inline unsigned long color_to_int(VALUE value)
+static inline uint32_t color_to_packed(VALUE value)
 {
   Color *color;
 
-  if (rb_obj_is_kind_of(value, c_allegro_color)) {
+  if (FIXNUM_P(value)) {
+    return (uint32_t) FIX2ULONG(value);
+  }
+  else if (TYPE(value) == T_BIGNUM) {
+    return (uint32_t) rb_num2ulong(value);
+  }
+  else if (rb_obj_is_kind_of(value, c_allegro_color)) {
     Data_Get_Struct(value, Color, color);
-    return makeacol(color->r, color->g, color->b, color->a);
+    return makeacol32(color->r, color->g, color->b, color->a);
   }
-  else if (TYPE(value) == T_FIXNUM || TYPE(value) == T_BIGNUM) {
-    return rb_num2ulong(value);
-  } 
   else {
-    rb_raise_arg_error("Color", value);	
+    rb_raise_arg_error("Color", value);
   }
 }
 
+/* Converts a pixel value of the current color depth to a packed color. */
+static inline VALUE int_to_color(int c)
+{
+  if (get_color_depth() == 32)
+    return packed_to_num((uint32_t) c);
+  return packed_to_num(makeacol32(getr(c), getg(c), getb(c), geta(c)));
+}
+
+/* Converts a packed color or Color object to the current color depth. */
+static inline int color_to_int(VALUE value)
+{
+  uint32_t c = color_to_packed(value);
+
+  if (get_color_depth() == 32)
+    return (int) c;
+  return makeacol(getr32(c), getg32(c), getb32(c), geta32(c));
+}
 
 static inline void put_pixel(BITMAP *bmp, int x, int y, int color)
 {
-  ((long *)bmp->line[y])[x] = color;
+  ((uint32_t *)bmp->line[y])[x] = color;
 }
 
 static inline int get_pixel(BITMAP *bmp, int x, int y)
 {
-  return ((long *)bmp->line[y])[x];
+  return ((uint32_t *)bmp->line[y])[x];
 }
 
 #endif // _RB_ALLEG_GLOBAL
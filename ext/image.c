@@ -0,0 +1,180 @@
+/*******************************************************************************************
+
+ image.c
+
+ Loading image files off the main thread. PNG and JPEG files, or buffers
+ in memory holding them, are read and decoded by the reentrant loaders,
+ PNG files straight to 32 bpp and JPEG files at the color depth of the
+ file; converting them to the current color depth, and loading any other
+ format through Allegro, waits for the main thread. Paletted PNG files
+ without transparency stay 8 bpp, so index 0 remains the mask color for
+ draw_sprite as it always was.
+
+*******************************************************************************************/
+
+#include "global.h"
+#include "jpgalleg.h"
+#include "loadpng.h"
+
+#define IMAGE_OTHER	0
+#define IMAGE_PNG	1
+#define IMAGE_JPG	2
+
+void image_prepare(ImageLoad *load, const char *file) {
+  const char *ext = get_extension(file);
+
+  load->file = file;
+  load->data = NULL;
+  load->size = 0;
+  load->scale = 1;
+  load->threads = 1;
+  load->bmp = NULL;
+  load->error = 0;
+
+  if (ustricmp(ext, "png") == 0)
+    load->type = IMAGE_PNG;
+  else if (ustricmp(ext, "jpg") == 0 || ustricmp(ext, "jpeg") == 0)
+    load->type = IMAGE_JPG;
+  else
+    load->type = IMAGE_OTHER;
+}
+
+/**
+ * Prepares to decode an image held in memory, which must stay put until
+ * image_finish. The format is "png" or "jpeg", or NULL to tell it from
+ * the first bytes. Returns FALSE if the format is not one the reentrant
+ * loaders read.
+ */
+int image_prepare_memory(ImageLoad *load, const void *data, int size, const char *format) {
+  const unsigned char *p = (const unsigned char *) data;
+
+  image_prepare(load, "");
+  load->file = NULL;
+  load->data = data;
+  load->size = size;
+
+  if (format)
+    load->type = strcmp(format, "png") == 0 ? IMAGE_PNG : strcmp(format, "jpeg") == 0 ? IMAGE_JPG : IMAGE_OTHER;
+  else if (size >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0)
+    load->type = IMAGE_PNG;
+  else if (size >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff)
+    load->type = IMAGE_JPG;
+
+  return load->type != IMAGE_OTHER;
+}
+
+/**
+ * Reads and decodes a file or buffer prepared by image_prepare or
+ * image_prepare_memory. Safe to run on any thread and without the
+ * interpreter lock.
+ */
+void *image_decode(void *arg) {
+  ImageLoad *load = (ImageLoad *) arg;
+
+  switch (load->type) {
+  case IMAGE_PNG:
+    if (load->data)
+      load->bmp = load_memory_png_r(load->data, load->size, load->pal, 32, &load->error);
+    else
+      load->bmp = load_png_r(load->file, load->pal, 32, &load->error);
+    break;
+  case IMAGE_JPG:
+    if (load->data)
+      load->bmp = load_memory_jpg_r((void *) load->data, load->size, load->pal, load->scale, load->threads, &load->error);
+    else
+      load->bmp = load_jpg_r(load->file, load->pal, load->scale, load->threads, &load->error);
+    break;
+  }
+
+  return load->bmp;
+}
+
+/**
+ * Reads the size and kind of a file prepared by image_prepare from its
+ * header, without decoding it. Returns 0 on success and an error code,
+ * which image_error explains, otherwise.
+ */
+int image_probe(ImageLoad *load, ImageInfo *info) {
+  info->format = NULL;
+  info->progressive = FALSE;
+
+  switch (load->type) {
+  case IMAGE_PNG:
+    info->format = "png";
+    load->error = probe_png(load->file, &info->w, &info->h, &info->depth, &info->progressive);
+    break;
+  case IMAGE_JPG:
+    info->format = "jpeg";
+    load->error = probe_jpg(load->file, &info->w, &info->h, &info->depth, &info->progressive);
+    break;
+  default:
+    load->error = -1;
+    break;
+  }
+
+  return load->error;
+}
+
+/* JPEG files are decoded at the requested scale; everything else is
+ * loaded at full size and shrunk here.
+ */
+static BITMAP *image_shrink(BITMAP *bmp, int scale) {
+  BITMAP *small;
+
+  if (!bmp || scale <= 1)
+    return bmp;
+
+  small = create_bitmap_ex(bitmap_color_depth(bmp), (bmp->w + scale - 1) / scale, (bmp->h + scale - 1) / scale);
+  if (small)
+    stretch_blit(bmp, small, 0, 0, bmp->w, bmp->h, 0, 0, small->w, small->h);
+  destroy_bitmap(bmp);
+
+  return small;
+}
+
+/**
+ * Converts a decoded image to the current color depth, or loads files
+ * of other formats. Returns NULL on failure; image_error tells why.
+ */
+BITMAP *image_finish(ImageLoad *load) {
+  switch (load->type) {
+  case IMAGE_PNG:
+    if (load->bmp && !(load->bmp = image_shrink(fixup_png(load->bmp, load->pal), load->scale)))
+      load->error = LOADPNG_ERROR_OUT_OF_MEMORY;
+    break;
+  case IMAGE_JPG:
+    if (load->bmp && !(load->bmp = fixup_jpg(load->bmp, load->pal)))
+      load->error = JPG_ERROR_OUT_OF_MEMORY;
+    break;
+  default:
+    if (load->file)
+      load->bmp = image_shrink(load_bitmap(load->file, load->pal), load->scale);
+    break;
+  }
+
+  return load->bmp;
+}
+
+const char *image_error(ImageLoad *load) {
+  switch (load->type) {
+  case IMAGE_PNG:
+    switch (load->error) {
+    case LOADPNG_ERROR_READING_FILE:	return "could not read file";
+    case LOADPNG_ERROR_NOT_PNG:		return "not a PNG file";
+    case LOADPNG_ERROR_OUT_OF_MEMORY:	return "out of memory";
+    default:				return "corrupt or unsupported PNG file";
+    }
+  case IMAGE_JPG:
+    switch (load->error) {
+    case JPG_ERROR_READING_FILE:		return "could not read file";
+    case JPG_ERROR_NOT_JPEG:			return "not a JPEG file";
+    case JPG_ERROR_UNSUPPORTED_ENCODING:	return "unsupported JPEG encoding";
+    case JPG_ERROR_UNSUPPORTED_COLOR_SPACE:	return "unsupported JPEG color space";
+    case JPG_ERROR_UNSUPPORTED_DATA_PRECISION:	return "unsupported JPEG data precision";
+    case JPG_ERROR_OUT_OF_MEMORY:		return "out of memory";
+    default:					return "corrupt JPEG file";
+    }
+  default:
+    return "unknown format or unreadable file";
+  }
+}
@@ -128,6 +128,9 @@
 #define DEFAULT_QUALITY		75
 #define DEFAULT_FLAGS		JPG_SAMPLING_444
 
+/* Bits looked up at once when decoding huffman codes */
+#define HUFFMAN_LOOKAHEAD	9
+
 
 
 typedef struct HUFFMAN_ENTRY
@@ -142,8 +145,15 @@ typedef struct HUFFMAN_ENTRY
 typedef struct HUFFMAN_TABLE
 {
 	HUFFMAN_ENTRY entry[257];
-	HUFFMAN_ENTRY *entry_of_length[16];
 	HUFFMAN_ENTRY *code[256];
+	/* Decoder side: codes up to HUFFMAN_LOOKAHEAD bits long are resolved
+	 * by a single lookup of the next bits, giving (length << 8) | value.
+	 * Longer codes are searched length by length through maxcode[].
+	 */
+	unsigned short lookup[1 << HUFFMAN_LOOKAHEAD];
+	int maxcode[17];
+	int valoffset[17];
+	unsigned char values[256];
 } HUFFMAN_TABLE;
 
 
@@ -165,9 +175,18 @@ typedef struct HUFFMAN_TREE
 } HUFFMAN_TREE;
 
 
+/* Coefficients of a block of a progressive image, in zigzag order. The
+ * first NARROW_START ones carry the large values and are kept in full, the
+ * others nearly always fit in a byte. A block getting one that does not
+ * moves whole to the wide block pool of the decoder.
+ */
+#define NARROW_START		4
+
 typedef struct DATA_BUFFER
 {
-	short data[64];
+	short low[NARROW_START];
+	signed char high[64 - NARROW_START];
+	int wide;		/* index + 1 in JPEG_DECODER.wide_block, or 0 */
 } DATA_BUFFER;
 
 
@@ -175,40 +194,117 @@ typedef struct IO_BUFFER
 {
 	unsigned char *buffer;
 	unsigned char *buffer_start, *buffer_end;
+	uint64_t bits;		/* entropy coded data read ahead, MSB first */
+	int bits_left;
+	int pad_bits;		/* zero bits past the end of buffer in bits */
 	int current_bit;
+	int current_byte;
+	int bytes_read;
+	int chunk_len;
+	unsigned char *chunk;
+	int growable;		/* output buffer is malloc'd and grows when full */
+	int error;
 } IO_BUFFER;
 
 
-extern int _jpeg_getc(void);
-extern int _jpeg_putc(int);
-extern int _jpeg_getw(void);
-extern int _jpeg_putw(int);
-extern INLINE int _jpeg_get_bit(void);
-extern int _jpeg_put_bit(int);
-extern void _jpeg_flush_bits(void);
-extern void _jpeg_open_chunk(void);
-extern void _jpeg_close_chunk(void);
-extern int _jpeg_eoc(void);
-extern void _jpeg_new_chunk(int);
-extern void _jpeg_write_chunk(void);
-extern void _jpeg_chunk_putc(int);
-extern void _jpeg_chunk_putw(int);
-extern void _jpeg_chunk_puts(unsigned char *, int);
-
-extern BITMAP *_jpeg_decode(RGB *, void (*)(int));
+/* A whole input file, mapped into memory where the platform allows it. */
+typedef struct INPUT_FILE
+{
+	unsigned char *data;
+	long size;
+	int mapped;
+} INPUT_FILE;
+
+
+/* All the state of a single decode. Nothing in the decoder touches
+ * globals, so several images can be decoded at once on different threads
+ * as long as each one has its own context.
+ */
+typedef struct JPEG_DECODER
+{
+	IO_BUFFER io;
+	HUFFMAN_TABLE huffman_ac_table[4];
+	HUFFMAN_TABLE huffman_dc_table[4];
+	HUFFMAN_TABLE *ac_luminance_table, *dc_luminance_table;
+	HUFFMAN_TABLE *ac_chrominance_table, *dc_chrominance_table;
+	DATA_BUFFER *data_buffer[3];
+	short (*wide_block)[64];
+	int wide_count, wide_size;
+	short quantization_table[256];
+	short *luminance_quantization_table, *chrominance_quantization_table;
+	int jpeg_w, jpeg_h, jpeg_components;
+	int sampling, v_sampling, h_sampling, restart_interval, skip_count;
+	int spectrum_start, spectrum_end, successive_high, successive_low;
+	int scan_components, component[3];
+	int progress_counter, progress_total;
+	int scale, threads;
+	void (*idct)(short *block, short *dequant, short *output, short *workspace);
+	void (*chroma_idct)(short *block, short *dequant, short *output, short *workspace);	/* one scale step larger for subsampled chroma */
+	void (*ycbcr2rgb)(unsigned char *addr, int y1, int cb1, int cr1, int y2, int cb2, int cr2, int y3, int cb3, int cr3, int y4, int cb4, int cr4);
+	void (*ycbcr2rgb_row)(struct JPEG_DECODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int dup);
+	void (*plot)(struct JPEG_DECODER *jpg, unsigned char *addr, int pitch, short *y1, short *y2, short *y3, short *y4, short *cb, short *cr);
+	void (*progress_cb)(int percentage);
+	void (*scan_cb)(BITMAP *bmp, int scan, void *data);
+	void *scan_data;
+} JPEG_DECODER;
+
+
+/* Same for the encoder. */
+typedef struct JPEG_ENCODER
+{
+	IO_BUFFER io;
+	HUFFMAN_TABLE huffman_ac_table[2];
+	HUFFMAN_TABLE huffman_dc_table[2];
+	unsigned char *num_codes_dc_luminance, *val_dc_luminance;
+	unsigned char *num_codes_dc_chrominance, *val_dc_chrominance;
+	unsigned char *num_codes_ac_luminance, *val_ac_luminance;
+	unsigned char *num_codes_ac_chrominance, *val_ac_chrominance;
+	int luminance_quant_table[64];
+	int chrominance_quant_table[64];
+	int current_pass, progress_counter, progress_total;
+	int sampling, greyscale, mcu_w, mcu_h;
+	int restart_interval;	/* MCUs between restart markers, 0 for none */
+	int threads;
+	BITMAP *fixed_bmp;
+	void (*fdct)(short *data);
+	void (*rgb2ycbcr)(unsigned char *addr, short *y1, short *cb1, short *cr1, short *y2, short *cb2, short *cr2);
+	void (*rgb2ycbcr_row)(struct JPEG_ENCODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int width);
+	void (*progress_cb)(int percentage);
+} JPEG_ENCODER;
+
+
+extern int _jpeg_getc(IO_BUFFER *);
+extern int _jpeg_putc(IO_BUFFER *, int);
+extern int _jpeg_getw(IO_BUFFER *);
+extern int _jpeg_putw(IO_BUFFER *, int);
+extern void _jpeg_fill_bits(IO_BUFFER *);
+extern int _jpeg_put_bit(IO_BUFFER *, int);
+extern void _jpeg_flush_bits(IO_BUFFER *);
+extern void _jpeg_open_chunk(IO_BUFFER *);
+extern void _jpeg_close_chunk(IO_BUFFER *);
+extern int _jpeg_eoc(IO_BUFFER *);
+extern void _jpeg_new_chunk(IO_BUFFER *, int);
+extern void _jpeg_write_chunk(IO_BUFFER *);
+extern void _jpeg_chunk_putc(IO_BUFFER *, int);
+extern void _jpeg_chunk_putw(IO_BUFFER *, int);
+extern void _jpeg_chunk_puts(IO_BUFFER *, unsigned char *, int);
+extern int _jpeg_open_file(AL_CONST char *, INPUT_FILE *);
+extern void _jpeg_close_file(INPUT_FILE *);
+
+extern BITMAP *_jpeg_decode(JPEG_DECODER *, RGB *, void (*)(int));
+extern int _jpeg_probe(JPEG_DECODER *, int *);
 extern void _jpeg_mmx_idct(short *, short *, short *, short *);
-extern void _jpeg_mmx_ycbcr2rgb(int, int, int, int, int, int, int, int, int, int, int, int, int);
-extern void _jpeg_mmx_ycbcr2bgr(int, int, int, int, int, int, int, int, int, int, int, int, int);
+extern void _jpeg_mmx_ycbcr2rgb(unsigned char *, int, int, int, int, int, int, int, int, int, int, int, int);
+extern void _jpeg_mmx_ycbcr2bgr(unsigned char *, int, int, int, int, int, int, int, int, int, int, int, int);
+extern void _jpeg_simd_decoder(JPEG_DECODER *);
 
-extern int _jpeg_encode(BITMAP *, AL_CONST RGB *, int, int, void (*)(int));
-extern void _jpeg_mmx_rgb2ycbcr(int, short *, short *, short *, short *, short *, short *);
-extern void _jpeg_mmx_bgr2ycbcr(int, short *, short *, short *, short *, short *, short *);
+extern int _jpeg_encode(JPEG_ENCODER *, BITMAP *, AL_CONST RGB *, int, int, void (*)(int));
+extern void _jpeg_mmx_rgb2ycbcr(unsigned char *, short *, short *, short *, short *, short *, short *);
+extern void _jpeg_mmx_bgr2ycbcr(unsigned char *, short *, short *, short *, short *, short *, short *);
+extern void _jpeg_simd_encoder(JPEG_ENCODER *);
 
 extern void _jpeg_trace(const char *, ...);
 
-extern HUFFMAN_TABLE _jpeg_huffman_ac_table[];
-extern HUFFMAN_TABLE _jpeg_huffman_dc_table[];
-extern IO_BUFFER _jpeg_io;
 extern const unsigned char _jpeg_zigzag_scan[];
 extern const char *_jpeg_component_name[];
 
@@ -70,11 +70,27 @@ extern BITMAP *load_jpg_ex(AL_CONST char *filename, RGB *palette, void (*callbac
 extern BITMAP *load_memory_jpg(void *buffer, int size, RGB *palette);
 extern BITMAP *load_memory_jpg_ex(void *buffer, int size, RGB *palette, void (*callback)(int progress));
 
+/* Reentrant loaders, safe to call from several threads at once */
+extern BITMAP *load_jpg_r(AL_CONST char *filename, RGB *palette, int scale, int threads, int *error);
+extern BITMAP *load_memory_jpg_r(void *buffer, int size, RGB *palette, int scale, int threads, int *error);
+extern BITMAP *fixup_jpg(BITMAP *bmp, RGB *palette);
+
+/* Reentrant loaders showing progressive images scan by scan */
+extern BITMAP *load_jpg_scans(AL_CONST char *filename, RGB *palette, int scale, void (*callback)(BITMAP *bmp, int scan, void *data), void *data, int *error);
+extern BITMAP *load_memory_jpg_scans(void *buffer, int size, RGB *palette, int scale, void (*callback)(BITMAP *bmp, int scan, void *data), void *data, int *error);
+
+/* Reading only the size and kind of an image */
+extern int probe_jpg(AL_CONST char *filename, int *width, int *height, int *depth, int *progressive);
+extern int probe_memory_jpg(void *buffer, int size, int *width, int *height, int *depth, int *progressive);
+
 extern int save_jpg(AL_CONST char *filename, BITMAP *image, AL_CONST RGB *palette);
 extern int save_jpg_ex(AL_CONST char *filename, BITMAP *image, AL_CONST RGB *palette, int quality, int flags, void (*callback)(int progress));
 extern int save_memory_jpg(void *buffer, int *size, BITMAP *image, AL_CONST RGB *palette);
 extern int save_memory_jpg_ex(void *buffer, int *size, BITMAP *image, AL_CONST RGB *palette, int quality, int flags, void (*callback)(int progress));
 
+/* Reentrant encoder, returns a malloc'd buffer sized to the result */
+extern void *save_memory_jpg_r(BITMAP *image, AL_CONST RGB *palette, int quality, int flags, int threads, int *size, int *error);
+
 extern int jpgalleg_error;
 
 
@@ -20,49 +20,82 @@
 
 #include <internal.h>
 
-
-static int current_byte = 0;
-static int bytes_read = 0;
-static int chunk_len = 0;
-static void *chunk = NULL;
-
+#if defined(ALLEGRO_WINDOWS)
+	#include <winalleg.h>
+#elif defined(ALLEGRO_UNIX) || defined(ALLEGRO_MACOSX)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define JPGALLEG_MMAP
+#endif
 
 
 /* _jpeg_getc:
  *  Reads a byte from the input stream.
  */
 int
-_jpeg_getc(void)
+_jpeg_getc(IO_BUFFER *io)
 {
-	bytes_read++;
-	if (_jpeg_io.current_bit < 8) {
-		if (*_jpeg_io.buffer == 0xff)
-			_jpeg_io.buffer++;
-		_jpeg_io.buffer++;
-	}
-	_jpeg_io.current_bit = 8;
-
-	if (_jpeg_io.buffer >= _jpeg_io.buffer_end) {
+	io->bytes_read++;
+	/* Entropy coded data ends on a byte boundary, so whatever is left in
+	 * the bit reservoir when switching back to bytes is padding.
+	 */
+	io->bits = 0;
+	io->bits_left = io->pad_bits = 0;
+
+	if (io->buffer >= io->buffer_end) {
 		TRACE("Tried to read memory past buffer size");
-		jpgalleg_error = JPG_ERROR_INPUT_BUFFER_TOO_SMALL;
+		io->error = JPG_ERROR_INPUT_BUFFER_TOO_SMALL;
 		return -1;
 	}
-	return *_jpeg_io.buffer++;
+	return *io->buffer++;
+}
+
+
+/* grow_buffer:
+ *  Doubles the size of a growable output buffer. Returns 0 on success.
+ */
+static int
+grow_buffer(IO_BUFFER *io)
+{
+	unsigned char *buffer;
+	long size, used;
+	
+	size = io->buffer_end - io->buffer_start;
+	used = io->buffer - io->buffer_start;
+	if (size >= 0x3fffffff)
+		return -1;
+	buffer = (unsigned char *)realloc(io->buffer_start, size * 2);
+	if (!buffer)
+		return -1;
+	io->buffer_start = buffer;
+	io->buffer = buffer + used;
+	io->buffer_end = buffer + (size * 2);
+	return 0;
 }
 
 
 /* _jpeg_putc:
- *  Writes a byte to the output stream.
+ *  Writes a byte to the output stream. A growable buffer is enlarged as
+ *  needed, a fixed one makes this fail when full.
  */
 int
-_jpeg_putc(int c)
+_jpeg_putc(IO_BUFFER *io, int c)
 {
-	if (_jpeg_io.buffer >= _jpeg_io.buffer_end) {
-		TRACE("Tried to write memory past buffer size");
-		jpgalleg_error = JPG_ERROR_OUTPUT_BUFFER_TOO_SMALL;
-		return -1;
+	if (io->buffer >= io->buffer_end) {
+		if (!io->growable) {
+			TRACE("Tried to write memory past buffer size");
+			io->error = JPG_ERROR_OUTPUT_BUFFER_TOO_SMALL;
+			return -1;
+		}
+		if (grow_buffer(io)) {
+			TRACE("Out of memory");
+			io->error = JPG_ERROR_OUT_OF_MEMORY;
+			return -1;
+		}
 	}
-	*_jpeg_io.buffer++ = c;
+	*io->buffer++ = c;
 	return 0;
 }
 
@@ -71,12 +104,12 @@ _jpeg_putc(int c)
  *  Reads a word from the input stream.
  */
 int
-_jpeg_getw(void)
+_jpeg_getw(IO_BUFFER *io)
 {
 	int result;
 	
-	result = _jpeg_getc() << 8;
-	result |= _jpeg_getc();
+	result = _jpeg_getc(io) << 8;
+	result |= _jpeg_getc(io);
 	return result;
 }
 
@@ -85,38 +118,46 @@ _jpeg_getw(void)
  *  Writes a word to the output stream.
  */
 int
-_jpeg_putw(int w)
+_jpeg_putw(IO_BUFFER *io, int w)
 {
 	int result;
 	
-	result = _jpeg_putc((w >> 8) & 0xff);
-	result |= _jpeg_putc(w & 0xff);
+	result = _jpeg_putc(io, (w >> 8) & 0xff);
+	result |= _jpeg_putc(io, w & 0xff);
 	return result;
 }
 
 
-/* _jpeg_get_bit:
- *  Reads a single bit from the input stream.
+/* _jpeg_fill_bits:
+ *  Tops up the bit reservoir to at least 57 bits, removing the 0x00 stuffed
+ *  after 0xff bytes. Reading stops at markers, and zeros are fed instead;
+ *  zeros fed past the end of the buffer are counted in pad_bits so readers
+ *  can tell when they run out of data.
  */
-INLINE int
-_jpeg_get_bit(void)
+void
+_jpeg_fill_bits(IO_BUFFER *io)
 {
-	if (_jpeg_io.current_bit <= 0) {
-		if (_jpeg_io.buffer >= _jpeg_io.buffer_end) {
-			TRACE("Tried to read memory past buffer size");
-			jpgalleg_error = JPG_ERROR_INPUT_BUFFER_TOO_SMALL;
-			return -1;
+	int c;
+	
+	while (io->bits_left <= 56) {
+		if ((io->buffer >= io->buffer_end) ||
+		    ((*io->buffer == 0xff) && (io->buffer + 1 >= io->buffer_end))) {
+			c = 0;
+			io->pad_bits += 8;
+		}
+		else if (*io->buffer != 0xff)
+			c = *io->buffer++;
+		else if (io->buffer[1] == 0) {
+			/* Stuffed 0xff00 */
+			c = 0xff;
+			io->buffer += 2;
 		}
-		if (*_jpeg_io.buffer == 0xff)
-			/* Special encoding for 0xff, which in JPGs is encoded like 2 bytes:
-			 * 0xff00. Here we skip the next byte (0x00)
-			 */
-			_jpeg_io.buffer++;
-		_jpeg_io.buffer++;
-		_jpeg_io.current_bit = 8;
+		else
+			/* Marker */
+			c = 0;
+		io->bits |= (uint64_t)c << (56 - io->bits_left);
+		io->bits_left += 8;
 	}
-	_jpeg_io.current_bit--;
-	return (*_jpeg_io.buffer >> _jpeg_io.current_bit) & 0x1;
 }
 
 
@@ -124,17 +165,17 @@ _jpeg_get_bit(void)
  *  Writes a single bit to the output stream.
  */
 int
-_jpeg_put_bit(int bit)
+_jpeg_put_bit(IO_BUFFER *io, int bit)
 {
-	current_byte |= (bit << _jpeg_io.current_bit);
-	_jpeg_io.current_bit--;
-	if (_jpeg_io.current_bit < 0) {
-		if (_jpeg_putc(current_byte))
+	io->current_byte |= (bit << io->current_bit);
+	io->current_bit--;
+	if (io->current_bit < 0) {
+		if (_jpeg_putc(io, io->current_byte))
 			return -1;
-		if (current_byte == 0xff)
-			_jpeg_putc(0);
-		_jpeg_io.current_bit = 7;
-		current_byte = 0;
+		if (io->current_byte == 0xff)
+			_jpeg_putc(io, 0);
+		io->current_bit = 7;
+		io->current_byte = 0;
 	}
 	return 0;
 }
@@ -144,10 +185,10 @@ _jpeg_put_bit(int bit)
  *  Flushes the current byte by filling unset bits with 1.
  */
 void
-_jpeg_flush_bits(void)
+_jpeg_flush_bits(IO_BUFFER *io)
 {
-	while (_jpeg_io.current_bit < 7)
-		_jpeg_put_bit(1);
+	while (io->current_bit < 7)
+		_jpeg_put_bit(io, 1);
 }
 
 
@@ -155,22 +196,34 @@ _jpeg_flush_bits(void)
  *  Opens a chunk for reading.
  */
 void
-_jpeg_open_chunk(void)
+_jpeg_open_chunk(IO_BUFFER *io)
 {
-	bytes_read = 0;
-	chunk_len = _jpeg_getw();
-	_jpeg_io.current_bit = 8;
+	io->bytes_read = 0;
+	io->chunk_len = _jpeg_getw(io);
 }
 
 
 /* _jpeg_close_chunk:
- *  Closes the chunk being read, eventually skipping unused bytes.
+ *  Closes the chunk being read, eventually skipping unused bytes. They are
+ *  skipped all at once, as whole chunks of metadata may be left unread.
  */
 void
-_jpeg_close_chunk(void)
+_jpeg_close_chunk(IO_BUFFER *io)
 {
-	while (bytes_read < chunk_len)
-		_jpeg_getc();
+	int left = io->chunk_len - io->bytes_read;
+	
+	if (left <= 0)
+		return;
+	if (left > io->buffer_end - io->buffer) {
+		TRACE("Tried to read memory past buffer size");
+		io->error = JPG_ERROR_INPUT_BUFFER_TOO_SMALL;
+		io->buffer = io->buffer_end;
+	}
+	else
+		io->buffer += left;
+	io->bytes_read = io->chunk_len;
+	io->bits = 0;
+	io->bits_left = io->pad_bits = 0;
 }
 
 
@@ -178,9 +231,9 @@ _jpeg_close_chunk(void)
  *  Returns true if the end of chunk being read is reached, otherwise false.
  */
 int
-_jpeg_eoc(void)
+_jpeg_eoc(IO_BUFFER *io)
 {
-	return (bytes_read < chunk_len) ? FALSE : TRUE;
+	return (io->bytes_read < io->chunk_len) ? FALSE : TRUE;
 }
 
 
@@ -188,14 +241,14 @@ _jpeg_eoc(void)
  *  Creates a new chunk for writing.
  */
 void
-_jpeg_new_chunk(int type)
+_jpeg_new_chunk(IO_BUFFER *io, int type)
 {
 	char *c = (char *)malloc(65536);
 	
 	c[0] = 0xff;
 	c[1] = type;
-	chunk_len = 2;
-	chunk = c;
+	io->chunk_len = 2;
+	io->chunk = (unsigned char *)c;
 }
 
 
@@ -203,21 +256,21 @@ _jpeg_new_chunk(int type)
  *  Writes the current chunk to the output stream.
  */
 void
-_jpeg_write_chunk(void)
+_jpeg_write_chunk(IO_BUFFER *io)
 {
 	unsigned char *c;
 	
-	if (!chunk)
+	if (!io->chunk)
 		return;
-	c = (unsigned char *)chunk;
-	c[2] = (chunk_len >> 8) & 0xff;
-	c[3] = chunk_len & 0xff;
-	for (chunk_len += 2; chunk_len; chunk_len--)
-		_jpeg_putc(*c++);
-	free(chunk);
-	chunk = NULL;
-	_jpeg_io.current_bit = 7;
-	current_byte = 0;
+	c = (unsigned char *)io->chunk;
+	c[2] = (io->chunk_len >> 8) & 0xff;
+	c[3] = io->chunk_len & 0xff;
+	for (io->chunk_len += 2; io->chunk_len; io->chunk_len--)
+		_jpeg_putc(io, *c++);
+	free(io->chunk);
+	io->chunk = NULL;
+	io->current_bit = 7;
+	io->current_byte = 0;
 }
 
 
@@ -225,12 +278,12 @@ _jpeg_write_chunk(void)
  *  Writes a byte to the current chunk.
  */
 void
-_jpeg_chunk_putc(int c)
+_jpeg_chunk_putc(IO_BUFFER *io, int c)
 {
-	char *p = (char *)chunk + chunk_len + 2;
+	char *p = (char *)io->chunk + io->chunk_len + 2;
 	
 	*p = c;
-	chunk_len++;
+	io->chunk_len++;
 }
 
 
@@ -238,10 +291,10 @@ _jpeg_chunk_putc(int c)
  *  Writes a word to the current chunk.
  */
 void
-_jpeg_chunk_putw(int w)
+_jpeg_chunk_putw(IO_BUFFER *io, int w)
 {
-	_jpeg_chunk_putc((w >> 8) & 0xff);
-	_jpeg_chunk_putc(w & 0xff);
+	_jpeg_chunk_putc(io, (w >> 8) & 0xff);
+	_jpeg_chunk_putc(io, w & 0xff);
 }
 
 
@@ -249,8 +302,124 @@ _jpeg_chunk_putw(int w)
  *  Writes a stream of bytes to the current chunk.
  */
 void
-_jpeg_chunk_puts(unsigned char *s, int size)
+_jpeg_chunk_puts(IO_BUFFER *io, unsigned char *s, int size)
 {
 	for (; size; size--)
-		_jpeg_chunk_putc(*s++);
+		_jpeg_chunk_putc(io, *s++);
+}
+
+
+/* _jpeg_open_file:
+ *  Makes the whole of a file available to the decoder. The file is mapped
+ *  read-only where the platform supports it, so its pages are read in as
+ *  the decoder gets to them and never copied; elsewhere it is read into a
+ *  buffer. Returns 0 on success or a JPG_ERROR_* code.
+ */
+int
+_jpeg_open_file(AL_CONST char *filename, INPUT_FILE *file)
+{
+	FILE *f;
+	
+	file->data = NULL;
+	file->size = 0;
+	file->mapped = FALSE;
+	
+#if defined(ALLEGRO_WINDOWS)
+	{
+		HANDLE handle, mapping;
+		LARGE_INTEGER size;
+		
+		handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (handle != INVALID_HANDLE_VALUE) {
+			if ((GetFileSizeEx(handle, &size)) && (size.QuadPart > 0) && (size.QuadPart < 0x7fffffff)) {
+				mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+				if (mapping) {
+					file->data = (unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+					file->size = (long)size.QuadPart;
+					CloseHandle(mapping);
+				}
+			}
+			CloseHandle(handle);
+			if (file->data) {
+				file->mapped = TRUE;
+				return JPG_ERROR_NONE;
+			}
+		}
+	}
+#elif defined(JPGALLEG_MMAP)
+	{
+		struct stat st;
+		void *data;
+		int fd;
+		
+		fd = open(filename, O_RDONLY);
+		if (fd >= 0) {
+			if ((fstat(fd, &st) == 0) && (S_ISREG(st.st_mode)) && (st.st_size > 0) && (st.st_size < 0x7fffffff)) {
+				data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data != MAP_FAILED) {
+					file->data = (unsigned char *)data;
+					file->size = (long)st.st_size;
+				}
+			}
+			close(fd);
+			if (file->data) {
+				file->mapped = TRUE;
+				return JPG_ERROR_NONE;
+			}
+		}
+	}
+#endif
+	
+	/* Fall back to reading it all */
+	f = fopen(filename, "rb");
+	if (!f) {
+		TRACE("Cannot open %s for reading", filename);
+		return JPG_ERROR_READING_FILE;
+	}
+	fseek(f, 0, SEEK_END);
+	file->size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if ((file->size <= 0) || (file->size >= 0x7fffffff)) {
+		TRACE("Cannot read %s", filename);
+		fclose(f);
+		return JPG_ERROR_READING_FILE;
+	}
+	file->data = (unsigned char *)malloc(file->size);
+	if (!file->data) {
+		TRACE("Out of memory");
+		fclose(f);
+		return JPG_ERROR_OUT_OF_MEMORY;
+	}
+	if (fread(file->data, 1, file->size, f) != (size_t)file->size) {
+		TRACE("Cannot read %s", filename);
+		fclose(f);
+		free(file->data);
+		file->data = NULL;
+		return JPG_ERROR_READING_FILE;
+	}
+	fclose(f);
+	
+	return JPG_ERROR_NONE;
+}
+
+
+/* _jpeg_close_file:
+ *  Releases a file opened by _jpeg_open_file().
+ */
+void
+_jpeg_close_file(INPUT_FILE *file)
+{
+	if (!file->data)
+		return;
+#if defined(ALLEGRO_WINDOWS)
+	if (file->mapped)
+		UnmapViewOfFile(file->data);
+	else
+#elif defined(JPGALLEG_MMAP)
+	if (file->mapped)
+		munmap(file->data, file->size);
+	else
+#endif
+		free(file->data);
+	file->data = NULL;
 }
@@ -22,10 +22,6 @@
 #include <internal.h>
 
 
-HUFFMAN_TABLE _jpeg_huffman_ac_table[4];
-HUFFMAN_TABLE _jpeg_huffman_dc_table[4];
-IO_BUFFER _jpeg_io;
-
 const unsigned char _jpeg_zigzag_scan[64] = {
 	 0, 1, 5, 6,14,15,27,28,
 	 2, 4, 7,13,16,26,29,42,
@@ -118,8 +114,67 @@ load_jpg(AL_CONST char *filename, RGB *palette)
 }
 
 
+/* decode:
+ *  Decodes size bytes at buffer with a context of its own, reduced by the
+ *  given scale (1, 2, 4 or 8), using up to the given number of threads.
+ *  scan_callback, if any, gets the image after each scan of a progressive
+ *  file but the last. Safe to call from any thread.
+ */
+static BITMAP *
+decode(void *buffer, int size, RGB *palette, void (*callback)(int progress), int scale, int threads, void (*scan_callback)(BITMAP *bmp, int scan, void *data), void *data, int *error)
+{
+	JPEG_DECODER *jpg;
+	BITMAP *bmp;
+	
+	jpg = (JPEG_DECODER *)calloc(1, sizeof(JPEG_DECODER));
+	if (!jpg) {
+		TRACE("Out of memory");
+		*error = JPG_ERROR_OUT_OF_MEMORY;
+		return NULL;
+	}
+	jpg->io.buffer = jpg->io.buffer_start = (unsigned char *)buffer;
+	jpg->io.buffer_end = jpg->io.buffer_start + size;
+	while ((jpg->scale < 3) && ((2 << jpg->scale) <= scale))
+		jpg->scale++;
+	jpg->threads = threads;
+	jpg->scan_cb = scan_callback;
+	jpg->scan_data = data;
+	
+	bmp = _jpeg_decode(jpg, palette, callback);
+	
+	*error = jpg->io.error;
+	free(jpg);
+	return bmp;
+}
+
+
+/* fixup_jpg:
+ *  Converts a bitmap returned by load_jpg_r() or load_memory_jpg_r() to the
+ *  color depth loaded images get (see set_color_conversion()). This may
+ *  select the palette, so it must run on the thread that owns Allegro.
+ */
+BITMAP *
+fixup_jpg(BITMAP *bmp, RGB *palette)
+{
+	int depth;
+	
+	if (!bmp)
+		return NULL;
+	
+	depth = _color_load_depth(bitmap_color_depth(bmp), FALSE);
+	if (depth != bitmap_color_depth(bmp))
+		bmp = _fixup_loaded_bitmap(bmp, palette, depth);
+	if (depth != 8)
+		generate_332_palette(palette);
+	
+	return bmp;
+}
+
+
 /* load_jpg_ex:
- *  Loads a JPG image from a file into a BITMAP.
+ *  Loads a JPG image from a file into a BITMAP. Plain files are mapped into
+ *  memory; anything else packfiles can open, like datafile objects, is read
+ *  into a buffer first.
  */
 BITMAP *
 load_jpg_ex(AL_CONST char *filename, RGB *palette, void (*callback)(int progress))
@@ -127,15 +182,24 @@ load_jpg_ex(AL_CONST char *filename, RGB *palette, void (*callback)(int progress
 	PACKFILE *f;
 	BITMAP *bmp;
 	PALETTE pal;
+	INPUT_FILE file;
+	unsigned char *buffer;
 	int size;
 	
 	if (!palette)
 		palette = pal;
 	
+	TRACE("Loading JPG from file %s", filename);
+	
+	if (_jpeg_open_file(filename, &file) == JPG_ERROR_NONE) {
+		bmp = fixup_jpg(decode(file.data, (int)file.size, palette, callback, 1, 1, NULL, NULL, &jpgalleg_error), palette);
+		_jpeg_close_file(&file);
+		return bmp;
+	}
+	
 	size = file_size(filename);
-	_jpeg_io.buffer = _jpeg_io.buffer_start = (unsigned char *)malloc(size);
-	_jpeg_io.buffer_end = _jpeg_io.buffer_start + size;
-	if (!_jpeg_io.buffer) {
+	buffer = (unsigned char *)malloc(size);
+	if (!buffer) {
 		TRACE("Out of memory");
 		jpgalleg_error = JPG_ERROR_OUT_OF_MEMORY;
 		return NULL;
@@ -144,17 +208,45 @@ load_jpg_ex(AL_CONST char *filename, RGB *palette, void (*callback)(int progress
 	if (!f) {
 		TRACE("Cannot open %s for reading", filename);
 		jpgalleg_error = JPG_ERROR_READING_FILE;
-		free(_jpeg_io.buffer);
+		free(buffer);
 		return NULL;
 	}
-	pack_fread(_jpeg_io.buffer, size, f);
+	pack_fread(buffer, size, f);
 	pack_fclose(f);
 	
-	TRACE("Loading JPG from file %s", filename);
+	bmp = fixup_jpg(decode(buffer, size, palette, callback, 1, 1, NULL, NULL, &jpgalleg_error), palette);
+	
+	free(buffer);
+	return bmp;
+}
+
+
+/* load_jpg_r:
+ *  Reentrant version of load_jpg(). Maps the file with _jpeg_open_file()
+ *  instead of going through packfiles and returns the image at its own
+ *  color depth, 8 bpp for greyscale and 24 bpp for color images, without
+ *  touching any global state. The error code goes to *error instead of
+ *  jpgalleg_error.
+ *  A scale of 2, 4 or 8 decodes the image straight to 1/scale of its size,
+ *  rounded up; 1 keeps the full size. Large baseline images with restart
+ *  markers are decoded on up to threads threads.
+ */
+BITMAP *
+load_jpg_r(AL_CONST char *filename, RGB *palette, int scale, int threads, int *error)
+{
+	BITMAP *bmp;
+	PALETTE pal;
+	INPUT_FILE file;
 	
-	bmp = _jpeg_decode(palette, callback);
+	if (!palette)
+		palette = pal;
+	
+	if ((*error = _jpeg_open_file(filename, &file)) != JPG_ERROR_NONE)
+		return NULL;
 	
-	free(_jpeg_io.buffer_start);
+	bmp = decode(file.data, (int)file.size, palette, NULL, scale, threads, NULL, NULL, error);
+	
+	_jpeg_close_file(&file);
 	return bmp;
 }
 
@@ -176,23 +268,186 @@ load_memory_jpg(void *buffer, int size, RGB *palette)
 BITMAP *
 load_memory_jpg_ex(void *buffer, int size, RGB *palette, void (*callback)(int progress))
 {
-	BITMAP *bmp;
 	PALETTE pal;
 	
 	if (!palette)
 		palette = pal;
 	
-	_jpeg_io.buffer = _jpeg_io.buffer_start = buffer;
-	_jpeg_io.buffer_end = _jpeg_io.buffer_start + size;
-	
 	TRACE("Loading JPG from memory buffer at %p (size = %d)", buffer, size);
 	
-	bmp = _jpeg_decode(palette, callback);
+	return fixup_jpg(decode(buffer, size, palette, callback, 1, 1, NULL, NULL, &jpgalleg_error), palette);
+}
+
 
+/* load_memory_jpg_r:
+ *  Reentrant version of load_memory_jpg(); see load_jpg_r().
+ */
+BITMAP *
+load_memory_jpg_r(void *buffer, int size, RGB *palette, int scale, int threads, int *error)
+{
+	PALETTE pal;
+	
+	if (!palette)
+		palette = pal;
+	
+	return decode(buffer, size, palette, NULL, scale, threads, NULL, NULL, error);
+}
+
+
+/* load_jpg_scans:
+ *  Like load_jpg_r(), but calls callback with the image decoded so far
+ *  after each scan of a progressive file except the last, for incremental
+ *  display. The callback gets the bitmap the function will return, at the
+ *  color depth of the file, with palette already set for greyscale images,
+ *  and the number of scans done; it must not keep or destroy it.
+ */
+BITMAP *
+load_jpg_scans(AL_CONST char *filename, RGB *palette, int scale, void (*callback)(BITMAP *bmp, int scan, void *data), void *data, int *error)
+{
+	BITMAP *bmp;
+	PALETTE pal;
+	INPUT_FILE file;
+	
+	if (!palette)
+		palette = pal;
+	
+	if ((*error = _jpeg_open_file(filename, &file)) != JPG_ERROR_NONE)
+		return NULL;
+	
+	bmp = decode(file.data, (int)file.size, palette, NULL, scale, 1, callback, data, error);
+	
+	_jpeg_close_file(&file);
 	return bmp;
 }
 
 
+/* load_memory_jpg_scans:
+ *  Memory buffer version of load_jpg_scans().
+ */
+BITMAP *
+load_memory_jpg_scans(void *buffer, int size, RGB *palette, int scale, void (*callback)(BITMAP *bmp, int scan, void *data), void *data, int *error)
+{
+	PALETTE pal;
+	
+	if (!palette)
+		palette = pal;
+	
+	return decode(buffer, size, palette, NULL, scale, 1, callback, data, error);
+}
+
+
+/* probe:
+ *  Reads the size, color depth and kind of the image in size bytes at
+ *  buffer, without decoding it. Returns 0 or an error code.
+ */
+static int
+probe(void *buffer, int size, int *width, int *height, int *depth, int *progressive)
+{
+	JPEG_DECODER *jpg;
+	int error;
+	
+	jpg = (JPEG_DECODER *)calloc(1, sizeof(JPEG_DECODER));
+	if (!jpg) {
+		TRACE("Out of memory");
+		return JPG_ERROR_OUT_OF_MEMORY;
+	}
+	jpg->io.buffer = jpg->io.buffer_start = (unsigned char *)buffer;
+	jpg->io.buffer_end = jpg->io.buffer_start + size;
+	
+	if (_jpeg_probe(jpg, progressive) == 0) {
+		*width = jpg->jpeg_w;
+		*height = jpg->jpeg_h;
+		*depth = jpg->jpeg_components * 8;
+	}
+	
+	error = jpg->io.error;
+	free(jpg);
+	return error;
+}
+
+
+/* probe_jpg:
+ *  Reads just enough of a JPG file to tell its width, height, color depth
+ *  (8 for greyscale and 24 for color images) and whether it is progressive.
+ *  Only the pages of the file holding the header are read. Safe to call
+ *  from any thread. Returns 0 on success or an error code.
+ */
+int
+probe_jpg(AL_CONST char *filename, int *width, int *height, int *depth, int *progressive)
+{
+	INPUT_FILE file;
+	int error;
+	
+	if ((error = _jpeg_open_file(filename, &file)) != JPG_ERROR_NONE)
+		return error;
+	
+	error = probe(file.data, (int)file.size, width, height, depth, progressive);
+	
+	_jpeg_close_file(&file);
+	return error;
+}
+
+
+/* probe_memory_jpg:
+ *  Memory buffer version of probe_jpg().
+ */
+int
+probe_memory_jpg(void *buffer, int size, int *width, int *height, int *depth, int *progressive)
+{
+	return probe(buffer, size, width, height, depth, progressive);
+}
+
+
+/* encode:
+ *  Encodes bmp with a context of its own, into size bytes at buffer or, if
+ *  buffer is NULL, into a malloc'd buffer that grows to fit and is returned
+ *  in *out, using up to threads threads. Returns the number of bytes
+ *  written, or -1 on error.
+ */
+static int
+encode(void *buffer, int size, unsigned char **out, BITMAP *bmp, AL_CONST RGB *palette, int quality, int flags, void (*callback)(int progress), int threads, int *error)
+{
+	JPEG_ENCODER *jpg;
+	int result;
+	
+	jpg = (JPEG_ENCODER *)calloc(1, sizeof(JPEG_ENCODER));
+	if (!jpg) {
+		TRACE("Out of memory");
+		*error = JPG_ERROR_OUT_OF_MEMORY;
+		return -1;
+	}
+	if (!buffer) {
+		/* About two bits per pixel, the typical size at quality 75 */
+		size = (bmp->w * bmp->h / 4) + 1024;
+		buffer = malloc(size);
+		if (!buffer) {
+			TRACE("Out of memory");
+			free(jpg);
+			*error = JPG_ERROR_OUT_OF_MEMORY;
+			return -1;
+		}
+		jpg->io.growable = TRUE;
+	}
+	jpg->io.buffer = jpg->io.buffer_start = (unsigned char *)buffer;
+	jpg->io.buffer_end = jpg->io.buffer_start + size;
+	jpg->threads = threads;
+	
+	result = _jpeg_encode(jpg, bmp, palette, quality, flags, callback);
+	if (result == 0)
+		result = jpg->io.buffer - jpg->io.buffer_start;
+	
+	if (jpg->io.growable) {
+		if (result >= 0)
+			*out = jpg->io.buffer_start;
+		else
+			free(jpg->io.buffer_start);
+	}
+	*error = jpg->io.error;
+	free(jpg);
+	return result;
+}
+
+
 /* save_jpg:
  *  Saves specified BITMAP into a JPG file with quality 75, no subsampling
  *  and no progress callback.
@@ -213,34 +468,28 @@ save_jpg_ex(AL_CONST char *filename, BITMAP *bmp, AL_CONST RGB *palette, int qua
 {
 	PACKFILE *f;
 	PALETTE pal;
-	int result, size;
+	unsigned char *buffer;
+	int result;
 	
 	if (!palette)
 		palette = pal;
 	
-	size = (bmp->w * bmp->h * 3) + 1000;    /* This extimation should be more than enough in all cases */
-	_jpeg_io.buffer = _jpeg_io.buffer_start = (unsigned char *)malloc(size);
-	_jpeg_io.buffer_end = _jpeg_io.buffer_start + size;
-	if (!_jpeg_io.buffer) {
-		TRACE("Out of memory");
-		jpgalleg_error = JPG_ERROR_OUT_OF_MEMORY;
-		return -1;
-	}
 	f = pack_fopen(filename, F_WRITE);
 	if (!f) {
 		TRACE("Cannot open %s for writing", filename);
 		jpgalleg_error = JPG_ERROR_WRITING_FILE;
-		free(_jpeg_io.buffer);
 		return -1;
 	}
 	
 	TRACE("Saving JPG to file %s", filename);
 	
-	result = _jpeg_encode(bmp, palette, quality, flags, callback);
-	if (!result)
-		pack_fwrite(_jpeg_io.buffer_start, _jpeg_io.buffer - _jpeg_io.buffer_start, f);
+	result = encode(NULL, 0, &buffer, bmp, palette, quality, flags, callback, 1, &jpgalleg_error);
+	if (result >= 0) {
+		pack_fwrite(buffer, result, f);
+		free(buffer);
+		result = 0;
+	}
 	
-	free(_jpeg_io.buffer_start);
 	pack_fclose(f);
 	return result;
 }
@@ -273,13 +522,37 @@ save_memory_jpg_ex(void *buffer, int *size, BITMAP *bmp, AL_CONST RGB *palette,
 	
 	TRACE("Saving JPG to memory buffer at %p (size = %d)", buffer, *size);
 	
-	_jpeg_io.buffer = _jpeg_io.buffer_start = buffer;
-	_jpeg_io.buffer_end = _jpeg_io.buffer_start + *size;
-	*size = 0;
+	result = encode(buffer, *size, NULL, bmp, palette, quality, flags, callback, 1, &jpgalleg_error);
 	
-	result = _jpeg_encode(bmp, palette, quality, flags, callback);
+	*size = 0;
+	if (result < 0)
+		return result;
+	*size = result;
+	return 0;
+}
+
+
+/* save_memory_jpg_r:
+ *  Reentrant counterpart of save_memory_jpg_ex() for truecolor images,
+ *  encoding large images on up to threads threads.
+ *  Returns the JPG data in a buffer allocated to fit, which the caller
+ *  frees, and its length in *size. On failure returns NULL and stores a
+ *  JPG_ERROR_* code in *error.
+ */
+void *
+save_memory_jpg_r(BITMAP *bmp, AL_CONST RGB *palette, int quality, int flags, int threads, int *size, int *error)
+{
+	unsigned char *buffer = NULL;
+	int result;
 	
-	if (result == 0)
-		*size = _jpeg_io.buffer - _jpeg_io.buffer_start;
-	return result;
+	*error = JPG_ERROR_NONE;
+	result = encode(NULL, 0, &buffer, bmp, palette, quality, flags, NULL, threads, error);
+	if (result < 0) {
+		if (*error == JPG_ERROR_NONE)
+			*error = JPG_ERROR_BAD_IMAGE;
+		*size = 0;
+		return NULL;
+	}
+	*size = result;
+	return buffer;
 }
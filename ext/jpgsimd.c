@@ -0,0 +1,1051 @@
+/*
+ *         __   _____    ______   ______   ___    ___
+ *        /\ \ /\  _ `\ /\  ___\ /\  _  \ /\_ \  /\_ \
+ *        \ \ \\ \ \L\ \\ \ \__/ \ \ \L\ \\//\ \ \//\ \      __     __
+ *      __ \ \ \\ \  __| \ \ \  __\ \  __ \ \ \ \  \ \ \   /'__`\ /'_ `\
+ *     /\ \_\/ / \ \ \/   \ \ \L\ \\ \ \/\ \ \_\ \_ \_\ \_/\  __//\ \L\ \
+ *     \ \____//  \ \_\    \ \____/ \ \_\ \_\/\____\/\____\ \____\ \____ \
+ *      \/____/    \/_/     \/___/   \/_/\/_/\/____/\/____/\/____/\/___L\ \
+ *                                                                  /\____/
+ *                                                                  \_/__/
+ *
+ *      Version 2.5, by Angelo Mottola, 2000-2004
+ *
+ *      SSE2, AVX2 and NEON versions of the decoder and encoder kernels.
+ *
+ *      They compute exactly what _jpeg_c_idct and _jpeg_c_ycbcr2rgb do, so
+ *      images decode to the same pixels whichever kernel runs, and what
+ *      apply_fdct and _jpeg_c_rgb2ycbcr do, so they encode to the same
+ *      bytes.
+ *
+ *      See the readme.txt file for instructions on using this package in your
+ *      own programs.
+ */
+
+
+#include <internal.h>
+#include "simd.h"
+
+
+#define YCC_R_OFS	(359 * 128)
+#define YCC_G_OFS	((88 + 183) * 128)
+#define YCC_B_OFS	(453 * 128)
+
+
+
+#ifdef SIMD_X86
+
+/* mul_const_sse2:
+ *  Low 32 bits of a * c for four signed ints; SSE2 has no pmulld.
+ */
+SIMD_TARGET("sse2")
+static INLINE __m128i
+mul_const_sse2(__m128i a, __m128i c)
+{
+	__m128i even = _mm_mul_epu32(a, c);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), c);
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+
+/* idct_1d_sse2:
+ *  One pass of the AAN butterfly of _jpeg_c_idct on four lanes at once.
+ */
+SIMD_TARGET("sse2")
+static INLINE void
+idct_1d_sse2(__m128i *x, __m128i *y)
+{
+	const __m128i c1 = _mm_set1_epi32(IFIX_1_414213562), c2 = _mm_set1_epi32(IFIX_1_847759065);
+	const __m128i c3 = _mm_set1_epi32(IFIX_1_082392200), c4 = _mm_set1_epi32(-IFIX_2_613125930);
+	__m128i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	__m128i tmp10, tmp11, tmp12, tmp13, z5, z10, z11, z12, z13;
+
+	tmp10 = _mm_add_epi32(x[0], x[4]);
+	tmp11 = _mm_sub_epi32(x[0], x[4]);
+	tmp13 = _mm_add_epi32(x[2], x[6]);
+	tmp12 = _mm_sub_epi32(_mm_srai_epi32(mul_const_sse2(_mm_sub_epi32(x[2], x[6]), c1), 8), tmp13);
+	tmp0 = _mm_add_epi32(tmp10, tmp13);
+	tmp3 = _mm_sub_epi32(tmp10, tmp13);
+	tmp1 = _mm_add_epi32(tmp11, tmp12);
+	tmp2 = _mm_sub_epi32(tmp11, tmp12);
+	z13 = _mm_add_epi32(x[5], x[3]);
+	z10 = _mm_sub_epi32(x[5], x[3]);
+	z11 = _mm_add_epi32(x[1], x[7]);
+	z12 = _mm_sub_epi32(x[1], x[7]);
+	tmp7 = _mm_add_epi32(z11, z13);
+	tmp11 = _mm_srai_epi32(mul_const_sse2(_mm_sub_epi32(z11, z13), c1), 8);
+	z5 = _mm_srai_epi32(mul_const_sse2(_mm_add_epi32(z10, z12), c2), 8);
+	tmp10 = _mm_sub_epi32(_mm_srai_epi32(mul_const_sse2(z12, c3), 8), z5);
+	tmp12 = _mm_add_epi32(_mm_srai_epi32(mul_const_sse2(z10, c4), 8), z5);
+	tmp6 = _mm_sub_epi32(tmp12, tmp7);
+	tmp5 = _mm_sub_epi32(tmp11, tmp6);
+	tmp4 = _mm_add_epi32(tmp10, tmp5);
+	y[0] = _mm_add_epi32(tmp0, tmp7);
+	y[7] = _mm_sub_epi32(tmp0, tmp7);
+	y[1] = _mm_add_epi32(tmp1, tmp6);
+	y[6] = _mm_sub_epi32(tmp1, tmp6);
+	y[2] = _mm_add_epi32(tmp2, tmp5);
+	y[5] = _mm_sub_epi32(tmp2, tmp5);
+	y[4] = _mm_add_epi32(tmp3, tmp4);
+	y[3] = _mm_sub_epi32(tmp3, tmp4);
+}
+
+
+/* transpose_sse2:
+ *  Transposes the 4x4 block of ints in a[0..3] into b[0..3].
+ */
+SIMD_TARGET("sse2")
+static INLINE void
+transpose_sse2(__m128i *a, __m128i *b)
+{
+	__m128i t0 = _mm_unpacklo_epi32(a[0], a[1]);
+	__m128i t1 = _mm_unpacklo_epi32(a[2], a[3]);
+	__m128i t2 = _mm_unpackhi_epi32(a[0], a[1]);
+	__m128i t3 = _mm_unpackhi_epi32(a[2], a[3]);
+
+	b[0] = _mm_unpacklo_epi64(t0, t1);
+	b[1] = _mm_unpackhi_epi64(t0, t1);
+	b[2] = _mm_unpacklo_epi64(t2, t3);
+	b[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+
+/* descale_sse2:
+ *  Final scaling of _jpeg_c_idct, ((x >> 5) + 128) stored as short, for two
+ *  vectors of four ints.
+ */
+SIMD_TARGET("sse2")
+static INLINE __m128i
+descale_sse2(__m128i a, __m128i b)
+{
+	const __m128i bias = _mm_set1_epi32(128);
+
+	a = _mm_add_epi32(_mm_srai_epi32(a, 5), bias);
+	b = _mm_add_epi32(_mm_srai_epi32(b, 5), bias);
+	/* truncate like the C cast to short instead of saturating */
+	a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+	b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+
+	return _mm_packs_epi32(a, b);
+}
+
+
+/* _jpeg_sse2_idct:
+ *  SSE2 version of _jpeg_c_idct. The block is split into a left and a
+ *  right half of four columns; each half goes through the column pass,
+ *  then gets transposed so the row pass runs on the same butterfly.
+ */
+SIMD_TARGET("sse2")
+static void
+_jpeg_sse2_idct(short *data, short *output, short *dequant, short *workspace)
+{
+	__m128i left[8], right[8], tmp[8], rows[8], cols[8];
+	__m128i d, q, lo, hi;
+	int i;
+
+	(void)workspace;
+
+	for (i = 0; i < 8; i++) {
+		d = _mm_loadu_si128((__m128i *)(data + i * 8));
+		q = _mm_loadu_si128((__m128i *)(dequant + i * 8));
+		lo = _mm_mullo_epi16(d, q);
+		hi = _mm_mulhi_epi16(d, q);
+		left[i] = _mm_unpacklo_epi16(lo, hi);
+		right[i] = _mm_unpackhi_epi16(lo, hi);
+	}
+	idct_1d_sse2(left, left);
+	idct_1d_sse2(right, right);
+
+	/* cols[k] holds column k of rows 0-3, rows[k] column k of rows 4-7 */
+	transpose_sse2(left, cols);
+	transpose_sse2(right, cols + 4);
+	transpose_sse2(left + 4, rows);
+	transpose_sse2(right + 4, rows + 4);
+	idct_1d_sse2(cols, cols);
+	idct_1d_sse2(rows, rows);
+
+	transpose_sse2(cols, tmp);
+	transpose_sse2(cols + 4, tmp + 4);
+	for (i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i *)(output + i * 8), descale_sse2(tmp[i], tmp[i + 4]));
+	transpose_sse2(rows, tmp);
+	transpose_sse2(rows + 4, tmp + 4);
+	for (i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i *)(output + (i + 4) * 8), descale_sse2(tmp[i], tmp[i + 4]));
+}
+
+
+/* load_chroma_sse2:
+ *  Loads 8 chroma samples for a row of 8 pixels; with dup, 4 samples each
+ *  stretched over 2 pixels.
+ */
+SIMD_TARGET("sse2")
+static INLINE __m128i
+load_chroma_sse2(short *c, int dup)
+{
+	__m128i v;
+
+	if (dup) {
+		v = _mm_loadl_epi64((__m128i *)c);
+		return _mm_unpacklo_epi16(v, v);
+	}
+	return _mm_loadu_si128((__m128i *)c);
+}
+
+
+/* pack24_sse2:
+ *  Stores 8 pixels of 24 bits, given as the low 3 bytes of the ints in a
+ *  and b, to 24 consecutive bytes at addr.
+ */
+SIMD_TARGET("sse2")
+static INLINE void
+pack24_sse2(unsigned char *addr, __m128i a, __m128i b)
+{
+	const __m128i low = _mm_set_epi32(0, -1, 0, -1);
+	const __m128i high = _mm_set_epi32(0x0000ffff, (int)0xff000000, 0x0000ffff, (int)0xff000000);
+	const __m128i low64 = _mm_set_epi32(0, 0, -1, -1);
+
+	/* join each pair of pixels into the low 6 bytes of a quadword */
+	a = _mm_or_si128(_mm_and_si128(a, low), _mm_and_si128(_mm_srli_epi64(a, 8), high));
+	b = _mm_or_si128(_mm_and_si128(b, low), _mm_and_si128(_mm_srli_epi64(b, 8), high));
+	/* and both quadwords into the low 12 bytes */
+	a = _mm_or_si128(_mm_and_si128(a, low64), _mm_srli_si128(_mm_andnot_si128(low64, a), 2));
+	b = _mm_or_si128(_mm_and_si128(b, low64), _mm_srli_si128(_mm_andnot_si128(low64, b), 2));
+
+	_mm_storeu_si128((__m128i *)addr, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+	_mm_storel_epi64((__m128i *)(addr + 16), _mm_srli_si128(b, 4));
+}
+
+
+/* _jpeg_sse2_ycbcr2rgb_row:
+ *  SSE2 version of _jpeg_c_ycbcr2rgb_row.
+ */
+SIMD_TARGET("sse2")
+static void
+_jpeg_sse2_ycbcr2rgb_row(JPEG_DECODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int dup)
+{
+	/* coefficient pairs for pmaddwd, which computes 256 * y + k * c */
+	const __m128i k_y = _mm_set1_epi16(256);
+	const __m128i k_r = _mm_unpacklo_epi16(k_y, _mm_set1_epi16(359)), k_b = _mm_unpacklo_epi16(k_y, _mm_set1_epi16(453));
+	const __m128i k_g1 = _mm_unpacklo_epi16(k_y, _mm_set1_epi16(-88)), k_g2 = _mm_set1_epi32(-183);
+	const __m128i ofs_r = _mm_set1_epi32(-YCC_R_OFS), ofs_g = _mm_set1_epi32(YCC_G_OFS), ofs_b = _mm_set1_epi32(-YCC_B_OFS);
+	const __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+	__m128i yv, cbv, crv, lo, hi, r, g, b;
+
+	(void)jpg;
+
+	yv = _mm_loadu_si128((__m128i *)y);
+	cbv = load_chroma_sse2(cb, dup);
+	crv = load_chroma_sse2(cr, dup);
+
+	lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(yv, crv), k_r), ofs_r);
+	hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(yv, crv), k_r), ofs_r);
+	r = _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+	lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(yv, cbv), k_g1), _mm_madd_epi16(_mm_unpacklo_epi16(crv, zero), k_g2)), ofs_g);
+	hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(yv, cbv), k_g1), _mm_madd_epi16(_mm_unpackhi_epi16(crv, zero), k_g2)), ofs_g);
+	g = _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+	lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(yv, cbv), k_b), ofs_b);
+	hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(yv, cbv), k_b), ofs_b);
+	b = _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+
+	r = _mm_min_epi16(_mm_max_epi16(r, zero), max);
+	g = _mm_min_epi16(_mm_max_epi16(g, zero), max);
+	b = _mm_min_epi16(_mm_max_epi16(b, zero), max);
+
+	/* makecol24 on each pixel */
+	lo = _mm_or_si128(_mm_or_si128(
+		_mm_sll_epi32(_mm_unpacklo_epi16(r, zero), _mm_cvtsi32_si128(_rgb_r_shift_24)),
+		_mm_sll_epi32(_mm_unpacklo_epi16(g, zero), _mm_cvtsi32_si128(_rgb_g_shift_24))),
+		_mm_sll_epi32(_mm_unpacklo_epi16(b, zero), _mm_cvtsi32_si128(_rgb_b_shift_24)));
+	hi = _mm_or_si128(_mm_or_si128(
+		_mm_sll_epi32(_mm_unpackhi_epi16(r, zero), _mm_cvtsi32_si128(_rgb_r_shift_24)),
+		_mm_sll_epi32(_mm_unpackhi_epi16(g, zero), _mm_cvtsi32_si128(_rgb_g_shift_24))),
+		_mm_sll_epi32(_mm_unpackhi_epi16(b, zero), _mm_cvtsi32_si128(_rgb_b_shift_24)));
+
+	pack24_sse2(addr, lo, hi);
+}
+
+
+/* fdct_1d_sse2:
+ *  One pass of apply_fdct on four lanes at once. The first pass scales the
+ *  even part up by 2 bits and the rest down by 11; the second pass scales
+ *  them down by 2 and 15.
+ */
+SIMD_TARGET("sse2")
+static INLINE void
+fdct_1d_sse2(__m128i *x, __m128i *y, int pass)
+{
+	const __m128i shift = _mm_cvtsi32_si128(pass == 1 ? 11 : 15);
+	__m128i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	__m128i tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5;
+
+	tmp0 = _mm_add_epi32(x[0], x[7]);
+	tmp7 = _mm_sub_epi32(x[0], x[7]);
+	tmp1 = _mm_add_epi32(x[1], x[6]);
+	tmp6 = _mm_sub_epi32(x[1], x[6]);
+	tmp2 = _mm_add_epi32(x[2], x[5]);
+	tmp5 = _mm_sub_epi32(x[2], x[5]);
+	tmp3 = _mm_add_epi32(x[3], x[4]);
+	tmp4 = _mm_sub_epi32(x[3], x[4]);
+
+	tmp10 = _mm_add_epi32(tmp0, tmp3);
+	tmp13 = _mm_sub_epi32(tmp0, tmp3);
+	tmp11 = _mm_add_epi32(tmp1, tmp2);
+	tmp12 = _mm_sub_epi32(tmp1, tmp2);
+
+	if (pass == 1) {
+		y[0] = _mm_slli_epi32(_mm_add_epi32(tmp10, tmp11), 2);
+		y[4] = _mm_slli_epi32(_mm_sub_epi32(tmp10, tmp11), 2);
+	}
+	else {
+		y[0] = _mm_srai_epi32(_mm_add_epi32(tmp10, tmp11), 2);
+		y[4] = _mm_srai_epi32(_mm_sub_epi32(tmp10, tmp11), 2);
+	}
+
+	z1 = mul_const_sse2(_mm_add_epi32(tmp12, tmp13), _mm_set1_epi32(FIX_0_541196100));
+	y[2] = _mm_sra_epi32(_mm_add_epi32(z1, mul_const_sse2(tmp13, _mm_set1_epi32(FIX_0_765366865))), shift);
+	y[6] = _mm_sra_epi32(_mm_add_epi32(z1, mul_const_sse2(tmp12, _mm_set1_epi32(-FIX_1_847759065))), shift);
+
+	z1 = _mm_add_epi32(tmp4, tmp7);
+	z2 = _mm_add_epi32(tmp5, tmp6);
+	z3 = _mm_add_epi32(tmp4, tmp6);
+	z4 = _mm_add_epi32(tmp5, tmp7);
+	z5 = mul_const_sse2(_mm_add_epi32(z3, z4), _mm_set1_epi32(FIX_1_175875602));
+
+	tmp4 = mul_const_sse2(tmp4, _mm_set1_epi32(FIX_0_298631336));
+	tmp5 = mul_const_sse2(tmp5, _mm_set1_epi32(FIX_2_053119869));
+	tmp6 = mul_const_sse2(tmp6, _mm_set1_epi32(FIX_3_072711026));
+	tmp7 = mul_const_sse2(tmp7, _mm_set1_epi32(FIX_1_501321110));
+	z1 = mul_const_sse2(z1, _mm_set1_epi32(-FIX_0_899976223));
+	z2 = mul_const_sse2(z2, _mm_set1_epi32(-FIX_2_562915447));
+	z3 = _mm_add_epi32(mul_const_sse2(z3, _mm_set1_epi32(-FIX_1_961570560)), z5);
+	z4 = _mm_add_epi32(mul_const_sse2(z4, _mm_set1_epi32(-FIX_0_390180644)), z5);
+
+	y[7] = _mm_sra_epi32(_mm_add_epi32(_mm_add_epi32(tmp4, z1), z3), shift);
+	y[5] = _mm_sra_epi32(_mm_add_epi32(_mm_add_epi32(tmp5, z2), z4), shift);
+	y[3] = _mm_sra_epi32(_mm_add_epi32(_mm_add_epi32(tmp6, z2), z3), shift);
+	y[1] = _mm_sra_epi32(_mm_add_epi32(_mm_add_epi32(tmp7, z1), z4), shift);
+}
+
+
+/* to_short_sse2:
+ *  Truncates four ints to short and back, as storing them in the short
+ *  block between the passes of apply_fdct does.
+ */
+SIMD_TARGET("sse2")
+static INLINE __m128i
+to_short_sse2(__m128i a)
+{
+	return _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+}
+
+
+/* _jpeg_sse2_fdct:
+ *  SSE2 version of apply_fdct. Like _jpeg_sse2_idct the block is handled
+ *  as halves of four columns, transposed between the passes.
+ */
+SIMD_TARGET("sse2")
+static void
+_jpeg_sse2_fdct(short *data)
+{
+	__m128i left[8], right[8], top[8], bottom[8], d;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		d = _mm_loadu_si128((__m128i *)(data + i * 8));
+		left[i] = _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16);
+		right[i] = _mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16);
+	}
+
+	/* top[k] holds column k of rows 0-3, bottom[k] column k of rows 4-7 */
+	transpose_sse2(left, top);
+	transpose_sse2(right, top + 4);
+	transpose_sse2(left + 4, bottom);
+	transpose_sse2(right + 4, bottom + 4);
+	fdct_1d_sse2(top, top, 1);
+	fdct_1d_sse2(bottom, bottom, 1);
+	for (i = 0; i < 8; i++) {
+		top[i] = to_short_sse2(top[i]);
+		bottom[i] = to_short_sse2(bottom[i]);
+	}
+
+	/* and back to rows, for the column pass */
+	transpose_sse2(top, left);
+	transpose_sse2(bottom, left + 4);
+	transpose_sse2(top + 4, right);
+	transpose_sse2(bottom + 4, right + 4);
+	fdct_1d_sse2(left, left, 2);
+	fdct_1d_sse2(right, right, 2);
+
+	for (i = 0; i < 8; i++)
+		_mm_storeu_si128((__m128i *)(data + i * 8), _mm_packs_epi32(to_short_sse2(left[i]), to_short_sse2(right[i])));
+}
+
+
+/* _jpeg_sse2_rgb2ycbcr_row:
+ *  SSE2 version of _jpeg_c_rgb2ycbcr_row, 8 pixels at a time. Y only
+ *  takes positive weights and stays below 65536, and Cb and Cr stay within
+ *  a short, so 16 bit lanes give the exact results despite wrapping on
+ *  the way.
+ */
+SIMD_TARGET("sse2")
+static void
+_jpeg_sse2_rgb2ycbcr_row(JPEG_ENCODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int width)
+{
+	const __m128i r_shift = _mm_cvtsi32_si128(_rgb_r_shift_32);
+	const __m128i g_shift = _mm_cvtsi32_si128(_rgb_g_shift_32);
+	const __m128i b_shift = _mm_cvtsi32_si128(_rgb_b_shift_32);
+	const __m128i mask = _mm_set1_epi32(0xff), bias = _mm_set1_epi16(128);
+	__m128i p0, p1, r, g, b, v;
+	int x;
+
+	(void)jpg;
+
+	for (x = 0; x < width; x += 8) {
+		p0 = _mm_loadu_si128((__m128i *)(addr + x * 4));
+		p1 = _mm_loadu_si128((__m128i *)(addr + x * 4 + 16));
+		r = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(p0, r_shift), mask), _mm_and_si128(_mm_srl_epi32(p1, r_shift), mask));
+		g = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(p0, g_shift), mask), _mm_and_si128(_mm_srl_epi32(p1, g_shift), mask));
+		b = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(p0, b_shift), mask), _mm_and_si128(_mm_srl_epi32(p1, b_shift), mask));
+
+		v = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(76)), _mm_mullo_epi16(g, _mm_set1_epi16(151))),
+				  _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+		_mm_storeu_si128((__m128i *)(y + x), _mm_sub_epi16(_mm_srli_epi16(v, 8), bias));
+		v = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-43)), _mm_mullo_epi16(g, _mm_set1_epi16(-85))),
+				  _mm_slli_epi16(b, 7));
+		_mm_storeu_si128((__m128i *)(cb + x), _mm_srai_epi16(v, 8));
+		v = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(r, 7), _mm_mullo_epi16(g, _mm_set1_epi16(-107))),
+				  _mm_mullo_epi16(b, _mm_set1_epi16(-21)));
+		_mm_storeu_si128((__m128i *)(cr + x), _mm_srai_epi16(v, 8));
+	}
+}
+
+
+#ifdef SIMD_X86_AVX2
+
+/* idct_1d_avx2:
+ *  One pass of the AAN butterfly of _jpeg_c_idct on eight lanes at once.
+ */
+SIMD_TARGET("avx2")
+static INLINE void
+idct_1d_avx2(__m256i *x, __m256i *y)
+{
+	const __m256i c1 = _mm256_set1_epi32(IFIX_1_414213562), c2 = _mm256_set1_epi32(IFIX_1_847759065);
+	const __m256i c3 = _mm256_set1_epi32(IFIX_1_082392200), c4 = _mm256_set1_epi32(-IFIX_2_613125930);
+	__m256i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	__m256i tmp10, tmp11, tmp12, tmp13, z5, z10, z11, z12, z13;
+
+	tmp10 = _mm256_add_epi32(x[0], x[4]);
+	tmp11 = _mm256_sub_epi32(x[0], x[4]);
+	tmp13 = _mm256_add_epi32(x[2], x[6]);
+	tmp12 = _mm256_sub_epi32(_mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(x[2], x[6]), c1), 8), tmp13);
+	tmp0 = _mm256_add_epi32(tmp10, tmp13);
+	tmp3 = _mm256_sub_epi32(tmp10, tmp13);
+	tmp1 = _mm256_add_epi32(tmp11, tmp12);
+	tmp2 = _mm256_sub_epi32(tmp11, tmp12);
+	z13 = _mm256_add_epi32(x[5], x[3]);
+	z10 = _mm256_sub_epi32(x[5], x[3]);
+	z11 = _mm256_add_epi32(x[1], x[7]);
+	z12 = _mm256_sub_epi32(x[1], x[7]);
+	tmp7 = _mm256_add_epi32(z11, z13);
+	tmp11 = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(z11, z13), c1), 8);
+	z5 = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_add_epi32(z10, z12), c2), 8);
+	tmp10 = _mm256_sub_epi32(_mm256_srai_epi32(_mm256_mullo_epi32(z12, c3), 8), z5);
+	tmp12 = _mm256_add_epi32(_mm256_srai_epi32(_mm256_mullo_epi32(z10, c4), 8), z5);
+	tmp6 = _mm256_sub_epi32(tmp12, tmp7);
+	tmp5 = _mm256_sub_epi32(tmp11, tmp6);
+	tmp4 = _mm256_add_epi32(tmp10, tmp5);
+	y[0] = _mm256_add_epi32(tmp0, tmp7);
+	y[7] = _mm256_sub_epi32(tmp0, tmp7);
+	y[1] = _mm256_add_epi32(tmp1, tmp6);
+	y[6] = _mm256_sub_epi32(tmp1, tmp6);
+	y[2] = _mm256_add_epi32(tmp2, tmp5);
+	y[5] = _mm256_sub_epi32(tmp2, tmp5);
+	y[4] = _mm256_add_epi32(tmp3, tmp4);
+	y[3] = _mm256_sub_epi32(tmp3, tmp4);
+}
+
+
+/* transpose_avx2:
+ *  Transposes the 8x8 block of ints in a[0..7] into b[0..7].
+ */
+SIMD_TARGET("avx2")
+static INLINE void
+transpose_avx2(__m256i *a, __m256i *b)
+{
+	__m256i t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(a[i], a[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(a[i], a[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		b[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		b[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+
+/* _jpeg_avx2_idct:
+ *  AVX2 version of _jpeg_c_idct. A register holds a whole row, so both
+ *  passes work on all eight columns at once.
+ */
+SIMD_TARGET("avx2")
+static void
+_jpeg_avx2_idct(short *data, short *output, short *dequant, short *workspace)
+{
+	const __m256i bias = _mm256_set1_epi32(128);
+	__m256i x[8], t[8];
+	int i;
+
+	(void)workspace;
+
+	for (i = 0; i < 8; i++)
+		x[i] = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(data + i * 8))),
+					  _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(dequant + i * 8))));
+	idct_1d_avx2(x, x);
+	transpose_avx2(x, t);
+	idct_1d_avx2(t, t);
+	transpose_avx2(t, x);
+
+	for (i = 0; i < 8; i++) {
+		x[i] = _mm256_add_epi32(_mm256_srai_epi32(x[i], 5), bias);
+		x[i] = _mm256_srai_epi32(_mm256_slli_epi32(x[i], 16), 16);
+	}
+	for (i = 0; i < 8; i += 2)
+		_mm256_storeu_si256((__m256i *)(output + i * 8), _mm256_permute4x64_epi64(_mm256_packs_epi32(x[i], x[i + 1]), 0xd8));
+}
+
+
+/* _jpeg_avx2_ycbcr2rgb_row:
+ *  AVX2 version of _jpeg_c_ycbcr2rgb_row; all 8 pixels in one register.
+ */
+SIMD_TARGET("avx2")
+static void
+_jpeg_avx2_ycbcr2rgb_row(JPEG_DECODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int dup)
+{
+	const __m256i zero = _mm256_setzero_si256(), max = _mm256_set1_epi32(255);
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256i yv, cbv, crv, r, g, b, p;
+	__m128i lo, hi;
+
+	(void)jpg;
+
+	yv = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)y)), 8);
+	cbv = _mm256_cvtepi16_epi32(load_chroma_sse2(cb, dup));
+	crv = _mm256_cvtepi16_epi32(load_chroma_sse2(cr, dup));
+
+	r = _mm256_add_epi32(yv, _mm256_mullo_epi32(crv, _mm256_set1_epi32(359)));
+	r = _mm256_srai_epi32(_mm256_sub_epi32(r, _mm256_set1_epi32(YCC_R_OFS)), 8);
+	g = _mm256_add_epi32(_mm256_mullo_epi32(cbv, _mm256_set1_epi32(-88)), _mm256_mullo_epi32(crv, _mm256_set1_epi32(-183)));
+	g = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(yv, g), _mm256_set1_epi32(YCC_G_OFS)), 8);
+	b = _mm256_add_epi32(yv, _mm256_mullo_epi32(cbv, _mm256_set1_epi32(453)));
+	b = _mm256_srai_epi32(_mm256_sub_epi32(b, _mm256_set1_epi32(YCC_B_OFS)), 8);
+
+	r = _mm256_min_epi32(_mm256_max_epi32(r, zero), max);
+	g = _mm256_min_epi32(_mm256_max_epi32(g, zero), max);
+	b = _mm256_min_epi32(_mm256_max_epi32(b, zero), max);
+
+	p = _mm256_or_si256(_mm256_or_si256(
+		_mm256_sll_epi32(r, _mm_cvtsi32_si128(_rgb_r_shift_24)),
+		_mm256_sll_epi32(g, _mm_cvtsi32_si128(_rgb_g_shift_24))),
+		_mm256_sll_epi32(b, _mm_cvtsi32_si128(_rgb_b_shift_24)));
+
+	/* drop the top byte of every pixel: 4 pixels in 12 bytes per half */
+	lo = _mm_shuffle_epi8(_mm256_castsi256_si128(p), pack);
+	hi = _mm_shuffle_epi8(_mm256_extracti128_si256(p, 1), pack);
+	_mm_storeu_si128((__m128i *)addr, _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+	_mm_storel_epi64((__m128i *)(addr + 16), _mm_srli_si128(hi, 4));
+}
+
+/* fdct_1d_avx2:
+ *  One pass of apply_fdct on eight lanes at once; see fdct_1d_sse2.
+ */
+SIMD_TARGET("avx2")
+static INLINE void
+fdct_1d_avx2(__m256i *x, __m256i *y, int pass)
+{
+	const __m128i shift = _mm_cvtsi32_si128(pass == 1 ? 11 : 15);
+	__m256i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	__m256i tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5;
+
+	tmp0 = _mm256_add_epi32(x[0], x[7]);
+	tmp7 = _mm256_sub_epi32(x[0], x[7]);
+	tmp1 = _mm256_add_epi32(x[1], x[6]);
+	tmp6 = _mm256_sub_epi32(x[1], x[6]);
+	tmp2 = _mm256_add_epi32(x[2], x[5]);
+	tmp5 = _mm256_sub_epi32(x[2], x[5]);
+	tmp3 = _mm256_add_epi32(x[3], x[4]);
+	tmp4 = _mm256_sub_epi32(x[3], x[4]);
+
+	tmp10 = _mm256_add_epi32(tmp0, tmp3);
+	tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+	tmp11 = _mm256_add_epi32(tmp1, tmp2);
+	tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+	if (pass == 1) {
+		y[0] = _mm256_slli_epi32(_mm256_add_epi32(tmp10, tmp11), 2);
+		y[4] = _mm256_slli_epi32(_mm256_sub_epi32(tmp10, tmp11), 2);
+	}
+	else {
+		y[0] = _mm256_srai_epi32(_mm256_add_epi32(tmp10, tmp11), 2);
+		y[4] = _mm256_srai_epi32(_mm256_sub_epi32(tmp10, tmp11), 2);
+	}
+
+	z1 = _mm256_mullo_epi32(_mm256_add_epi32(tmp12, tmp13), _mm256_set1_epi32(FIX_0_541196100));
+	y[2] = _mm256_sra_epi32(_mm256_add_epi32(z1, _mm256_mullo_epi32(tmp13, _mm256_set1_epi32(FIX_0_765366865))), shift);
+	y[6] = _mm256_sra_epi32(_mm256_add_epi32(z1, _mm256_mullo_epi32(tmp12, _mm256_set1_epi32(-FIX_1_847759065))), shift);
+
+	z1 = _mm256_add_epi32(tmp4, tmp7);
+	z2 = _mm256_add_epi32(tmp5, tmp6);
+	z3 = _mm256_add_epi32(tmp4, tmp6);
+	z4 = _mm256_add_epi32(tmp5, tmp7);
+	z5 = _mm256_mullo_epi32(_mm256_add_epi32(z3, z4), _mm256_set1_epi32(FIX_1_175875602));
+
+	tmp4 = _mm256_mullo_epi32(tmp4, _mm256_set1_epi32(FIX_0_298631336));
+	tmp5 = _mm256_mullo_epi32(tmp5, _mm256_set1_epi32(FIX_2_053119869));
+	tmp6 = _mm256_mullo_epi32(tmp6, _mm256_set1_epi32(FIX_3_072711026));
+	tmp7 = _mm256_mullo_epi32(tmp7, _mm256_set1_epi32(FIX_1_501321110));
+	z1 = _mm256_mullo_epi32(z1, _mm256_set1_epi32(-FIX_0_899976223));
+	z2 = _mm256_mullo_epi32(z2, _mm256_set1_epi32(-FIX_2_562915447));
+	z3 = _mm256_add_epi32(_mm256_mullo_epi32(z3, _mm256_set1_epi32(-FIX_1_961570560)), z5);
+	z4 = _mm256_add_epi32(_mm256_mullo_epi32(z4, _mm256_set1_epi32(-FIX_0_390180644)), z5);
+
+	y[7] = _mm256_sra_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp4, z1), z3), shift);
+	y[5] = _mm256_sra_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp5, z2), z4), shift);
+	y[3] = _mm256_sra_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp6, z2), z3), shift);
+	y[1] = _mm256_sra_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp7, z1), z4), shift);
+}
+
+
+/* _jpeg_avx2_fdct:
+ *  AVX2 version of apply_fdct, a whole row per register.
+ */
+SIMD_TARGET("avx2")
+static void
+_jpeg_avx2_fdct(short *data)
+{
+	__m256i x[8], t[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		x[i] = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(data + i * 8)));
+	transpose_avx2(x, t);
+	fdct_1d_avx2(t, t, 1);
+	for (i = 0; i < 8; i++)
+		t[i] = _mm256_srai_epi32(_mm256_slli_epi32(t[i], 16), 16);
+	transpose_avx2(t, x);
+	fdct_1d_avx2(x, x, 2);
+
+	for (i = 0; i < 8; i++)
+		x[i] = _mm256_srai_epi32(_mm256_slli_epi32(x[i], 16), 16);
+	for (i = 0; i < 8; i += 2)
+		_mm256_storeu_si256((__m256i *)(data + i * 8), _mm256_permute4x64_epi64(_mm256_packs_epi32(x[i], x[i + 1]), 0xd8));
+}
+
+
+/* _jpeg_avx2_rgb2ycbcr_row:
+ *  AVX2 version of _jpeg_c_rgb2ycbcr_row, 16 pixels at a time; a last
+ *  group of 8 goes through the SSE2 version.
+ */
+SIMD_TARGET("avx2")
+static void
+_jpeg_avx2_rgb2ycbcr_row(JPEG_ENCODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int width)
+{
+	const __m128i r_shift = _mm_cvtsi32_si128(_rgb_r_shift_32);
+	const __m128i g_shift = _mm_cvtsi32_si128(_rgb_g_shift_32);
+	const __m128i b_shift = _mm_cvtsi32_si128(_rgb_b_shift_32);
+	const __m256i mask = _mm256_set1_epi32(0xff), bias = _mm256_set1_epi16(128);
+	__m256i p0, p1, r, g, b, v;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		p0 = _mm256_loadu_si256((__m256i *)(addr + x * 4));
+		p1 = _mm256_loadu_si256((__m256i *)(addr + x * 4 + 32));
+		/* packing works per 128 bit lane, the final permute puts the
+		 * pixels back in order */
+		r = _mm256_packs_epi32(_mm256_and_si256(_mm256_srl_epi32(p0, r_shift), mask), _mm256_and_si256(_mm256_srl_epi32(p1, r_shift), mask));
+		g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srl_epi32(p0, g_shift), mask), _mm256_and_si256(_mm256_srl_epi32(p1, g_shift), mask));
+		b = _mm256_packs_epi32(_mm256_and_si256(_mm256_srl_epi32(p0, b_shift), mask), _mm256_and_si256(_mm256_srl_epi32(p1, b_shift), mask));
+
+		v = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(76)), _mm256_mullo_epi16(g, _mm256_set1_epi16(151))),
+				     _mm256_mullo_epi16(b, _mm256_set1_epi16(29)));
+		v = _mm256_sub_epi16(_mm256_srli_epi16(v, 8), bias);
+		_mm256_storeu_si256((__m256i *)(y + x), _mm256_permute4x64_epi64(v, 0xd8));
+		v = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(-43)), _mm256_mullo_epi16(g, _mm256_set1_epi16(-85))),
+				     _mm256_slli_epi16(b, 7));
+		_mm256_storeu_si256((__m256i *)(cb + x), _mm256_permute4x64_epi64(_mm256_srai_epi16(v, 8), 0xd8));
+		v = _mm256_add_epi16(_mm256_add_epi16(_mm256_slli_epi16(r, 7), _mm256_mullo_epi16(g, _mm256_set1_epi16(-107))),
+				     _mm256_mullo_epi16(b, _mm256_set1_epi16(-21)));
+		_mm256_storeu_si256((__m256i *)(cr + x), _mm256_permute4x64_epi64(_mm256_srai_epi16(v, 8), 0xd8));
+	}
+	if (x < width)
+		_jpeg_sse2_rgb2ycbcr_row(jpg, addr + x * 4, y + x, cb + x, cr + x, width - x);
+}
+
+
+#endif
+#endif
+
+
+
+#if defined(SIMD_ARM_NEON) && defined(ALLEGRO_LITTLE_ENDIAN)
+
+/* idct_1d_neon:
+ *  One pass of the AAN butterfly of _jpeg_c_idct on four lanes at once.
+ */
+static INLINE void
+idct_1d_neon(int32x4_t *x, int32x4_t *y)
+{
+	int32x4_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32x4_t tmp10, tmp11, tmp12, tmp13, z5, z10, z11, z12, z13;
+
+	tmp10 = vaddq_s32(x[0], x[4]);
+	tmp11 = vsubq_s32(x[0], x[4]);
+	tmp13 = vaddq_s32(x[2], x[6]);
+	tmp12 = vsubq_s32(vshrq_n_s32(vmulq_n_s32(vsubq_s32(x[2], x[6]), IFIX_1_414213562), 8), tmp13);
+	tmp0 = vaddq_s32(tmp10, tmp13);
+	tmp3 = vsubq_s32(tmp10, tmp13);
+	tmp1 = vaddq_s32(tmp11, tmp12);
+	tmp2 = vsubq_s32(tmp11, tmp12);
+	z13 = vaddq_s32(x[5], x[3]);
+	z10 = vsubq_s32(x[5], x[3]);
+	z11 = vaddq_s32(x[1], x[7]);
+	z12 = vsubq_s32(x[1], x[7]);
+	tmp7 = vaddq_s32(z11, z13);
+	tmp11 = vshrq_n_s32(vmulq_n_s32(vsubq_s32(z11, z13), IFIX_1_414213562), 8);
+	z5 = vshrq_n_s32(vmulq_n_s32(vaddq_s32(z10, z12), IFIX_1_847759065), 8);
+	tmp10 = vsubq_s32(vshrq_n_s32(vmulq_n_s32(z12, IFIX_1_082392200), 8), z5);
+	tmp12 = vaddq_s32(vshrq_n_s32(vmulq_n_s32(z10, -IFIX_2_613125930), 8), z5);
+	tmp6 = vsubq_s32(tmp12, tmp7);
+	tmp5 = vsubq_s32(tmp11, tmp6);
+	tmp4 = vaddq_s32(tmp10, tmp5);
+	y[0] = vaddq_s32(tmp0, tmp7);
+	y[7] = vsubq_s32(tmp0, tmp7);
+	y[1] = vaddq_s32(tmp1, tmp6);
+	y[6] = vsubq_s32(tmp1, tmp6);
+	y[2] = vaddq_s32(tmp2, tmp5);
+	y[5] = vsubq_s32(tmp2, tmp5);
+	y[4] = vaddq_s32(tmp3, tmp4);
+	y[3] = vsubq_s32(tmp3, tmp4);
+}
+
+
+/* transpose_neon:
+ *  Transposes the 4x4 block of ints in a[0..3] into b[0..3].
+ */
+static INLINE void
+transpose_neon(int32x4_t *a, int32x4_t *b)
+{
+	int32x4x2_t p = vtrnq_s32(a[0], a[1]);
+	int32x4x2_t q = vtrnq_s32(a[2], a[3]);
+
+	b[0] = vcombine_s32(vget_low_s32(p.val[0]), vget_low_s32(q.val[0]));
+	b[1] = vcombine_s32(vget_low_s32(p.val[1]), vget_low_s32(q.val[1]));
+	b[2] = vcombine_s32(vget_high_s32(p.val[0]), vget_high_s32(q.val[0]));
+	b[3] = vcombine_s32(vget_high_s32(p.val[1]), vget_high_s32(q.val[1]));
+}
+
+
+/* descale_neon:
+ *  Final scaling of _jpeg_c_idct for two vectors of four ints; vmovn
+ *  truncates like the C cast to short.
+ */
+static INLINE int16x8_t
+descale_neon(int32x4_t a, int32x4_t b)
+{
+	const int32x4_t bias = vdupq_n_s32(128);
+
+	return vcombine_s16(vmovn_s32(vaddq_s32(vshrq_n_s32(a, 5), bias)), vmovn_s32(vaddq_s32(vshrq_n_s32(b, 5), bias)));
+}
+
+
+/* _jpeg_neon_idct:
+ *  NEON version of _jpeg_c_idct, laid out like _jpeg_sse2_idct.
+ */
+static void
+_jpeg_neon_idct(short *data, short *output, short *dequant, short *workspace)
+{
+	int32x4_t left[8], right[8], tmp[8], rows[8], cols[8];
+	int16x8_t d, q;
+	int i;
+
+	(void)workspace;
+
+	for (i = 0; i < 8; i++) {
+		d = vld1q_s16(data + i * 8);
+		q = vld1q_s16(dequant + i * 8);
+		left[i] = vmull_s16(vget_low_s16(d), vget_low_s16(q));
+		right[i] = vmull_s16(vget_high_s16(d), vget_high_s16(q));
+	}
+	idct_1d_neon(left, left);
+	idct_1d_neon(right, right);
+
+	transpose_neon(left, cols);
+	transpose_neon(right, cols + 4);
+	transpose_neon(left + 4, rows);
+	transpose_neon(right + 4, rows + 4);
+	idct_1d_neon(cols, cols);
+	idct_1d_neon(rows, rows);
+
+	transpose_neon(cols, tmp);
+	transpose_neon(cols + 4, tmp + 4);
+	for (i = 0; i < 4; i++)
+		vst1q_s16(output + i * 8, descale_neon(tmp[i], tmp[i + 4]));
+	transpose_neon(rows, tmp);
+	transpose_neon(rows + 4, tmp + 4);
+	for (i = 0; i < 4; i++)
+		vst1q_s16(output + (i + 4) * 8, descale_neon(tmp[i], tmp[i + 4]));
+}
+
+
+/* load_chroma_neon:
+ *  Like load_chroma_sse2.
+ */
+static INLINE int16x8_t
+load_chroma_neon(short *c, int dup)
+{
+	int16x4x2_t v;
+
+	if (dup) {
+		v = vzip_s16(vld1_s16(c), vld1_s16(c));
+		return vcombine_s16(v.val[0], v.val[1]);
+	}
+	return vld1q_s16(c);
+}
+
+
+/* convert_neon:
+ *  Computes ((y << 8) + k1 * c1 + k2 * c2 + ofs) >> 8 clamped to 0-255.
+ */
+static INLINE uint8x8_t
+convert_neon(int16x8_t y, int16x8_t c1, int k1, int16x8_t c2, int k2, int ofs)
+{
+	int32x4_t lo = vshll_n_s16(vget_low_s16(y), 8), hi = vshll_n_s16(vget_high_s16(y), 8);
+
+	lo = vmlal_n_s16(vmlal_n_s16(vaddq_s32(lo, vdupq_n_s32(ofs)), vget_low_s16(c1), k1), vget_low_s16(c2), k2);
+	hi = vmlal_n_s16(vmlal_n_s16(vaddq_s32(hi, vdupq_n_s32(ofs)), vget_high_s16(c1), k1), vget_high_s16(c2), k2);
+
+	return vqmovun_s16(vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, 8)), vqmovn_s32(vshrq_n_s32(hi, 8))));
+}
+
+
+/* _jpeg_neon_ycbcr2rgb_row:
+ *  NEON version of _jpeg_c_ycbcr2rgb_row. Allegro keeps 24 bit components
+ *  on byte boundaries, so the shifts pick the plane of each component.
+ */
+static void
+_jpeg_neon_ycbcr2rgb_row(JPEG_DECODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int dup)
+{
+	int16x8_t yv = vld1q_s16(y), cbv = load_chroma_neon(cb, dup), crv = load_chroma_neon(cr, dup);
+	uint8x8x3_t out;
+
+	(void)jpg;
+
+	out.val[_rgb_r_shift_24 >> 3] = convert_neon(yv, crv, 359, cbv, 0, -YCC_R_OFS);
+	out.val[_rgb_g_shift_24 >> 3] = convert_neon(yv, cbv, -88, crv, -183, YCC_G_OFS);
+	out.val[_rgb_b_shift_24 >> 3] = convert_neon(yv, cbv, 453, crv, 0, -YCC_B_OFS);
+
+	vst3_u8(addr, out);
+}
+
+
+/* fdct_1d_neon:
+ *  One pass of apply_fdct on four lanes at once; see fdct_1d_sse2.
+ */
+static INLINE void
+fdct_1d_neon(int32x4_t *x, int32x4_t *y, int pass)
+{
+	const int32x4_t shift = vdupq_n_s32(pass == 1 ? -11 : -15);
+	int32x4_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32x4_t tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5;
+
+	tmp0 = vaddq_s32(x[0], x[7]);
+	tmp7 = vsubq_s32(x[0], x[7]);
+	tmp1 = vaddq_s32(x[1], x[6]);
+	tmp6 = vsubq_s32(x[1], x[6]);
+	tmp2 = vaddq_s32(x[2], x[5]);
+	tmp5 = vsubq_s32(x[2], x[5]);
+	tmp3 = vaddq_s32(x[3], x[4]);
+	tmp4 = vsubq_s32(x[3], x[4]);
+
+	tmp10 = vaddq_s32(tmp0, tmp3);
+	tmp13 = vsubq_s32(tmp0, tmp3);
+	tmp11 = vaddq_s32(tmp1, tmp2);
+	tmp12 = vsubq_s32(tmp1, tmp2);
+
+	if (pass == 1) {
+		y[0] = vshlq_n_s32(vaddq_s32(tmp10, tmp11), 2);
+		y[4] = vshlq_n_s32(vsubq_s32(tmp10, tmp11), 2);
+	}
+	else {
+		y[0] = vshrq_n_s32(vaddq_s32(tmp10, tmp11), 2);
+		y[4] = vshrq_n_s32(vsubq_s32(tmp10, tmp11), 2);
+	}
+
+	z1 = vmulq_n_s32(vaddq_s32(tmp12, tmp13), FIX_0_541196100);
+	y[2] = vshlq_s32(vmlaq_n_s32(z1, tmp13, FIX_0_765366865), shift);
+	y[6] = vshlq_s32(vmlaq_n_s32(z1, tmp12, -FIX_1_847759065), shift);
+
+	z1 = vaddq_s32(tmp4, tmp7);
+	z2 = vaddq_s32(tmp5, tmp6);
+	z3 = vaddq_s32(tmp4, tmp6);
+	z4 = vaddq_s32(tmp5, tmp7);
+	z5 = vmulq_n_s32(vaddq_s32(z3, z4), FIX_1_175875602);
+
+	tmp4 = vmulq_n_s32(tmp4, FIX_0_298631336);
+	tmp5 = vmulq_n_s32(tmp5, FIX_2_053119869);
+	tmp6 = vmulq_n_s32(tmp6, FIX_3_072711026);
+	tmp7 = vmulq_n_s32(tmp7, FIX_1_501321110);
+	z1 = vmulq_n_s32(z1, -FIX_0_899976223);
+	z2 = vmulq_n_s32(z2, -FIX_2_562915447);
+	z3 = vmlaq_n_s32(z5, z3, -FIX_1_961570560);
+	z4 = vmlaq_n_s32(z5, z4, -FIX_0_390180644);
+
+	y[7] = vshlq_s32(vaddq_s32(vaddq_s32(tmp4, z1), z3), shift);
+	y[5] = vshlq_s32(vaddq_s32(vaddq_s32(tmp5, z2), z4), shift);
+	y[3] = vshlq_s32(vaddq_s32(vaddq_s32(tmp6, z2), z3), shift);
+	y[1] = vshlq_s32(vaddq_s32(vaddq_s32(tmp7, z1), z4), shift);
+}
+
+
+/* _jpeg_neon_fdct:
+ *  NEON version of apply_fdct, laid out like _jpeg_sse2_fdct.
+ */
+static void
+_jpeg_neon_fdct(short *data)
+{
+	int32x4_t left[8], right[8], top[8], bottom[8];
+	int16x8_t d;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		d = vld1q_s16(data + i * 8);
+		left[i] = vmovl_s16(vget_low_s16(d));
+		right[i] = vmovl_s16(vget_high_s16(d));
+	}
+
+	transpose_neon(left, top);
+	transpose_neon(right, top + 4);
+	transpose_neon(left + 4, bottom);
+	transpose_neon(right + 4, bottom + 4);
+	fdct_1d_neon(top, top, 1);
+	fdct_1d_neon(bottom, bottom, 1);
+	for (i = 0; i < 8; i++) {
+		top[i] = vmovl_s16(vmovn_s32(top[i]));
+		bottom[i] = vmovl_s16(vmovn_s32(bottom[i]));
+	}
+
+	transpose_neon(top, left);
+	transpose_neon(bottom, left + 4);
+	transpose_neon(top + 4, right);
+	transpose_neon(bottom + 4, right + 4);
+	fdct_1d_neon(left, left, 2);
+	fdct_1d_neon(right, right, 2);
+
+	for (i = 0; i < 8; i++)
+		vst1q_s16(data + i * 8, vcombine_s16(vmovn_s32(left[i]), vmovn_s32(right[i])));
+}
+
+
+/* _jpeg_neon_rgb2ycbcr_row:
+ *  NEON version of _jpeg_c_rgb2ycbcr_row, 8 pixels at a time. As with 24
+ *  bits, 32 bit components sit on byte boundaries, so vld4 splits them.
+ */
+static void
+_jpeg_neon_rgb2ycbcr_row(JPEG_ENCODER *jpg, unsigned char *addr, short *y, short *cb, short *cr, int width)
+{
+	uint8x8x4_t p;
+	uint16x8_t r, g, b;
+	int16x8_t v;
+	int x;
+
+	(void)jpg;
+
+	for (x = 0; x < width; x += 8) {
+		p = vld4_u8(addr + x * 4);
+		r = vmovl_u8(p.val[_rgb_r_shift_32 >> 3]);
+		g = vmovl_u8(p.val[_rgb_g_shift_32 >> 3]);
+		b = vmovl_u8(p.val[_rgb_b_shift_32 >> 3]);
+
+		v = vreinterpretq_s16_u16(vshrq_n_u16(vmlaq_n_u16(vmlaq_n_u16(vmulq_n_u16(r, 76), g, 151), b, 29), 8));
+		vst1q_s16(y + x, vsubq_s16(v, vdupq_n_s16(128)));
+		v = vmlaq_n_s16(vmlaq_n_s16(vmulq_n_s16(vreinterpretq_s16_u16(r), -43), vreinterpretq_s16_u16(g), -85), vreinterpretq_s16_u16(b), 128);
+		vst1q_s16(cb + x, vshrq_n_s16(v, 8));
+		v = vmlaq_n_s16(vmlaq_n_s16(vmulq_n_s16(vreinterpretq_s16_u16(r), 128), vreinterpretq_s16_u16(g), -107), vreinterpretq_s16_u16(b), -21);
+		vst1q_s16(cr + x, vshrq_n_s16(v, 8));
+	}
+}
+
+#endif
+
+
+
+/* _jpeg_simd_decoder:
+ *  Replaces the C kernels of the decoder by the best vector versions the
+ *  CPU runs.
+ */
+void
+_jpeg_simd_decoder(JPEG_DECODER *jpg)
+{
+#ifdef SIMD_X86
+	if (simd_caps() & SIMD_SSE2) {
+		jpg->idct = _jpeg_sse2_idct;
+		jpg->ycbcr2rgb_row = _jpeg_sse2_ycbcr2rgb_row;
+		TRACE("Using SSE2...");
+	}
+#ifdef SIMD_X86_AVX2
+	if (simd_caps() & SIMD_AVX2) {
+		jpg->idct = _jpeg_avx2_idct;
+		jpg->ycbcr2rgb_row = _jpeg_avx2_ycbcr2rgb_row;
+		TRACE("Using AVX2...");
+	}
+#endif
+#elif defined(SIMD_ARM_NEON) && defined(ALLEGRO_LITTLE_ENDIAN)
+	if (simd_caps() & SIMD_NEON) {
+		jpg->idct = _jpeg_neon_idct;
+		jpg->ycbcr2rgb_row = _jpeg_neon_ycbcr2rgb_row;
+		TRACE("Using NEON...");
+	}
+#else
+	(void)jpg;
+#endif
+}
+
+
+
+/* _jpeg_simd_encoder:
+ *  Replaces the C kernels of the encoder by the best vector versions the
+ *  CPU runs.
+ */
+void
+_jpeg_simd_encoder(JPEG_ENCODER *jpg)
+{
+#ifdef SIMD_X86
+	if (simd_caps() & SIMD_SSE2) {
+		jpg->fdct = _jpeg_sse2_fdct;
+		jpg->rgb2ycbcr_row = _jpeg_sse2_rgb2ycbcr_row;
+	}
+#ifdef SIMD_X86_AVX2
+	if (simd_caps() & SIMD_AVX2) {
+		jpg->fdct = _jpeg_avx2_fdct;
+		jpg->rgb2ycbcr_row = _jpeg_avx2_rgb2ycbcr_row;
+	}
+#endif
+#elif defined(SIMD_ARM_NEON) && defined(ALLEGRO_LITTLE_ENDIAN)
+	if (simd_caps() & SIMD_NEON) {
+		jpg->fdct = _jpeg_neon_fdct;
+		jpg->rgb2ycbcr_row = _jpeg_neon_rgb2ycbcr_row;
+	}
+#else
+	(void)jpg;
+#endif
+}
@@ -0,0 +1,571 @@
+/*******************************************************************************************
+
+ loader.c
+
+ class Allegro::Loader
+ class Allegro::Loader::Future
+
+ Loading assets on native background threads. The threads only read and
+ decode, from copies of the file names and blobs that the jobs own;
+ everything that touches ruby or the Allegro state, converting images to
+ the current color depth, building samples and wrapping the results,
+ happens in Loader#update on the main thread, a few loads per call.
+
+*******************************************************************************************/
+
+#include "global.h"
+
+#define LOAD_IMAGE	0
+#define LOAD_SAMPLE	1
+
+typedef struct LoadJob
+{
+  Job job;
+  int kind;
+  ImageLoad image;
+  SAMPLE *sample;
+  char *path;
+  void *data;
+  long size;
+  VALUE future;
+  struct LoadJob *prev;
+  struct LoadJob *next;
+} LoadJob;
+
+typedef struct Loader
+{
+  JobQueue *queue;
+  LoadJob *jobs;
+  int pending;
+  double budget;
+} Loader;
+
+typedef struct Future
+{
+  VALUE loader;
+  LoadJob *job;
+  VALUE value;
+  VALUE error;
+} Future;
+
+/* Milliseconds Loader#update spends per call unless told otherwise. */
+#define DEFAULT_BUDGET 2.0
+
+/* Reads a whole file with stdio, which unlike packfiles is safe on
+ * any thread. Returns NULL if it cannot.
+ */
+static void *read_file(const char *path, long *size) {
+  FILE *f = fopen(path, "rb");
+  void *data = NULL;
+  long len;
+
+  if (!f)
+    return NULL;
+
+  if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+    data = malloc(len);
+    if (data && fread(data, 1, len, f) != (size_t) len) {
+      free(data);
+      data = NULL;
+    }
+    *size = len;
+  }
+
+  fclose(f);
+
+  return data;
+}
+
+/* Runs on a background thread, so it must not touch ruby objects or
+ * Allegro. Samples are only read here; loader_deliver builds them.
+ */
+static void load_run(void *data) {
+  LoadJob *job = (LoadJob *) data;
+
+  switch (job->kind) {
+  case LOAD_IMAGE:
+    image_decode(&job->image);
+    break;
+  case LOAD_SAMPLE:
+    job->data = read_file(job->path, &job->size);
+    break;
+  }
+}
+
+
+/* Samples from memory */
+
+typedef struct MemFile
+{
+  const unsigned char *data;
+  long size;
+  long pos;
+} MemFile;
+
+static int mem_fclose(void *f) {
+  return 0;
+}
+
+static int mem_getc(void *f) {
+  MemFile *m = (MemFile *) f;
+  return m->pos < m->size ? m->data[m->pos++] : EOF;
+}
+
+static int mem_ungetc(int c, void *f) {
+  MemFile *m = (MemFile *) f;
+  if (m->pos <= 0)
+    return EOF;
+  m->pos--;
+  return c;
+}
+
+static long mem_fread(void *p, long n, void *f) {
+  MemFile *m = (MemFile *) f;
+  n = MIN(n, m->size - m->pos);
+  memcpy(p, m->data + m->pos, n);
+  m->pos += n;
+  return n;
+}
+
+static int mem_putc(int c, void *f) {
+  return EOF;
+}
+
+static long mem_fwrite(AL_CONST void *p, long n, void *f) {
+  return 0;
+}
+
+static int mem_fseek(void *f, int offset) {
+  MemFile *m = (MemFile *) f;
+  if (offset < 0 || offset > m->size - m->pos) {
+    m->pos = m->size;
+    return -1;
+  }
+  m->pos += offset;
+  return 0;
+}
+
+static int mem_feof(void *f) {
+  MemFile *m = (MemFile *) f;
+  return m->pos >= m->size;
+}
+
+static int mem_ferror(void *f) {
+  return 0;
+}
+
+static PACKFILE_VTABLE mem_vtable = {
+  mem_fclose, mem_getc, mem_ungetc, mem_fread,
+  mem_putc, mem_fwrite, mem_fseek, mem_feof, mem_ferror
+};
+
+/* Builds the sample a worker read into job->data, choosing the loader by
+ * the file extension as load_sample does. Uses Allegro, so it must run
+ * on the main thread.
+ */
+static SAMPLE *sample_from_job(LoadJob *job) {
+  const char *ext = get_extension(job->path);
+  SAMPLE *sample = NULL;
+  PACKFILE *pf;
+  MemFile m;
+
+  if (!job->data)
+    return NULL;
+
+  m.data = (const unsigned char *) job->data;
+  m.size = job->size;
+  m.pos = 0;
+
+  pf = pack_fopen_vtable(&mem_vtable, &m);
+  if (!pf)
+    return NULL;
+
+  if (ustricmp(ext, "wav") == 0)
+    sample = load_wav_pf(pf);
+  else if (ustricmp(ext, "voc") == 0)
+    sample = load_voc_pf(pf);
+
+  pack_fclose(pf);
+
+  return sample;
+}
+
+
+static void job_free(LoadJob *job) {
+  if (job->image.bmp)
+    destroy_bitmap(job->image.bmp);
+  if (job->sample)
+    destroy_sample(job->sample);
+  free(job->path);
+  free(job->data);
+  free(job);
+}
+
+static void loader_mark(Loader *loader) {
+  LoadJob *job;
+
+  for (job = loader->jobs; job; job = job->next) {
+    rb_gc_mark(job->future);
+  }
+}
+
+/* Any futures still waiting are garbage as well, since they keep the
+ * loader alive; the loads they wait for are thrown away.
+ */
+static void loader_free(Loader *loader) {
+  LoadJob *job, *next;
+
+  if (loader->queue)
+    jobs_stop(loader->queue);
+
+  for (job = loader->jobs; job; job = next) {
+    next = job->next;
+    job_free(job);
+  }
+
+  free(loader);
+}
+
+static void future_mark(Future *future) {
+  rb_gc_mark(future->loader);
+  rb_gc_mark(future->value);
+  rb_gc_mark(future->error);
+}
+
+static inline Loader* get_loader(VALUE self) {
+  Loader *loader;
+  Data_Get_Struct(self, Loader, loader);
+  return loader;
+}
+
+static inline Future* get_future(VALUE self) {
+  Future *future;
+  Data_Get_Struct(self, Future, future);
+  return future;
+}
+
+/**
+ * Makes a job for a copy of source, a file name or, with blob set, the
+ * bytes of an image, and returns the future for it. The job owns the
+ * copy, so the workers never read ruby strings, which the GC may free
+ * along with the loader while a decode still runs.
+ */
+static LoadJob *loader_push(VALUE self, int kind, VALUE source, int blob, VALUE *obj) {
+  Loader *loader = get_loader(self);
+  LoadJob *job;
+  Future *future;
+
+  *obj = Data_Make_Struct(c_allegro_future, Future, future_mark, free, future);
+  future->loader = self;
+  future->value = Qnil;
+  future->error = Qnil;
+
+  job = (LoadJob *) calloc(1, sizeof(LoadJob));
+  if (job) {
+    if (blob) {
+      job->size = RSTRING(source)->len;
+      if ((job->data = malloc(MAX(job->size, 1))))
+	memcpy(job->data, RSTRING(source)->ptr, job->size);
+    }
+    else if ((job->path = (char *) malloc(RSTRING(source)->len + 1))) {
+      memcpy(job->path, RSTRING(source)->ptr, RSTRING(source)->len);
+      job->path[RSTRING(source)->len] = 0;
+    }
+  }
+  if (!job || (blob ? !job->data : !job->path)) {
+    if (job)
+      job_free(job);
+    rb_raise(rb_eNoMemError, "out of memory");
+  }
+
+  job->job.func = load_run;
+  job->job.data = job;
+  job->kind = kind;
+  job->future = *obj;
+
+  job->next = loader->jobs;
+  if (loader->jobs)
+    loader->jobs->prev = job;
+  loader->jobs = job;
+  loader->pending++;
+
+  future->job = job;
+
+  return job;
+}
+
+/* Finishes a job the queue handed back and passes its result or error
+ * to the future.
+ */
+static void loader_deliver(Loader *loader, LoadJob *job) {
+  Future *future = get_future(job->future);
+  BITMAP *bmp;
+  char msg[512];
+
+  switch (job->kind) {
+  case LOAD_IMAGE:
+    bmp = image_finish(&job->image);
+    job->image.bmp = NULL;
+    if (bmp) {
+      set_clip_rect(bmp, 0, 0, bmp->w - 1, bmp->h - 1);
+      future->value = Data_Wrap_Struct(c_allegro_bitmap, 0, bitmap_free, bmp);
+    } else {
+      if (job->image.file)
+	snprintf(msg, sizeof(msg), "could not load bitmap: %s (%s)", job->image.file, image_error(&job->image));
+      else
+	snprintf(msg, sizeof(msg), "could not load bitmap from blob (%s)", image_error(&job->image));
+      future->error = rb_str_new2(msg);
+    }
+    break;
+  case LOAD_SAMPLE:
+    if ((job->sample = sample_from_job(job))) {
+      future->value = Data_Wrap_Struct(c_allegro_sample, 0, destroy_sample, job->sample);
+      job->sample = NULL;
+    } else {
+      snprintf(msg, sizeof(msg), "could not load sample: %s", job->path);
+      future->error = rb_str_new2(msg);
+    }
+    break;
+  }
+
+  future->job = NULL;
+
+  if (job->prev)
+    job->prev->next = job->next;
+  else
+    loader->jobs = job->next;
+  if (job->next)
+    job->next->prev = job->prev;
+  loader->pending--;
+
+  job_free(job);
+}
+
+static void *wait_done(void *queue) {
+  return jobs_done((JobQueue *) queue, TRUE);
+}
+
+/**
+ * call-seq: new(:threads => n, :budget_ms => 2.0)
+ *
+ * Starts a loader with n background threads, by default one less than
+ * the processors online, and at least one. The budget is how many
+ * milliseconds #update spends handing out finished loads.
+ *
+ *   loader = Loader.new(:threads => 2)
+ */
+static VALUE loader_new(int argc, VALUE *argv, VALUE self) {
+  VALUE opts, value, obj;
+  Loader *loader;
+  int threads;
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  value = get_option(opts, "threads");
+  threads = NIL_P(value) ? MAX(cpu_count() - 1, 1) : NUM2INT(value);
+  if (threads < 1) {
+    rb_raise(rb_eArgError, "threads must be at least 1");
+  }
+
+  obj = Data_Make_Struct(self, Loader, loader_mark, loader_free, loader);
+
+  value = get_option(opts, "budget_ms");
+  loader->budget = NIL_P(value) ? DEFAULT_BUDGET : NUM2DBL(value);
+
+  loader->queue = jobs_start(threads);
+  if (!loader->queue) {
+    rb_raise(rb_eNoMemError, "out of memory");
+  }
+
+  return obj;
+}
+
+/**
+ * call-seq: load(file, :scale => s)
+ *
+ * Queues an image file to be loaded in the background, and returns a
+ * Future for the Bitmap. Takes the same files and options as
+ * Bitmap.load. PNG and JPEG files are decoded on the loader threads;
+ * other formats are loaded by #update.
+ *
+ *   tiles = loader.load("zone2/tiles.png")
+ */
+static VALUE loader_load(int argc, VALUE *argv, VALUE self) {
+  VALUE file, opts, obj;
+  LoadJob *job;
+  int scale;
+
+  rb_scan_args(argc, argv, "11", &file, &opts);
+
+  Check_Type(file, T_STRING);
+  scale = get_scale_option(opts);
+
+  job = loader_push(self, LOAD_IMAGE, file, FALSE, &obj);
+  image_prepare(&job->image, job->path);
+  job->image.scale = scale;
+  jobs_push(get_loader(self)->queue, &job->job);
+
+  return obj;
+}
+
+/**
+ * call-seq: load_blob(string, format = :auto)
+ *
+ * Queues a PNG or JPEG image held in a String to be decoded in the
+ * background, and returns a Future for the Bitmap. See
+ * Bitmap.from_blob; unlike it, the loader works on a copy of the
+ * String, so the String may change or go away meanwhile.
+ */
+static VALUE loader_load_blob(int argc, VALUE *argv, VALUE self) {
+  VALUE str, format, obj;
+  const char *name;
+  LoadJob *job;
+  ImageLoad check;
+
+  rb_scan_args(argc, argv, "11", &str, &format);
+
+  Check_Type(str, T_STRING);
+  name = get_format_option(format);
+  if (!image_prepare_memory(&check, RSTRING(str)->ptr, RSTRING(str)->len, name)) {
+    rb_raise(rb_eArgError, "not a PNG or JPEG image");
+  }
+
+  job = loader_push(self, LOAD_IMAGE, str, TRUE, &obj);
+  image_prepare_memory(&job->image, job->data, job->size, name);
+  jobs_push(get_loader(self)->queue, &job->job);
+
+  return obj;
+}
+
+/**
+ * call-seq: load_sample(file)
+ *
+ * Queues a WAV or VOC file to be read in the background, and returns
+ * a Future for the Sample, which #update builds from the bytes read.
+ */
+static VALUE loader_load_sample(VALUE self, VALUE file) {
+  VALUE obj;
+  LoadJob *job;
+
+  Check_Type(file, T_STRING);
+
+  job = loader_push(self, LOAD_SAMPLE, file, FALSE, &obj);
+  jobs_push(get_loader(self)->queue, &job->job);
+
+  return obj;
+}
+
+/**
+ * call-seq: update(budget_ms = budget_ms)
+ *
+ * Hands out the loads that finished since the last call, until the
+ * budget is spent, and returns how many it handed out. Their futures
+ * become ready. Call once per frame; it always hands out at least one
+ * finished load, so a small budget slows loading down but never stops
+ * it.
+ *
+ *   Allegro.run(60, lambda { |dt| loader.update; world.step(dt) },
+ *                   lambda { |alpha| world.draw(buf, alpha) })
+ */
+static VALUE loader_update(int argc, VALUE *argv, VALUE self) {
+  Loader *loader = get_loader(self);
+  VALUE budget;
+  LoadJob *job;
+  double start, limit;
+  int n = 0;
+
+  rb_scan_args(argc, argv, "01", &budget);
+
+  limit = NIL_P(budget) ? loader->budget : NUM2DBL(budget);
+  start = timer_now();
+
+  while ((n == 0 || (timer_now() - start) * 1000.0 < limit) && (job = (LoadJob *) jobs_done(loader->queue, FALSE))) {
+    loader_deliver(loader, job);
+    n++;
+  }
+
+  return INT2NUM(n);
+}
+
+/**
+ * Returns the number of loads that are queued, running, or finished
+ * but not yet handed out by #update.
+ */
+static VALUE loader_pending(VALUE self) {
+  return INT2NUM(get_loader(self)->pending);
+}
+
+static VALUE loader_get_budget(VALUE self) {
+  return rb_float_new(get_loader(self)->budget);
+}
+
+static VALUE loader_set_budget(VALUE self, VALUE budget) {
+  get_loader(self)->budget = NUM2DBL(budget);
+  return budget;
+}
+
+/**
+ * Returns true once #update has handed out the load.
+ */
+static VALUE future_is_ready(VALUE self) {
+  return get_future(self)->job ? Qfalse : Qtrue;
+}
+
+/**
+ * Returns the loaded Bitmap or Sample. If the load is not ready yet it
+ * waits for it, handing out every load that finishes meanwhile, with the
+ * interpreter lock released. Raises RuntimeError if the load failed.
+ */
+static VALUE future_value(VALUE self) {
+  Future *future = get_future(self);
+  Loader *loader;
+  LoadJob *job;
+
+  if (future->job) {
+    loader = get_loader(future->loader);
+    while (future->job && (job = (LoadJob *) call_without_gvl(wait_done, loader->queue))) {
+      loader_deliver(loader, job);
+    }
+  }
+
+  if (!NIL_P(future->error)) {
+    rb_raise(rb_eRuntimeError, "%s", RSTRING(future->error)->ptr);
+  }
+
+  return future->value;
+}
+
+void Init_allegro_loader() {
+
+  /**
+   * A Loader reads and decodes images and samples on background threads
+   * while the game keeps running, and hands them out on the main thread
+   * through #update, a few milliseconds per frame:
+   *
+   *   loader = Loader.new
+   *   next_zone = files.map { |f| loader.load(f) }
+   *   loop do
+   *     loader.update
+   *     enter_zone(next_zone.map { |f| f.value }) if next_zone.all? { |f| f.ready? }
+   *     ...
+   *   end
+   *
+   * Loaded bitmaps are memory bitmaps.
+   */
+  c_allegro_loader = rb_define_class_under(m_allegro, "Loader", rb_cObject);
+  c_allegro_future = rb_define_class_under(c_allegro_loader, "Future", rb_cObject);
+
+  rb_define_singleton_method(c_allegro_loader, "new",		loader_new,		-1);
+
+  rb_define_method(c_allegro_loader, "load",			loader_load,		-1);
+  rb_define_method(c_allegro_loader, "load_blob",		loader_load_blob,	-1);
+  rb_define_method(c_allegro_loader, "load_sample",		loader_load_sample,	1);
+  rb_define_method(c_allegro_loader, "update",			loader_update,		-1);
+  rb_define_method(c_allegro_loader, "pending",			loader_pending,		0);
+  rb_define_method(c_allegro_loader, "budget_ms",		loader_get_budget,	0);
+  rb_define_method(c_allegro_loader, "budget_ms=",		loader_set_budget,	1);
+
+  rb_undef_alloc_func(c_allegro_future);
+  rb_define_method(c_allegro_future, "ready?",			future_is_ready,	0);
+  rb_define_method(c_allegro_future, "value",			future_value,		0);
+}
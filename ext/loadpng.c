@@ -75,9 +75,15 @@ static int check_if_png(PACKFILE *fp)
 
 
 /* really_load_png:
- *  Worker routine, used by load_png and load_memory_png.
+ *  Worker routine, used by load_png_io.  Leaves the image at the colour
+ *  depth of the file, or with depth 32 expands every image but paletted
+ *  ones without transparency to 32 bpp as it is read; those stay 8 bpp,
+ *  so that index 0 keeps working as the mask colour.  Touches no global
+ *  state, so several threads may run it at once.  The bitmap goes to *out
+ *  as soon as it exists, so that the caller can free it when libpng bails
+ *  out half way.
  */
-static BITMAP *really_load_png(png_structp png_ptr, png_infop info_ptr, RGB *pal)
+static void really_load_png(png_structp png_ptr, png_infop info_ptr, RGB *pal, int depth, BITMAP **out)
 {
     BITMAP *bmp;
     PALETTE tmppal;
@@ -85,8 +91,9 @@ static BITMAP *really_load_png(png_structp png_ptr, png_infop info_ptr, RGB *pal
     int bit_depth, color_type, interlace_type;
     double image_gamma, screen_gamma;
     int intent;
-    int bpp, dest_bpp;
+    int bpp;
     int tRNS_to_alpha = FALSE;
+    int expand;
     int number_passes, pass;
 
     ASSERT(png_ptr && info_ptr && rgb);
@@ -115,6 +122,23 @@ static BITMAP *really_load_png(png_structp png_ptr, png_infop info_ptr, RGB *pal
 	tRNS_to_alpha = TRUE;
     }
 
+    /* For 32 bpp, expand palettes to RGB triplets, and give images with
+     * no alpha channel a zero one, which is what converting them to
+     * 32 bpp would give.  Paletted images without tRNS are left alone:
+     * as 8 bpp bitmaps their index 0 is transparent to draw_sprite(),
+     * which expanding them would lose.
+     */
+    expand = (depth == 32) && !((color_type == PNG_COLOR_TYPE_PALETTE) && !tRNS_to_alpha);
+    if (expand) {
+	png_set_expand(png_ptr);
+	if (!(color_type & PNG_COLOR_MASK_ALPHA) && !tRNS_to_alpha)
+#ifdef ALLEGRO_BIG_ENDIAN
+	    png_set_filler(png_ptr, 0, PNG_FILLER_BEFORE);
+#else
+	    png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+#endif
+    }
+
     /* Convert 16-bits per colour component to 8-bits per colour component. */
     if (bit_depth == 16)
 	png_set_strip_16(png_ptr);
@@ -153,7 +177,7 @@ static BITMAP *really_load_png(png_structp png_ptr, png_infop info_ptr, RGB *pal
 	pal = tmppal;
     
     /* Palettes. */
-    if (color_type & PNG_COLOR_MASK_PALETTE) {
+    if ((color_type & PNG_COLOR_MASK_PALETTE) && !expand) {
 	int num_palette, i;
 	png_colorp palette;
 
@@ -182,8 +206,9 @@ static BITMAP *really_load_png(png_structp png_ptr, png_infop info_ptr, RGB *pal
     if (bpp < 8)
 	bpp = 8;
 
-    dest_bpp = _color_load_depth(bpp, (bpp == 32));
-    bmp = create_bitmap_ex(bpp, width, height);
+    bmp = *out = create_bitmap_ex(bpp, width, height);
+    if (!bmp)
+	png_error(png_ptr, "out of memory (loadpng calling create_bitmap_ex)");
 
     /* Maybe flip RGB to BGR. */
     if ((bpp == 24) || (bpp == 32)) {
@@ -203,13 +228,95 @@ static BITMAP *really_load_png(png_structp png_ptr, png_infop info_ptr, RGB *pal
 	    png_read_row(png_ptr, bmp->line[y], NULL);
     }
 
+    /* Read rest of file, and get additional chunks in info_ptr. */
+    png_read_end(png_ptr, info_ptr);
+}
+
+
+
+/* load_png_io:
+ *  Sets up libpng to read through read_fn from io, whose signature has
+ *  already been checked, and loads the image at the colour depth of the
+ *  file, or at 32 bpp if depth is 32.  Returns NULL and sets *error on
+ *  failure.
+ */
+static BITMAP *load_png_io(png_rw_ptr read_fn, void *io, RGB *pal, int depth, int *error)
+{
+    BITMAP *volatile bmp = NULL;
+    png_structp png_ptr;
+    png_infop info_ptr;
+
+    /* Create and initialize the png_struct with the desired error handler
+     * functions.  If you want to use the default stderr and longjump method,
+     * you can supply NULL for the last three parameters.  We also supply the
+     * the compiler header file version, so that we know if the application
+     * was compiled with a compatible version of the library.
+     */
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+				     (void *)NULL, NULL, NULL);
+    if (!png_ptr) {
+	*error = LOADPNG_ERROR_OUT_OF_MEMORY;
+	return NULL;
+    }
+
+    /* Allocate/initialize the memory for image information. */
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+	png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+	*error = LOADPNG_ERROR_OUT_OF_MEMORY;
+	return NULL;
+    }
+
+    /* Set error handling if you are using the setjmp/longjmp method (this is
+     * the normal method of doing things with libpng).  REQUIRED unless you
+     * set up your own error handlers in the png_create_read_struct() earlier.
+     */
+    if (setjmp(png_ptr->jmpbuf)) {
+	/* Free all of the memory associated with the png_ptr and info_ptr */
+	png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+	/* If we get here, we had a problem reading the file */
+	if (bmp)
+	    destroy_bitmap(bmp);
+	*error = LOADPNG_ERROR_BAD_IMAGE;
+	return NULL;
+    }
+
+    png_set_read_fn(png_ptr, io, read_fn);
+
+    /* We have already read some of the signature. */
+    png_set_sig_bytes(png_ptr, PNG_BYTES_TO_CHECK);
+
+    /* Really load the image now. */
+    really_load_png(png_ptr, info_ptr, pal, depth, (BITMAP **)&bmp);
+
+    /* Clean up after the read, and free any memory allocated. */
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+
+    *error = LOADPNG_ERROR_NONE;
+    return bmp;
+}
+
+
+
+/* fixup_png:
+ *  Converts a bitmap returned by load_png_r() or load_memory_png_r() to the
+ *  colour depth Allegro wants for loaded images.  Uses global state, so it
+ *  belongs on the thread that owns Allegro.
+ */
+BITMAP *fixup_png(BITMAP *bmp, RGB *pal)
+{
+    int bpp, dest_bpp;
+
+    if (!bmp)
+	return NULL;
+
+    bpp = bitmap_color_depth(bmp);
+    dest_bpp = _color_load_depth(bpp, (bpp == 32));
+
     /* Let Allegro convert the image into the desired colour depth. */
     if (dest_bpp != bpp)
 	bmp = _fixup_loaded_bitmap(bmp, pal, dest_bpp);
 
-    /* Read rest of file, and get additional chunks in info_ptr. */
-    png_read_end(png_ptr, info_ptr);
-
     return bmp;
 }
 
@@ -243,9 +350,8 @@ BITMAP *load_png(AL_CONST char *filename, RGB *pal)
  */
 BITMAP *load_png_pf(PACKFILE *fp, RGB *pal)
 {
-    BITMAP *bmp;
-    png_structp png_ptr;
-    png_infop info_ptr;
+    PALETTE tmppal;
+    int error;
 
     ASSERT(fp);
 
@@ -253,49 +359,122 @@ BITMAP *load_png_pf(PACKFILE *fp, RGB *pal)
 	return NULL;
     }
 
-    /* Create and initialize the png_struct with the desired error handler
-     * functions.  If you want to use the default stderr and longjump method,
-     * you can supply NULL for the last three parameters.  We also supply the
-     * the compiler header file version, so that we know if the application
-     * was compiled with a compatible version of the library.
-     */
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-				     (void *)NULL, NULL, NULL);
-    if (!png_ptr) {
+    /* The conversion needs the palette of paletted images. */
+    if (!pal)
+	pal = tmppal;
+
+    /* Use Allegro packfile routines. */
+    return fixup_png(load_png_io((png_rw_ptr)read_data, fp, pal, 0, &error), pal);
+}
+
+
+
+/* read_data_stdio:
+ *  Custom read function for C streams.  Used by load_png_r, since
+ *  packfiles are not safe to use from several threads.
+ */
+static void read_data_stdio(png_structp png_ptr, png_bytep data, png_uint_32 length)
+{
+    FILE *f = (FILE *)png_get_io_ptr(png_ptr);
+    if ((png_uint_32)fread(data, 1, length, f) != length)
+	png_error(png_ptr, "read error (loadpng calling fread)");
+}
+
+
+
+/* load_png_r:
+ *  Reentrant version of load_png().  With depth 0 the image keeps the
+ *  colour depth of the file until it is passed to fixup_png(); with depth
+ *  32 every image is expanded to 32 bpp while it is read, which saves
+ *  converting it afterwards.  The error code goes to *error.
+ */
+BITMAP *load_png_r(AL_CONST char *filename, RGB *pal, int depth, int *error)
+{
+    unsigned char buf[PNG_BYTES_TO_CHECK];
+    BITMAP *bmp = NULL;
+    FILE *fp;
+
+    ASSERT(filename);
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+	*error = LOADPNG_ERROR_READING_FILE;
 	return NULL;
     }
 
-    /* Allocate/initialize the memory for image information. */
-    info_ptr = png_create_info_struct(png_ptr);
+    if (fread(buf, 1, PNG_BYTES_TO_CHECK, fp) != PNG_BYTES_TO_CHECK)
+	*error = LOADPNG_ERROR_READING_FILE;
+    else if (png_sig_cmp(buf, (png_size_t)0, PNG_BYTES_TO_CHECK) != 0)
+	*error = LOADPNG_ERROR_NOT_PNG;
+    else
+	bmp = load_png_io((png_rw_ptr)read_data_stdio, fp, pal, depth, error);
+
+    fclose(fp);
+
+    return bmp;
+}
+
+
+
+/* probe_png:
+ *  Reads the header of a PNG file, up to the IHDR chunk and whatever
+ *  precedes the image data, for its width, height, bits per pixel in the
+ *  file and whether it is interlaced.  Safe to call from any thread.
+ *  Returns LOADPNG_ERROR_NONE or an error code.
+ */
+int probe_png(AL_CONST char *filename, int *width, int *height, int *depth, int *interlaced)
+{
+    unsigned char buf[PNG_BYTES_TO_CHECK];
+    png_structp png_ptr;
+    png_infop info_ptr;
+    FILE *fp;
+    int error;
+
+    ASSERT(filename);
+
+    fp = fopen(filename, "rb");
+    if (!fp)
+	return LOADPNG_ERROR_READING_FILE;
+
+    if (fread(buf, 1, PNG_BYTES_TO_CHECK, fp) != PNG_BYTES_TO_CHECK) {
+	fclose(fp);
+	return LOADPNG_ERROR_READING_FILE;
+    }
+    if (png_sig_cmp(buf, (png_size_t)0, PNG_BYTES_TO_CHECK) != 0) {
+	fclose(fp);
+	return LOADPNG_ERROR_NOT_PNG;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+				     (void *)NULL, NULL, NULL);
+    info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
     if (!info_ptr) {
-	png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-	return NULL;
+	if (png_ptr)
+	    png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+	fclose(fp);
+	return LOADPNG_ERROR_OUT_OF_MEMORY;
     }
 
-    /* Set error handling if you are using the setjmp/longjmp method (this is
-     * the normal method of doing things with libpng).  REQUIRED unless you
-     * set up your own error handlers in the png_create_read_struct() earlier.
-     */
     if (setjmp(png_ptr->jmpbuf)) {
-	/* Free all of the memory associated with the png_ptr and info_ptr */
-	png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-	/* If we get here, we had a problem reading the file */
-	return NULL;
+	error = LOADPNG_ERROR_BAD_IMAGE;
     }
+    else {
+	png_set_read_fn(png_ptr, fp, (png_rw_ptr)read_data_stdio);
+	png_set_sig_bytes(png_ptr, PNG_BYTES_TO_CHECK);
 
-    /* Use Allegro packfile routines. */
-    png_set_read_fn(png_ptr, fp, (png_rw_ptr)read_data);
-
-    /* We have already read some of the signature. */
-    png_set_sig_bytes(png_ptr, PNG_BYTES_TO_CHECK);
+	png_read_info(png_ptr, info_ptr);
 
-    /* Really load the image now. */
-    bmp = really_load_png(png_ptr, info_ptr, pal);
+	*width = png_get_image_width(png_ptr, info_ptr);
+	*height = png_get_image_height(png_ptr, info_ptr);
+	*depth = png_get_bit_depth(png_ptr, info_ptr) * png_get_channels(png_ptr, info_ptr);
+	*interlaced = (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE);
+	error = LOADPNG_ERROR_NONE;
+    }
 
-    /* Clean up after the read, and free any memory allocated. */
     png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    fclose(fp);
 
-    return bmp;
+    return error;
 }
 
 
@@ -339,43 +518,32 @@ static int check_if_png_memory(AL_CONST void *buffer)
  */
 BITMAP *load_memory_png(AL_CONST void *buffer, int bufsize, RGB *pal)
 {
-    MEMORY_READER_STATE memory_reader_state;
-    BITMAP *bmp;
-    png_structp png_ptr;
-    png_infop info_ptr;
+    PALETTE tmppal;
+    int error;
 
-    if (!buffer || (bufsize <= 0))
-    	return NULL;
+    /* The conversion needs the palette of paletted images. */
+    if (!pal)
+	pal = tmppal;
 
-    if (!check_if_png_memory(buffer))
-	return NULL;
+    return fixup_png(load_memory_png_r(buffer, bufsize, pal, 0, &error), pal);
+}
 
-    /* Create and initialize the png_struct with the desired error handler
-     * functions.  If you want to use the default stderr and longjump method,
-     * you can supply NULL for the last three parameters.  We also supply the
-     * the compiler header file version, so that we know if the application
-     * was compiled with a compatible version of the library.
-     */
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-				     (void *)NULL, NULL, NULL);
-    if (!png_ptr)
-	return NULL;
 
-    /* Allocate/initialize the memory for image information. */
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-	png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+
+/* load_memory_png_r:
+ *  Reentrant version of load_memory_png(); see load_png_r().
+ */
+BITMAP *load_memory_png_r(AL_CONST void *buffer, int bufsize, RGB *pal, int depth, int *error)
+{
+    MEMORY_READER_STATE memory_reader_state;
+
+    if (!buffer || (bufsize < PNG_BYTES_TO_CHECK)) {
+	*error = LOADPNG_ERROR_READING_FILE;
 	return NULL;
     }
 
-    /* Set error handling if you are using the setjmp/longjmp method (this is
-     * the normal method of doing things with libpng).  REQUIRED unless you
-     * set up your own error handlers in the png_create_read_struct() earlier.
-     */
-    if (setjmp(png_ptr->jmpbuf)) {
-	/* Free all of the memory associated with the png_ptr and info_ptr */
-	png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-	/* If we get here, we had a problem reading the file */
+    if (!check_if_png_memory(buffer)) {
+	*error = LOADPNG_ERROR_NOT_PNG;
 	return NULL;
     }
 
@@ -385,16 +553,5 @@ BITMAP *load_memory_png(AL_CONST void *buffer, int bufsize, RGB *pal)
     memory_reader_state.current_pos = PNG_BYTES_TO_CHECK;
 
     /* Tell libpng to use our custom reader. */
-    png_set_read_fn(png_ptr, &memory_reader_state, (png_rw_ptr)read_data_memory);
-
-    /* We have already read some of the signature. */
-    png_set_sig_bytes(png_ptr, PNG_BYTES_TO_CHECK);
-
-    /* Really load the image now. */
-    bmp = really_load_png(png_ptr, info_ptr, pal);
-
-    /* Clean up after the read, and free any memory allocated. */
-    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-    
-    return bmp;
+    return load_png_io((png_rw_ptr)read_data_memory, &memory_reader_state, pal, depth, error);
 }
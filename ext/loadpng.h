@@ -45,9 +45,65 @@ extern BITMAP *load_png_pf(PACKFILE *fp, RGB *pal);
 /* Load a PNG from memory. */
 extern BITMAP *load_memory_png(AL_CONST void *buffer, int buffer_size, RGB *pal);
 
+/* Reentrant loaders, safe to call from several threads at once.  With
+ * depth 0 they leave the image at the colour depth of the file, and with
+ * depth 32 they decode every image straight to 32 bpp, except paletted
+ * ones without transparency, which stay 8 bpp so index 0 still masks;
+ * pass it through fixup_png() afterwards, on the thread that owns Allegro.
+ */
+extern BITMAP *load_png_r(AL_CONST char *filename, RGB *pal, int depth, int *error);
+extern BITMAP *load_memory_png_r(AL_CONST void *buffer, int buffer_size, RGB *pal, int depth, int *error);
+extern BITMAP *fixup_png(BITMAP *bmp, RGB *pal);
+
+/* Read the size, bits per pixel and interlacing of a PNG from disk
+ * without loading it.  Safe to call from several threads at once.
+ */
+extern int probe_png(AL_CONST char *filename, int *width, int *height, int *depth, int *interlaced);
+
+/* Error codes of the reentrant loaders. */
+#define LOADPNG_ERROR_NONE			0
+#define LOADPNG_ERROR_READING_FILE		-1
+#define LOADPNG_ERROR_NOT_PNG		-2
+#define LOADPNG_ERROR_BAD_IMAGE		-3
+#define LOADPNG_ERROR_OUT_OF_MEMORY		-4
+
 /* Save a bitmap to disk in PNG format. */
 extern int save_png(AL_CONST char *filename, BITMAP *bmp, AL_CONST RGB *pal);
 
+/* Save a bitmap to disk in PNG format, with the zlib compression level
+ * (0-9), row filters and zlib strategy given.  Large memory bitmaps are
+ * deflated on up to threads threads.
+ */
+extern int save_png_ex(AL_CONST char *filename, BITMAP *bmp, AL_CONST RGB *pal, int level, int filter, int strategy, int threads);
+
+/* Save a bitmap in PNG format to a malloc'd buffer, which the caller
+ * frees.  Returns NULL on error, otherwise the length goes in *size.
+ */
+extern void *save_memory_png(BITMAP *bmp, AL_CONST RGB *pal, int level, int filter, int strategy, int threads, int *size);
+
+/* Row filters for the savers, the same bits as libpng's PNG_FILTER_*.
+ * Several may be or'ed together, to let libpng pick the best one for
+ * each row; LOADPNG_FILTER_DEFAULT leaves the choice to libpng.
+ */
+#define LOADPNG_FILTER_DEFAULT		0
+#define LOADPNG_FILTER_NONE		0x08
+#define LOADPNG_FILTER_SUB		0x10
+#define LOADPNG_FILTER_UP		0x20
+#define LOADPNG_FILTER_AVG		0x40
+#define LOADPNG_FILTER_PAETH		0x80
+#define LOADPNG_FILTER_ALL		0xf8
+
+/* zlib strategies for the savers, the same as zlib's Z_* values, with
+ * LOADPNG_STRATEGY_PLAIN being Z_DEFAULT_STRATEGY.  LOADPNG_STRATEGY_DEFAULT
+ * leaves the choice to libpng, which picks Z_FILTERED for filtered rows.
+ */
+#define LOADPNG_STRATEGY_DEFAULT	-1
+#define LOADPNG_STRATEGY_PLAIN		0
+#define LOADPNG_STRATEGY_FILTERED	1
+#define LOADPNG_STRATEGY_HUFFMAN_ONLY	2
+#define LOADPNG_STRATEGY_RLE		3
+#define LOADPNG_STRATEGY_FIXED		4
+
 /* Adds `PNG' to Allegro's internal file type table.
  * You can then just use load_bitmap and save_bitmap as usual.
  */
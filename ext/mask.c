@@ -0,0 +1,200 @@
+/*******************************************************************************************
+
+ mask.c
+
+ Color key masking: replaces every pixel close to one of a set of key
+ colors by the mask color of the bitmap.
+
+*******************************************************************************************/
+
+#include "global.h"
+#include "simd.h"
+
+static const unsigned char bits_set[16] = {
+  0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+};
+
+static inline int within(int r, int g, int b, const int *key, int tol) {
+  return abs(r - key[0]) <= tol && abs(g - key[1]) <= tol && abs(b - key[2]) <= tol;
+}
+
+static int mask_row32_c(uint32_t *p, int w, const uint32_t *keys, int num_keys, int tol, uint32_t mask) {
+  int x, k, count = 0;
+  uint32_t c;
+  int key[3];
+
+  for (x = 0; x < w; ++x) {
+    c = p[x];
+    for (k = 0; k < num_keys; ++k) {
+      key[0] = getr32(keys[k]);
+      key[1] = getg32(keys[k]);
+      key[2] = getb32(keys[k]);
+      if (within(getr32(c), getg32(c), getb32(c), key, tol)) {
+	p[x] = mask;
+	count++;
+	break;
+      }
+    }
+  }
+
+  return count;
+}
+
+#ifdef SIMD_X86
+
+/* Every byte of a pixel is compared as |pixel - key| <= tolerance. The
+ * alpha byte gets a tolerance of 255 so it never decides the outcome.
+ */
+static inline uint32_t tolerance32(int tol) {
+  return ((uint32_t) tol * 0x01010101u) | (0xFFu << _rgb_a_shift_32);
+}
+
+SIMD_TARGET("sse2")
+static int mask_row32_sse2(uint32_t *p, int w, const uint32_t *keys, int num_keys, int tol, uint32_t mask) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i tolv = _mm_set1_epi32((int) tolerance32(tol));
+  __m128i maskv = _mm_set1_epi32((int) mask);
+  __m128i v, kv, d, hit;
+  int x, k, count = 0;
+
+  for (x = 0; x + 4 <= w; x += 4) {
+    v = _mm_loadu_si128((__m128i *) (p + x));
+    hit = zero;
+    for (k = 0; k < num_keys; ++k) {
+      kv = _mm_set1_epi32((int) keys[k]);
+      d = _mm_or_si128(_mm_subs_epu8(v, kv), _mm_subs_epu8(kv, v));
+      d = _mm_subs_epu8(d, tolv);
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi32(d, zero));
+    }
+    k = _mm_movemask_ps(_mm_castsi128_ps(hit));
+    if (k) {
+      v = _mm_or_si128(_mm_and_si128(hit, maskv), _mm_andnot_si128(hit, v));
+      _mm_storeu_si128((__m128i *) (p + x), v);
+      count += bits_set[k];
+    }
+  }
+
+  return count + mask_row32_c(p + x, w - x, keys, num_keys, tol, mask);
+}
+
+#ifdef SIMD_X86_AVX2
+
+SIMD_TARGET("avx2")
+static int mask_row32_avx2(uint32_t *p, int w, const uint32_t *keys, int num_keys, int tol, uint32_t mask) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i tolv = _mm256_set1_epi32((int) tolerance32(tol));
+  __m256i maskv = _mm256_set1_epi32((int) mask);
+  __m256i v, kv, d, hit;
+  int x, k, count = 0;
+
+  for (x = 0; x + 8 <= w; x += 8) {
+    v = _mm256_loadu_si256((__m256i *) (p + x));
+    hit = zero;
+    for (k = 0; k < num_keys; ++k) {
+      kv = _mm256_set1_epi32((int) keys[k]);
+      d = _mm256_or_si256(_mm256_subs_epu8(v, kv), _mm256_subs_epu8(kv, v));
+      d = _mm256_subs_epu8(d, tolv);
+      hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(d, zero));
+    }
+    k = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+    if (k) {
+      v = _mm256_blendv_epi8(v, maskv, hit);
+      _mm256_storeu_si256((__m256i *) (p + x), v);
+      count += bits_set[k & 15] + bits_set[k >> 4];
+    }
+  }
+
+  return count + mask_row32_sse2(p + x, w - x, keys, num_keys, tol, mask);
+}
+
+#endif
+#endif
+
+/* Rows of 8, 15, 16 and 24 bit bitmaps are compared channel by channel
+ * after expanding them to 8 bits, so a tolerance means the same thing
+ * at every depth.
+ */
+static int mask_row_generic(unsigned char *p, int w, int depth, const int *keys, int num_keys, int tol, int mask) {
+  int x, k, c, r, g, b, count = 0;
+
+  for (x = 0; x < w; ++x) {
+    switch (depth) {
+    case 8:  c = p[x]; break;
+    case 15:
+    case 16: c = ((uint16_t *) p)[x]; break;
+    default: c = READ3BYTES(p + x * 3); break;
+    }
+
+    r = getr_depth(depth, c);
+    g = getg_depth(depth, c);
+    b = getb_depth(depth, c);
+
+    for (k = 0; k < num_keys; ++k) {
+      if (within(r, g, b, keys + k * 3, tol)) {
+	switch (depth) {
+	case 8:  p[x] = mask; break;
+	case 15:
+	case 16: ((uint16_t *) p)[x] = mask; break;
+	default: WRITE3BYTES(p + x * 3, mask); break;
+	}
+	count++;
+	break;
+      }
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Replaces every pixel whose red, green and blue components are all
+ * within tolerance of one of the given 32 bit key colors by the mask
+ * color of the bitmap. Returns the number of pixels that were masked.
+ * Keys past MAX_MASK_KEYS are ignored. The bitmap must be acquired by
+ * the caller.
+ */
+int mask_color_keys(BITMAP *bmp, const uint32_t *keys, int num_keys, int tolerance) {
+  int (*row32)(uint32_t *, int, const uint32_t *, int, int, uint32_t) = mask_row32_c;
+  int depth = bitmap_color_depth(bmp);
+  int mask = bitmap_mask_color(bmp);
+  int tol = MID(0, tolerance, 255);
+  int rgb[MAX_MASK_KEYS * 3];
+  unsigned char *line;
+  int y, k, count = 0;
+
+  if (num_keys <= 0)
+    return 0;
+  if (num_keys > MAX_MASK_KEYS)
+    num_keys = MAX_MASK_KEYS;
+
+#ifdef SIMD_X86
+  if (simd_caps() & SIMD_SSE2)
+    row32 = mask_row32_sse2;
+#ifdef SIMD_X86_AVX2
+  if (simd_caps() & SIMD_AVX2)
+    row32 = mask_row32_avx2;
+#endif
+#endif
+
+  if (depth != 32) {
+    for (k = 0; k < num_keys; ++k) {
+      rgb[k * 3 + 0] = getr32(keys[k]);
+      rgb[k * 3 + 1] = getg32(keys[k]);
+      rgb[k * 3 + 2] = getb32(keys[k]);
+    }
+  }
+
+  bmp_select(bmp);
+
+  for (y = 0; y < bmp->h; ++y) {
+    line = (unsigned char *) bmp_write_line(bmp, y);
+    if (depth == 32)
+      count += row32((uint32_t *) line, bmp->w, keys, num_keys, tol, mask);
+    else
+      count += mask_row_generic(line, bmp->w, depth, rgb, num_keys, tol, mask);
+  }
+
+  bmp_unwrite_line(bmp);
+
+  return count;
+}
@@ -26,6 +26,12 @@ VALUE m_allegro_fx;
 
 VALUE c_allegro_color;
 VALUE c_allegro_bitmap;
+VALUE c_allegro_bitmap_buffer;
+VALUE c_allegro_swapchain;
+VALUE c_allegro_timer;
+VALUE c_allegro_atlas;
+VALUE c_allegro_loader;
+VALUE c_allegro_future;
 VALUE c_allegro_sample;
 VALUE c_allegro_joystick_info;
 VALUE c_allegro_joystick_stickinfo;
@@ -75,6 +81,11 @@ void Init_Allegro ()
   Init_allegro_gfx();
   Init_allegro_color();
   Init_allegro_bitmap();
+  Init_allegro_buffer();
+  Init_allegro_swapchain();
+  Init_allegro_timer();
+  Init_allegro_atlas();
+  Init_allegro_loader();
   Init_allegro_key();
   Init_allegro_config();
   Init_allegro_mouse();
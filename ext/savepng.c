@@ -5,9 +5,12 @@
  */
 
 
+#include <string.h>
+#include <zlib.h>
 #include <png.h>
 #include <allegro.h>
 #include "loadpng.h"
+#include "thread.h"
 
 
 
@@ -28,6 +31,41 @@ static void write_data(png_structp png_ptr, png_bytep data, png_uint_32 length)
 static void flush_data(png_structp png_ptr) { (void)png_ptr; }
 
 
+/* A growing buffer for save_memory_png. */
+typedef struct MEMORY_WRITER {
+    unsigned char *data;
+    png_uint_32 size, max;
+} MEMORY_WRITER;
+
+/* write_memory:
+ *  Custom write function appending to a MEMORY_WRITER, which doubles
+ *  its buffer whenever it runs out of room.
+ */
+static void write_memory(png_structp png_ptr, png_bytep data, png_uint_32 length)
+{
+    MEMORY_WRITER *w = (MEMORY_WRITER *)png_get_io_ptr(png_ptr);
+
+    if (w->size + length > w->max) {
+	png_uint_32 max = w->max;
+	unsigned char *p;
+
+	while (w->size + length > max) {
+	    if (max >= 0x40000000)
+		png_error(png_ptr, "write error (image too large)");
+	    max *= 2;
+	}
+	p = (unsigned char *)realloc(w->data, max);
+	if (!p)
+	    png_error(png_ptr, "write error (out of memory)");
+	w->data = p;
+	w->max = max;
+    }
+
+    memcpy(w->data + w->size, data, length);
+    w->size += length;
+}
+
+
 
 /* save_indexed:
  *  Core save routine for 8 bpp images.
@@ -71,6 +109,64 @@ static int save_indexed(png_structp png_ptr, BITMAP *bmp)
 
 
 
+/* set_row_layout:
+ *  Tells libpng how to read the pixels of a 24 or 32 bpp memory bitmap
+ *  straight out of bmp->line[], if it can: png_set_bgr() for blue first
+ *  and png_set_swap_alpha() for alpha first.  Returns zero when the rows
+ *  have to be converted instead.
+ */
+static int set_row_layout(png_structp png_ptr, BITMAP *bmp)
+{
+    AL_CONST int bytes = (bitmap_color_depth(bmp) == 24) ? 3 : 4;
+    int r, g, b, a, swap_alpha = FALSE;
+
+    if (!is_memory_bitmap(bmp))
+	return 0;
+
+    if (bytes == 3) {
+	r = _rgb_r_shift_24 / 8;
+	g = _rgb_g_shift_24 / 8;
+	b = _rgb_b_shift_24 / 8;
+	a = 3;
+    }
+    else {
+	r = _rgb_r_shift_32 / 8;
+	g = _rgb_g_shift_32 / 8;
+	b = _rgb_b_shift_32 / 8;
+	a = _rgb_a_shift_32 / 8;
+    }
+
+#ifdef ALLEGRO_BIG_ENDIAN
+    /* Turn shifts into byte offsets. */
+    r = bytes - 1 - r;
+    g = bytes - 1 - g;
+    b = bytes - 1 - b;
+    if (bytes == 4)
+	a = 3 - a;
+#endif
+
+    if (a == 0) {
+	/* Alpha first, which png_set_swap_alpha() moves to the end. */
+	r--;
+	g--;
+	b--;
+	a = 3;
+	swap_alpha = TRUE;
+    }
+
+    if ((a != 3) || (g != 1) || (r + b != 2))
+	return 0;
+
+    if (swap_alpha)
+	png_set_swap_alpha(png_ptr);
+    if (r == 2)
+	png_set_bgr(png_ptr);
+
+    return 1;
+}
+
+
+
 /* save_rgb:
  *  Core save routine for 15/16/24 bpp images (original by Martijn Versteegh).
  */
@@ -82,6 +178,14 @@ static int save_rgb(png_structp png_ptr, BITMAP *bmp)
 
     ASSERT(depth == 15 || depth == 16 || depth == 24);
 
+    if ((depth == 24) && set_row_layout(png_ptr, bmp)) { /* fast path */
+	for (y=0; y<bmp->h; y++) {
+	    png_write_row(png_ptr, bmp->line[y]);
+	}
+
+	return 1;
+    }
+
     rowdata = (unsigned char *)malloc(bmp->w * 3);
     if (!rowdata)
 	return 0;
@@ -134,6 +238,14 @@ static int save_rgba(png_structp png_ptr, BITMAP *bmp)
 
     ASSERT(bitmap_color_depth(bmp) == 32);
 
+    if (set_row_layout(png_ptr, bmp)) { /* fast path */
+	for (y=0; y<bmp->h; y++) {
+	    png_write_row(png_ptr, bmp->line[y]);
+	}
+
+	return 1;
+    }
+
     rowdata = (unsigned char *)malloc(bmp->w * 4);
     if (!rowdata)
 	return 0;
@@ -159,14 +271,365 @@ static int save_rgba(png_structp png_ptr, BITMAP *bmp)
 
 
 
-/* save_png:
- *  Writes a non-interlaced, no-frills PNG, taking the usual save_xyz
- *  parameters.  Returns non-zero on error.
+/* Saving on several threads works the way pigz compresses: the rows are
+ * split into bands, and each band is filtered and deflated on a thread of
+ * its own, with a dictionary of its own.  Every band but the last ends in
+ * a sync flush, which leaves the deflate stream on a byte boundary, so the
+ * bands join into one stream; a zlib header in front and the combined
+ * adler32 of all the filtered rows at the end make it the zlib stream of
+ * the IDAT chunks.
+ */
+
+#define BAND_BYTES		(1 << 20)	/* filtered bytes per band, about */
+#define BANDS_PER_THREAD	2		/* bands held in memory per thread */
+#define IDAT_BYTES		(1 << 20)	/* longest IDAT chunk written */
+
+typedef struct BAND {
+    int y, h;				/* rows of the image in the band */
+    unsigned char *data;		/* the rows, filtered and deflated */
+    uLong size, max;
+    uLong adler;			/* adler32 of the filtered rows */
+    int error;
+} BAND;
+
+typedef struct BAND_SET {
+    BITMAP *bmp;
+    int pixel_bytes, row_bytes;		/* of the image in the PNG */
+    int level, filter, strategy;
+    BAND *band;
+    int count, max_count;
+} BAND_SET;
+
+
+
+/* grow_band:
+ *  Makes room for at least need more bytes in the output of a band.
+ *  Returns non-zero if out of memory.
+ */
+static int grow_band(BAND *band, uLong need)
+{
+    unsigned char *p;
+    uLong max = band->max ? band->max : 4096;
+
+    if (band->size + need <= band->max)
+	return 0;
+
+    while (band->size + need > max)
+	max *= 2;
+    p = (unsigned char *)realloc(band->data, max);
+    if (!p)
+	return -1;
+    band->data = p;
+    band->max = max;
+
+    return 0;
+}
+
+
+
+/* get_row:
+ *  Converts row y of a memory bitmap to the pixel layout of the PNG.
  */
-static int really_save_png(PACKFILE *fp, BITMAP *bmp, AL_CONST RGB *pal)
+static void get_row(BAND_SET *set, int y, unsigned char *p)
+{
+    BITMAP *bmp = set->bmp;
+    int x, c;
+
+    switch (bitmap_color_depth(bmp)) {
+	case 8:
+	    memcpy(p, bmp->line[y], bmp->w);
+	    break;
+	case 15:
+	    for (x = 0; x < bmp->w; x++) {
+		c = ((unsigned short *)bmp->line[y])[x];
+		*p++ = getr15(c);
+		*p++ = getg15(c);
+		*p++ = getb15(c);
+	    }
+	    break;
+	case 16:
+	    for (x = 0; x < bmp->w; x++) {
+		c = ((unsigned short *)bmp->line[y])[x];
+		*p++ = getr16(c);
+		*p++ = getg16(c);
+		*p++ = getb16(c);
+	    }
+	    break;
+	case 24:
+	    for (x = 0; x < bmp->w; x++) {
+		c = READ3BYTES(bmp->line[y] + x * 3);
+		*p++ = getr24(c);
+		*p++ = getg24(c);
+		*p++ = getb24(c);
+	    }
+	    break;
+	case 32:
+	    for (x = 0; x < bmp->w; x++) {
+		c = ((uint32_t *)bmp->line[y])[x];
+		*p++ = getr32(c);
+		*p++ = getg32(c);
+		*p++ = getb32(c);
+		*p++ = geta32(c);
+	    }
+	    break;
+    }
+}
+
+
+
+/* paeth:
+ *  The Paeth predictor of the PNG specification.
+ */
+static INLINE int paeth(int a, int b, int c)
+{
+    int pa = ABS(b - c), pb = ABS(a - c), pc = ABS(a + b - c - c);
+
+    if ((pa <= pb) && (pa <= pc))
+	return a;
+    return (pb <= pc) ? b : c;
+}
+
+
+
+/* filter_row:
+ *  Writes the filter type byte and the row cur filtered with it to out;
+ *  prev is the row above.  Returns the sum of the filtered bytes taken
+ *  as signed, which libpng uses to pick a filter for each row.
+ */
+static int filter_row(int type, AL_CONST unsigned char *prev, AL_CONST unsigned char *cur, unsigned char *out, int n, int bpp)
+{
+    int i, sum = 0;
+
+    *out++ = type;
+
+    switch (type) {
+	case PNG_FILTER_VALUE_NONE:
+	    memcpy(out, cur, n);
+	    break;
+	case PNG_FILTER_VALUE_SUB:
+	    for (i = 0; i < bpp; i++)
+		out[i] = cur[i];
+	    for (; i < n; i++)
+		out[i] = cur[i] - cur[i - bpp];
+	    break;
+	case PNG_FILTER_VALUE_UP:
+	    for (i = 0; i < n; i++)
+		out[i] = cur[i] - prev[i];
+	    break;
+	case PNG_FILTER_VALUE_AVG:
+	    for (i = 0; i < bpp; i++)
+		out[i] = cur[i] - (prev[i] >> 1);
+	    for (; i < n; i++)
+		out[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+	    break;
+	case PNG_FILTER_VALUE_PAETH:
+	    for (i = 0; i < bpp; i++)
+		out[i] = cur[i] - prev[i];
+	    for (; i < n; i++)
+		out[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+	    break;
+    }
+
+    for (i = 0; i < n; i++)
+	sum += (out[i] < 128) ? out[i] : 256 - out[i];
+
+    return sum;
+}
+
+
+
+/* deflate_rows:
+ *  Feeds length bytes at data to the deflate stream of a band, growing
+ *  its output as needed.  Returns non-zero on error.
+ */
+static int deflate_rows(z_stream *z, BAND *band, unsigned char *data, int length, int flush)
+{
+    int result;
+
+    z->next_in = data;
+    z->avail_in = length;
+
+    for (;;) {
+	if (grow_band(band, 1024))
+	    return -1;
+	z->next_out = band->data + band->size;
+	z->avail_out = band->max - band->size;
+	result = deflate(z, flush);
+	band->size = z->next_out - band->data;
+	if (result == Z_STREAM_ERROR)
+	    return -1;
+	if ((z->avail_in == 0) && (z->avail_out != 0) &&
+	    ((flush != Z_FINISH) || (result == Z_STREAM_END)))
+	    return 0;
+    }
+}
+
+
+
+/* deflate_band:
+ *  Filters and deflates band i of a BAND_SET, on whatever thread
+ *  parallel_run() picks.
+ */
+static void deflate_band(void *data, int i)
+{
+    BAND_SET *set = (BAND_SET *)data;
+    BAND *band = &set->band[i];
+    AL_CONST int n = set->row_bytes;
+    AL_CONST int last = (band->y + band->h == set->bmp->h);
+    unsigned char *rows, *prev, *cur, *best, *out;
+    int y, type, sum, best_sum, header;
+    z_stream z;
+
+    band->size = 0;
+    band->adler = adler32(0L, Z_NULL, 0);
+    band->error = TRUE;
+
+    /* Two rows of pixels and a filtered row for each filter type. */
+    rows = (unsigned char *)malloc(n * 2 + (n + 1) * 5);
+    if (!rows)
+	return;
+    prev = rows;
+    cur = rows + n;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, set->level, Z_DEFLATED, -MAX_WBITS, 8, set->strategy) != Z_OK) {
+	free(rows);
+	return;
+    }
+
+    if (band->y == 0) {
+	/* The zlib header, with the level hint zlib itself would give. */
+	if (grow_band(band, 2))
+	    goto Done;
+	if ((set->strategy >= Z_HUFFMAN_ONLY) || (set->level < 2))
+	    header = 0;
+	else if (set->level < 6)
+	    header = 1;
+	else
+	    header = (set->level == 6) ? 2 : 3;
+	header = (0x78 << 8) | (header << 6);
+	header += 31 - (header % 31);
+	band->data[0] = header >> 8;
+	band->data[1] = header & 0xff;
+	band->size = 2;
+	memset(prev, 0, n);
+    }
+    else
+	get_row(set, band->y - 1, prev);
+
+    for (y = band->y; y < band->y + band->h; y++) {
+	get_row(set, y, cur);
+
+	best = NULL;
+	best_sum = 0;
+	for (type = PNG_FILTER_VALUE_NONE; type <= PNG_FILTER_VALUE_PAETH; type++) {
+	    if (!(set->filter & (PNG_FILTER_NONE << type)))
+		continue;
+	    out = rows + n * 2 + (n + 1) * type;
+	    sum = filter_row(type, prev, cur, out, n, set->pixel_bytes);
+	    if ((!best) || (sum < best_sum)) {
+		best = out;
+		best_sum = sum;
+	    }
+	}
+
+	band->adler = adler32(band->adler, best, n + 1);
+	if (deflate_rows(&z, band, best, n + 1,
+			 (y < band->y + band->h - 1) ? Z_NO_FLUSH :
+			 last ? Z_FINISH : Z_SYNC_FLUSH))
+	    goto Done;
+
+	out = prev;
+	prev = cur;
+	cur = out;
+    }
+
+    /* Room for the adler32 at the end of the stream. */
+    if (last && grow_band(band, 4))
+	goto Done;
+
+    band->error = FALSE;
+
+  Done:
+    deflateEnd(&z);
+    free(rows);
+}
+
+
+
+/* write_bands:
+ *  Writes the image data of set->bmp as IDAT chunks, deflated on up to
+ *  threads threads, a few bands per thread at a time.
+ */
+static void write_bands(png_structp png_ptr, BAND_SET *set, int threads)
+{
+    AL_CONST int h = set->bmp->h;
+    AL_CONST int rows = MAX(1, BAND_BYTES / (set->row_bytes + 1));
+    uLong adler = adler32(0L, Z_NULL, 0), size, offset;
+    BAND *band;
+    int y = 0, i;
+
+    while (y < h) {
+	for (set->count = 0; (set->count < set->max_count) && (y < h); set->count++) {
+	    band = &set->band[set->count];
+	    band->y = y;
+	    band->h = MIN(rows, h - y);
+	    y += band->h;
+	}
+
+	parallel_run(set->count, threads, deflate_band, set);
+
+	for (i = 0; i < set->count; i++) {
+	    if (set->band[i].error)
+		png_error(png_ptr, "out of memory (loadpng deflating rows)");
+	}
+
+	for (i = 0; i < set->count; i++) {
+	    band = &set->band[i];
+	    adler = adler32_combine(adler, band->adler, (z_off_t)band->h * (set->row_bytes + 1));
+	    if (band->y + band->h == h) {
+		band->data[band->size++] = (unsigned char)(adler >> 24);
+		band->data[band->size++] = (unsigned char)(adler >> 16);
+		band->data[band->size++] = (unsigned char)(adler >> 8);
+		band->data[band->size++] = (unsigned char)adler;
+	    }
+	    for (offset = 0; offset < band->size; offset += size) {
+		size = MIN(band->size - offset, IDAT_BYTES);
+		png_write_chunk(png_ptr, (png_bytep)"IDAT", band->data + offset, size);
+	    }
+	}
+    }
+}
+
+
+
+/* free_bands:
+ *  Frees the bands of a BAND_SET, if any.
+ */
+static void free_bands(BAND_SET *set)
+{
+    int i;
+
+    if (!set->band)
+	return;
+    for (i = 0; i < set->max_count; i++)
+	free(set->band[i].data);
+    free(set->band);
+}
+
+
+
+/* really_save_png:
+ *  Writes a non-interlaced, no-frills PNG through write_fn, at the
+ *  given zlib compression level, row filters and zlib strategy; see
+ *  loadpng.h for the defaults.  Large memory bitmaps are deflated on up
+ *  to threads threads.  Returns non-zero on error.
+ */
+static int really_save_png(png_rw_ptr write_fn, void *io, BITMAP *bmp, AL_CONST RGB *pal, int level, int filter, int strategy, int threads)
 {
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
+    BAND_SET set;
     int depth;
     int colour_type;
 
@@ -174,6 +637,29 @@ static int really_save_png(PACKFILE *fp, BITMAP *bmp, AL_CONST RGB *pal)
     if (depth == 8 && !pal)
 	return -1;
 
+    /* Set up the bands of a parallel save, with the filters and strategy
+     * libpng would use by default.  Without memory for them, the image is
+     * saved the usual way.
+     */
+    set.band = NULL;
+    set.pixel_bytes = (depth == 8) ? 1 : (depth == 32) ? 4 : 3;
+    set.row_bytes = bmp->w * set.pixel_bytes;
+    if ((threads > 1) && is_memory_bitmap(bmp) &&
+	((double)(set.row_bytes + 1) * bmp->h >= 2.0 * BAND_BYTES)) {
+	set.bmp = bmp;
+	set.level = level;
+	if (filter)
+	    set.filter = filter;
+	else
+	    set.filter = (depth == 8) ? PNG_FILTER_NONE : PNG_ALL_FILTERS;
+	if (strategy >= 0)
+	    set.strategy = strategy;
+	else
+	    set.strategy = (set.filter == PNG_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	set.max_count = threads * BANDS_PER_THREAD;
+	set.band = (BAND *)calloc(set.max_count, sizeof(BAND));
+    }
+
     /* Create and initialize the png_struct with the
      * desired error handler functions.
      */
@@ -193,8 +679,8 @@ static int really_save_png(PACKFILE *fp, BITMAP *bmp, AL_CONST RGB *pal)
 	goto Error;
     }
 
-    /* Use packfile routines. */
-    png_set_write_fn(png_ptr, fp, (png_rw_ptr)write_data, flush_data);
+    /* Use the caller's output routine. */
+    png_set_write_fn(png_ptr, io, write_fn, flush_data);
 
     /* Set the image information here.  Width and height are up to 2^31,
      * bit_depth is one of 1, 2, 4, 8, or 16, but valid values also depend on
@@ -211,8 +697,12 @@ static int really_save_png(PACKFILE *fp, BITMAP *bmp, AL_CONST RGB *pal)
     else
 	colour_type = PNG_COLOR_TYPE_RGB;
 
-    /* Set compression level. */
-    png_set_compression_level(png_ptr, _png_compression_level);
+    /* Set compression level, filters and strategy. */
+    png_set_compression_level(png_ptr, level);
+    if (strategy >= 0)
+	png_set_compression_strategy(png_ptr, strategy);
+    if (filter)
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filter);
 
     png_set_IHDR(png_ptr, info_ptr, bmp->w, bmp->h, 8, colour_type,
 		 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
@@ -245,6 +735,14 @@ static int really_save_png(PACKFILE *fp, BITMAP *bmp, AL_CONST RGB *pal)
      */
 
     /* Save the data. */
+    if (set.band) {
+	write_bands(png_ptr, &set, threads);
+	png_write_chunk(png_ptr, (png_bytep)"IEND", NULL, 0);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	free_bands(&set);
+	return 0;
+    }
+
     switch (depth) {
 	case 8:
 	    if (!save_indexed(png_ptr, bmp))
@@ -280,11 +778,26 @@ static int really_save_png(PACKFILE *fp, BITMAP *bmp, AL_CONST RGB *pal)
 	    png_destroy_write_struct(&png_ptr, NULL);
     }
 
+    free_bands(&set);
+
     return -1;
 }
 
 
 int save_png(AL_CONST char *filename, BITMAP *bmp, AL_CONST RGB *pal)
+{
+    return save_png_ex(filename, bmp, pal, _png_compression_level,
+		       LOADPNG_FILTER_DEFAULT, LOADPNG_STRATEGY_DEFAULT, 1);
+}
+
+
+
+/* save_png_ex:
+ *  Like save_png(), with the zlib compression level (0-9), row filters
+ *  and zlib strategy given.  Large memory bitmaps are deflated on up to
+ *  threads threads; the output is still a plain PNG file.
+ */
+int save_png_ex(AL_CONST char *filename, BITMAP *bmp, AL_CONST RGB *pal, int level, int filter, int strategy, int threads)
 {
     PACKFILE *fp;
     int result;
@@ -297,10 +810,48 @@ int save_png(AL_CONST char *filename, BITMAP *bmp, AL_CONST RGB *pal)
 	return -1;
     
     acquire_bitmap(bmp);
-    result = really_save_png(fp, bmp, pal);
+    result = really_save_png((png_rw_ptr)write_data, fp, bmp, pal, MID(0, level, 9), filter, strategy, threads);
     release_bitmap(bmp);
 
     pack_fclose(fp);
 
     return result;
 }
+
+
+
+/* save_memory_png:
+ *  Encodes a bitmap as PNG at the given compression level (0-9), with
+ *  the given row filters and zlib strategy, on up to threads threads like
+ *  save_png_ex(), into a malloc'd buffer, grown as needed, and returns it
+ *  with its length in *size.  The caller frees it.  Returns NULL on error.
+ */
+void *save_memory_png(BITMAP *bmp, AL_CONST RGB *pal, int level, int filter, int strategy, int threads, int *size)
+{
+    MEMORY_WRITER w;
+    int result;
+
+    ASSERT(bmp);
+    ASSERT(size);
+
+    *size = 0;
+
+    /* A quarter of the 32 bpp pixel data is plenty for most images. */
+    w.size = 0;
+    w.max = (bmp->w * bmp->h) + 1024;
+    w.data = (unsigned char *)malloc(w.max);
+    if (!w.data)
+	return NULL;
+
+    acquire_bitmap(bmp);
+    result = really_save_png((png_rw_ptr)write_memory, &w, bmp, pal, MID(0, level, 9), filter, strategy, threads);
+    release_bitmap(bmp);
+
+    if (result != 0) {
+	free(w.data);
+	return NULL;
+    }
+
+    *size = w.size;
+    return w.data;
+}
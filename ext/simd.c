@@ -0,0 +1,87 @@
+/*******************************************************************************************
+
+ simd.c
+
+ CPU feature detection for the vectorized kernels.
+
+*******************************************************************************************/
+
+#include "simd.h"
+
+#if defined(SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(SIMD_X86)
+#include <cpuid.h>
+#endif
+
+static int caps = -1;
+
+#ifdef SIMD_X86
+
+static void cpuid(int leaf, int sub, unsigned int regs[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int *) regs, leaf, sub);
+#else
+  __cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/* The OS must save the upper halves of the ymm registers on context
+ * switches, otherwise AVX code corrupts other threads.
+ */
+static int os_saves_ymm(void) {
+#if defined(_MSC_VER) && _MSC_VER >= 1600
+  return (_xgetbv(0) & 6) == 6;
+#elif defined(__GNUC__)
+  unsigned int eax, edx;
+  __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return (eax & 6) == 6;
+#else
+  return 0;
+#endif
+}
+
+static int detect(void) {
+  unsigned int regs[4];
+  int result = 0;
+
+  cpuid(0, 0, regs);
+  if (regs[0] < 1)
+    return 0;
+
+  cpuid(1, 0, regs);
+  if (regs[3] & (1 << 26))
+    result |= SIMD_SSE2;
+
+#ifdef SIMD_X86_AVX2
+  /* OSXSAVE and AVX, then the AVX2 bit of leaf 7 */
+  if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && os_saves_ymm()) {
+    cpuid(0, 0, regs);
+    if (regs[0] >= 7) {
+      cpuid(7, 0, regs);
+      if (regs[1] & (1 << 5))
+	result |= SIMD_AVX2;
+    }
+  }
+#endif
+
+  return result;
+}
+
+#else
+
+static int detect(void) {
+#ifdef SIMD_ARM_NEON
+  return SIMD_NEON;
+#else
+  return 0;
+#endif
+}
+
+#endif
+
+int simd_caps(void) {
+  if (caps < 0)
+    caps = detect();
+  return caps;
+}
@@ -0,0 +1,45 @@
+/******************************************************************************************
+
+ simd.h
+
+ Compile time and runtime detection of the vector instruction sets used
+ by the pixel and codec kernels.
+
+*******************************************************************************************/
+
+#ifndef _RB_ALLEG_SIMD
+#define _RB_ALLEG_SIMD
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86
+#include <emmintrin.h>
+#if !defined(_MSC_VER) || _MSC_VER >= 1700
+#define SIMD_X86_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIMD_ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* GCC and clang only emit instructions the whole file was compiled for,
+ * unless a function asks for more; MSVC always allows intrinsics.
+ */
+#if defined(__GNUC__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+#define SIMD_SSE2		0x01
+#define SIMD_AVX2		0x02
+#define SIMD_NEON		0x04
+
+/* Returns the SIMD_* flags supported by both the compiler and the CPU
+ * we are running on. Detection runs once; later calls are cheap.
+ */
+int simd_caps(void);
+
+#endif // _RB_ALLEG_SIMD
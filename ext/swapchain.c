@@ -0,0 +1,258 @@
+/*******************************************************************************************
+
+ swapchain.c
+
+ class Allegro::SwapChain
+
+*******************************************************************************************/
+
+#include "global.h"
+
+#define SWAP_TRIPLE	3
+#define SWAP_PAGE_FLIP	2
+#define SWAP_DOUBLE	1
+
+typedef struct SwapChain
+{
+  int mode;
+  int num_pages;
+  int current;
+  BITMAP *pages[3];
+  VALUE page_objs[3];
+} SwapChain;
+
+static void swapchain_mark(SwapChain *chain) {
+  int i;
+
+  for (i = 0; i < chain->num_pages; ++i) {
+    rb_gc_mark(chain->page_objs[i]);
+  }
+}
+
+/* Shows the normal screen again and destroys all pages. */
+static void swapchain_destroy(SwapChain *chain) {
+  int i;
+
+  if (chain->num_pages > 0 && chain->mode != SWAP_DOUBLE && screen) {
+    show_video_bitmap(screen);
+  }
+
+  for (i = 0; i < chain->num_pages; ++i) {
+    dirty_track(chain->pages[i], 0);
+    destroy_bitmap(chain->pages[i]);
+    chain->pages[i] = NULL;
+    chain->page_objs[i] = Qnil;
+  }
+
+  chain->num_pages = 0;
+}
+
+/* The pages keep the chain alive, so by the time it is collected no
+ * page wrapper is left to point at the destroyed bitmaps. */
+static void swapchain_free(SwapChain *chain) {
+  swapchain_destroy(chain);
+  free(chain);
+}
+
+static inline SwapChain* get_chain(VALUE self) {
+  SwapChain *chain;
+  Data_Get_Struct(self, SwapChain, chain);
+  if (chain->num_pages == 0) {
+    rb_raise(rb_eRuntimeError, "swap chain was disposed");
+  }
+  return chain;
+}
+
+/**
+ * Creates n video pages the size of the screen. Returns 0 and frees
+ * everything if the driver cannot give us that many.
+ */
+static int create_pages(SwapChain *chain, int n, BITMAP *(*create)(int, int)) {
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    chain->pages[i] = create(SCREEN_W, SCREEN_H);
+    if (!chain->pages[i]) {
+      while (i-- > 0) {
+	destroy_bitmap(chain->pages[i]);
+      }
+      return 0;
+    }
+    clear_bitmap(chain->pages[i]);
+  }
+
+  chain->num_pages = n;
+
+  return 1;
+}
+
+/**
+ * call-seq: new(pages = 3)
+ *
+ * Sets up buffering for the current graphics mode. With 3 pages it
+ * tries triple buffering first, where a flip only queues the finished
+ * page and returns without waiting for the retrace. If the driver
+ * cannot triple buffer it tries two video pages with tearing-free page
+ * flips, and if video memory is too small it falls back to a single
+ * system bitmap (or memory bitmap) blitted to the screen.
+ *
+ * The pages are destroyed with the chain; call #dispose before
+ * changing the graphics mode.
+ */
+static VALUE swapchain_new(int argc, VALUE *argv, VALUE self) {
+  VALUE pages, obj;
+  SwapChain *chain;
+  int n, i;
+
+  rb_scan_args(argc, argv, "01", &pages);
+
+  n = NIL_P(pages) ? 3 : NUM2INT(pages);
+
+  if (!screen) {
+    rb_raise(rb_eRuntimeError, "no graphics mode set");
+  }
+
+  obj = Data_Make_Struct(self, SwapChain, swapchain_mark, swapchain_free, chain);
+
+  if (n >= 3) {
+    if (!(gfx_capabilities & GFX_CAN_TRIPLE_BUFFER))
+      enable_triple_buffer();
+    if ((gfx_capabilities & GFX_CAN_TRIPLE_BUFFER) && create_pages(chain, 3, create_video_bitmap))
+      chain->mode = SWAP_TRIPLE;
+  }
+
+  if (!chain->mode && n >= 2 && create_pages(chain, 2, create_video_bitmap))
+    chain->mode = SWAP_PAGE_FLIP;
+
+  if (!chain->mode && (create_pages(chain, 1, create_system_bitmap) || create_pages(chain, 1, create_bitmap)))
+    chain->mode = SWAP_DOUBLE;
+
+  if (!chain->mode) {
+    rb_raise(rb_eRuntimeError, "could not create swap chain: %s", allegro_error);
+  }
+
+  for (i = 0; i < chain->num_pages; ++i) {
+    chain->page_objs[i] = Data_Wrap_Struct(c_allegro_bitmap, 0, 0, chain->pages[i]);
+    rb_iv_set(chain->page_objs[i], "@chain", obj);
+  }
+
+  /* page flipping starts by showing the first page */
+  if (chain->mode == SWAP_PAGE_FLIP || chain->mode == SWAP_TRIPLE) {
+    show_video_bitmap(chain->pages[0]);
+    chain->current = 1;
+  }
+
+  return obj;
+}
+
+/**
+ * Returns the page to draw the next frame on. With page flipping the
+ * page still holds the frame from two or three flips ago, so redraw
+ * it completely.
+ */
+static VALUE swapchain_back(VALUE self) {
+  SwapChain *chain = get_chain(self);
+  return chain->page_objs[chain->current];
+}
+
+/**
+ * call-seq: flip(vsync = true)
+ *
+ * Shows the back page and makes the next page the back page.
+ *
+ * Triple buffering waits only if the previously queued page has not
+ * been shown yet, page flipping waits for the retrace inside Allegro.
+ * Double buffering waits for the retrace unless vsync is false and
+ * then blits the back buffer to the screen; if dirty tracking is on
+ * for the back buffer (Bitmap#track_dirty) only the changed areas
+ * are copied.
+ */
+static VALUE swapchain_flip(int argc, VALUE *argv, VALUE self) {
+  VALUE vsync_flag;
+  SwapChain *chain = get_chain(self);
+  BITMAP *back = chain->pages[chain->current];
+
+  rb_scan_args(argc, argv, "01", &vsync_flag);
+
+  switch (chain->mode) {
+  case SWAP_TRIPLE:
+    while (poll_scroll())
+      rest(0);
+    request_video_bitmap(back);
+    chain->current = (chain->current + 1) % 3;
+    break;
+  case SWAP_PAGE_FLIP:
+    show_video_bitmap(back);
+    chain->current ^= 1;
+    break;
+  default:
+    if (NIL_P(vsync_flag) || RTEST(vsync_flag))
+      vsync();
+    dirty_present(back, screen, 0, 0);
+    break;
+  }
+
+  return self;
+}
+
+/**
+ * Returns :triple, :page_flip or :double_buffer.
+ */
+static VALUE swapchain_mode(VALUE self) {
+  switch (get_chain(self)->mode) {
+  case SWAP_TRIPLE:    return ID2SYM(rb_intern("triple"));
+  case SWAP_PAGE_FLIP: return ID2SYM(rb_intern("page_flip"));
+  default:             return ID2SYM(rb_intern("double_buffer"));
+  }
+}
+
+/**
+ * Returns the number of pages.
+ */
+static VALUE swapchain_pages(VALUE self) {
+  return INT2FIX(get_chain(self)->num_pages);
+}
+
+/**
+ * Shows the normal screen again and destroys all pages. Bitmaps
+ * returned by #back raise a RuntimeError when used afterwards.
+ */
+static VALUE swapchain_dispose(VALUE self) {
+  SwapChain *chain;
+  int i;
+
+  Data_Get_Struct(self, SwapChain, chain);
+
+  for (i = 0; i < chain->num_pages; ++i) {
+    DATA_PTR(chain->page_objs[i]) = NULL;
+  }
+
+  swapchain_destroy(chain);
+
+  return Qnil;
+}
+
+void Init_allegro_swapchain() {
+
+  /**
+   * A SwapChain owns the pages a game draws its frames on and presents
+   * them without copying whole frames from memory to the screen:
+   *
+   *   chain = SwapChain.new
+   *   loop do
+   *     page = chain.back
+   *     page.clear(0)
+   *     ...
+   *     chain.flip
+   *   end
+   */
+  c_allegro_swapchain = rb_define_class_under(m_allegro, "SwapChain", rb_cObject);
+
+  rb_define_singleton_method(c_allegro_swapchain, "new",		swapchain_new,		-1);
+
+  rb_define_method(c_allegro_swapchain, "back",				swapchain_back,		0);
+  rb_define_method(c_allegro_swapchain, "flip",				swapchain_flip,		-1);
+  rb_define_method(c_allegro_swapchain, "mode",				swapchain_mode,		0);
+  rb_define_method(c_allegro_swapchain, "pages",			swapchain_pages,	0);
+  rb_define_method(c_allegro_swapchain, "dispose",			swapchain_dispose,	0);
+}
@@ -0,0 +1,350 @@
+/*******************************************************************************************
+
+ thread.c
+
+ Running native code outside the ruby interpreter lock.
+
+*******************************************************************************************/
+
+#include "global.h"
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+#ifdef _WIN32
+#if !defined(_MSC_VER)
+#include "winalleg.h"
+#endif
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if !defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && defined(HAVE_RB_THREAD_BLOCKING_REGION)
+
+typedef struct BlockingCall
+{
+  void *(*func)(void *);
+  void *data;
+  void *result;
+} BlockingCall;
+
+static VALUE blocking_call(void *arg) {
+  BlockingCall *call = (BlockingCall *) arg;
+  call->result = call->func(call->data);
+  return Qnil;
+}
+
+#endif
+
+/**
+ * Runs func(data) with the interpreter lock released, so other ruby
+ * threads keep running while it works. func must neither touch ruby
+ * objects nor call into the ruby API. Ruby 1.8 only has green threads
+ * and no lock to release; there func simply runs.
+ */
+void *call_without_gvl(void *(*func)(void *), void *data) {
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+  return rb_thread_call_without_gvl(func, data, NULL, NULL);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  BlockingCall call;
+
+  call.func = func;
+  call.data = data;
+  call.result = NULL;
+
+  rb_thread_blocking_region(blocking_call, &call, NULL, NULL);
+
+  return call.result;
+#else
+  return func(data);
+#endif
+}
+
+
+/* Worker pool */
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+#define THREAD_RETURN unsigned __stdcall
+#define mutex_init(m)		InitializeCriticalSection(m)
+#define mutex_lock(m)		EnterCriticalSection(m)
+#define mutex_unlock(m)		LeaveCriticalSection(m)
+#define mutex_destroy(m)	DeleteCriticalSection(m)
+typedef CONDITION_VARIABLE Cond;
+#define cond_init(c)		InitializeConditionVariable(c)
+#define cond_wait(c, m)		SleepConditionVariableCS(c, m, INFINITE)
+#define cond_broadcast(c)	WakeAllConditionVariable(c)
+#define cond_destroy(c)
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+#define THREAD_RETURN void *
+#define mutex_init(m)		pthread_mutex_init(m, NULL)
+#define mutex_lock(m)		pthread_mutex_lock(m)
+#define mutex_unlock(m)		pthread_mutex_unlock(m)
+#define mutex_destroy(m)	pthread_mutex_destroy(m)
+typedef pthread_cond_t Cond;
+#define cond_init(c)		pthread_cond_init(c, NULL)
+#define cond_wait(c, m)		pthread_cond_wait(c, m)
+#define cond_broadcast(c)	pthread_cond_broadcast(c)
+#define cond_destroy(c)		pthread_cond_destroy(c)
+#endif
+
+/* More threads than this never pay off for the work we hand out. */
+#define MAX_THREADS 64
+
+typedef struct Parallel
+{
+  void (*func)(void *, int);
+  void *data;
+  int n;
+  int next;
+  Mutex lock;
+} Parallel;
+
+/* Each worker takes the next index until all are taken, so a few slow
+ * items do not hold up the others.
+ */
+static THREAD_RETURN parallel_worker(void *arg) {
+  Parallel *p = (Parallel *) arg;
+  int i;
+
+  for (;;) {
+    mutex_lock(&p->lock);
+    i = p->next++;
+    mutex_unlock(&p->lock);
+
+    if (i >= p->n)
+      break;
+
+    p->func(p->data, i);
+  }
+
+  return 0;
+}
+
+static int thread_start(Thread *thread, THREAD_RETURN (*func)(void *), void *arg) {
+#ifdef _WIN32
+  *thread = (HANDLE) _beginthreadex(NULL, 0, func, arg, 0, NULL);
+  return *thread != 0;
+#else
+  return pthread_create(thread, NULL, func, arg) == 0;
+#endif
+}
+
+static void thread_join(Thread thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+/**
+ * Returns the number of processors online, at least 1.
+ */
+int cpu_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return MAX((int) info.dwNumberOfProcessors, 1);
+#elif defined(_SC_NPROCESSORS_ONLN)
+  return MAX((int) sysconf(_SC_NPROCESSORS_ONLN), 1);
+#else
+  return 1;
+#endif
+}
+
+/**
+ * Calls func(data, i) for every i in 0...n on up to threads native
+ * threads, the calling one included, and returns when all calls are
+ * done. The order of the calls is unspecified. If threads cannot be
+ * started the remaining ones do all the work.
+ */
+void parallel_run(int n, int threads, void (*func)(void *, int), void *data) {
+  Thread workers[MAX_THREADS];
+  Parallel p;
+  int i, started = 0;
+
+  p.func = func;
+  p.data = data;
+  p.n = n;
+  p.next = 0;
+
+  threads = MIN(MIN(threads, n), MAX_THREADS);
+
+  if (threads <= 1) {
+    for (i = 0; i < n; ++i)
+      func(data, i);
+    return;
+  }
+
+  mutex_init(&p.lock);
+
+  for (i = 0; i < threads - 1; ++i) {
+    if (thread_start(&workers[started], parallel_worker, &p))
+      started++;
+  }
+
+  parallel_worker(&p);
+
+  for (i = 0; i < started; ++i) {
+    thread_join(workers[i]);
+  }
+
+  mutex_destroy(&p.lock);
+}
+
+
+/* Job queue */
+
+struct JobQueue
+{
+  Thread workers[MAX_THREADS];
+  int started;
+  Job *waiting;
+  Job *last_waiting;
+  Job *done;
+  Job *last_done;
+  int running;
+  int stop;
+  Mutex lock;
+  Cond work;
+  Cond finished;
+};
+
+static void append(Job **first, Job **last, Job *job) {
+  job->next = NULL;
+  if (*last)
+    (*last)->next = job;
+  else
+    *first = job;
+  *last = job;
+}
+
+static Job *take(Job **first, Job **last) {
+  Job *job = *first;
+
+  if (job) {
+    *first = job->next;
+    if (!*first)
+      *last = NULL;
+    job->next = NULL;
+  }
+
+  return job;
+}
+
+static THREAD_RETURN queue_worker(void *arg) {
+  JobQueue *q = (JobQueue *) arg;
+  Job *job;
+
+  for (;;) {
+    mutex_lock(&q->lock);
+    while (!q->waiting && !q->stop)
+      cond_wait(&q->work, &q->lock);
+    if (q->stop) {
+      mutex_unlock(&q->lock);
+      break;
+    }
+    job = take(&q->waiting, &q->last_waiting);
+    q->running++;
+    mutex_unlock(&q->lock);
+
+    job->func(job->data);
+
+    mutex_lock(&q->lock);
+    append(&q->done, &q->last_done, job);
+    q->running--;
+    cond_broadcast(&q->finished);
+    mutex_unlock(&q->lock);
+  }
+
+  return 0;
+}
+
+/**
+ * Starts up to threads native threads that run queued jobs until
+ * jobs_stop. If no thread can be started, jobs_push runs each job
+ * itself before returning.
+ */
+JobQueue *jobs_start(int threads) {
+  JobQueue *q = (JobQueue *) calloc(1, sizeof(JobQueue));
+
+  if (!q)
+    return NULL;
+
+  mutex_init(&q->lock);
+  cond_init(&q->work);
+  cond_init(&q->finished);
+
+  threads = MIN(MAX(threads, 1), MAX_THREADS);
+  while (q->started < threads && thread_start(&q->workers[q->started], queue_worker, q))
+    q->started++;
+
+  return q;
+}
+
+/**
+ * Queues job->func(job->data) to run on one of the threads. Jobs start
+ * in the order they are queued.
+ */
+void jobs_push(JobQueue *q, Job *job) {
+  if (!q->started) {
+    job->func(job->data);
+    mutex_lock(&q->lock);
+    append(&q->done, &q->last_done, job);
+    mutex_unlock(&q->lock);
+    return;
+  }
+
+  mutex_lock(&q->lock);
+  append(&q->waiting, &q->last_waiting, job);
+  cond_broadcast(&q->work);
+  mutex_unlock(&q->lock);
+}
+
+/**
+ * Returns the next finished job, in the order they finished, or NULL
+ * if none has finished yet. With wait set, blocks until a job finishes
+ * unless none are queued or running.
+ */
+Job *jobs_done(JobQueue *q, int wait) {
+  Job *job;
+
+  mutex_lock(&q->lock);
+  while (wait && !q->done && (q->waiting || q->running))
+    cond_wait(&q->finished, &q->lock);
+  job = take(&q->done, &q->last_done);
+  mutex_unlock(&q->lock);
+
+  return job;
+}
+
+/**
+ * Waits for the running jobs to finish and stops the threads. Jobs that
+ * have not started are dropped without running; the caller still owns
+ * every job it queued.
+ */
+void jobs_stop(JobQueue *q) {
+  int i;
+
+  mutex_lock(&q->lock);
+  q->stop = 1;
+  cond_broadcast(&q->work);
+  mutex_unlock(&q->lock);
+
+  for (i = 0; i < q->started; ++i) {
+    thread_join(q->workers[i]);
+  }
+
+  cond_destroy(&q->work);
+  cond_destroy(&q->finished);
+  mutex_destroy(&q->lock);
+  free(q);
+}
@@ -0,0 +1,33 @@
+/*******************************************************************************************
+
+ thread.h
+
+ Native worker threads, for the codecs as well as the ruby classes.
+ Nothing here touches the ruby API.
+
+*******************************************************************************************/
+
+#ifndef _RB_ALLEG_THREAD
+#define _RB_ALLEG_THREAD
+
+int cpu_count(void);
+void parallel_run(int n, int threads, void (*func)(void *, int), void *data);
+
+/* A job for a JobQueue, which keeps running them on its threads until
+ * stopped. The queue links jobs through next; the caller owns them.
+ */
+typedef struct Job
+{
+  void (*func)(void *);
+  void *data;
+  struct Job *next;
+} Job;
+
+typedef struct JobQueue JobQueue;
+
+JobQueue *jobs_start(int threads);
+void jobs_push(JobQueue *q, Job *job);
+Job *jobs_done(JobQueue *q, int wait);
+void jobs_stop(JobQueue *q);
+
+#endif // _RB_ALLEG_THREAD
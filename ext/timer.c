@@ -0,0 +1,391 @@
+/*******************************************************************************************
+
+ timer.c
+
+ class Allegro::Timer
+
+*******************************************************************************************/
+
+#include "global.h"
+
+#if defined(_WIN32) && !defined(_MSC_VER)
+#include "winalleg.h"
+#elif !defined(_WIN32)
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+/* The counter is written by the timer thread and taken by ours, so
+ * both sides change it in one atomic step.
+ */
+#ifdef _WIN32
+#define atomic_inc(p)	InterlockedIncrement(p)
+#define atomic_take(p)	InterlockedExchange(p, 0)
+#else
+#define atomic_inc(p)	__sync_fetch_and_add(p, 1)
+#define atomic_take(p)	__sync_fetch_and_and(p, 0)
+#endif
+
+typedef struct Timer
+{
+  volatile long ticks;
+  int hz;
+  int installed;
+} Timer;
+
+/* Runs on Allegro's timer thread (or in an interrupt under DOS), so it
+ * must not touch anything but the counter.
+ */
+static void timer_tick(void *param) {
+  atomic_inc(&((Timer *) param)->ticks);
+}
+END_OF_STATIC_FUNCTION(timer_tick);
+
+static void timer_stop(Timer *timer) {
+  if (timer->installed) {
+    remove_param_int(timer_tick, timer);
+    timer->installed = 0;
+  }
+}
+
+static void timer_free(Timer *timer) {
+  timer_stop(timer);
+  free(timer);
+}
+
+static inline Timer* get_timer(VALUE self) {
+  Timer *timer;
+  Data_Get_Struct(self, Timer, timer);
+  return timer;
+}
+
+/**
+ * Seconds since an arbitrary point, from the best monotonic clock of
+ * the platform.
+ */
+double timer_now(void) {
+#ifdef _WIN32
+  static double period = 0;
+  LARGE_INTEGER count;
+
+  if (period == 0) {
+    QueryPerformanceFrequency(&count);
+    period = 1.0 / (double) count.QuadPart;
+  }
+  QueryPerformanceCounter(&count);
+
+  return (double) count.QuadPart * period;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+/**
+ * Sleeps until timer_now() reaches the deadline. The bulk of the wait
+ * is a real sleep which lets other ruby threads run; the last two
+ * milliseconds, where OS sleeps are unreliable, just yield.
+ */
+void timer_sleep_until(double deadline) {
+  struct timeval tv;
+  double left = deadline - timer_now() - 0.002;
+
+  if (left > 0) {
+    tv.tv_sec = (long) left;
+    tv.tv_usec = (long) ((left - tv.tv_sec) * 1e6);
+    rb_thread_wait_for(tv);
+  }
+
+  while (timer_now() < deadline) {
+    rest(0);
+  }
+}
+
+/**
+ * call-seq: new(hz)
+ *
+ * Creates a timer which counts hz ticks per second, driven by
+ * Allegro's timer interrupt. Ticks are counted even while ruby is
+ * busy, so a game can catch up by reading #take.
+ */
+static VALUE timer_new(VALUE self, VALUE hz) {
+  Timer *timer;
+  VALUE obj = Data_Make_Struct(self, Timer, 0, timer_free, timer);
+
+  timer->hz = NUM2INT(hz);
+
+  if (timer->hz <= 0) {
+    rb_raise(rb_eArgError, "hz must be positive");
+  }
+
+  LOCK_FUNCTION(timer_tick);
+  LOCK_VARIABLE(*timer);
+
+  if (install_param_int_ex(timer_tick, timer, BPS_TO_TIMER(timer->hz)) != 0) {
+    rb_raise(rb_eRuntimeError, "could not install timer: %s", allegro_error);
+  }
+
+  timer->installed = 1;
+
+  return obj;
+}
+
+/**
+ * Returns the ticks counted since the timer was created or reset.
+ */
+static VALUE timer_ticks(VALUE self) {
+  return LONG2NUM(get_timer(self)->ticks);
+}
+
+/**
+ * Returns the ticks counted since the last call and subtracts them
+ * from the counter.
+ */
+static VALUE timer_take(VALUE self) {
+  return LONG2NUM(atomic_take(&get_timer(self)->ticks));
+}
+
+/**
+ * Sets the counter back to zero.
+ */
+static VALUE timer_reset(VALUE self) {
+  atomic_take(&get_timer(self)->ticks);
+  return self;
+}
+
+/**
+ * Returns the rate in ticks per second.
+ */
+static VALUE timer_hz(VALUE self) {
+  return INT2FIX(get_timer(self)->hz);
+}
+
+/**
+ * Removes the timer interrupt. The counter keeps its value.
+ */
+static VALUE timer_remove(VALUE self) {
+  timer_stop(get_timer(self));
+  return self;
+}
+
+/**
+ * Returns the seconds elapsed since an arbitrary point as Float, with
+ * the resolution of the performance counter of the system.
+ */
+static VALUE timer_s_now(VALUE self) {
+  return rb_float_new(timer_now());
+}
+
+
+/* Allegro.run */
+
+typedef struct RunStats
+{
+  long frames;
+  long updates;
+  long dropped;
+  double total;
+  double min;
+  double max;
+} RunStats;
+
+typedef struct RunArgs
+{
+  double step;
+  double frame;
+  VALUE update;
+  VALUE render;
+} RunArgs;
+
+/* Updates run per rendered frame at most. When the game cannot keep up
+ * the rest of the backlog is dropped instead of piling up.
+ */
+#define RUN_MAX_UPDATES 5
+
+static RunStats run_stats;
+static int run_running = 0;
+static int run_stopping = 0;
+static ID id_call;
+
+static VALUE run_stats_hash(void) {
+  VALUE hash = rb_hash_new();
+  double avg = run_stats.frames > 1 ? run_stats.total / (run_stats.frames - 1) : 0;
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("frames")),	LONG2NUM(run_stats.frames));
+  rb_hash_aset(hash, ID2SYM(rb_intern("updates")),	LONG2NUM(run_stats.updates));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped_updates")), LONG2NUM(run_stats.dropped));
+  rb_hash_aset(hash, ID2SYM(rb_intern("avg_frame_ms")),	rb_float_new(avg * 1000));
+  rb_hash_aset(hash, ID2SYM(rb_intern("min_frame_ms")),	rb_float_new(run_stats.min * 1000));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max_frame_ms")),	rb_float_new(run_stats.max * 1000));
+  rb_hash_aset(hash, ID2SYM(rb_intern("fps")),		rb_float_new(avg > 0 ? 1 / avg : 0));
+
+  return hash;
+}
+
+static VALUE run_loop(VALUE arg) {
+  RunArgs *args = (RunArgs *) arg;
+  VALUE dt = rb_float_new(args->step);
+  double last = timer_now();
+  double acc = 0, next_frame = last, last_frame = last, now, elapsed;
+  int n;
+
+  while (!run_stopping) {
+    now = timer_now();
+    acc += now - last;
+    last = now;
+
+    for (n = 0; acc >= args->step && n < RUN_MAX_UPDATES && !run_stopping; ++n) {
+      rb_funcall(args->update, id_call, 1, dt);
+      acc -= args->step;
+      run_stats.updates++;
+    }
+
+    if (acc >= args->step) {
+      run_stats.dropped += (long) (acc / args->step);
+      acc -= args->step * (long) (acc / args->step);
+    }
+
+    if (run_stopping)
+      break;
+
+    /* wake-ups for updates in between frames render nothing */
+    if (now >= next_frame) {
+      if (!NIL_P(args->render)) {
+	rb_funcall(args->render, id_call, 1, rb_float_new(acc / args->step));
+      }
+
+      if (run_stats.frames > 0) {
+	elapsed = now - last_frame;
+	if (run_stats.frames == 1 || elapsed < run_stats.min) run_stats.min = elapsed;
+	if (elapsed > run_stats.max) run_stats.max = elapsed;
+	run_stats.total += elapsed;
+      }
+      run_stats.frames++;
+      last_frame = now;
+
+      /* a frame that is late does not make the next ones come sooner */
+      next_frame += args->frame;
+      if (next_frame < now)
+	next_frame = now + args->frame;
+    }
+
+    /* sleep until the next frame is due, or the next update if that
+     * comes first; never spin on a frame that has nothing to do */
+    timer_sleep_until(MIN(next_frame, now + args->step - acc));
+  }
+
+  return run_stats_hash();
+}
+
+static VALUE run_done(VALUE arg) {
+  run_running = 0;
+  run_stopping = 0;
+  return Qnil;
+}
+
+/**
+ * call-seq: run(update_hz, update, render = nil, render_hz = update_hz)
+ *           run(update_hz) { |dt| ... }
+ *
+ * Runs a fixed timestep game loop in C until Allegro.stop is called.
+ * update.call(dt) is called exactly update_hz times per second of
+ * game time with the constant step dt in seconds, independent of how
+ * long rendering takes. render.call(alpha) is called at most
+ * render_hz times per second, with alpha in 0...1 telling how far the
+ * clock has advanced towards the next update, for interpolation.
+ * Between frames the loop sleeps instead of spinning on Gfx.vsync.
+ *
+ *   Allegro.run(60, lambda { |dt| world.step(dt) },
+ *                   lambda { |alpha| world.draw(buf, alpha); chain.flip })
+ *
+ * When update is omitted the block is used instead, for loops that do
+ * their drawing inside the update:
+ *
+ *   Allegro.run(60) { |dt| world.step(dt); world.draw(buf, 0) }
+ *
+ * Returns frame time statistics, see Allegro.frame_stats.
+ */
+static VALUE allegro_run(int argc, VALUE *argv, VALUE self) {
+  VALUE update_hz, update, render, render_hz;
+  RunArgs args;
+  double hz;
+
+  rb_scan_args(argc, argv, "13", &update_hz, &update, &render, &render_hz);
+
+  if (NIL_P(update)) {
+    if (!rb_block_given_p()) {
+      rb_raise(rb_eArgError, "no update given");
+    }
+    update = rb_block_proc();
+  }
+
+  hz = NUM2DBL(update_hz);
+
+  if (hz <= 0 || (!NIL_P(render_hz) && NUM2DBL(render_hz) <= 0)) {
+    rb_raise(rb_eArgError, "rates must be positive");
+  }
+  if (run_running) {
+    rb_raise(rb_eRuntimeError, "Allegro.run is already running");
+  }
+
+  args.step = 1.0 / hz;
+  args.frame = NIL_P(render_hz) ? args.step : 1.0 / NUM2DBL(render_hz);
+  args.update = update;
+  args.render = render;
+
+  memset(&run_stats, 0, sizeof(run_stats));
+  run_running = 1;
+
+  return rb_ensure(run_loop, (VALUE) &args, run_done, Qnil);
+}
+
+/**
+ * Makes Allegro.run return after the current update or render call.
+ */
+static VALUE allegro_stop(VALUE self) {
+  if (run_running)
+    run_stopping = 1;
+  return self;
+}
+
+/**
+ * Returns statistics of the current or last Allegro.run as a hash
+ * with :frames, :updates, :dropped_updates, :avg_frame_ms,
+ * :min_frame_ms, :max_frame_ms and :fps.
+ */
+static VALUE allegro_frame_stats(VALUE self) {
+  return run_stats_hash();
+}
+
+void Init_allegro_timer() {
+
+  if (!m_allegro) {
+    m_allegro = rb_define_module ("Allegro");
+  }
+
+  id_call = rb_intern("call");
+
+  c_allegro_timer = rb_define_class_under(m_allegro, "Timer", rb_cObject);
+
+  rb_define_singleton_method(c_allegro_timer, "new",		timer_new,		1);
+  rb_define_singleton_method(c_allegro_timer, "now",		timer_s_now,		0);
+
+  rb_define_method(c_allegro_timer, "ticks",			timer_ticks,		0);
+  rb_define_method(c_allegro_timer, "take",			timer_take,		0);
+  rb_define_method(c_allegro_timer, "reset",			timer_reset,		0);
+  rb_define_method(c_allegro_timer, "hz",			timer_hz,		0);
+  rb_define_method(c_allegro_timer, "remove",			timer_remove,		0);
+
+  rb_define_module_function(m_allegro, "run",			allegro_run,		-1);
+  rb_define_module_function(m_allegro, "stop",			allegro_stop,		0);
+  rb_define_module_function(m_allegro, "frame_stats",		allegro_frame_stats,	0);
+}